@@ -0,0 +1,257 @@
+#include "assembler.h"
+#include <stdint.h>
+#include <string.h>
+
+size_t Assembler::position ()
+{
+        return this->code.size ();
+}
+
+void Assembler::emit8 (uint8_t b)
+{
+        this->code.push_back (b);
+}
+
+void Assembler::emit32 (int32_t v)
+{
+        uint8_t bytes[sizeof (int32_t)];
+
+        memcpy (bytes, &v, sizeof (int32_t));
+        this->code.insert (this->code.end (), bytes, bytes + sizeof (int32_t));
+}
+
+void Assembler::emit64 (uint64_t v)
+{
+        uint8_t bytes[sizeof (uint64_t)];
+
+        memcpy (bytes, &v, sizeof (uint64_t));
+        this->code.insert (this->code.end (), bytes, bytes + sizeof (uint64_t));
+}
+
+/**
+ * REX prefix, only emitted when the instruction is wide or uses r8 to r15
+ */
+void Assembler::rex (bool wide, int reg, int index, int base)
+{
+        uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+
+        if (prefix != 0x40)
+                this->emit8 (prefix);
+}
+
+void Assembler::opcode (uint32_t opcode)
+{
+        if (opcode > 0xff)
+                this->emit8 (opcode >> 8);
+
+        this->emit8 (opcode & 0xff);
+}
+
+void Assembler::modrm (int mod, int reg, int rm)
+{
+        this->emit8 ((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+void Assembler::mem (bool wide, uint32_t opcode, int reg, int base, int32_t disp)
+{
+        this->rex (wide, reg, 0, base);
+        this->opcode (opcode);
+
+        /* rbp and r13 have no encoding without displacement, rsp and r12 need a SIB byte */
+        int mod = disp == 0 && (base & 7) != RBP ? 0 : disp == (int8_t)disp ? 1 : 2;
+
+        this->modrm (mod, reg, base);
+
+        if ((base & 7) == RSP)
+                this->emit8 (0x24);
+
+        if (mod == 1)
+                this->emit8 (disp);
+        else if (mod == 2)
+                this->emit32 (disp);
+}
+
+void Assembler::mem_index (bool wide, uint32_t opcode, int reg, int base, int index)
+{
+        this->rex (wide, reg, index, base);
+        this->opcode (opcode);
+
+        if ((base & 7) == RBP) {
+                this->modrm (1, reg, RSP);
+                this->emit8 ((3 << 6) | ((index & 7) << 3) | (base & 7));
+                this->emit8 (0);
+        } else {
+                this->modrm (0, reg, RSP);
+                this->emit8 ((3 << 6) | ((index & 7) << 3) | (base & 7));
+        }
+}
+
+void Assembler::regs (bool wide, uint32_t opcode, int reg, int rm)
+{
+        this->rex (wide, reg, 0, rm);
+        this->opcode (opcode);
+        this->modrm (3, reg, rm);
+}
+
+void Assembler::load (int dst, int base, int32_t disp)
+{
+        this->mem (false, 0x8b, dst, base, disp);
+}
+
+void Assembler::store (int base, int32_t disp, int src)
+{
+        this->mem (false, 0x89, src, base, disp);
+}
+
+void Assembler::store_imm (int base, int32_t disp, int32_t imm)
+{
+        this->mem (false, 0xc7, 0, base, disp);
+        this->emit32 (imm);
+}
+
+void Assembler::load64 (int dst, int base, int32_t disp)
+{
+        this->mem (true, 0x8b, dst, base, disp);
+}
+
+void Assembler::store64 (int base, int32_t disp, int src)
+{
+        this->mem (true, 0x89, src, base, disp);
+}
+
+void Assembler::lea (int dst, int base, int32_t disp)
+{
+        this->mem (true, 0x8d, dst, base, disp);
+}
+
+void Assembler::movsxd (int dst, int base, int32_t disp)
+{
+        this->mem (true, 0x63, dst, base, disp);
+}
+
+void Assembler::mov64 (int dst, int src)
+{
+        this->regs (true, 0x89, src, dst);
+}
+
+void Assembler::mov_imm (int dst, int32_t imm)
+{
+        this->rex (false, 0, 0, dst);
+        this->emit8 (0xb8 + (dst & 7));
+        this->emit32 (imm);
+}
+
+void Assembler::mov_imm64 (int dst, uint64_t imm)
+{
+        this->rex (true, 0, 0, dst);
+        this->emit8 (0xb8 + (dst & 7));
+        this->emit64 (imm);
+}
+
+void Assembler::add64 (int dst, int32_t imm)
+{
+        this->regs (true, 0x81, 0, dst);
+        this->emit32 (imm);
+}
+
+void Assembler::sub64 (int dst, int32_t imm)
+{
+        this->regs (true, 0x81, 5, dst);
+        this->emit32 (imm);
+}
+
+void Assembler::cmp_mem_imm (int base, int32_t disp, int32_t imm)
+{
+        this->mem (false, 0x81, 7, base, disp);
+        this->emit32 (imm);
+}
+
+/**
+ * Set the low byte of dst to the condition. Only al, cl, dl and bl, the others
+ * would need a REX prefix to mean their low byte.
+ */
+void Assembler::setcc (enum cond cc, int dst)
+{
+        this->regs (false, 0x0f90 + cc, 0, dst);
+}
+
+void Assembler::movzx8 (int dst, int src)
+{
+        this->regs (false, 0x0fb6, dst, src);
+}
+
+void Assembler::cmov64 (enum cond cc, int dst, int src)
+{
+        this->regs (true, 0x0f40 + cc, dst, src);
+}
+
+void Assembler::push (int src)
+{
+        this->rex (false, 0, 0, src);
+        this->emit8 (0x50 + (src & 7));
+}
+
+void Assembler::pop (int dst)
+{
+        this->rex (false, 0, 0, dst);
+        this->emit8 (0x58 + (dst & 7));
+}
+
+void Assembler::call (int target)
+{
+        this->regs (false, 0xff, 2, target);
+}
+
+void Assembler::jump (int target)
+{
+        this->regs (false, 0xff, 4, target);
+}
+
+void Assembler::ret ()
+{
+        this->emit8 (0xc3);
+}
+
+size_t Assembler::jump ()
+{
+        this->emit8 (0xe9);
+        this->emit32 (0);
+
+        return this->position () - sizeof (int32_t);
+}
+
+size_t Assembler::jump_if (enum cond cc)
+{
+        this->opcode (0x0f80 + cc);
+        this->emit32 (0);
+
+        return this->position () - sizeof (int32_t);
+}
+
+size_t Assembler::call_rel ()
+{
+        this->emit8 (0xe8);
+        this->emit32 (0);
+
+        return this->position () - sizeof (int32_t);
+}
+
+/**
+ * Point the rel32 operand at position at to target
+ */
+void Assembler::patch (size_t at, size_t target)
+{
+        int32_t rel = (int32_t)(target - (at + sizeof (int32_t)));
+
+        memcpy (&this->code[at], &rel, sizeof (int32_t));
+}
+
+void Assembler::jump_to (size_t target)
+{
+        this->patch (this->jump (), target);
+}
+
+void Assembler::jump_if_to (enum cond cc, size_t target)
+{
+        this->patch (this->jump_if (cc), target);
+}
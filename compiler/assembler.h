@@ -0,0 +1,88 @@
+#ifndef assembler_h
+#define assembler_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* x86-64 general purpose registers, numbered as in their encoding */
+enum reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* condition codes of jcc, setcc and cmovcc */
+enum cond {
+        CC_B = 0x2,
+        CC_AE = 0x3,
+        CC_E = 0x4,
+        CC_NE = 0x5,
+        CC_BE = 0x6,
+        CC_A = 0x7,
+        CC_S = 0x8,
+        CC_L = 0xC,
+        CC_GE = 0xD,
+        CC_LE = 0xE,
+        CC_G = 0xF,
+};
+
+/**
+ * Encoder for the handful of x86-64 instructions the JIT emits. Code goes into
+ * a byte vector and is position independent: jumps within it are relative,
+ * everything outside it is reached through absolute addresses in registers.
+ * Memory operands are [base + disp], operands are 32 bit unless wide.
+ */
+class Assembler {
+    public:
+        std::vector<uint8_t> code;
+
+        size_t position ();
+        void emit8 (uint8_t b);
+        void emit32 (int32_t v);
+        void emit64 (uint64_t v);
+
+        /* opcode reg, [base + disp]; opcodes above 0xff are two bytes */
+        void mem (bool wide, uint32_t opcode, int reg, int base, int32_t disp);
+        /* opcode reg, [base + index * 8] */
+        void mem_index (bool wide, uint32_t opcode, int reg, int base, int index);
+        /* opcode reg, rm with both operands in registers */
+        void regs (bool wide, uint32_t opcode, int reg, int rm);
+
+        void load (int dst, int base, int32_t disp);
+        void store (int base, int32_t disp, int src);
+        void store_imm (int base, int32_t disp, int32_t imm);
+        void load64 (int dst, int base, int32_t disp);
+        void store64 (int base, int32_t disp, int src);
+        void lea (int dst, int base, int32_t disp);
+        void movsxd (int dst, int base, int32_t disp);
+        void mov64 (int dst, int src);
+        void mov_imm (int dst, int32_t imm);
+        void mov_imm64 (int dst, uint64_t imm);
+
+        /* add, sub and cmp of a 64 bit register with an immediate */
+        void add64 (int dst, int32_t imm);
+        void sub64 (int dst, int32_t imm);
+        void cmp_mem_imm (int base, int32_t disp, int32_t imm);
+
+        void setcc (enum cond cc, int dst);
+        void movzx8 (int dst, int src);
+        void cmov64 (enum cond cc, int dst, int src);
+
+        void push (int src);
+        void pop (int dst);
+        void call (int target);
+        void jump (int target);
+        void ret ();
+
+        /* jumps to a label that is bound later; return the position to patch */
+        size_t jump ();
+        size_t jump_if (enum cond cc);
+        size_t call_rel ();
+        void patch (size_t at, size_t target);
+        void jump_to (size_t target);
+        void jump_if_to (enum cond cc, size_t target);
+
+    private:
+        void rex (bool wide, int reg, int index, int base);
+        void opcode (uint32_t opcode);
+        void modrm (int mod, int reg, int rm);
+};
+
+#endif
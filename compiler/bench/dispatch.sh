@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Compare dispatch throughput of the switch and threaded engines and of the
+# register instruction set.
+# usage: bench/dispatch.sh [program.cb ...]   (run from the compiler directory)
+
+COBRAC=${COBRAC:-./cobrac}
+PROGRAMS=${*:-bench/*.cb}
+OUT=$(mktemp)
+
+trap 'rm -f "$OUT"' EXIT
+
+for program in $PROGRAMS; do
+        "$COBRAC" "$program" -o "$OUT" || exit 1
+
+        for engine in switch threaded; do
+                printf "%-20s %-10s " "$(basename "$program")" "$engine"
+                "$COBRAC" --exec --verbose --engine "$engine" "$OUT" | grep "Total opcodes executed" | sed 's/Total opcodes executed: //'
+        done
+
+        "$COBRAC" --isa register "$program" -o "$OUT" || exit 1
+        printf "%-20s %-10s " "$(basename "$program")" "register"
+        "$COBRAC" --exec --verbose "$OUT" | grep "Total opcodes executed" | sed 's/Total opcodes executed: //'
+done
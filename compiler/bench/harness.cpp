@@ -0,0 +1,588 @@
+/*
+ * Benchmark harness: scans, compiles and runs cobra programs with warm-up and
+ * repetitions and reports the median and 95th percentile of each measurement.
+ * Scanning and compiling run in process, programs run through cobrac -e.
+ * Results go to JSON and are compared against a saved baseline.
+ *
+ * usage: bench/harness [options] program.cb ...   (run from the compiler directory)
+ *   --cobrac PATH        cobrac binary to run programs with, ./cobrac
+ *   --warmup N           runs that are not measured, 1
+ *   --repetitions N      measured runs, 5
+ *   --output FILE        JSON results, bench/results.json
+ *   --baseline FILE      results to compare with, flagging regressions
+ *   --threshold PERCENT  change of a median that counts as a regression, 10
+ *   --generated N        also measure a generated source of N functions, 0 for none, 2000
+ *
+ * cp bench/results.json bench/baseline.json makes a run the new baseline.
+ */
+#include "compiler.h"
+#include "scanner.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <getopt.h>
+#include <map>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+/* scanning repeats until it covered this many bytes, compiling until it took this long */
+#define SCAN_BYTES      (4 * 1024 * 1024)
+#define COMPILE_SECONDS 0.02
+
+/* a measurement and whether a higher value is better */
+struct metric {
+        const char *name;
+        bool higher_is_better;
+};
+
+static const struct metric metrics[] = {
+        {"scan_mb_per_s",  true},
+        {   "compile_ms", false},
+        {       "run_ms", false},
+        {"vm_mops_per_s",  true},
+};
+
+#define METRIC_COUNT (sizeof (metrics) / sizeof (metrics[0]))
+
+struct benchmark {
+        std::string name;
+        std::string source;
+        std::vector<double> samples[METRIC_COUNT];
+        double median[METRIC_COUNT];
+        double p95[METRIC_COUNT];
+        bool failed;
+};
+
+static const char *cobrac = "./cobrac";
+static int warmup = 1;
+static int repetitions = 5;
+static const char *output = "bench/results.json";
+static const char *baseline = NULL;
+static double threshold = 10;
+static int generated = 2000;
+
+static double now ()
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string read_file (const char *filename)
+{
+        FILE *fp = fopen (filename, "r");
+        std::string text;
+        char buffer[4096];
+        size_t n;
+
+        if (!fp) {
+                perror (filename);
+                exit (EXIT_FAILURE);
+        }
+
+        while ((n = fread (buffer, 1, sizeof (buffer), fp)) > 0)
+                text.append (buffer, n);
+
+        fclose (fp);
+
+        return text;
+}
+
+/**
+ * A large program of functions loops, conditions and compound assignments,
+ * and a script that calls every one of them
+ */
+static std::string generate_source (int functions)
+{
+        std::string source = "// generated\n";
+        char buffer[512];
+
+        for (int k = 0; k < functions; k++) {
+                snprintf (buffer, sizeof (buffer),
+                          "func g%d(a, b) {\n"
+                          "    s = 0;\n"
+                          "    for (i = 0; i < a; i += 1) {\n"
+                          "        s += i * b;\n"
+                          "        if (s > 100000) {\n"
+                          "            s -= 100000;\n"
+                          "        }\n"
+                          "    }\n"
+                          "    return s;\n"
+                          "}\n",
+                          k);
+                source += buffer;
+        }
+
+        source += "t = 0;\nv = 0;\n";
+
+        for (int k = 0; k < functions; k++) {
+                snprintf (buffer, sizeof (buffer), "v = g%d(100, %d);\nt += v;\n", k, k);
+                source += buffer;
+        }
+
+        source += "print(t);\n";
+
+        return source;
+}
+
+/**
+ * Scan the source until SCAN_BYTES went through the scanner. Returns MB/s.
+ */
+static double measure_scan (std::string &source)
+{
+        size_t rounds = std::max ((size_t)1, SCAN_BYTES / std::max ((size_t)1, source.size ()));
+        std::vector<char> text (source.begin (), source.end ());
+
+        text.push_back ('\0');
+
+        double start = now ();
+
+        for (size_t round = 0; round < rounds; round++) {
+                Scanner scanner (text.data ());
+
+                while (scanner.scan_token ().type != END)
+                        ;
+        }
+
+        return rounds * source.size () / (now () - start) / 1e6;
+}
+
+/**
+ * Compile the source in process, as often as fits into COMPILE_SECONDS.
+ * Returns the milliseconds one compile takes.
+ */
+static double measure_compile (std::string &source)
+{
+        int rounds = 0;
+        double start = now ();
+        double elapsed;
+
+        do {
+                char *text = strdup (source.c_str ());
+                Compiler *compiler = new Compiler (text);
+
+                if (!compiler->compile ()) {
+                        fprintf (stderr, "error: compile failed\n");
+                        exit (EXIT_FAILURE);
+                }
+
+                delete compiler;
+                free (text);
+                rounds++;
+                elapsed = now () - start;
+        } while (elapsed < COMPILE_SECONDS);
+
+        return elapsed / rounds * 1e3;
+}
+
+/**
+ * Run cobrac with arguments and collect its standard output. Returns false
+ * when it fails.
+ */
+static bool run_cobrac (std::vector<const char *> arguments, std::string *out)
+{
+        int fds[2];
+
+        if (pipe (fds) != 0) {
+                perror ("pipe");
+                exit (EXIT_FAILURE);
+        }
+
+        arguments.insert (arguments.begin (), cobrac);
+        arguments.push_back (NULL);
+
+        pid_t pid = fork ();
+
+        if (pid < 0) {
+                perror ("fork");
+                exit (EXIT_FAILURE);
+        }
+
+        if (pid == 0) {
+                int null = open ("/dev/null", O_WRONLY);
+
+                dup2 (fds[1], STDOUT_FILENO);
+                dup2 (null, STDERR_FILENO);
+                close (fds[0]);
+                close (fds[1]);
+                execv (cobrac, (char *const *)arguments.data ());
+                _exit (127);
+        }
+
+        char buffer[4096];
+        ssize_t n;
+        int status;
+
+        close (fds[1]);
+        out->clear ();
+
+        while ((n = read (fds[0], buffer, sizeof (buffer))) > 0)
+                out->append (buffer, n);
+
+        close (fds[0]);
+        waitpid (pid, &status, 0);
+
+        return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+/**
+ * Run the image with cobrac -e -v. Sets the wall time in milliseconds and the
+ * instructions the VM ran per second, in millions. Returns false when the run
+ * fails.
+ */
+static bool measure_run (const char *image, double *run_ms, double *mops)
+{
+        std::string out;
+        double start = now ();
+
+        if (!run_cobrac ({ "-e", "-v", image }, &out))
+                return false;
+
+        *run_ms = (now () - start) * 1e3;
+
+        const char *total = strstr (out.c_str (), "Total opcodes executed: ");
+        unsigned long ops;
+        double seconds;
+
+        if (!total || sscanf (total, "Total opcodes executed: %lu in %lf s", &ops, &seconds) != 2)
+                return false;
+
+        *mops = seconds > 0 ? ops / seconds / 1e6 : 0;
+
+        return true;
+}
+
+/**
+ * The median and the 95th percentile of samples on the slow side: the high
+ * end for times, the low end for rates
+ */
+static void summarize (std::vector<double> samples, bool higher_is_better, double *median, double *p95)
+{
+        size_t n = samples.size ();
+
+        if (n == 0) {
+                *median = *p95 = 0;
+                return;
+        }
+
+        std::sort (samples.begin (), samples.end ());
+
+        *median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+
+        size_t rank = (size_t)ceil (0.95 * n) - 1;
+
+        *p95 = higher_is_better ? samples[n - 1 - rank] : samples[rank];
+}
+
+static void measure (struct benchmark *benchmark)
+{
+        char image[] = "/tmp/cobra-bench-XXXXXX";
+        char source[] = "/tmp/cobra-bench-XXXXXX.cb";
+        int fd = mkstemp (image);
+        int source_fd = mkstemps (source, 3);
+
+        if (fd < 0 || source_fd < 0) {
+                perror ("mkstemp");
+                exit (EXIT_FAILURE);
+        }
+
+        close (fd);
+
+        if (write (source_fd, benchmark->source.data (), benchmark->source.size ()) !=
+            (ssize_t)benchmark->source.size ()) {
+                perror ("write");
+                exit (EXIT_FAILURE);
+        }
+
+        close (source_fd);
+
+        std::string out;
+
+        benchmark->failed = !run_cobrac ({ "-o", image, source }, &out);
+
+        for (int run = 0; run < warmup + repetitions && !benchmark->failed; run++) {
+                double values[METRIC_COUNT];
+
+                values[0] = measure_scan (benchmark->source);
+                values[1] = measure_compile (benchmark->source);
+                benchmark->failed = !measure_run (image, &values[2], &values[3]);
+
+                if (run < warmup || benchmark->failed)
+                        continue;
+
+                for (size_t m = 0; m < METRIC_COUNT; m++)
+                        benchmark->samples[m].push_back (values[m]);
+        }
+
+        unlink (image);
+        unlink (source);
+
+        for (size_t m = 0; m < METRIC_COUNT; m++)
+                summarize (benchmark->samples[m], metrics[m].higher_is_better, &benchmark->median[m], &benchmark->p95[m]);
+}
+
+/* just enough JSON to read back the results file: objects, arrays, strings and numbers */
+struct json {
+        double number;
+        std::map<std::string, struct json> members;
+};
+
+static void skip_space (const char **p)
+{
+        while (**p == ' ' || **p == '\n' || **p == '\t' || **p == '\r')
+                (*p)++;
+}
+
+static std::string parse_string (const char **p)
+{
+        std::string text;
+
+        (*p)++;
+
+        while (**p && **p != '"') {
+                if (**p == '\\' && (*p)[1])
+                        (*p)++;
+
+                text += *(*p)++;
+        }
+
+        if (**p == '"')
+                (*p)++;
+
+        return text;
+}
+
+static bool parse_json (const char **p, struct json *value)
+{
+        skip_space (p);
+        value->number = 0;
+
+        if (**p == '{' || **p == '[') {
+                char close = **p == '{' ? '}' : ']';
+
+                (*p)++;
+                skip_space (p);
+
+                while (**p && **p != close) {
+                        std::string key;
+                        struct json member;
+
+                        if (close == '}') {
+                                if (**p != '"')
+                                        return false;
+
+                                key = parse_string (p);
+                                skip_space (p);
+
+                                if (**p != ':')
+                                        return false;
+
+                                (*p)++;
+                        }
+
+                        if (!parse_json (p, &member))
+                                return false;
+
+                        if (close == '}')
+                                value->members[key] = member;
+
+                        skip_space (p);
+
+                        if (**p == ',')
+                                (*p)++;
+
+                        skip_space (p);
+                }
+
+                if (**p != close)
+                        return false;
+
+                (*p)++;
+                return true;
+        }
+
+        if (**p == '"') {
+                parse_string (p);
+                return true;
+        }
+
+        char *end;
+
+        value->number = strtod (*p, &end);
+
+        if (end == *p)
+                return false;
+
+        *p = end;
+
+        return true;
+}
+
+static void write_results (std::vector<struct benchmark> &benchmarks)
+{
+        FILE *fp = fopen (output, "w");
+
+        if (!fp) {
+                perror (output);
+                exit (EXIT_FAILURE);
+        }
+
+        fprintf (fp, "{\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"benchmarks\": {", warmup, repetitions);
+
+        bool first = true;
+
+        for (struct benchmark &benchmark : benchmarks) {
+                if (benchmark.failed)
+                        continue;
+
+                fprintf (fp, "%s\n    \"%s\": {", first ? "" : ",", benchmark.name.c_str ());
+
+                for (size_t m = 0; m < METRIC_COUNT; m++)
+                        fprintf (fp, "%s\"%s\": {\"median\": %.6g, \"p95\": %.6g}", m ? ", " : "", metrics[m].name,
+                                 benchmark.median[m], benchmark.p95[m]);
+
+                fprintf (fp, "}");
+                first = false;
+        }
+
+        fprintf (fp, "\n  }\n}\n");
+        fclose (fp);
+}
+
+/**
+ * Print every measurement next to the baseline. Returns the number of
+ * regressions, medians that got worse by more than threshold percent.
+ */
+static int report (std::vector<struct benchmark> &benchmarks, struct json *base)
+{
+        int regressions = 0;
+
+        printf ("%-20s %-14s %12s %12s %12s %9s\n", "benchmark", "metric", "median", "p95", "baseline", "change");
+
+        for (struct benchmark &benchmark : benchmarks) {
+                if (benchmark.failed) {
+                        printf ("%-20s failed\n", benchmark.name.c_str ());
+                        regressions++;
+                        continue;
+                }
+
+                for (size_t m = 0; m < METRIC_COUNT; m++) {
+                        printf ("%-20s %-14s %12.3f %12.3f", benchmark.name.c_str (), metrics[m].name,
+                                benchmark.median[m], benchmark.p95[m]);
+
+                        auto entry = base ? base->members["benchmarks"].members.find (benchmark.name)
+                                          : std::map<std::string, struct json>::iterator ();
+
+                        if (!base || entry == base->members["benchmarks"].members.end () ||
+                            !entry->second.members.count (metrics[m].name)) {
+                                printf ("\n");
+                                continue;
+                        }
+
+                        double old = entry->second.members[metrics[m].name].members["median"].number;
+                        double change = old ? (benchmark.median[m] - old) / old * 100 : 0;
+                        bool worse = metrics[m].higher_is_better ? change < -threshold : change > threshold;
+
+                        printf (" %12.3f %+8.1f%%%s\n", old, change, worse ? "  REGRESSION" : "");
+                        regressions += worse;
+                }
+        }
+
+        return regressions;
+}
+
+int main (int argc, char **argv)
+{
+        struct option long_options[] = {
+                {     "cobrac", required_argument, 0, 'c'},
+                {     "warmup", required_argument, 0, 'w'},
+                {"repetitions", required_argument, 0, 'r'},
+                {     "output", required_argument, 0, 'o'},
+                {   "baseline", required_argument, 0, 'b'},
+                {  "threshold", required_argument, 0, 't'},
+                {  "generated", required_argument, 0, 'g'},
+                {         NULL,                 0, 0,   0}
+        };
+
+        int c, option_index = 0;
+
+        while ((c = getopt_long (argc, argv, "c:w:r:o:b:t:g:", long_options, &option_index)) != -1) {
+                switch (c) {
+                case 'c': cobrac = optarg; break;
+                case 'w': warmup = atoi (optarg); break;
+                case 'r': repetitions = atoi (optarg); break;
+                case 'o': output = optarg; break;
+                case 'b': baseline = optarg; break;
+                case 't': threshold = atof (optarg); break;
+                case 'g': generated = atoi (optarg); break;
+                default: exit (EXIT_FAILURE);
+                }
+        }
+
+        if (warmup < 0 || repetitions < 1 || threshold < 0 || generated < 0) {
+                fprintf (stderr, "error: invalid option, see the usage at the top of bench/harness.cpp\n");
+                exit (EXIT_FAILURE);
+        }
+
+        std::vector<struct benchmark> benchmarks;
+
+        for (int i = optind; i < argc; i++) {
+                struct benchmark benchmark;
+                const char *slash = strrchr (argv[i], '/');
+
+                benchmark.name = slash ? slash + 1 : argv[i];
+                benchmark.source = read_file (argv[i]);
+                benchmarks.push_back (benchmark);
+        }
+
+        if (generated > 0) {
+                struct benchmark benchmark;
+
+                benchmark.name = "generated";
+                benchmark.source = generate_source (generated);
+                benchmarks.push_back (benchmark);
+        }
+
+        if (benchmarks.empty ()) {
+                fprintf (stderr, "error: no programs to measure\n");
+                exit (EXIT_FAILURE);
+        }
+
+        for (struct benchmark &benchmark : benchmarks) {
+                fprintf (stderr, "measuring %s\n", benchmark.name.c_str ());
+                measure (&benchmark);
+        }
+
+        struct json base;
+        bool have_base = false;
+
+        if (baseline) {
+                std::string text = read_file (baseline);
+                const char *p = text.c_str ();
+
+                have_base = parse_json (&p, &base);
+
+                if (!have_base)
+                        fprintf (stderr, "warning: %s: not a results file, nothing to compare with\n", baseline);
+        }
+
+        write_results (benchmarks);
+
+        int regressions = report (benchmarks, have_base ? &base : NULL);
+
+        if (regressions > 0) {
+                fprintf (stderr, "%d regression%s beyond %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Load and run generated programs of growing image size, from a file and from
+# a pipe. Each program has the given number of functions and calls all of them.
+# usage: bench/image.sh [functions ...]   (run from the compiler directory)
+
+COBRAC=${COBRAC:-./cobrac}
+SIZES=${*:-10 100 1000 10000}
+SOURCE=$(mktemp)
+OUT=$(mktemp)
+
+trap 'rm -f "$SOURCE" "$OUT"' EXIT
+
+generate() {
+        awk -v n="$1" 'BEGIN {
+                for (i = 0; i < n; i++) {
+                        printf "func f%d(a, b) {\n    x = a * %d + b;\n", i, i % 7 + 1
+                        printf "    if (x > %d) {\n        return x - %d;\n    }\n    return x + b;\n}\n", i, i
+                }
+                print "s = 0;"
+                for (i = 0; i < n; i++)
+                        printf "s = f%d(s - s / 1000 * 1000, %d);\n", i, i
+                print "print(s);"
+        }'
+}
+
+for functions in $SIZES; do
+        generate "$functions" > "$SOURCE"
+        "$COBRAC" "$SOURCE" -o "$OUT" || exit 1
+
+        size=$(wc -c < "$OUT")
+        start=$(date +%s%N)
+        "$COBRAC" --exec "$OUT" > /dev/null || exit 1
+        mid=$(date +%s%N)
+        "$COBRAC" --exec - < "$OUT" > /dev/null || exit 1
+        end=$(date +%s%N)
+
+        printf "%-10s %10s bytes  file %8s us  pipe %8s us\n" "$functions" "$size" \
+                $(((mid - start) / 1000)) $(((end - mid) / 1000))
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Time many threads streaming a local file on each engine and worker count, and
+# compiled to C. bench/io.cb times pipes instead, it needs no file.
+# usage: bench/io.sh [program.cb] [workers ...]   (run from the compiler directory)
+
+COBRAC=${COBRAC:-./cobrac}
+CC=${CC:-cc}
+PROGRAM=${1:-bench/files.cb}
+SIZE=${SIZE:-65536}
+OUT=$(mktemp)
+C_OUT=$(mktemp --suffix=.c)
+DATA=$(mktemp)
+
+[ $# -gt 0 ] && shift
+WORKERS=${*:-1 2 4}
+
+trap 'rm -f "$OUT" "$OUT.aot" "$C_OUT" "$DATA"' EXIT
+
+# the same bytes every run, so every engine prints the same sum
+yes "cobra streams this file" | head -c "$SIZE" > "$DATA"
+
+run ()
+{
+        label=$1
+        shift
+        start=$(date +%s%N)
+        result=$("$@" "$DATA" | tail -1)
+        end=$(date +%s%N)
+        printf "%-20s %-14s %-12s %6d ms\n" "$(basename "$PROGRAM")" "$label" "$result" $(((end - start) / 1000000))
+}
+
+"$COBRAC" "$PROGRAM" -o "$OUT" || exit 1
+
+for engine in switch threaded; do
+        for workers in $WORKERS; do
+                run "$engine/$workers" "$COBRAC" --exec --engine "$engine" --workers "$workers" "$OUT"
+        done
+done
+
+"$COBRAC" --emit-c -o "$C_OUT" "$PROGRAM" && "$CC" -O2 -I. "$C_OUT" -o "$OUT.aot" || exit 1
+run "c" "$OUT.aot"
@@ -0,0 +1,21 @@
+#!/bin/sh
+#
+# Compare the interpreter with the JIT on call heavy and loop heavy kernels.
+# usage: bench/jit.sh [program.cb ...]   (run from the compiler directory)
+
+COBRAC=${COBRAC:-./cobrac}
+PROGRAMS=${*:-bench/fib.cb bench/kernel.cb}
+OUT=$(mktemp)
+
+trap 'rm -f "$OUT"' EXIT
+
+for program in $PROGRAMS; do
+        "$COBRAC" "$program" -o "$OUT" || exit 1
+
+        for mode in interpreter jit; do
+                flags=
+                [ "$mode" = jit ] && flags=--jit
+                printf "%-20s %-12s " "$(basename "$program")" "$mode"
+                "$COBRAC" --exec --verbose $flags "$OUT" | grep "Total opcodes executed" | sed 's/Total opcodes executed: //'
+        done
+done
@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Measure how the fork benchmark scales with the number of workers.
+# usage: bench/workers.sh [program.cb] [workers ...]   (run from the compiler directory)
+
+COBRAC=${COBRAC:-./cobrac}
+PROGRAM=${1:-bench/parallel.cb}
+OUT=$(mktemp)
+
+[ $# -gt 0 ] && shift
+WORKERS=${*:-1 2 4 8}
+
+trap 'rm -f "$OUT"' EXIT
+
+"$COBRAC" "$PROGRAM" -o "$OUT" || exit 1
+
+for workers in $WORKERS; do
+        printf "%-20s %-10s " "$(basename "$PROGRAM")" "$workers"
+        "$COBRAC" --exec --verbose --engine threaded --workers "$workers" "$OUT" | grep "Total opcodes executed" | sed 's/Total opcodes executed: //'
+done
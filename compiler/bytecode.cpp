@@ -16,6 +16,7 @@ Bytecode::Bytecode ()
 
         this->count = 0;
         this->address_offset = 0;
+        this->isa = ISA_STACK;
 }
 
 /**
@@ -127,7 +128,11 @@ void Bytecode::patch_jump (size_t offset)
         *((int32_t *)&this->chunk[offset]) = this->count;
 }
 
-bool Bytecode::instruction_at (size_t *position, enum OpCode *opcode, int32_t *arg)
+/**
+ * Decode the instruction at position into op and its operands, advancing
+ * position past it. args must hold MAX_OPERANDS values.
+ */
+bool Bytecode::instruction_at (size_t *position, enum OpCode *opcode, int32_t *args)
 {
         if (*position >= this->count)
                 return false;
@@ -137,44 +142,176 @@ bool Bytecode::instruction_at (size_t *position, enum OpCode *opcode, int32_t *a
 
         *opcode = op;
 
+        for (int i = 0; i < Bytecode::operand_count (op); i++) {
+                args[i] = AS_INT32 (&this->chunk[*position]);
+                *position += sizeof (int32_t);
+        }
+
+        return true;
+}
+
+/**
+ * Whether the instruction is followed by a 32 bit operand
+ */
+bool Bytecode::has_operand (enum OpCode op)
+{
+        return Bytecode::operand_count (op) > 0;
+}
+
+/**
+ * Number of 32 bit operands following the instruction. A superinstruction
+ * takes the operands of every instruction in its sequence.
+ */
+int Bytecode::operand_count (enum OpCode op)
+{
         switch (op) {
         case OPJMP:
         case OPJMPFALSE:
         case OPSTORE:
         case OPLOAD:
         case OPCALL:
-        case OPPUSH: {
-                *arg = AS_INT32 (&this->chunk[*position]);
-                *position += sizeof (int32_t);
-        } break;
+        case OPPUSH:
+        case OPADDTO:
+        case OPSUBTO:
+        case OPMULTTO: return 1;
+        case OPTAILCALL:
+        case OPINC: return 2;
+        default: break;
+        }
+
+        enum OpCode sequence[MAX_SEQUENCE];
+        int length = Bytecode::superinstruction_sequence (op, sequence);
+        int count = 0;
+
+        for (int i = 0; i < length; i++)
+                count += Bytecode::operand_count (sequence[i]);
+
+        return count;
+}
+
+/**
+ * Index of the operand holding a code address, -1 if the instruction has none
+ */
+int Bytecode::jump_operand (enum OpCode op)
+{
+        switch (op) {
+        case OPJMP:
+        case OPJMPFALSE:
+        case OPCALL:
+        case OPTAILCALL: return 0;
         default: break;
         }
+
+        enum OpCode sequence[MAX_SEQUENCE];
+        int length = Bytecode::superinstruction_sequence (op, sequence);
+        int operand = 0;
+
+        for (int i = 0; i < length; i++) {
+                if (Bytecode::jump_operand (sequence[i]) == 0)
+                        return operand;
+
+                operand += Bytecode::operand_count (sequence[i]);
+        }
+
+        return -1;
+}
+
+/**
+ * Whether op ends a block without going on to the next instruction
+ */
+bool Bytecode::ends_path (enum OpCode op)
+{
+        return op == OPJMP || op == OPRET || op == OPHALT || op == OPEXIT || op == OPTAILCALL;
+}
+
+/**
+ * Print a single instruction in the format used by dump_bytecode
+ */
+void Bytecode::print_instruction (FILE *fp, size_t address, enum OpCode op, int32_t *args)
+{
+        fprintf (fp, "%" PRIu64 ": %s ", address, Bytecode::get_op_name (op));
+
+        for (int i = 0; i < Bytecode::operand_count (op); i++)
+                fprintf (fp, i == 0 ? "%d" : ", %d", args[i]);
+}
+
+bool Bytecode::register_instruction_at (size_t *position, enum RegOpCode *opcode, int32_t *args)
+{
+        if (*position >= this->count)
+                return false;
+
+        enum RegOpCode op = (enum RegOpCode)this->chunk[(*position)++];
+
+        *opcode = op;
+
+        for (int i = 0; i < Bytecode::register_operand_count (op); i++) {
+                args[i] = AS_INT32 (&this->chunk[*position]);
+                *position += sizeof (int32_t);
+        }
+
         return true;
 }
 
+/**
+ * Number of 32 bit operands following a register instruction
+ */
+int Bytecode::register_operand_count (enum RegOpCode op)
+{
+        if (ROP_ADD <= op && op <= ROP_SUB)
+                return 3;
+
+        if (ROP_JEQ <= op && op <= ROP_JGTEQK)
+                return 3;
+
+        switch (op) {
+        case ROP_ADDK: return 3;
+        case ROP_NEG:
+        case ROP_NOT:
+        case ROP_MOV:
+        case ROP_LOADK:
+        case ROP_JMPFALSE:
+        case ROP_CALL:
+        case ROP_KILL: return 2;
+        case ROP_JMP:
+        case ROP_RET:
+        case ROP_PRINT:
+        case ROP_FORK: return 1;
+        default: return 0;
+        }
+}
+
+void Bytecode::print_register_instruction (FILE *fp, size_t address, enum RegOpCode op, int32_t *args)
+{
+        fprintf (fp, "%" PRIu64 ": %s", address, Bytecode::get_register_op_name (op));
+
+        for (int i = 0; i < Bytecode::register_operand_count (op); i++)
+                fprintf (fp, "%s%d", i == 0 ? " " : ", ", args[i]);
+}
+
 void Bytecode::dump_bytecode ()
 {
-        
         size_t c = 0;
         enum OpCode op;
-        int32_t arg;
-        while (this->instruction_at (&c, &op, &arg)) {
-                switch (op) {
-                case OPJMP:
-                case OPJMPFALSE:
-                case OPSTORE:
-                case OPLOAD:
-                case OPCALL:
-                case OPPUSH: {
-                        printf ("%" PRIu64 ": %s ", c - 1 - sizeof (int32_t), this->get_op_name (op));
-                        printf ("%d\n", arg);
-                        break;
-                }
-                default:
-                        printf ("%" PRIu64 ": %s ", c - 1, this->get_op_name (op));
+        int32_t args[MAX_OPERANDS];
+        size_t address = c;
+
+        if (this->isa == ISA_REGISTER) {
+                enum RegOpCode rop;
+                int32_t args[MAX_REG_OPERANDS];
+
+                while (this->register_instruction_at (&c, &rop, args)) {
+                        Bytecode::print_register_instruction (stdout, address, rop, args);
                         printf ("\n");
-                        continue;
+                        address = c;
                 }
+
+                return;
+        }
+
+        while (this->instruction_at (&c, &op, args)) {
+                Bytecode::print_instruction (stdout, address, op, args);
+                printf ("\n");
+                address = c;
         }
 }
 
@@ -193,9 +330,11 @@ void Bytecode::set_address_offset (size_t offset)
                         c += sizeof (int32_t);
                         break;
                 }
-                default: continue;
+                default: c += Bytecode::operand_count (op) * sizeof (int32_t); break;
                 }
         }
+
+        this->address_offset = offset;
 }
 
 void Bytecode::import (int8_t *bytecode, size_t size)
@@ -209,6 +348,20 @@ void Bytecode::import (int8_t *bytecode, size_t size)
         }
 }
 
+/**
+ * Drop the code from address on, along with the lines that start after it
+ */
+void Bytecode::truncate (size_t address)
+{
+        if (address >= this->count)
+                return;
+
+        this->count = address;
+
+        while (!this->lines.empty () && (size_t)this->lines.back ().address > address)
+                this->lines.pop_back ();
+}
+
 const char *Bytecode::get_op_name (enum OpCode op)
 {
         switch (op) {
@@ -225,6 +378,8 @@ const char *Bytecode::get_op_name (enum OpCode op)
         case OPLTEQ: return "OPLTEQ";
         case OPAND: return "OPAND";
         case OPOR: return "OPOR";
+        case OPNEQ: return "OPNEQ";
+        case OPSUB: return "OPSUB";
         case OPJMP: return "OPJMP";
         case OPJMPFALSE: return "OPJMPFALSE";
         case OPSTORE: return "OPSTORE";
@@ -237,6 +392,78 @@ const char *Bytecode::get_op_name (enum OpCode op)
         case OPKILL: return "OPKILL";
         case OPPRINT: return "OPPRINT";
         case OPRET: return "OPRET";
+        case OPYIELD: return "OPYIELD";
+        case OPTAILCALL: return "OPTAILCALL";
+        case OPCHAN: return "OPCHAN";
+        case OPSEND: return "OPSEND";
+        case OPRECV: return "OPRECV";
+        case OPEXIT: return "OPEXIT";
+        case OPJOIN: return "OPJOIN";
+        case OPJOINANY: return "OPJOINANY";
+        case OPOPEN: return "OPOPEN";
+        case OPREAD: return "OPREAD";
+        case OPWRITE: return "OPWRITE";
+        case OPCLOSE: return "OPCLOSE";
+        case OPPIPE: return "OPPIPE";
+        case OPSOCKETPAIR: return "OPSOCKETPAIR";
+        case OPDUP: return "OPDUP";
+        case OPINC: return "OPINC";
+        case OPADDTO: return "OPADDTO";
+        case OPSUBTO: return "OPSUBTO";
+        case OPMULTTO: return "OPMULTTO";
+        case OPLOAD_PUSH_LT_JMPFALSE: return "OPLOAD_PUSH_LT_JMPFALSE";
+        case OPLOAD_PUSH_ADD: return "OPLOAD_PUSH_ADD";
+        case OPLOAD_ADD_STORE: return "OPLOAD_ADD_STORE";
+        case OPLOAD_LOAD: return "OPLOAD_LOAD";
+        case OPSTORE_POP: return "OPSTORE_POP";
+        case OPLT_JMPFALSE: return "OPLT_JMPFALSE";
+        case OPINC_JMP: return "OPINC_JMP";
+        default: return "UNKNOWN_OP";
+        }
+}
+
+const char *Bytecode::get_register_op_name (enum RegOpCode op)
+{
+        switch (op) {
+        case ROP_ADD: return "ADD";
+        case ROP_MULT: return "MULT";
+        case ROP_DIV: return "DIV";
+        case ROP_MOD: return "MOD";
+        case ROP_EQ: return "EQ";
+        case ROP_GT: return "GT";
+        case ROP_LT: return "LT";
+        case ROP_GTEQ: return "GTEQ";
+        case ROP_LTEQ: return "LTEQ";
+        case ROP_AND: return "AND";
+        case ROP_OR: return "OR";
+        case ROP_NEQ: return "NEQ";
+        case ROP_SUB: return "SUB";
+        case ROP_ADDK: return "ADDK";
+        case ROP_NEG: return "NEG";
+        case ROP_NOT: return "NOT";
+        case ROP_MOV: return "MOV";
+        case ROP_LOADK: return "LOADK";
+        case ROP_JMP: return "JMP";
+        case ROP_JMPFALSE: return "JMPFALSE";
+        case ROP_JEQ: return "JEQ";
+        case ROP_JNE: return "JNE";
+        case ROP_JLT: return "JLT";
+        case ROP_JLTEQ: return "JLTEQ";
+        case ROP_JGT: return "JGT";
+        case ROP_JGTEQ: return "JGTEQ";
+        case ROP_JEQK: return "JEQK";
+        case ROP_JNEK: return "JNEK";
+        case ROP_JLTK: return "JLTK";
+        case ROP_JLTEQK: return "JLTEQK";
+        case ROP_JGTK: return "JGTK";
+        case ROP_JGTEQK: return "JGTEQK";
+        case ROP_CALL: return "CALL";
+        case ROP_RET: return "RET";
+        case ROP_PRINT: return "PRINT";
+        case ROP_FORK: return "FORK";
+        case ROP_KILL: return "KILL";
+        case ROP_YIELD: return "YIELD";
+        case ROP_HALT: return "HALT";
         default: return "UNKNOWN_OP";
         }
 }
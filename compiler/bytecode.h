@@ -2,7 +2,10 @@
 #define bytecode_h
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string>
+#include <vector>
 
 #define AS_INT32(ptr)             (*((int32_t *)ptr))
 #define WRITE_INT(type, idx, val) *((type *)&this->chunk[idx]) = val
@@ -35,7 +38,209 @@ enum OpCode {
         OPPRINT,
         OPFORK,
         OPKILL,
-        OPRET
+        OPRET,
+        OPYIELD,
+        /* call that reuses the frame of the caller: target, argument count */
+        OPTAILCALL,
+        OPCHAN,
+        OPSEND,
+        OPRECV,
+        OPEXIT,
+        OPJOIN,
+        OPJOINANY,
+        OPOPEN,
+        OPREAD,
+        OPWRITE,
+        OPCLOSE,
+        OPPIPE,
+        OPSOCKETPAIR,
+
+        /*
+         * instructions are only ever added after the ones above, so the
+         * opcodes of raw images and of images with an older version keep
+         * their meaning
+         */
+        OPNEQ,
+        OPSUB,
+        OPDUP,
+        /* add an immediate to a local in place: offset, value */
+        OPINC,
+        /* pop a value and add it to, subtract it from or multiply a local by it in place: offset */
+        OPADDTO,
+        OPSUBTO,
+        OPMULTTO,
+
+        /*
+         * superinstructions: each runs a fixed sequence of the instructions
+         * above and takes their operands in the same order. must be kept in
+         * the order of the table in superinstructions.cpp
+         */
+        OPLOAD_PUSH_LT_JMPFALSE,
+        OPLOAD_PUSH_ADD,
+        OPLOAD_ADD_STORE,
+        OPLOAD_LOAD,
+        OPSTORE_POP,
+        OPLT_JMPFALSE,
+        OPINC_JMP,
+
+        /* number of opcodes, not an instruction */
+        OPCODE_COUNT
+};
+
+static inline bool is_binary (enum OpCode op)
+{
+        return (OPADD <= op && op <= OPOR) || op == OPNEQ || op == OPSUB;
+}
+
+/* most operands of any stack instruction, superinstructions included */
+#define MAX_OPERANDS 3
+
+/* longest instruction sequence a superinstruction stands for */
+#define MAX_SEQUENCE 4
+
+/**
+ * Three address register instruction set. Operands are 32 bit frame slots
+ * relative to bp, immediates (K suffix) or absolute code addresses.
+ */
+enum RegOpCode {
+        /* binary operations: dst, src1, src2. must be kept contiguous and in the order of binary_rop () */
+        ROP_ADD,
+        ROP_MULT,
+        ROP_DIV,
+        ROP_MOD,
+        ROP_EQ,
+        ROP_GT,
+        ROP_LT,
+        ROP_GTEQ,
+        ROP_LTEQ,
+        ROP_AND,
+        ROP_OR,
+        ROP_NEQ,
+        ROP_SUB,
+        /* end binary operations */
+
+        ROP_ADDK,     /* dst, src, imm */
+        ROP_NEG,      /* dst, src */
+        ROP_NOT,      /* dst, src */
+        ROP_MOV,      /* dst, src */
+        ROP_LOADK,    /* dst, imm */
+        ROP_JMP,      /* target */
+        ROP_JMPFALSE, /* src, target */
+
+        /* compare and branch: src1, src2, target. must be kept contiguous */
+        ROP_JEQ,
+        ROP_JNE,
+        ROP_JLT,
+        ROP_JLTEQ,
+        ROP_JGT,
+        ROP_JGTEQ,
+
+        /* compare with immediate and branch: src, imm, target. must be kept contiguous */
+        ROP_JEQK,
+        ROP_JNEK,
+        ROP_JLTK,
+        ROP_JLTEQK,
+        ROP_JGTK,
+        ROP_JGTEQK,
+
+        ROP_CALL,  /* target, base: return address and result in base, callee bp at base + 1 */
+        ROP_RET,   /* src */
+        ROP_PRINT, /* src */
+        ROP_FORK,  /* dst: also the number of live slots in the frame */
+        ROP_KILL,  /* dst, src */
+        ROP_YIELD,
+        ROP_HALT
+};
+
+#define MAX_REG_OPERANDS 3
+
+enum isa { ISA_STACK, ISA_REGISTER };
+
+/* the register instruction corresponding to a binary stack instruction */
+static inline enum RegOpCode binary_rop (enum OpCode op)
+{
+        if (op == OPNEQ)
+                return ROP_NEQ;
+
+        if (op == OPSUB)
+                return ROP_SUB;
+
+        return (enum RegOpCode)(op - OPADD + ROP_ADD);
+}
+
+/**
+ * Header of compiled program files. Files without the magic are raw stack
+ * instruction images starting at address 0.
+ */
+#define IMAGE_MAGIC "\177CBR"
+
+/*
+ * Changes whenever an opcode changes its number or meaning. Headers from
+ * before the version field have the isa, 0 or 1, where it is now.
+ */
+#define IMAGE_VERSION 3
+
+struct image_header {
+        char magic[4];
+        int32_t version;
+        int32_t isa;
+        int32_t entry_address;
+};
+
+/**
+ * Images may end in debug information for profiling: symbol_count functions
+ * as address, name length and name, then line_count lines as address and
+ * line, then this trailer. The code ends at code_size.
+ */
+#define DEBUG_MAGIC "\177CBD"
+
+struct debug_trailer {
+        int32_t code_size;
+        int32_t symbol_count;
+        int32_t line_count;
+        char magic[4];
+};
+
+/* a function starting at address */
+struct function_symbol {
+        int32_t address;
+        std::string name;
+};
+
+/* the code from address up to the next entry was compiled from line */
+struct line_entry {
+        int32_t address;
+        int32_t line;
+};
+
+/* rewrites done by the peephole pass */
+enum peephole_rule {
+        PEEPHOLE_DEAD_VALUE, /* PUSH or LOAD; POP */
+        PEEPHOLE_SELF_STORE, /* LOAD x; STORE x */
+        PEEPHOLE_SUB,        /* NEG; ADD */
+        PEEPHOLE_SWAP_SUB,   /* LOAD a; NEG; LOAD b; ADD */
+        PEEPHOLE_NEQ,        /* EQ; NOT */
+        PEEPHOLE_INC,        /* x = x + k */
+        PEEPHOLE_UPDATE,     /* LOAD x; ADD or MULT; STORE x and LOAD x; LOAD y; op; STORE x */
+        PEEPHOLE_SUB_TO,     /* NEG; LOAD x; ADD; STORE x */
+        PEEPHOLE_DUP,        /* STORE x; LOAD x */
+        PEEPHOLE_RULE_COUNT
+};
+
+struct peephole_stats {
+        uint64_t rewrites[PEEPHOLE_RULE_COUNT];
+        uint64_t instructions_before;
+        uint64_t instructions_after;
+};
+
+/* changes made by the jump threading pass */
+struct jump_stats {
+        uint64_t threaded;    /* jumps sent past a jump they led to */
+        uint64_t removed;     /* jumps to the next instruction */
+        uint64_t inverted;    /* branches over a jump merged into one */
+        uint64_t decided;     /* branches on a constant */
+        uint64_t moved;       /* blocks placed after the jump into them */
+        uint64_t unreachable; /* instructions no path reaches */
 };
 
 class Bytecode {
@@ -44,6 +249,12 @@ class Bytecode {
         size_t count;
         size_t capacity;
         size_t address_offset;
+        enum isa isa;
+
+        /* debug information, both sorted by address */
+        std::vector<struct function_symbol> symbols;
+        std::vector<struct line_entry> lines;
+
         Bytecode ();
         void emit_op (enum OpCode op);
         void patch_jump (size_t offset);
@@ -57,10 +268,33 @@ class Bytecode {
         void dump_bytecode ();
         void set_address_offset (size_t offset);
         void import (int8_t *bytecode, size_t size);
-        bool instruction_at (size_t *position, enum OpCode *op, int32_t *arg);
+        void truncate (size_t address);
+        bool instruction_at (size_t *position, enum OpCode *op, int32_t *args);
+        void fuse_superinstructions ();
+        void peephole (struct peephole_stats *stats);
+        void thread_jumps (struct jump_stats *stats);
+        void mark_line (int32_t line);
+        void add_symbol (int32_t address, std::string name);
+        void import_debug_info (Bytecode *other, int32_t offset);
+        void relocate_debug_info (std::vector<int32_t> &new_address);
+        bool write_debug_info (FILE *fp);
+
+        static bool has_operand (enum OpCode op);
+        static int operand_count (enum OpCode op);
+        static int jump_operand (enum OpCode op);
+        static bool ends_path (enum OpCode op);
+        static int superinstruction_sequence (enum OpCode op, enum OpCode *sequence);
+        static const char *get_op_name (enum OpCode op);
+        static void print_peephole_stats (FILE *fp, struct peephole_stats *stats);
+        static void print_jump_stats (FILE *fp, struct jump_stats *stats);
+        static void print_instruction (FILE *fp, size_t address, enum OpCode op, int32_t *args);
+
+        bool register_instruction_at (size_t *position, enum RegOpCode *op, int32_t *args);
+        static int register_operand_count (enum RegOpCode op);
+        static const char *get_register_op_name (enum RegOpCode op);
+        static void print_register_instruction (FILE *fp, size_t address, enum RegOpCode op, int32_t *args);
 
     private:
         void resize_chunk (size_t min_size);
-        const char *get_op_name (enum OpCode op);
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,464 @@
+#include "vm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Take thread out of queue. Returns false when it does not wait there.
+ */
+static bool unlink_waiting (struct wait_queue *queue, struct context *thread)
+{
+        struct context *previous = NULL;
+
+        for (struct context *t = queue->head; t; previous = t, t = t->next_waiting) {
+                if (t != thread)
+                        continue;
+
+                if (previous)
+                        previous->next_waiting = t->next_waiting;
+                else
+                        queue->head = t->next_waiting;
+
+                if (queue->tail == t)
+                        queue->tail = previous;
+
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * Take the value child id of parent left when it finished. Returns false when
+ * there is none.
+ */
+static bool take_exit (struct context *parent, int32_t id, int32_t *value)
+{
+        struct exit_record *previous = NULL;
+
+        for (struct exit_record *record = parent->exits; record; previous = record, record = record->next) {
+                if (record->id != id)
+                        continue;
+
+                if (previous)
+                        previous->next = record->next;
+                else
+                        parent->exits = record->next;
+
+                if (parent->exits_tail == record)
+                        parent->exits_tail = previous;
+
+                *value = record->value;
+                free (record);
+
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * The channel with the given id, NULL if there is none. The caller holds the
+ * channel lock.
+ */
+struct channel *VM::channel_at (int32_t id)
+{
+        if (id < 1 || (size_t)id > this->runtime->channels.size ())
+                return NULL;
+
+        return this->runtime->channels[id - 1];
+}
+
+/**
+ * chan(n): create a channel that buffers up to n values. Pushes its id, or -1
+ * when n is negative or there are MAX_CHANNELS channels already.
+ */
+void VM::chan_op ()
+{
+        int32_t capacity = this->pop ();
+
+        if (capacity < 0) {
+                this->push (-1);
+                return;
+        }
+
+        struct channel *channel = (struct channel *)calloc (1, sizeof (struct channel));
+        int32_t *buffer = (int32_t *)malloc ((capacity > 0 ? capacity : 1) * sizeof (int32_t));
+
+        if (!channel || !buffer) {
+                perror ("malloc");
+                exit (EXIT_FAILURE);
+        }
+
+        channel->capacity = capacity;
+        channel->buffer = buffer;
+        channel->id = -1;
+
+        {
+                std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+
+                if (this->runtime->channels.size () < MAX_CHANNELS) {
+                        this->runtime->channels.push_back (channel);
+                        channel->id = this->runtime->channels.size ();
+                }
+        }
+
+        this->push (channel->id);
+
+        if (channel->id == -1) {
+                free (buffer);
+                free (channel);
+        }
+}
+
+/**
+ * send(c, v): hand v to the thread that waits longest to receive from c, or
+ * buffer it. The sender blocks while the channel is full. Pushes 1 once v is
+ * sent, 0 when c is not a channel. Returns whether the thread blocked or woke
+ * another one, either way it gives up its time slice.
+ */
+bool VM::send_op ()
+{
+        int32_t value = this->pop ();
+        int32_t id = this->pop ();
+        std::unique_lock<std::mutex> guard (this->runtime->channel_lock);
+        struct channel *channel = this->channel_at (id);
+
+        if (!channel) {
+                guard.unlock ();
+                this->push (0);
+                return false;
+        }
+
+        /* receivers only wait on an empty buffer */
+        struct context *receiver = dequeue (&channel->receivers);
+
+        if (receiver) {
+                *receiver->sp++ = value;
+                this->wake (receiver);
+                guard.unlock ();
+                this->push (1);
+                return true;
+        }
+
+        if (channel->count < channel->capacity) {
+                channel->buffer[(channel->head + channel->count++) % channel->capacity] = value;
+                guard.unlock ();
+                this->push (1);
+                return false;
+        }
+
+        this->thread->message = value;
+        this->block (channel, &channel->senders);
+
+        return true;
+}
+
+/**
+ * recv(c): take the oldest value of c, blocking while there is none. Pushes
+ * 0 when c is not a channel. Returns whether the thread blocked or woke a
+ * sender.
+ */
+bool VM::recv_op ()
+{
+        int32_t id = this->pop ();
+        std::unique_lock<std::mutex> guard (this->runtime->channel_lock);
+        struct channel *channel = this->channel_at (id);
+
+        if (!channel) {
+                guard.unlock ();
+                this->push (0);
+                return false;
+        }
+
+        struct context *sender = dequeue (&channel->senders);
+        int32_t value;
+
+        if (channel->count > 0) {
+                value = channel->buffer[channel->head];
+                channel->head = (channel->head + 1) % channel->capacity;
+                channel->count--;
+
+                /* the slot it frees goes to the sender that waits longest */
+                if (sender)
+                        channel->buffer[(channel->head + channel->count++) % channel->capacity] = sender->message;
+        } else if (sender) {
+                value = sender->message;
+        } else {
+                this->block (channel, &channel->receivers);
+                return true;
+        }
+
+        if (sender) {
+                *sender->sp++ = 1;
+                this->wake (sender);
+        }
+
+        guard.unlock ();
+        this->push (value);
+
+        return sender != NULL;
+}
+
+/**
+ * Block the current thread in queue, of channel when it is on one. Its worker
+ * takes it off the ring when it schedules. The caller holds the channel lock.
+ */
+void VM::block (struct channel *channel, struct wait_queue *queue)
+{
+        this->thread->queue = queue;
+        this->thread->channel = channel;
+        this->thread->state = BLOCKED;
+
+        if (queue)
+                enqueue (queue, this->thread);
+
+        this->runtime->blocked++;
+}
+
+/**
+ * Let a thread taken from a wait queue run again. A thread its worker has not
+ * taken off the ring yet simply carries on there, a parked one joins the ring
+ * of this worker. The caller holds the channel lock.
+ */
+void VM::wake (struct context *thread)
+{
+        if (thread->handle)
+                this->runtime->io_waiting--;
+
+        thread->handle = NULL;
+        thread->queue = NULL;
+        thread->channel = NULL;
+        thread->joining = NULL;
+        this->runtime->blocked--;
+
+        if (!thread->parked) {
+                thread->state = RUNNING;
+                return;
+        }
+
+        thread->parked = false;
+        thread->worker = this->id;
+        thread->state = RUNNING;
+
+        {
+                std::lock_guard<std::mutex> guard (this->lock);
+                this->add_thread (thread);
+        }
+
+        this->runtime->work.notify_one ();
+}
+
+/**
+ * Kill a thread blocked on a channel. Returns false when it is not blocked.
+ * release is set when it was parked, then the caller releases it, otherwise
+ * its worker does.
+ */
+bool VM::kill_blocked (struct context *thread, bool *release)
+{
+        std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+
+        if (thread->state != BLOCKED)
+                return false;
+
+        if (thread->queue)
+                unlink_waiting (thread->queue, thread);
+
+        if (thread->handle)
+                this->runtime->io_waiting--;
+
+        thread->handle = NULL;
+        thread->queue = NULL;
+        thread->channel = NULL;
+        thread->joining = NULL;
+        thread->state = KILLED;
+        this->runtime->blocked--;
+
+        *release = thread->parked;
+        thread->parked = false;
+
+        return true;
+}
+
+/**
+ * join(t): wait for thread t to finish and push what it exited with, -1 when
+ * it was killed. A thread that finished already, or was never started, pushes
+ * its value right away. The slot of a child is not reused before its parent
+ * took the value, anyone else joins the thread holding the slot.
+ * Joining itself or no thread pushes -1. Returns whether the thread blocked.
+ */
+bool VM::join_op ()
+{
+        int32_t id = this->pop ();
+        std::unique_lock<std::mutex> guard (this->runtime->channel_lock);
+        struct context *target = this->thread_at (id);
+        int32_t value = -1;
+
+        if (target && target != this->thread) {
+                if (take_exit (this->thread, id, &value)) {
+                        this->free_thread (target);
+                } else if (!target->finished) {
+                        this->thread->joining = target;
+                        this->block (NULL, &target->joiners);
+                        return true;
+                } else {
+                        value = target->exit_value;
+                }
+        }
+
+        guard.unlock ();
+        this->push (value);
+
+        return false;
+}
+
+/**
+ * join_any(): wait for any child of the current thread to finish and push its
+ * value, the values of children that finished before are taken first, oldest
+ * first. Pushes -1 when there is no child left. Returns whether the thread
+ * blocked.
+ */
+bool VM::join_any_op ()
+{
+        std::unique_lock<std::mutex> guard (this->runtime->channel_lock);
+        struct exit_record *record = this->thread->exits;
+        int32_t value = -1;
+
+        if (record) {
+                this->thread->exits = record->next;
+
+                if (!record->next)
+                        this->thread->exits_tail = NULL;
+
+                value = record->value;
+                this->free_thread (this->thread_at (record->id));
+                free (record);
+        } else if (this->thread->children > 0) {
+                this->block (NULL, NULL);
+                return true;
+        }
+
+        guard.unlock ();
+        this->push (value);
+
+        return false;
+}
+
+/**
+ * Make the value of a stopped thread final and hand it to the threads joining
+ * it, or to its parent. A parent waiting for any child takes it, otherwise it
+ * is kept for the parent unless it is one of the joiners. Returns whether it
+ * was kept, the slot is not free again until the parent takes the value or
+ * finishes itself.
+ */
+bool VM::finish_thread (struct context *thread)
+{
+        std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+        struct context *parent = thread->parent;
+        bool collected = false;
+        bool kept = false;
+
+        if (parent && parent->generation != thread->parent_generation)
+                parent = NULL;
+
+        if (thread->state == KILLED)
+                thread->exit_value = -1;
+
+        thread->finished = true;
+
+        for (struct context *joiner; (joiner = dequeue (&thread->joiners));) {
+                collected = collected || joiner == parent;
+                *joiner->sp++ = thread->exit_value;
+                this->wake (joiner);
+        }
+
+        if (parent) {
+                parent->children--;
+
+                if (collected) {
+                        /* the parent joined it by id */
+                } else if (parent->state == BLOCKED && !parent->queue && !parent->channel) {
+                        *parent->sp++ = thread->exit_value;
+                        this->wake (parent);
+                } else {
+                        struct exit_record *record = (struct exit_record *)malloc (sizeof (struct exit_record));
+
+                        if (!record) {
+                                perror ("malloc");
+                                exit (EXIT_FAILURE);
+                        }
+
+                        record->id = thread->id;
+                        record->value = thread->exit_value;
+                        record->next = NULL;
+
+                        if (parent->exits_tail)
+                                parent->exits_tail->next = record;
+                        else
+                                parent->exits = record;
+
+                        parent->exits_tail = record;
+                        kept = true;
+
+                        /* the parent can take the value once the lock is released, and reuse the slot */
+                        this->free_stack (thread);
+                }
+        }
+
+        /* its children outlive it, they no longer have a parent to leave their values with */
+        thread->generation++;
+
+        while (thread->exits) {
+                struct exit_record *record = thread->exits;
+
+                thread->exits = record->next;
+                this->free_thread (this->thread_at (record->id));
+                free (record);
+        }
+
+        thread->exits_tail = NULL;
+
+        return kept;
+}
+
+/**
+ * Stop the program when every thread left is blocked on a channel or joining,
+ * no thread could ever wake them. Threads waiting for I/O can be woken from
+ * outside.
+ */
+void VM::check_deadlock ()
+{
+        std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+
+        if (this->runtime->blocked == 0 || this->runtime->blocked != this->runtime->live || this->runtime->io_waiting > 0)
+                return;
+
+        fprintf (stderr, "error: deadlock: all %d threads are blocked\n", this->runtime->blocked);
+
+        for (int32_t id = 1; id <= this->runtime->capacity; id++) {
+                struct context *thread = this->thread_at (id);
+
+                if (thread->state != BLOCKED)
+                        continue;
+
+                if (thread->channel)
+                        fprintf (stderr, "thread #%d is blocked on channel #%d\n", id - 1, thread->channel->id);
+                else if (thread->joining)
+                        fprintf (stderr, "thread #%d is joining thread #%d\n", id - 1, thread->joining->id - 1);
+                else
+                        fprintf (stderr, "thread #%d is waiting for a child to finish\n", id - 1);
+        }
+
+        exit (EXIT_FAILURE);
+}
+
+void VM::destroy_channels ()
+{
+        for (struct channel *channel : this->runtime->channels) {
+                free (channel->buffer);
+                free (channel);
+        }
+
+        this->runtime->channels.clear ();
+        this->runtime->blocked = 0;
+}
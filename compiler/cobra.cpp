@@ -1,17 +1,51 @@
 
 #include "bytecode.h"
 #include "compiler.h"
+#include "emitc.h"
 #include "vm.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define DEBUG_MODE        0
-#define EXEC_MODE         1
-#define VERBOSE           2
-#define SET_OPTION(opt)   (options |= (1 << (opt)))
-#define OPTION_ISSET(opt) (options & (1 << (opt)))
+#define DEBUG_MODE           0
+#define EXEC_MODE            1
+#define VERBOSE              2
+#define NO_VERIFY            3
+#define NO_SUPERINSTRUCTIONS 4
+#define JIT                  5
+#define EMIT_C               6
+#define NO_FOLD              7
+#define NO_PEEPHOLE          8
+#define NO_JUMP_THREADING    9
+#define NO_STRIP             10
+#define SET_OPTION(opt)      (options |= (1 << (opt)))
+#define OPTION_ISSET(opt)    (options & (1 << (opt)))
 int32_t options = 0;
+enum engine engine = ENGINE_SWITCH;
+enum isa target = ISA_STACK;
+uint32_t quantum = DEFAULT_QUANTUM;
+uint32_t workers = 1;
+const char *profile = NULL;
+uint64_t profile_interval = PROFILE_INTERVAL;
+const char *opstats = NULL;
+bool opstats_triples = false;
+int optimize = 0;
+
+/**
+ * Set the passes of compiler from the command line options, generating code
+ * for isa
+ */
+void configure (Compiler *compiler, enum isa isa)
+{
+        compiler->target = isa;
+        compiler->superinstructions = !OPTION_ISSET (NO_SUPERINSTRUCTIONS);
+        compiler->fold_constants = !OPTION_ISSET (NO_FOLD);
+        compiler->peephole = !OPTION_ISSET (NO_PEEPHOLE);
+        compiler->thread_jumps = !OPTION_ISSET (NO_JUMP_THREADING);
+        compiler->optimize = optimize;
+        compiler->strip_functions = !OPTION_ISSET (NO_STRIP);
+}
 
 void compile (const char *filename, const char *outfile)
 {
@@ -24,14 +58,37 @@ void compile (const char *filename, const char *outfile)
 
         Compiler compiler (fp);
 
+        configure (&compiler, target);
+
         Function *bytes = compiler.compile ();
 
         FILE *outfp = fopen (outfile, "w");
 
+        if (!outfp) {
+                perror ("fopen");
+                exit (EXIT_FAILURE);
+        }
+
+        struct image_header header;
+        memcpy (header.magic, IMAGE_MAGIC, sizeof (header.magic));
+        header.version = IMAGE_VERSION;
+        header.isa = compiler.target;
+        header.entry_address = 0;
+
+        if (fwrite (&header, sizeof (header), 1, outfp) != 1) {
+                fprintf (stderr, "fatal error: failed to write to out file");
+                exit (EXIT_FAILURE);
+        }
+
         if (fwrite (bytes->bytecode->chunk, bytes->bytecode->count, 1, outfp) != 1) {
                 fprintf (stderr, "fatal error: failed to write to out file");
                 exit (EXIT_FAILURE);
         }
+
+        if (!bytes->bytecode->write_debug_info (outfp)) {
+                fprintf (stderr, "fatal error: failed to write to out file");
+                exit (EXIT_FAILURE);
+        }
         fclose (outfp);
 }
 
@@ -46,41 +103,205 @@ void debug (char *filename)
 
         Compiler compiler (fp);
 
+        configure (&compiler, target);
+
         Function *bytes = compiler.compile ();
 
         bytes->bytecode->dump_bytecode ();
+
+        if (compiler.optimize > 0)
+                IR::print_stats (stderr, &compiler.ir_stats);
+
+        if (compiler.peephole)
+                Bytecode::print_peephole_stats (stderr, &compiler.peephole_stats);
+
+        if (compiler.thread_jumps)
+                Bytecode::print_jump_stats (stderr, &compiler.jump_stats);
+
+        if (compiler.strip_functions)
+                Compiler::print_link_stats (stderr, &compiler.link_stats);
+}
+
+/**
+ * Translate a program into C for cobra_runtime.h instead of a bytecode image
+ */
+void emit_c (const char *filename, const char *outfile)
+{
+        FILE *fp = fopen (filename, "r");
+
+        if (!fp) {
+                perror ("fopen");
+                exit (EXIT_FAILURE);
+        }
+
+        Compiler compiler (fp);
+
+        configure (&compiler, ISA_STACK);
+
+        Function *bytes = compiler.compile ();
+        CEmitter emitter (bytes->bytecode, 0, quantum);
+
+        FILE *outfp = fopen (outfile, "w");
+
+        if (!outfp) {
+                perror ("fopen");
+                exit (EXIT_FAILURE);
+        }
+
+        if (!emitter.emit (outfp)) {
+                fprintf (stderr, "error: %s: only verified programs can be translated to C\n", filename);
+                fclose (outfp);
+                remove (outfile);
+                exit (EXIT_FAILURE);
+        }
+
+        fclose (outfp);
 }
 
-void exec (char *filename)
+/**
+ * Run the image in filename, open() takes the files in arguments
+ */
+void exec (char *filename, char **arguments, int argument_count)
 {
         VM vm;
 
         if (OPTION_ISSET (VERBOSE))
                 vm.verbose = true;
 
+        if (OPTION_ISSET (NO_VERIFY))
+                vm.verify = false;
+
+        if (OPTION_ISSET (JIT))
+                vm.jit = true;
+
+        vm.engine = engine;
+        vm.quantum = quantum;
+        vm.workers = workers;
+        vm.arguments = arguments;
+        vm.argument_count = argument_count;
+        vm.profile = profile;
+        vm.profile_interval = profile_interval;
+        vm.opstats = opstats;
+        vm.opstats_triples = opstats_triples;
+
         vm.load_file_and_run (filename);
 }
 
 void parse_cmd (int argc, char **argv)
 {
         struct option long_options[] = {
-                {  "debug",       no_argument, 0, 'd'},
-                {   "exec",       no_argument, 0, 'e'},
-                {"verbose",       no_argument, 0, 'v'},
-                { "output", required_argument, 0, 'o'},
-                {     NULL,                 0, 0,   0}
+                {               "debug",       no_argument, 0, 'd'},
+                {                "exec",       no_argument, 0, 'e'},
+                {             "verbose",       no_argument, 0, 'v'},
+                {              "output", required_argument, 0, 'o'},
+                {              "engine", required_argument, 0, 'E'},
+                {           "no-verify",       no_argument, 0, 'n'},
+                {                 "isa", required_argument, 0, 'i'},
+                {"no-superinstructions",       no_argument, 0, 's'},
+                {             "quantum", required_argument, 0, 'q'},
+                {             "workers", required_argument, 0, 'w'},
+                {                 "jit",       no_argument, 0, 'j'},
+                {              "emit-c",       no_argument, 0, 'c'},
+                {             "profile", required_argument, 0, 'p'},
+                {    "profile-interval", required_argument, 0, 'P'},
+                {             "opstats", required_argument, 0, 'S'},
+                {     "opstats-triples",       no_argument, 0, 'T'},
+                {             "no-fold",       no_argument, 0, 'f'},
+                {         "no-peephole",       no_argument, 0, 'k'},
+                {   "no-jump-threading",       no_argument, 0, 't'},
+                {            "optimize", required_argument, 0, 'O'},
+                {            "no-strip",       no_argument, 0, 'x'},
+                {                  NULL,                 0, 0,   0}
         };
 
         int c, option_index = 0;
 
         char *outfile_name = NULL;
 
-        while ((c = getopt_long (argc, argv, "devo:", long_options, &option_index)) != -1) {
+        while ((c = getopt_long (argc, argv, "devnsjcTfktxo:E:i:q:w:p:P:S:O:", long_options, &option_index)) != -1) {
                 switch (c) {
                 case 'd': SET_OPTION (DEBUG_MODE); break;
                 case 'e': SET_OPTION (EXEC_MODE); break;
                 case 'v': SET_OPTION (VERBOSE); break;
+                case 'n': SET_OPTION (NO_VERIFY); break;
+                case 's': SET_OPTION (NO_SUPERINSTRUCTIONS); break;
+                case 'f': SET_OPTION (NO_FOLD); break;
+                case 'k': SET_OPTION (NO_PEEPHOLE); break;
+                case 't': SET_OPTION (NO_JUMP_THREADING); break;
+                case 'x': SET_OPTION (NO_STRIP); break;
+                case 'j': SET_OPTION (JIT); break;
+                case 'c': SET_OPTION (EMIT_C); break;
+                case 'i': {
+                        if (strcmp (optarg, "stack") == 0) {
+                                target = ISA_STACK;
+                        } else if (strcmp (optarg, "register") == 0) {
+                                target = ISA_REGISTER;
+                        } else {
+                                fprintf (stderr, "error: unknown instruction set '%s', expected stack or register\n", optarg);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                }
+                case 'q': {
+                        char *end;
+                        long n = strtol (optarg, &end, 10);
+
+                        if (*optarg == '\0' || *end != '\0' || n < 1 || n > UINT32_MAX) {
+                                fprintf (stderr, "error: invalid quantum '%s', expected a positive number of instructions\n", optarg);
+                                exit (EXIT_FAILURE);
+                        }
+
+                        quantum = n;
+                        break;
+                }
+                case 'w': {
+                        char *end;
+                        long n = strtol (optarg, &end, 10);
+
+                        if (*optarg == '\0' || *end != '\0' || n < 1 || n > MAX_WORKERS) {
+                                fprintf (stderr, "error: invalid number of workers '%s', expected 1 to %d\n", optarg, MAX_WORKERS);
+                                exit (EXIT_FAILURE);
+                        }
+
+                        workers = n;
+                        break;
+                }
+                case 'p': profile = optarg; break;
+                case 'S': opstats = optarg; break;
+                case 'T': opstats_triples = true; break;
+                case 'P': {
+                        char *end;
+                        long n = strtol (optarg, &end, 10);
+
+                        if (*optarg == '\0' || *end != '\0' || n < 1) {
+                                fprintf (stderr, "error: invalid profile interval '%s', expected a positive number of instructions\n", optarg);
+                                exit (EXIT_FAILURE);
+                        }
+
+                        profile_interval = n;
+                        break;
+                }
+                case 'O': {
+                        if (strcmp (optarg, "0") == 0 || strcmp (optarg, "1") == 0 || strcmp (optarg, "2") == 0) {
+                                optimize = optarg[0] - '0';
+                        } else {
+                                fprintf (stderr, "error: unknown optimization level '%s', expected 0, 1 or 2\n", optarg);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                }
                 case 'o': outfile_name = optarg; break;
+                case 'E': {
+                        if (strcmp (optarg, "switch") == 0) {
+                                engine = ENGINE_SWITCH;
+                        } else if (strcmp (optarg, "threaded") == 0) {
+                                engine = ENGINE_THREADED;
+                        } else {
+                                fprintf (stderr, "error: unknown engine '%s', expected switch or threaded\n", optarg);
+                                exit (EXIT_FAILURE);
+                        }
+                        break;
+                }
                 default: break;
                 }
         }
@@ -93,7 +314,9 @@ void parse_cmd (int argc, char **argv)
         if (OPTION_ISSET (DEBUG_MODE))
                 debug (argv[optind]);
         else if (OPTION_ISSET (EXEC_MODE))
-                exec (argv[optind]);
+                exec (argv[optind], argv + optind + 1, argc - optind - 1);
+        else if (OPTION_ISSET (EMIT_C))
+                emit_c (argv[optind], outfile_name ? outfile_name : "a.c");
         else
                 compile (argv[optind], outfile_name ? outfile_name : "a.bin");
 }
@@ -0,0 +1,1427 @@
+#ifndef cobra_runtime_h
+#define cobra_runtime_h
+
+/*
+ * Runtime of C programs generated by cobrac --emit-c: the thread table, the
+ * green thread scheduler and the stack and frame management of the VM, for a
+ * single OS thread. Every cobra function is a C function that works on the
+ * stack of the current thread and is entered at an address, either its entry
+ * or a point where the thread stopped before.
+ *
+ * The generated file defines the limits below and includes this header once.
+ */
+
+/* pipe2 and the socket flags */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef CB_QUANTUM
+#define CB_QUANTUM 1000
+#endif
+#ifndef CB_STACK_SIZE
+#define CB_STACK_SIZE (1024 * 1024 * 16)
+#endif
+#ifndef CB_FRAME_SIZE
+#define CB_FRAME_SIZE (1024 * 1024)
+#endif
+#ifndef CB_MAX_THREADS
+#define CB_MAX_THREADS (1024 * 1024)
+#endif
+#ifndef CB_THREAD_BLOCK
+#define CB_THREAD_BLOCK 1024
+#endif
+#ifndef CB_MAX_CHANNELS
+#define CB_MAX_CHANNELS (1024 * 1024)
+#endif
+#ifndef CB_IO_BUFFER
+#define CB_IO_BUFFER 4096
+#endif
+#ifndef CB_IO_POLL_INTERVAL
+#define CB_IO_POLL_INTERVAL 1000
+#endif
+
+#define CB_INITIAL_STACK_SIZE 256
+#define CB_INITIAL_FRAME_SIZE 32
+
+/* nested C calls before the C stack is unwound and the thread continues from its saved state */
+#define CB_MAX_DEPTH 10000
+
+/* a function returns its return address, or one of these when it left the thread in memory */
+#define CB_SUSPEND (-1)
+#define CB_UNWIND  (-2)
+
+/* blocked threads wait on a channel, for I/O or for other threads to finish and are on no ring */
+enum cb_state { CB_UNUSED, CB_RUNNING, CB_BLOCKED, CB_EXITED, CB_KILLED };
+
+struct cb_wait_queue {
+        struct cb_thread *head;
+        struct cb_thread *tail;
+};
+
+/* the value a child finished with, kept for its parent */
+struct cb_exit {
+        int32_t id;
+        int32_t value;
+        struct cb_exit *next;
+};
+
+struct cb_thread {
+        int32_t *stack;
+        int32_t *stack_limit;
+        int32_t *sp;
+        int32_t *bp;
+        /* frames are kept as offsets into the stack, which moves when it grows */
+        ptrdiff_t *frames;
+        int32_t frame_no;
+        int32_t frame_capacity;
+        int32_t ip;
+        int32_t id;
+        enum cb_state state;
+        struct cb_thread *next;
+        struct cb_thread *previous;
+        struct cb_thread *next_free;
+
+        /*
+         * a blocked thread waits in queue, on channel, on an I/O handle or
+         * joining a thread, a sender or writer with the value it offers. one
+         * waiting for any child is in no queue
+         */
+        struct cb_wait_queue *queue;
+        struct cb_channel *channel;
+        struct cb_handle *handle;
+        struct cb_thread *joining;
+        struct cb_thread *next_waiting;
+        int32_t message;
+
+        /* what join returns, final once the thread is finished, and the threads joining it */
+        int32_t exit_value;
+        int finished;
+        struct cb_wait_queue joiners;
+
+        /*
+         * the thread that forked it while its slot is in the same generation,
+         * the children running and the values of those not joined yet
+         */
+        struct cb_thread *parent;
+        uint32_t parent_generation;
+        uint32_t generation;
+        int32_t children;
+        struct cb_exit *exits;
+        struct cb_exit *exits_tail;
+};
+
+/* a bounded channel, a ring buffer of capacity values and the threads blocked on either end */
+struct cb_channel {
+        int32_t id;
+        int32_t capacity;
+        int32_t head;
+        int32_t count;
+        int32_t *buffer;
+        struct cb_wait_queue senders;
+        struct cb_wait_queue receivers;
+};
+
+/*
+ * an open file, pipe end or socket. pipes and sockets are non-blocking and
+ * polled while threads wait on them, a waiting writer offers its byte or
+ * CB_IO_CLOSE. the standard handles have a stream. standard input stays
+ * blocking, so when it is a pipe or terminal it is only read once poll
+ * found it readable
+ */
+struct cb_handle {
+        int fd;
+        FILE *stream;
+        int pollable;
+        int blocking;
+        int readable;
+        int eof;
+        int32_t in_start;
+        int32_t in_end;
+        int32_t out_count;
+        uint8_t in[CB_IO_BUFFER];
+        uint8_t out[CB_IO_BUFFER];
+        struct cb_wait_queue readers;
+        struct cb_wait_queue writers;
+};
+
+#define CB_IO_CLOSE (-1)
+
+typedef int32_t (*cb_function) (struct cb_thread *t, int32_t at);
+
+static struct cb_thread *cb_blocks[CB_MAX_THREADS / CB_THREAD_BLOCK];
+static int32_t cb_capacity;
+static struct cb_thread *cb_free_threads;
+static struct cb_thread *cb_current;
+static int cb_alone;
+
+static struct cb_channel **cb_channels;
+static int32_t cb_channel_count;
+static int32_t cb_blocked;
+
+/* I/O handles by id, the threads waiting on them and the files open() takes by index */
+static struct cb_handle **cb_handles;
+static int32_t cb_handle_count;
+static int32_t cb_io_waiting;
+static int cb_io_dirty;
+static char **cb_arguments;
+static int cb_argument_count;
+
+/* instructions executed so far and the count at which the time slice of the current thread ends */
+static uint64_t cb_ops;
+static uint64_t cb_slice_end;
+static int32_t cb_depth;
+
+static inline void *cb_alloc (void *ptr, size_t size)
+{
+        ptr = realloc (ptr, size);
+
+        if (!ptr) {
+                perror ("realloc");
+                exit (EXIT_FAILURE);
+        }
+
+        return ptr;
+}
+
+/**
+ * Make room for at least needed stack slots, doubling the stack until it fits
+ */
+static inline void cb_grow_stack (struct cb_thread *t, size_t needed)
+{
+        size_t capacity = t->stack_limit - t->stack;
+        size_t grown = capacity;
+
+        if (needed <= capacity)
+                return;
+
+        if (needed > CB_STACK_SIZE) {
+                fprintf (stderr, "error: stack overflow: thread #%d needs %lu stack slots, at most %d fit\n",
+                         t->id - 1, (unsigned long)needed, CB_STACK_SIZE);
+                exit (EXIT_FAILURE);
+        }
+
+        while (grown < needed)
+                grown *= 2;
+
+        if (grown > CB_STACK_SIZE)
+                grown = CB_STACK_SIZE;
+
+        ptrdiff_t sp = t->sp - t->stack;
+        ptrdiff_t bp = t->bp - t->stack;
+
+        t->stack = (int32_t *)cb_alloc (t->stack, grown * sizeof (int32_t));
+        memset (t->stack + capacity, 0, (grown - capacity) * sizeof (int32_t));
+        t->stack_limit = t->stack + grown;
+        t->sp = t->stack + sp;
+        t->bp = t->stack + bp;
+}
+
+/**
+ * Double the frame array of t. Returns 0 when it already holds CB_FRAME_SIZE frames.
+ */
+static inline int cb_grow_frames (struct cb_thread *t)
+{
+        int32_t grown = t->frame_capacity * 2;
+
+        if (t->frame_capacity == CB_FRAME_SIZE)
+                return 0;
+
+        if (grown > CB_FRAME_SIZE)
+                grown = CB_FRAME_SIZE;
+
+        t->frames = (ptrdiff_t *)cb_alloc (t->frames, grown * sizeof (ptrdiff_t));
+        t->frame_capacity = grown;
+
+        return 1;
+}
+
+/**
+ * The thread with the given id, NULL if no slot has that id
+ */
+static inline struct cb_thread *cb_thread_at (int32_t id)
+{
+        if (id < 1 || id > cb_capacity)
+                return NULL;
+
+        return &cb_blocks[(id - 1) / CB_THREAD_BLOCK][(id - 1) % CB_THREAD_BLOCK];
+}
+
+/**
+ * Take the lowest free slot for a child of parent, growing the table by a
+ * block when none is left. Returns NULL when the table is full.
+ */
+static inline struct cb_thread *cb_allocate_thread (struct cb_thread *parent)
+{
+        if (!cb_free_threads) {
+                if (cb_capacity == CB_MAX_THREADS)
+                        return NULL;
+
+                struct cb_thread *threads = (struct cb_thread *)calloc (CB_THREAD_BLOCK, sizeof (struct cb_thread));
+
+                if (!threads) {
+                        perror ("calloc");
+                        exit (EXIT_FAILURE);
+                }
+
+                cb_blocks[cb_capacity / CB_THREAD_BLOCK] = threads;
+
+                for (int32_t i = CB_THREAD_BLOCK - 1; i >= 0; i--) {
+                        threads[i].id = cb_capacity + i + 1;
+                        threads[i].exit_value = -1;
+                        threads[i].finished = 1;
+                        threads[i].next_free = cb_free_threads;
+                        cb_free_threads = &threads[i];
+                }
+
+                cb_capacity += CB_THREAD_BLOCK;
+        }
+
+        struct cb_thread *t = cb_free_threads;
+
+        cb_free_threads = t->next_free;
+
+        if (!t->stack) {
+                t->stack = (int32_t *)cb_alloc (NULL, CB_INITIAL_STACK_SIZE * sizeof (int32_t));
+                t->stack_limit = t->stack + CB_INITIAL_STACK_SIZE;
+                t->frames = (ptrdiff_t *)cb_alloc (NULL, CB_INITIAL_FRAME_SIZE * sizeof (ptrdiff_t));
+                t->frame_capacity = CB_INITIAL_FRAME_SIZE;
+        }
+
+        t->sp = t->stack;
+        t->bp = t->stack;
+        t->frame_no = 0;
+        t->queue = NULL;
+        t->channel = NULL;
+        t->handle = NULL;
+        t->joining = NULL;
+        t->exit_value = 0;
+        t->finished = 0;
+        t->parent = parent;
+        t->parent_generation = parent ? parent->generation : 0;
+        t->children = 0;
+
+        if (parent)
+                parent->children++;
+
+        return t;
+}
+
+static inline int cb_finish (struct cb_thread *t);
+
+/**
+ * Put the slot of a finished thread back on the free list
+ */
+static inline void cb_free_thread (struct cb_thread *t)
+{
+        t->next_free = cb_free_threads;
+        cb_free_threads = t;
+}
+
+/**
+ * Finish a stopped thread, which wakes the threads joining it, and free its
+ * slot unless its value is kept for its parent. A kept slot only gives up its
+ * stack, the parent frees it once it takes the value.
+ */
+static inline void cb_release_thread (struct cb_thread *t)
+{
+        if (!cb_finish (t)) {
+                cb_free_thread (t);
+                return;
+        }
+
+        free (t->stack);
+        free (t->frames);
+        t->stack = NULL;
+        t->frames = NULL;
+}
+
+/**
+ * Link t into the ring after the current thread, or make it the ring
+ */
+static inline void cb_add_thread (struct cb_thread *t)
+{
+        if (!cb_current) {
+                t->next = t;
+                t->previous = t;
+                cb_current = t;
+                return;
+        }
+
+        struct cb_thread *next = cb_current->next;
+
+        cb_current->next = t;
+        t->previous = cb_current;
+        t->next = next;
+        next->previous = t;
+}
+
+static inline void cb_remove_thread (struct cb_thread *t)
+{
+        if (t->next == t)
+                return;
+
+        t->previous->next = t->next;
+        t->next->previous = t->previous;
+        t->next = t;
+        t->previous = t;
+}
+
+static inline void cb_enqueue (struct cb_wait_queue *queue, struct cb_thread *t)
+{
+        t->next_waiting = NULL;
+
+        if (queue->tail)
+                queue->tail->next_waiting = t;
+        else
+                queue->head = t;
+
+        queue->tail = t;
+}
+
+static inline struct cb_thread *cb_dequeue (struct cb_wait_queue *queue)
+{
+        struct cb_thread *t = queue->head;
+
+        if (!t)
+                return NULL;
+
+        queue->head = t->next_waiting;
+
+        if (!queue->head)
+                queue->tail = NULL;
+
+        return t;
+}
+
+/**
+ * Take t out of queue, returns 0 when it does not wait there
+ */
+static inline int cb_unlink_waiting (struct cb_wait_queue *queue, struct cb_thread *t)
+{
+        struct cb_thread *previous = NULL;
+
+        for (struct cb_thread *waiting = queue->head; waiting; previous = waiting, waiting = waiting->next_waiting) {
+                if (waiting != t)
+                        continue;
+
+                if (previous)
+                        previous->next_waiting = t->next_waiting;
+                else
+                        queue->head = t->next_waiting;
+
+                if (queue->tail == t)
+                        queue->tail = previous;
+
+                return 1;
+        }
+
+        return 0;
+}
+
+static inline struct cb_channel *cb_channel_at (int32_t id)
+{
+        if (id < 1 || id > cb_channel_count)
+                return NULL;
+
+        return cb_channels[id - 1];
+}
+
+/**
+ * Create a channel that buffers up to capacity values. Returns its id, or -1
+ * when capacity is negative or there are CB_MAX_CHANNELS channels already.
+ */
+static inline int32_t cb_chan (int32_t capacity)
+{
+        if (capacity < 0 || cb_channel_count == CB_MAX_CHANNELS)
+                return -1;
+
+        /* the table doubles whenever its size is a power of two */
+        if ((cb_channel_count & (cb_channel_count - 1)) == 0)
+                cb_channels = (struct cb_channel **)cb_alloc (
+                        cb_channels, (cb_channel_count ? cb_channel_count * 2 : 1) * sizeof (struct cb_channel *));
+
+        struct cb_channel *channel = (struct cb_channel *)cb_alloc (NULL, sizeof (struct cb_channel));
+
+        memset (channel, 0, sizeof (struct cb_channel));
+        channel->buffer = (int32_t *)cb_alloc (NULL, (capacity > 0 ? capacity : 1) * sizeof (int32_t));
+        channel->capacity = capacity;
+        channel->id = cb_channel_count + 1;
+        cb_channels[cb_channel_count++] = channel;
+
+        return channel->id;
+}
+
+static inline void cb_block (struct cb_thread *t, struct cb_channel *channel, struct cb_wait_queue *queue)
+{
+        t->queue = queue;
+        t->channel = channel;
+        t->state = CB_BLOCKED;
+
+        if (queue)
+                cb_enqueue (queue, t);
+
+        cb_blocked++;
+}
+
+/**
+ * Take the blocked thread t out of the queue it waits in
+ */
+static inline void cb_unblock (struct cb_thread *t)
+{
+        if (t->queue)
+                cb_unlink_waiting (t->queue, t);
+
+        if (t->handle)
+                cb_io_waiting--;
+
+        t->handle = NULL;
+        t->queue = NULL;
+        t->channel = NULL;
+        t->joining = NULL;
+        cb_blocked--;
+}
+
+/* a woken thread has left its queue already and joins the ring after the current thread */
+static inline void cb_wake (struct cb_thread *t)
+{
+        if (t->handle)
+                cb_io_waiting--;
+
+        t->handle = NULL;
+        t->queue = NULL;
+        t->channel = NULL;
+        t->joining = NULL;
+        t->state = CB_RUNNING;
+        cb_blocked--;
+        cb_add_thread (t);
+}
+
+/**
+ * Send the value on top of the stack of t to the channel below it. Pushes 1
+ * once it is sent, 0 when there is no such channel. Returns whether t blocked
+ * or woke a receiver and gives up its time slice.
+ */
+static inline int cb_send (struct cb_thread *t)
+{
+        int32_t value = *--t->sp;
+        struct cb_channel *channel = cb_channel_at (*--t->sp);
+        struct cb_thread *receiver;
+
+        if (!channel) {
+                *t->sp++ = 0;
+                return 0;
+        }
+
+        if ((receiver = cb_dequeue (&channel->receivers))) {
+                *receiver->sp++ = value;
+                cb_wake (receiver);
+                *t->sp++ = 1;
+                return 1;
+        }
+
+        if (channel->count < channel->capacity) {
+                channel->buffer[(channel->head + channel->count++) % channel->capacity] = value;
+                *t->sp++ = 1;
+                return 0;
+        }
+
+        t->message = value;
+        cb_block (t, channel, &channel->senders);
+
+        return 1;
+}
+
+/**
+ * Receive from the channel on top of the stack of t. Pushes the value, 0 when
+ * there is no such channel. Returns whether t blocked or woke a sender.
+ */
+static inline int cb_recv (struct cb_thread *t)
+{
+        struct cb_channel *channel = cb_channel_at (*--t->sp);
+        struct cb_thread *sender;
+        int32_t value;
+
+        if (!channel) {
+                *t->sp++ = 0;
+                return 0;
+        }
+
+        sender = cb_dequeue (&channel->senders);
+
+        if (channel->count > 0) {
+                value = channel->buffer[channel->head];
+                channel->head = (channel->head + 1) % channel->capacity;
+                channel->count--;
+
+                if (sender)
+                        channel->buffer[(channel->head + channel->count++) % channel->capacity] = sender->message;
+        } else if (sender) {
+                value = sender->message;
+        } else {
+                cb_block (t, channel, &channel->receivers);
+                return 1;
+        }
+
+        if (sender) {
+                *sender->sp++ = 1;
+                cb_wake (sender);
+        }
+
+        *t->sp++ = value;
+
+        return sender != NULL;
+}
+
+/**
+ * Take the value child id of parent left when it finished. Returns 0 when
+ * there is none.
+ */
+static inline int cb_take_exit (struct cb_thread *parent, int32_t id, int32_t *value)
+{
+        struct cb_exit *previous = NULL;
+
+        for (struct cb_exit *record = parent->exits; record; previous = record, record = record->next) {
+                if (record->id != id)
+                        continue;
+
+                if (previous)
+                        previous->next = record->next;
+                else
+                        parent->exits = record->next;
+
+                if (parent->exits_tail == record)
+                        parent->exits_tail = previous;
+
+                *value = record->value;
+                free (record);
+
+                return 1;
+        }
+
+        return 0;
+}
+
+/**
+ * Wait for the thread whose id is on top of the stack of t to finish and push
+ * its value, -1 when it was killed, it is t or there is none. The slot of a
+ * child is not reused before its parent took the value. Returns whether t
+ * blocked.
+ */
+static inline int cb_join (struct cb_thread *t)
+{
+        int32_t id = *--t->sp;
+        struct cb_thread *target = cb_thread_at (id);
+        int32_t value = -1;
+
+        if (target && target != t) {
+                if (cb_take_exit (t, id, &value)) {
+                        cb_free_thread (target);
+                } else if (!target->finished) {
+                        t->joining = target;
+                        cb_block (t, NULL, &target->joiners);
+                        return 1;
+                } else {
+                        value = target->exit_value;
+                }
+        }
+
+        *t->sp++ = value;
+
+        return 0;
+}
+
+/**
+ * Wait for any child of t to finish and push its value, those that finished
+ * already first. Pushes -1 when t has no child left. Returns whether t blocked.
+ */
+static inline int cb_join_any (struct cb_thread *t)
+{
+        struct cb_exit *record = t->exits;
+        int32_t value = -1;
+
+        if (record) {
+                t->exits = record->next;
+
+                if (!record->next)
+                        t->exits_tail = NULL;
+
+                value = record->value;
+                cb_free_thread (cb_thread_at (record->id));
+                free (record);
+        } else if (t->children > 0) {
+                cb_block (t, NULL, NULL);
+                return 1;
+        }
+
+        *t->sp++ = value;
+
+        return 0;
+}
+
+/**
+ * Make the value of the stopped thread t final and hand it to the threads
+ * joining it, or to its parent, which takes it when waiting for any child and
+ * keeps it otherwise unless it joins t. Returns whether it was kept.
+ */
+static inline int cb_finish (struct cb_thread *t)
+{
+        struct cb_thread *parent = t->parent;
+        struct cb_thread *joiner;
+        int collected = 0;
+        int kept = 0;
+
+        if (parent && parent->generation != t->parent_generation)
+                parent = NULL;
+
+        if (t->state == CB_KILLED)
+                t->exit_value = -1;
+
+        t->finished = 1;
+
+        while ((joiner = cb_dequeue (&t->joiners))) {
+                collected = collected || joiner == parent;
+                *joiner->sp++ = t->exit_value;
+                cb_wake (joiner);
+        }
+
+        if (parent) {
+                parent->children--;
+
+                if (collected) {
+                        /* the parent joined it by id */
+                } else if (parent->state == CB_BLOCKED && !parent->queue && !parent->channel) {
+                        *parent->sp++ = t->exit_value;
+                        cb_wake (parent);
+                } else {
+                        struct cb_exit *record = (struct cb_exit *)cb_alloc (NULL, sizeof (struct cb_exit));
+
+                        record->id = t->id;
+                        record->value = t->exit_value;
+                        record->next = NULL;
+
+                        if (parent->exits_tail)
+                                parent->exits_tail->next = record;
+                        else
+                                parent->exits = record;
+
+                        parent->exits_tail = record;
+                        kept = 1;
+                }
+        }
+
+        /* the children it leaves behind have no parent any more */
+        t->generation++;
+
+        while (t->exits) {
+                struct cb_exit *record = t->exits;
+
+                t->exits = record->next;
+                cb_free_thread (cb_thread_at (record->id));
+                free (record);
+        }
+
+        t->exits_tail = NULL;
+
+        return kept;
+}
+
+/**
+ * Stop the program, every thread left is blocked on a channel or joining
+ */
+static inline void cb_deadlock (void)
+{
+        fprintf (stderr, "error: deadlock: all %d threads are blocked\n", cb_blocked);
+
+        for (int32_t id = 1; id <= cb_capacity; id++) {
+                struct cb_thread *t = cb_thread_at (id);
+
+                if (t->state != CB_BLOCKED)
+                        continue;
+
+                if (t->channel)
+                        fprintf (stderr, "thread #%d is blocked on channel #%d\n", id - 1, t->channel->id);
+                else if (t->joining)
+                        fprintf (stderr, "thread #%d is joining thread #%d\n", id - 1, t->joining->id - 1);
+                else
+                        fprintf (stderr, "thread #%d is waiting for a child to finish\n", id - 1);
+        }
+
+        exit (EXIT_FAILURE);
+}
+
+/**
+ * Take the next byte of handle into value, -1 at the end or on an error.
+ * Returns 0 when there is none yet and the reader has to wait.
+ */
+static inline int cb_read_byte (struct cb_handle *handle, int32_t *value)
+{
+        while (handle->in_start == handle->in_end && !handle->eof) {
+                if (handle->blocking && !handle->readable)
+                        return 0;
+
+                handle->readable = 0;
+
+                ssize_t n = read (handle->fd, handle->in, CB_IO_BUFFER);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return 0;
+
+                if (n <= 0) {
+                        handle->eof = 1;
+                } else {
+                        handle->in_start = 0;
+                        handle->in_end = n;
+                }
+        }
+
+        *value = handle->in_start < handle->in_end ? handle->in[handle->in_start++] : -1;
+
+        return 1;
+}
+
+/**
+ * Write out what handle buffers, a full pipe or socket keeps the rest. Returns
+ * 0 on an error, the buffer is dropped then.
+ */
+static inline int cb_flush_handle (struct cb_handle *handle)
+{
+        int32_t written = 0;
+
+        while (written < handle->out_count) {
+                ssize_t n = write (handle->fd, handle->out + written, handle->out_count - written);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+
+                if (n < 0) {
+                        handle->out_count = 0;
+                        return 0;
+                }
+
+                written += n;
+        }
+
+        memmove (handle->out, handle->out + written, handle->out_count - written);
+        handle->out_count -= written;
+
+        return 1;
+}
+
+/**
+ * Buffer the byte value for handle. Returns 1 once it is, 0 when the buffer is
+ * full and the writer has to wait, -1 on an error.
+ */
+static inline int cb_write_byte (struct cb_handle *handle, int32_t value)
+{
+        if (handle->stream)
+                return fputc (value, handle->stream) == EOF ? -1 : 1;
+
+        if (handle->out_count == CB_IO_BUFFER && !cb_flush_handle (handle))
+                return -1;
+
+        if (handle->out_count == CB_IO_BUFFER)
+                return 0;
+
+        handle->out[handle->out_count++] = value;
+        cb_io_dirty = 1;
+
+        return 1;
+}
+
+static inline struct cb_handle *cb_handle_at (int32_t id)
+{
+        if (id < 0 || id >= cb_handle_count)
+                return NULL;
+
+        return cb_handles[id];
+}
+
+/**
+ * Make a handle of fd and return its id. Descriptors other than regular files
+ * are polled, a stream marks one of the standard handles, of which only
+ * standard input is.
+ */
+static inline int32_t cb_add_handle (int fd, FILE *stream)
+{
+        struct cb_handle *handle = (struct cb_handle *)cb_alloc (NULL, sizeof (struct cb_handle));
+        struct stat info;
+
+        memset (handle, 0, sizeof (struct cb_handle));
+        handle->fd = fd;
+        handle->stream = stream;
+        handle->pollable = (!stream || stream == stdin) && fstat (fd, &info) == 0 && !S_ISREG (info.st_mode);
+        handle->blocking = stream && handle->pollable;
+
+        /* a reader that closed its end is reported by write, not by a signal */
+        if (handle->pollable && !stream)
+                signal (SIGPIPE, SIG_IGN);
+        else if (!stream)
+                fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+
+        /* the table doubles whenever its size is a power of two */
+        if ((cb_handle_count & (cb_handle_count - 1)) == 0)
+                cb_handles = (struct cb_handle **)cb_alloc (
+                        cb_handles, (cb_handle_count ? cb_handle_count * 2 : 1) * sizeof (struct cb_handle *));
+
+        cb_handles[cb_handle_count] = handle;
+
+        return cb_handle_count++;
+}
+
+static inline void cb_wait_io (struct cb_thread *t, struct cb_handle *handle, struct cb_wait_queue *queue)
+{
+        cb_block (t, NULL, queue);
+        t->handle = handle;
+        cb_io_waiting++;
+}
+
+/**
+ * Close handle id, threads still waiting on it get -1
+ */
+static inline void cb_close_handle (int32_t id)
+{
+        struct cb_handle *handle = cb_handles[id];
+        struct cb_thread *waiting;
+
+        cb_handles[id] = NULL;
+
+        while ((waiting = cb_dequeue (&handle->readers)) || (waiting = cb_dequeue (&handle->writers))) {
+                *waiting->sp++ = -1;
+                cb_wake (waiting);
+        }
+
+        if (handle->stream)
+                fflush (handle->stream);
+        else
+                close (handle->fd);
+
+        free (handle);
+}
+
+/**
+ * Serve the threads waiting on handle id in the order they came, as far as it
+ * is ready
+ */
+static inline void cb_serve_io (int32_t id)
+{
+        struct cb_handle *handle = cb_handle_at (id);
+        struct cb_thread *waiting;
+        int32_t value;
+
+        if (!handle)
+                return;
+
+        while ((waiting = handle->readers.head) && cb_read_byte (handle, &value)) {
+                cb_dequeue (&handle->readers);
+                *waiting->sp++ = value;
+                cb_wake (waiting);
+        }
+
+        while ((waiting = handle->writers.head)) {
+                if (waiting->message == CB_IO_CLOSE) {
+                        int flushed = cb_flush_handle (handle);
+
+                        if (handle->out_count > 0)
+                                break;
+
+                        cb_dequeue (&handle->writers);
+                        *waiting->sp++ = flushed ? 0 : -1;
+                        cb_wake (waiting);
+                        cb_close_handle (id);
+                        return;
+                }
+
+                int result = cb_write_byte (handle, waiting->message);
+
+                if (result == 0)
+                        break;
+
+                cb_dequeue (&handle->writers);
+                *waiting->sp++ = result;
+                cb_wake (waiting);
+        }
+}
+
+/**
+ * Open argument index for reading with mode 0, writing with 1 or appending
+ * with 2. Returns the handle, -1 when it can not be opened.
+ */
+static inline int32_t cb_open (int32_t index, int32_t mode)
+{
+        static const int flags[] = { O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND };
+        int fd;
+
+        if (index < 0 || index >= cb_argument_count || mode < 0 || mode > 2)
+                return -1;
+
+        fd = open (cb_arguments[index], flags[mode] | O_NONBLOCK | O_CLOEXEC, 0666);
+
+        return fd < 0 ? -1 : cb_add_handle (fd, NULL);
+}
+
+/**
+ * Create a pipe, or a pair of UNIX stream sockets. Returns the handle of the
+ * read end or first socket, the other end is the next one, -1 on an error.
+ */
+static inline int32_t cb_pipe (int socket)
+{
+        int fds[2];
+        int32_t id;
+        int result = socket ? socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds)
+                            : pipe2 (fds, O_NONBLOCK | O_CLOEXEC);
+
+        if (result != 0)
+                return -1;
+
+        id = cb_add_handle (fds[0], NULL);
+        cb_add_handle (fds[1], NULL);
+
+        return id;
+}
+
+/**
+ * Read a byte of the handle on top of the stack of t and push it, -1 at the
+ * end or when it is not open. Returns whether t blocked.
+ */
+static inline int cb_read (struct cb_thread *t)
+{
+        struct cb_handle *handle = cb_handle_at (*--t->sp);
+        int32_t value = -1;
+
+        if (handle && !cb_read_byte (handle, &value)) {
+                cb_wait_io (t, handle, &handle->readers);
+                return 1;
+        }
+
+        *t->sp++ = value;
+
+        return 0;
+}
+
+/**
+ * Write the low byte of the value on top of the stack of t to the handle below
+ * it. Pushes 1, -1 on an error. Returns whether t blocked.
+ */
+static inline int cb_write (struct cb_thread *t)
+{
+        int32_t value = *--t->sp & 0xff;
+        struct cb_handle *handle = cb_handle_at (*--t->sp);
+        int result = -1;
+
+        if (handle) {
+                result = cb_write_byte (handle, value);
+
+                if (result == 0) {
+                        t->message = value;
+                        cb_wait_io (t, handle, &handle->writers);
+                        return 1;
+                }
+        }
+
+        *t->sp++ = result;
+
+        return 0;
+}
+
+/**
+ * Write out and close the handle on top of the stack of t. Pushes 0, -1 on an
+ * error. Returns whether t blocked.
+ */
+static inline int cb_close (struct cb_thread *t)
+{
+        int32_t id = *--t->sp;
+        struct cb_handle *handle = cb_handle_at (id);
+        int32_t result = -1;
+
+        if (handle) {
+                int flushed = handle->stream ? fflush (handle->stream) == 0 : cb_flush_handle (handle);
+
+                if (handle->out_count > 0) {
+                        t->message = CB_IO_CLOSE;
+                        cb_wait_io (t, handle, &handle->writers);
+                        return 1;
+                }
+
+                cb_close_handle (id);
+                result = flushed ? 0 : -1;
+        }
+
+        *t->sp++ = result;
+
+        return 0;
+}
+
+/**
+ * Write out buffered output and wait up to timeout milliseconds for the
+ * handles threads wait on, then serve them
+ */
+static inline void cb_poll_io (int timeout)
+{
+        static struct pollfd *fds;
+        static int32_t *ids;
+        static int32_t capacity;
+        int32_t count = 0;
+
+        if (cb_io_dirty) {
+                cb_io_dirty = 0;
+
+                for (int32_t id = 0; id < cb_handle_count; id++) {
+                        if (cb_handles[id] && cb_handles[id]->out_count > 0 && !cb_flush_handle (cb_handles[id]))
+                                continue;
+
+                        if (cb_handles[id] && cb_handles[id]->out_count > 0)
+                                cb_io_dirty = 1;
+                }
+        }
+
+        if (capacity < cb_handle_count) {
+                capacity = cb_handle_count;
+                fds = (struct pollfd *)cb_alloc (fds, capacity * sizeof (struct pollfd));
+                ids = (int32_t *)cb_alloc (ids, capacity * sizeof (int32_t));
+        }
+
+        for (int32_t id = 0; id < cb_handle_count; id++) {
+                struct cb_handle *handle = cb_handles[id];
+
+                if (!handle || (!handle->readers.head && !handle->writers.head))
+                        continue;
+
+                fds[count].fd = handle->fd;
+                fds[count].events = (handle->readers.head ? POLLIN : 0) | (handle->writers.head ? POLLOUT : 0);
+                fds[count].revents = 0;
+                ids[count++] = id;
+        }
+
+        if (poll (fds, count, timeout) <= 0)
+                return;
+
+        for (int32_t i = 0; i < count; i++) {
+                if (!fds[i].revents)
+                        continue;
+
+                cb_handles[ids[i]]->readable = 1;
+                cb_serve_io (ids[i]);
+        }
+}
+
+static inline void cb_destroy_io (void)
+{
+        for (int32_t id = 0; id < cb_handle_count; id++) {
+                struct cb_handle *handle = cb_handles[id];
+
+                if (!handle)
+                        continue;
+
+                /* no thread is left to wait, what is buffered goes out blocking */
+                if (handle->out_count > 0) {
+                        fcntl (handle->fd, F_SETFL, fcntl (handle->fd, F_GETFL) & ~O_NONBLOCK);
+                        cb_flush_handle (handle);
+                }
+
+                if (!handle->stream)
+                        close (handle->fd);
+
+                free (handle);
+        }
+
+        cb_handle_count = 0;
+}
+
+/**
+ * Fork the current thread, whose state is saved. The parent gets the id of the
+ * child, or -1 when the table is full, the child gets 0.
+ */
+static inline void cb_fork (struct cb_thread *t)
+{
+        struct cb_thread *child = cb_allocate_thread (t);
+
+        if (!child) {
+                *t->sp++ = -1;
+                return;
+        }
+
+        cb_grow_stack (child, t->stack_limit - t->stack);
+
+        while (child->frame_capacity < t->frame_no)
+                cb_grow_frames (child);
+
+        memcpy (child->stack, t->stack, (t->sp - t->stack) * sizeof (int32_t));
+        memcpy (child->frames, t->frames, t->frame_no * sizeof (ptrdiff_t));
+
+        child->sp = child->stack + (t->sp - t->stack);
+        child->bp = child->stack + (t->bp - t->stack);
+        child->frame_no = t->frame_no;
+        child->ip = t->ip;
+        child->state = CB_RUNNING;
+
+        *t->sp++ = child->id;
+        *child->sp++ = 0;
+
+        cb_add_thread (child);
+}
+
+/**
+ * Kill the running thread whose id is on top of the stack. Pushes whether
+ * there was one.
+ */
+static inline void cb_kill (struct cb_thread *t)
+{
+        struct cb_thread *victim = cb_thread_at (*--t->sp);
+
+        if (victim && victim->state == CB_BLOCKED) {
+                cb_unblock (victim);
+                victim->state = CB_KILLED;
+                cb_release_thread (victim);
+                *t->sp++ = 1;
+                return;
+        }
+
+        if (!victim || victim->state != CB_RUNNING) {
+                *t->sp++ = 0;
+                return;
+        }
+
+        victim->state = CB_KILLED;
+
+        if (victim != t) {
+                cb_remove_thread (victim);
+                cb_release_thread (victim);
+        }
+
+        *t->sp++ = 1;
+}
+
+/**
+ * Switch to the next running thread in the ring, releasing the stopped ones on
+ * the way and taking a blocked one off it. Returns 0 once every thread has
+ * stopped.
+ */
+static inline int cb_schedule (void)
+{
+        static uint64_t io_polled;
+        struct cb_thread *old_thread = cb_current;
+        struct cb_thread *next = old_thread->next;
+        struct cb_thread *stopped_thread = NULL;
+
+        while (next != old_thread && next->state != CB_RUNNING) {
+                struct cb_thread *stopped = next;
+
+                next = next->next;
+                cb_remove_thread (stopped);
+                cb_release_thread (stopped);
+        }
+
+        if (old_thread->state == CB_BLOCKED) {
+                cb_remove_thread (old_thread);
+
+                if (next == old_thread)
+                        next = NULL;
+        } else if (old_thread->state != CB_RUNNING) {
+                cb_remove_thread (old_thread);
+                stopped_thread = old_thread;
+
+                if (next == old_thread)
+                        next = NULL;
+        }
+
+        cb_current = next;
+
+        /* once it is off the ring, the threads joining it join the ring of the others */
+        if (stopped_thread)
+                cb_release_thread (stopped_thread);
+
+        /* a thread woken by I/O joins the ring, so it is polled once blocked threads are off it */
+        if (cb_io_waiting > 0 && (!cb_current || cb_ops - io_polled >= CB_IO_POLL_INTERVAL)) {
+                io_polled = cb_ops;
+                cb_poll_io (0);
+        }
+
+        /* with nothing to run, wait for I/O */
+        while (!cb_current && cb_io_waiting > 0)
+                cb_poll_io (-1);
+
+        if (!cb_current && cb_blocked > 0)
+                cb_deadlock ();
+
+        cb_alone = cb_current && cb_current->next == cb_current;
+
+        return cb_current != NULL;
+}
+
+/**
+ * Run the program whose script starts at entry. resume enters the function
+ * that holds an address at that address. A thread runs until its time slice is
+ * over or it gives it up, a function returning into a frame that is not on the
+ * C stack continues through resume.
+ */
+static int cb_run (cb_function resume, int32_t entry, int32_t frame_size, int argument_count, char **arguments)
+{
+        struct cb_thread *t = cb_allocate_thread (NULL);
+
+        cb_grow_stack (t, frame_size + 1);
+        t->ip = entry;
+        t->state = CB_RUNNING;
+        t->next = t;
+        t->previous = t;
+        cb_current = t;
+        cb_alone = 1;
+        cb_arguments = arguments;
+        cb_argument_count = argument_count;
+        cb_add_handle (STDIN_FILENO, stdin);
+        cb_add_handle (STDOUT_FILENO, stdout);
+        cb_add_handle (STDERR_FILENO, stderr);
+
+        do {
+                t = cb_current;
+                cb_slice_end = cb_alone ? UINT64_MAX : cb_ops + CB_QUANTUM;
+
+                while (t->state == CB_RUNNING) {
+                        cb_depth = 0;
+
+                        int32_t address = resume (t, t->ip);
+
+                        if (address == CB_SUSPEND)
+                                break;
+
+                        if (address != CB_UNWIND)
+                                t->ip = address;
+                }
+        } while (cb_schedule ());
+
+        cb_destroy_io ();
+
+        return EXIT_SUCCESS;
+}
+
+/**
+ * Run the function at address, whose frame is set up, on the C stack. Returns
+ * what it returned, or why the thread was left in memory before or while it
+ * ran.
+ */
+static inline int32_t cb_enter (struct cb_thread *t, cb_function function, int32_t address, int32_t frame_size)
+{
+        int32_t returned;
+
+        if (t->sp + frame_size >= t->stack_limit)
+                cb_grow_stack (t, t->sp - t->stack + frame_size + 1);
+
+        if (cb_ops >= cb_slice_end)
+                return CB_SUSPEND;
+
+        if (cb_depth == CB_MAX_DEPTH)
+                return CB_UNWIND;
+
+        cb_depth++;
+        returned = function (t, address);
+        cb_depth--;
+
+        return returned;
+}
+
+/**
+ * Push the frame of a call to function at address and run it
+ */
+static inline int32_t cb_call (struct cb_thread *t, cb_function function, int32_t address, int32_t frame_size)
+{
+        if (t->frame_no == t->frame_capacity && !cb_grow_frames (t)) {
+                fprintf (stderr, "call: maximum recursion depth exceeded\n");
+                t->state = CB_KILLED;
+                return CB_SUSPEND;
+        }
+
+        t->frames[t->frame_no++] = t->bp - t->stack;
+        t->bp = t->sp;
+        t->ip = address;
+
+        return cb_enter (t, function, address, frame_size);
+}
+
+static inline int32_t cb_bad_address (int32_t at)
+{
+        fprintf (stderr, "error: invalid resume address: %d\n", at);
+        exit (EXIT_FAILURE);
+}
+
+/*
+ * Instruction templates. The generated functions keep sp and bp in locals and
+ * write them back whenever the thread is left in memory.
+ */
+#define CB_ADD(a, b)  ((int32_t)((uint32_t)(a) + (uint32_t)(b)))
+#define CB_SUB(a, b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)))
+#define CB_MULT(a, b) ((int32_t)((uint32_t)(a) * (uint32_t)(b)))
+#define CB_NEG(a)     ((int32_t)-(uint32_t)(a))
+#define CB_NOT(a)     ((int32_t)(1 - (uint32_t)(a)))
+
+#define CB_SAVE(address) (t->sp = sp, t->bp = bp, t->ip = (address))
+
+#define CB_SUSPEND_AT(address)                                                                                         \
+        do {                                                                                                           \
+                CB_SAVE (address);                                                                                     \
+                return CB_SUSPEND;                                                                                     \
+        } while (0)
+
+/* the time slice is only checked on control transfers, like the threaded engine does */
+#define CB_JUMP(address)                                                                                               \
+        do {                                                                                                           \
+                if (cb_ops >= cb_slice_end)                                                                            \
+                        CB_SUSPEND_AT (address);                                                                       \
+                goto a##address;                                                                                       \
+        } while (0)
+
+#define CB_STORE(slot)                                                                                                 \
+        do {                                                                                                           \
+                bp[slot] = *--sp;                                                                                      \
+                if (bp + (slot) >= sp)                                                                                 \
+                        sp = bp + (slot) + 1;                                                                          \
+        } while (0)
+
+/* the return address is pushed already, the callee returns to the next instruction */
+#define CB_CALL(function, address, frame_size)                                                                         \
+        do {                                                                                                           \
+                int32_t returned;                                                                                      \
+                t->sp = sp;                                                                                            \
+                t->bp = bp;                                                                                            \
+                if ((returned = cb_call (t, function, address, frame_size)) < 0)                                       \
+                        return returned;                                                                               \
+                sp = t->sp;                                                                                            \
+                bp = t->bp;                                                                                            \
+        } while (0)
+
+/* a tail call: the arguments replace the parameters and the callee takes over the frame */
+#define CB_REPLACE_FRAME(count)                                                                                        \
+        do {                                                                                                           \
+                memmove (bp - 1 - (count), sp - (count), (count) * sizeof (int32_t));                                  \
+                sp = bp;                                                                                               \
+        } while (0)
+
+#define CB_RETURN()                                                                                                    \
+        do {                                                                                                           \
+                int32_t value = *--sp;                                                                                 \
+                int32_t address = *--sp;                                                                               \
+                bp = t->stack + t->frames[--t->frame_no];                                                              \
+                *sp++ = value;                                                                                         \
+                CB_SAVE (address);                                                                                     \
+                return cb_ops >= cb_slice_end ? CB_SUSPEND : address;                                                  \
+        } while (0)
+
+#endif
@@ -53,6 +53,20 @@ void Compiler::setup (char *src_code)
          * indicates whether an compilation error has occurred.
          */
         this->has_error = false;
+        this->tail_position = NULL;
+        this->tail_called = false;
+        this->target = ISA_STACK;
+        this->superinstructions = true;
+        this->fold_constants = true;
+        this->peephole = true;
+        this->peephole_stats = (struct peephole_stats){};
+        this->thread_jumps = true;
+        this->jump_stats = (struct jump_stats){};
+        this->optimize = 0;
+        this->ir_stats = (struct ir_stats){};
+        this->strip_functions = true;
+        this->link_stats.bytes_before = 0;
+        this->link_stats.bytes_after = 0;
         this->scanner = new Scanner (src_code);
 
         /*
@@ -217,6 +231,8 @@ enum token_t Compiler::previous ()
 
 void Compiler::parse_statement ()
 {
+        this->function->bytecode->mark_line (this->peek_token ().line);
+
         switch (this->peek ()) {
         case LBRACE: this->parse_block (); break;
         case IF: this->parse_condition (); break;
@@ -281,6 +297,13 @@ void Compiler::parse_function_statement ()
 
         Function *old_function = this->function;
         this->function = new Function (func_name.name, func_name.len, func_name);
+        this->function->arity = args_idx;
+
+        std::vector<struct operand> old_operands;
+        std::unordered_map<int32_t, int32_t> old_known_values;
+
+        this->operands.swap (old_operands);
+        this->known_values.swap (old_known_values);
 
         this->symbol_to_function[this->convert_to_string (func_name.name, func_name.len)] = this->function;
 
@@ -299,6 +322,8 @@ void Compiler::parse_function_statement ()
         this->functions.push_back (this->function);
         this->function = old_function;
         this->symbols = old_symbols;
+        this->operands.swap (old_operands);
+        this->known_values.swap (old_known_values);
 }
 
 Function *Compiler::find_function_by_name (char *func_name, size_t len)
@@ -328,7 +353,11 @@ void Compiler::variable_check_before_assignment (char *variable_name,
         }
 }
 
-void Compiler::resolve_call_statement (char *func_name, size_t len, int param_count)
+/**
+ * Emit a call. tail_arguments is the number of arguments pushed when the call
+ * is the whole expression of a return statement, -1 otherwise.
+ */
+void Compiler::resolve_call_statement (char *func_name, size_t len, int param_count, int tail_arguments)
 {
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
@@ -343,11 +372,70 @@ void Compiler::resolve_call_statement (char *func_name, size_t len, int param_co
                 this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
                 param_count--;
         } else if (strncmp (func_name, "exit", MAX (4, len)) == 0) {
-                this->function->bytecode->emit_op (OPHALT);
+                /* exit() ends the thread with 0, exit(v) with v */
+                this->function->bytecode->emit_op (param_count > 0 ? OPEXIT : OPHALT);
                 return;
         } else if (strncmp (func_name, "print", MAX (5, len)) == 0) {
                 this->function->bytecode->emit_op (OPPRINT);
                 param_count--;
+        } else if (strncmp (func_name, "yield", MAX (5, len)) == 0) {
+                this->function->bytecode->emit_op (OPYIELD);
+                param_count--;
+        } else if (strncmp (func_name, "chan", MAX (4, len)) == 0) {
+                this->function->bytecode->emit_op (OPCHAN);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count--;
+        } else if (strncmp (func_name, "send", MAX (4, len)) == 0) {
+                /* takes the channel and the value, leaves the result in the slot of the channel */
+                this->function->bytecode->emit_op (OPSEND);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count -= 2;
+        } else if (strncmp (func_name, "recv", MAX (4, len)) == 0) {
+                this->function->bytecode->emit_op (OPRECV);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count--;
+        } else if (strncmp (func_name, "join_any", MAX (8, len)) == 0) {
+                this->function->bytecode->emit_op (OPJOINANY);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count--;
+        } else if (strncmp (func_name, "join", MAX (4, len)) == 0) {
+                this->function->bytecode->emit_op (OPJOIN);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count--;
+        } else if (strncmp (func_name, "open", MAX (4, len)) == 0) {
+                this->function->bytecode->emit_op (OPOPEN);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count -= 2;
+        } else if (strncmp (func_name, "read", MAX (4, len)) == 0) {
+                this->function->bytecode->emit_op (OPREAD);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count--;
+        } else if (strncmp (func_name, "write", MAX (5, len)) == 0) {
+                this->function->bytecode->emit_op (OPWRITE);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count -= 2;
+        } else if (strncmp (func_name, "close", MAX (5, len)) == 0) {
+                this->function->bytecode->emit_op (OPCLOSE);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count--;
+        } else if (strncmp (func_name, "pipe", MAX (4, len)) == 0 ||
+                   strncmp (func_name, "socketpair", MAX (10, len)) == 0) {
+                this->function->bytecode->emit_op (func_name[0] == 'p' ? OPPIPE : OPSOCKETPAIR);
+                this->function->bytecode->emit_op (OPSTORE);
+                this->function->bytecode->write_int32 (this->symbols->get_next_local_offset ());
+                param_count--;
+        } else if (tail_arguments != -1 && tail_arguments <= this->function->arity &&
+                   this->emit_tail_call (func_name, len, tail_arguments)) {
+                return;
         } else {
                 this->function->bytecode->emit_op (OPCALL);
                 this->function->bytecode->write_int32 (this->resolve_function_placeholder (func_name, len));
@@ -361,6 +449,43 @@ void Compiler::resolve_call_statement (char *func_name, size_t len, int param_co
 #undef MAX
 }
 
+/**
+ * A call in tail position does not need the frame of the current function
+ * any more, its arguments replace the parameters. A function that calls
+ * itself with all of them jumps back to its start, other calls become
+ * OPTAILCALL. The register instruction set has no tail call, so there only
+ * self recursion is turned into a loop. Returns false for a plain call.
+ */
+bool Compiler::emit_tail_call (char *func_name, size_t len, int arguments)
+{
+        auto callee = this->symbol_to_function.find (this->convert_to_string (func_name, len));
+        Bytecode *bytecode = this->function->bytecode;
+
+        if (callee != this->symbol_to_function.end () && callee->second == this->function &&
+            arguments == this->function->arity) {
+                /* the last argument is on top and belongs in the slot below the return address */
+                for (int i = 0; i < arguments; i++) {
+                        bytecode->emit_op (OPSTORE);
+                        bytecode->write_int32 (-2 - i);
+                }
+
+                for (int total = this->symbols->get_all_locals_count (); total > 0; total--)
+                        bytecode->emit_op (OPPOP);
+
+                bytecode->emit_jump (0);
+        } else if (this->target == ISA_STACK) {
+                bytecode->emit_op (OPTAILCALL);
+                bytecode->write_int32 (this->resolve_function_placeholder (func_name, len));
+                bytecode->write_int32 (arguments);
+        } else {
+                return false;
+        }
+
+        this->tail_called = true;
+
+        return true;
+}
+
 void Compiler::parse_primary ()
 {
         struct token token = this->peek_token ();
@@ -373,10 +498,13 @@ void Compiler::parse_primary ()
                         int32_t offset = this->symbols->get_stack_offset (token.name, token.len);
 
                         if (this->symbols->variable_declared (token.name, token.len)) {
-                                this->function->bytecode->emit_op (OPSTORE);
-                                this->function->bytecode->write_int32 (offset);
+                                this->emit_store (offset);
                         } else {
                                 this->symbols->declare_local_variable (token.name, token.len);
+
+                                /* the value stays where it is as the local */
+                                this->declare_known_value (this->symbols->get_stack_offset (token.name, token.len));
+                                this->mark_label ();
                         }
 
                         return;
@@ -387,30 +515,26 @@ void Compiler::parse_primary ()
                 if (this->match (PLUS_EQUAL)) {
                         this->variable_check_before_assignment (token.name, token.len, token, op);
                         this->parse_precedence (PRECEDENCE_GREATER_THAN (PLUS_EQUAL));
-                        this->function->bytecode->emit_op (OPLOAD);
-                        this->function->bytecode->write_int32 (offset);
-                        this->function->bytecode->emit_op (OPADD);
-                        this->function->bytecode->emit_op (OPSTORE);
-                        this->function->bytecode->write_int32 (offset);
+                        this->emit_load (offset);
+                        this->emit_binary (OPADD);
+                        this->emit_store (offset);
                 } else if (this->match (MINUS_EQUAL)) {
                         this->variable_check_before_assignment (token.name, token.len, token, op);
                         this->parse_precedence (PRECEDENCE_GREATER_THAN (MINUS_EQUAL));
-                        this->function->bytecode->emit_op (OPNEG);
-                        this->function->bytecode->emit_op (OPLOAD);
-                        this->function->bytecode->write_int32 (offset);
-                        this->function->bytecode->emit_op (OPADD);
-                        this->function->bytecode->emit_op (OPSTORE);
-                        this->function->bytecode->write_int32 (offset);
+                        this->emit_unary (OPNEG);
+                        this->emit_load (offset);
+                        this->emit_binary (OPADD);
+                        this->emit_store (offset);
                 } else if (this->match (MULT_EQUAL)) {
                         this->variable_check_before_assignment (token.name, token.len, token, op);
                         this->parse_precedence (PRECEDENCE_GREATER_THAN (MULT_EQUAL));
-                        this->function->bytecode->emit_op (OPLOAD);
-                        this->function->bytecode->write_int32 (offset);
-                        this->function->bytecode->emit_op (OPMULT);
-                        this->function->bytecode->emit_op (OPSTORE);
-                        this->function->bytecode->write_int32 (offset);
+                        this->emit_load (offset);
+                        this->emit_binary (OPMULT);
+                        this->emit_store (offset);
                 } else if (this->match (LPAREN)) {
                         int param_count = 0;
+                        bool no_arguments = this->peek () == RPAREN;
+
                         do {
                                 this->parse_expression ();
                                 param_count++;
@@ -423,15 +547,19 @@ void Compiler::parse_primary ()
                                 return;
                         }
 
-                        this->resolve_call_statement (token.name, token.len, param_count);
+                        if (no_arguments)
+                                param_count = 0;
+
+                        if (token.name == this->tail_position && this->peek () == SEMICOLON)
+                                this->resolve_call_statement (token.name, token.len, param_count, param_count);
+                        else
+                                this->resolve_call_statement (token.name, token.len, param_count);
 
                 } else {
-                        this->function->bytecode->emit_op (OPLOAD);
-                        this->function->bytecode->write_int32 (offset);
+                        this->emit_load (offset);
                 }
         } else if (this->match (INT)) {
-                this->function->bytecode->emit_op (OPPUSH);
-                this->function->bytecode->write_int32 (token.i);
+                this->emit_constant (token.i);
         } else if (this->match (LPAREN)) {
                 this->parse_precedence (PREC_ASSIGNMENT);
                 this->match (RPAREN);
@@ -475,17 +603,71 @@ void Compiler::parse_logical ()
                 this->parse_error ("expected '&&' or '||' operation", op_token);
                 return;
         }
-        if (this->previous () == AND) {
-                this->parse_precedence (PRECEDENCE_GREATER_THAN (AND));
-        } else {
-                this->parse_precedence (PRECEDENCE_GREATER_THAN (OR));
+
+        Bytecode *bytecode = this->function->bytecode;
+        std::unordered_map<int32_t, int32_t> known = this->known_values;
+        int32_t value;
+
+        // a constant left operand decides alone or leaves the result to the right one
+        if (this->constant_result (&value)) {
+                size_t right = bytecode->address ();
+                this->parse_precedence (PRECEDENCE_GREATER_THAN (op));
+
+                if ((value != 0) == (op == OR)) {
+                        this->truncate (right);
+                        this->known_values = known;
+                        this->emit_constant (op == OR);
+                } else if (this->constant_condition (right, &value)) {
+                        this->emit_constant (value != 0);
+                } else {
+                        this->emit_truth (std::vector<size_t> (), std::vector<size_t> ());
+                }
+
+                return;
         }
 
-        switch (op) {
-        case AND: this->function->bytecode->emit_op (OPAND); break;
-        case OR: this->function->bytecode->emit_op (OPOR); break;
-        default: break;
+        // the right operand only runs when the left one does not decide
+        std::vector<size_t> false_jumps, end_jumps;
+        size_t left_false = bytecode->emit_jump_false ();
+
+        if (op == AND) {
+                false_jumps.push_back (left_false);
+        } else {
+                this->emit_constant (1);
+                end_jumps.push_back (bytecode->emit_jump ());
+                bytecode->patch_jump (left_false);
         }
+
+        this->mark_label ();
+        this->parse_precedence (PRECEDENCE_GREATER_THAN (op));
+        this->emit_truth (false_jumps, end_jumps);
+        this->merge_known_values (known);
+}
+
+/**
+ * Turn the value on top of the stack into 1 or 0. The jumps in false_jumps
+ * lead to the 0 and the ones in end_jumps past it, with their result already
+ * pushed. The jump threading pass sends these straight to the targets of a
+ * branch that tests the result.
+ */
+void Compiler::emit_truth (std::vector<size_t> false_jumps, std::vector<size_t> end_jumps)
+{
+        Bytecode *bytecode = this->function->bytecode;
+
+        false_jumps.push_back (bytecode->emit_jump_false ());
+        this->emit_constant (1);
+        end_jumps.push_back (bytecode->emit_jump ());
+
+        for (size_t jump : false_jumps)
+                bytecode->patch_jump (jump);
+
+        this->mark_label ();
+        this->emit_constant (0);
+
+        for (size_t jump : end_jumps)
+                bytecode->patch_jump (jump);
+
+        this->mark_label ();
 }
 
 void Compiler::consume (enum token_t t, const char *error_message, ...)
@@ -532,7 +714,7 @@ void Compiler::parse_unary ()
 {
         if (this->match (MINUS)) {
                 this->parse_precedence (this->get_unary_precedence (MINUS));
-                this->function->bytecode->emit_op (OPNEG);
+                this->emit_unary (OPNEG);
         }
 }
 
@@ -545,14 +727,14 @@ void Compiler::parse_comparison ()
         this->parse_precedence (PRECEDENCE_GREATER_THAN (this->previous ()));
 
         switch (op) {
-        case GT: this->function->bytecode->emit_op (OPGT); break;
-        case GTEQUAL: this->function->bytecode->emit_op (OPGTEQ); break;
-        case LT: this->function->bytecode->emit_op (OPLT); break;
-        case LTEQUAL: this->function->bytecode->emit_op (OPLTEQ); break;
-        case EQUAL_EQUAL: this->function->bytecode->emit_op (OPEQ); break;
+        case GT: this->emit_binary (OPGT); break;
+        case GTEQUAL: this->emit_binary (OPGTEQ); break;
+        case LT: this->emit_binary (OPLT); break;
+        case LTEQUAL: this->emit_binary (OPLTEQ); break;
+        case EQUAL_EQUAL: this->emit_binary (OPEQ); break;
         case BANG_EQUAL: {
-                this->function->bytecode->emit_op (OPEQ);
-                this->function->bytecode->emit_op (OPNOT);
+                this->emit_binary (OPEQ);
+                this->emit_unary (OPNOT);
                 break;
         }
         default: this->parse_error ("expected ==, !=, >, >=, <=, < after lvalue", op_token); break;
@@ -571,8 +753,8 @@ void Compiler::parse_products ()
         this->parse_precedence (PRECEDENCE_GREATER_THAN (op));
 
         switch (op) {
-        case MULT: this->function->bytecode->emit_op (OPMULT); break;
-        case DIV: this->function->bytecode->emit_op (OPDIV); break;
+        case MULT: this->emit_binary (OPMULT); break;
+        case DIV: this->emit_binary (OPDIV); break;
         default: break;
         }
 }
@@ -589,10 +771,10 @@ void Compiler::parse_terms ()
         this->parse_precedence (PRECEDENCE_GREATER_THAN (op));
 
         switch (op) {
-        case PLUS: this->function->bytecode->emit_op (OPADD); break;
+        case PLUS: this->emit_binary (OPADD); break;
         case MINUS:
-                this->function->bytecode->emit_op (OPNEG);
-                this->function->bytecode->emit_op (OPADD);
+                this->emit_unary (OPNEG);
+                this->emit_binary (OPADD);
                 break;
         default: break;
         }
@@ -620,12 +802,33 @@ void Compiler::parse_condition ()
 
         this->consume (LPAREN, "expected '(' after if keyword");
 
+        size_t condition = this->function->bytecode->address ();
+        int32_t value;
+
         // parse if condition
         this->parse_expression ();
 
         this->consume (RPAREN, "expected ')' after if condition");
 
+        // only one of the branches can run, leave out the other
+        if (this->constant_condition (condition, &value)) {
+                if (value)
+                        this->parse_statement ();
+                else
+                        this->skip_statement ();
+
+                if (this->match (ELSE)) {
+                        if (value)
+                                this->skip_statement ();
+                        else
+                                this->parse_statement ();
+                }
+
+                return;
+        }
+
         size_t offset_false = this->function->bytecode->emit_jump_false ();
+        std::unordered_map<int32_t, int32_t> known = this->known_values;
 
         // parse if body
         this->parse_statement ();
@@ -634,59 +837,117 @@ void Compiler::parse_condition ()
         if (this->match (ELSE)) {
                 size_t offset_true = this->function->bytecode->emit_jump ();
                 this->function->bytecode->patch_jump (offset_false);
+                this->mark_label ();
+                this->known_values.swap (known);
                 this->parse_statement ();
                 this->function->bytecode->patch_jump (offset_true);
         } else {
                 this->function->bytecode->patch_jump(offset_false);
         }
+
+        this->mark_label ();
+        this->merge_known_values (known);
 }
 
 void Compiler::parse_while ()
 {
         this->consume (WHILE, "expected while keyword");
+
+        char *header = this->peek_token ().name;
+
         this->consume (LPAREN, "expected '(' after while keyword");
 
         size_t start_offset = this->function->bytecode->address ();
+        int32_t value;
 
+        this->mark_label ();
+        this->forget_assigned_in_loop (header);
         this->parse_expression ();
 
         this->consume (RPAREN, "expected ')' after while condition");
 
+        if (this->constant_condition (start_offset, &value)) {
+                if (!value) {
+                        this->skip_statement ();
+                        return;
+                }
+
+                this->parse_statement ();
+                this->function->bytecode->emit_jump (start_offset);
+                return;
+        }
+
         size_t offset_false = this->function->bytecode->emit_jump_false ();
+        std::unordered_map<int32_t, int32_t> known = this->known_values;
 
         this->parse_statement ();
 
         this->function->bytecode->emit_jump (start_offset);
 
         this->function->bytecode->patch_jump (offset_false);
+        this->mark_label ();
+        this->known_values.swap (known);
 }
 
 void Compiler::parse_for ()
 {
         this->consume (FOR, "expected for statement");
 
+        char *header = this->peek_token ().name;
+
         this->consume (LPAREN, "expected '(' after for keyword");
 
         this->parse_expression ();
         this->consume (SEMICOLON, "expected ';' after for initializer");
 
         size_t start_offset = this->function->bytecode->address ();
+        int32_t value;
+
+        this->mark_label ();
+        this->forget_assigned_in_loop (header);
+
+        std::unordered_map<int32_t, int32_t> loop_known = this->known_values;
 
         this->parse_expression ();
         this->consume (SEMICOLON, "expected ';' after for condition");
-        size_t condition_false_offset = this->function->bytecode->emit_jump_false ();
+
+        bool constant = this->constant_condition (start_offset, &value);
+
+        if (constant && !value) {
+                std::unordered_map<int32_t, int32_t> known = this->known_values;
+
+                this->parse_expression ();
+                this->truncate (start_offset);
+                this->known_values = known;
+                this->consume (RPAREN, "expected ')' after for statement");
+                this->skip_statement ();
+                return;
+        }
+
+        size_t condition_false_offset = constant ? 0 : this->function->bytecode->emit_jump_false ();
         size_t condition_true_offset = this->function->bytecode->emit_jump ();
+        std::unordered_map<int32_t, int32_t> known = this->known_values;
 
+        // the update runs after the body, only what holds on every iteration is known there
         size_t update_offset = this->function->bytecode->address ();
+        this->mark_label ();
+        this->known_values = loop_known;
         this->parse_expression ();
         this->function->bytecode->emit_jump (start_offset);
 
         this->consume (RPAREN, "expected ')' after for statement");
 
         this->function->bytecode->patch_jump (condition_true_offset);
+        this->mark_label ();
+        this->known_values = known;
         this->parse_statement ();
         this->function->bytecode->emit_jump (update_offset);
-        this->function->bytecode->patch_jump (condition_false_offset);
+
+        if (!constant)
+                this->function->bytecode->patch_jump (condition_false_offset);
+
+        this->mark_label ();
+        this->known_values.swap (known);
 }
 
 void Compiler::parse_return ()
@@ -703,9 +964,15 @@ void Compiler::parse_return ()
                 this->function->bytecode->emit_op (OPPUSH);
                 this->function->bytecode->write_int32 (0);
         } else {
+                this->tail_position = this->peek_token ().name;
+                this->tail_called = false;
                 this->parse_expression ();
+                this->tail_position = NULL;
                 this->consume (SEMICOLON, "expected ; after return statement");
 
+                if (this->tail_called)
+                        return;
+
                 if (total != 0) {
                         // write the return value to the bottom of the stack frame
                         this->function->bytecode->emit_op (OPSTORE);
@@ -744,29 +1011,109 @@ Function *Compiler::resolve_placeholder (int32_t placeholder)
         return this->symbol_to_function[func_name];
 }
 
+/**
+ * Run f through the IR: -O1 propagates copies and drops dead code, -O2 also
+ * merges common subexpressions and drops dead stores. f keeps the code the
+ * parser emitted if the IR can not model it or the lowered code is larger.
+ */
+void Compiler::optimize_function (Function *f, std::unordered_map<int32_t, int32_t> *call_arities)
+{
+        IR ir (f->bytecode, f->arity, call_arities, &this->ir_stats);
+
+        if (!ir.build ()) {
+                this->ir_stats.kept++;
+                return;
+        }
+
+        ir.propagate_copies ();
+
+        if (this->optimize >= 2) {
+                ir.eliminate_common_subexpressions ();
+                ir.eliminate_dead_stores ();
+        }
+
+        ir.eliminate_dead_code ();
+
+        if (!ir.lower ())
+                this->ir_stats.kept++;
+}
+
 Function *Compiler::link ()
 {
-        for (size_t i = 0; i < this->functions.size (); i++) {
-                Function *f = this->functions[i];
+        if (this->optimize > 0) {
+                std::unordered_map<int32_t, int32_t> call_arities;
+
+                for (auto &placeholder : this->call_placeholders) {
+                        auto callee = this->symbol_to_function.find (placeholder.second);
+
+                        if (callee != this->symbol_to_function.end ())
+                                call_arities[placeholder.first] = callee->second->arity;
+                }
+
+                this->optimize_function (this->function, &call_arities);
+
+                for (Function *f : this->functions)
+                        this->optimize_function (f, &call_arities);
+        }
+
+        if (this->peephole) {
+                this->function->bytecode->peephole (&this->peephole_stats);
+
+                for (Function *f : this->functions)
+                        f->bytecode->peephole (&this->peephole_stats);
+        }
+
+        if (this->thread_jumps) {
+                this->function->bytecode->thread_jumps (&this->jump_stats);
+
+                for (Function *f : this->functions)
+                        f->bytecode->thread_jumps (&this->jump_stats);
+        }
+
+        std::vector<Function *> imported = this->functions;
+        std::unordered_map<Function *, Function *> folded;
+
+        if (this->strip_functions)
+                imported = this->select_functions (folded);
+
+        this->function->bytecode->add_symbol (0, "main");
+
+        for (size_t i = 0; i < imported.size (); i++) {
+                Function *f = imported[i];
 
                 size_t entry_address = this->function->bytecode->address ();
 
                 f->set_entry_address (entry_address);
 
+                this->function->bytecode->add_symbol (entry_address, std::string (f->name, f->len));
+                this->function->bytecode->import_debug_info (f->bytecode, entry_address);
                 this->function->bytecode->import (f->bytecode->chunk, f->bytecode->count);
         }
 
+        for (auto &f : folded)
+                f.first->set_entry_address (f.second->entry_address);
+
         size_t c = 0;
-        int32_t arg;
+        int32_t args[MAX_OPERANDS];
         enum OpCode op;
 
-        while (this->function->bytecode->instruction_at (&c, &op, &arg)) {
-                if (op == OPCALL) {
-                        *((int32_t *)&this->function->bytecode->chunk[c - sizeof (int32_t)]) =
-                                (int32_t)this->resolve_placeholder (arg)->entry_address;
+        while (this->function->bytecode->instruction_at (&c, &op, args)) {
+                if (op == OPCALL || op == OPTAILCALL) {
+                        size_t operand = c - Bytecode::operand_count (op) * sizeof (int32_t);
+
+                        *((int32_t *)&this->function->bytecode->chunk[operand]) =
+                                (int32_t)this->resolve_placeholder (args[0])->entry_address;
                 }
         }
 
+        if (this->target == ISA_REGISTER && !this->emit_register_code ()) {
+                fprintf (stderr, "warning: program can not be translated to registers, using the stack instruction set\n");
+                this->target = ISA_STACK;
+        }
+
+        if (this->target == ISA_STACK && this->superinstructions)
+                this->function->bytecode->fuse_superinstructions ();
+
         return this->function;
 }
 
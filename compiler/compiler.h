@@ -2,6 +2,7 @@
 #define compiler_h
 #include "bytecode.h"
 #include "function.h"
+#include "ir.h"
 #include "scanner.h"
 #include "symbols.h"
 #include <stdarg.h>
@@ -28,6 +29,13 @@ enum Precedence {
         PREC_PRIMARY
 };
 
+/* an instruction that pushes a value without side effects: a constant or a local */
+struct operand {
+        size_t address;
+        enum OpCode op;
+        int32_t value;
+};
+
 struct ParseRule {
         Parser binary_parser;
         Parser unary_parser;
@@ -35,6 +43,14 @@ struct ParseRule {
         enum Precedence unary_prec;
 };
 
+/* what the linker left out of the image */
+struct link_stats {
+        std::vector<std::string> stripped;
+        std::vector<std::pair<std::string, std::string> > folded;
+        uint64_t bytes_before;
+        uint64_t bytes_after;
+};
+
 class Compiler {
     public:
         Compiler (char *src_code);
@@ -43,6 +59,33 @@ class Compiler {
         Function *compile ();
         Function *link ();
 
+        /* instruction set of the compiled image, falls back to ISA_STACK if the register code generator fails */
+        enum isa target;
+
+        /* rewrite stack images to use superinstructions after linking */
+        bool superinstructions;
+
+        /* fold constant expressions, propagate constant locals and drop branches that can not run */
+        bool fold_constants;
+
+        /* run the peephole pass over every function before linking */
+        bool peephole;
+        struct peephole_stats peephole_stats;
+
+        /* thread jumps and lay out the blocks of every function before linking */
+        bool thread_jumps;
+        struct jump_stats jump_stats;
+
+        /* 0 links the code the parser emitted, 1 and 2 run every function through the IR first */
+        int optimize;
+        struct ir_stats ir_stats;
+
+        /* import only the functions the script can call, folding identical ones into one */
+        bool strip_functions;
+        struct link_stats link_stats;
+
+        static void print_link_stats (FILE *fp, struct link_stats *stats);
+
     private:
         std::unordered_map<int32_t, std::string> call_placeholders;
         std::unordered_map<std::string, Function *> symbol_to_function;
@@ -50,6 +93,8 @@ class Compiler {
         int32_t next_placeholder_value;
         int32_t resolve_function_placeholder (char *func_name, size_t len);
         Function *resolve_placeholder (int32_t placeholder);
+        std::vector<Function *> callees (Function *f);
+        std::vector<Function *> select_functions (std::unordered_map<Function *, Function *> &folded);
         void add_symbol (char *symbol, size_t len, size_t address);
 
         std::string convert_to_string (char *s, size_t len);
@@ -64,6 +109,12 @@ class Compiler {
 
         bool has_error;
 
+        /* first token of the expression of the return statement being parsed */
+        char *tail_position;
+
+        /* whether that expression was a call that replaced the frame */
+        bool tail_called;
+
         void setup (char *src_code);
 
         bool match (enum token_t t);
@@ -79,7 +130,8 @@ class Compiler {
         void variable_check_before_assignment (char *variable_name, size_t len, struct token token, struct token assign_op);
         Function *find_function_by_name(char *func_name, size_t len);
 
-        void resolve_call_statement(char *func_name, size_t len, int param_count);
+        void resolve_call_statement(char *func_name, size_t len, int param_count, int tail_arguments = -1);
+        bool emit_tail_call(char *func_name, size_t len, int arguments);
 
         void parse_statement ();
 
@@ -109,6 +161,31 @@ class Compiler {
         void parse_comparison ();
         void parse_logical ();
         void parse_return();
+
+        bool emit_register_code ();
+        void optimize_function (Function *f, std::unordered_map<int32_t, int32_t> *call_arities);
+
+        /* operands among the last instructions emitted since the last jump target, by address */
+        std::vector<struct operand> operands;
+
+        /* constants the locals hold at the current point of the code, by stack offset */
+        std::unordered_map<int32_t, int32_t> known_values;
+
+        void emit_constant (int32_t value);
+        void emit_load (int32_t offset);
+        void emit_store (int32_t offset);
+        void emit_unary (enum OpCode op);
+        void emit_binary (enum OpCode op);
+        bool operand_at (size_t address, struct operand *operand);
+        bool constant_condition (size_t start, int32_t *value);
+        bool constant_result (int32_t *value);
+        void emit_truth (std::vector<size_t> false_jumps, std::vector<size_t> end_jumps);
+        void declare_known_value (int32_t offset);
+        void forget_assigned_in_loop (char *source);
+        void merge_known_values (std::unordered_map<int32_t, int32_t> &other);
+        void truncate (size_t address);
+        void mark_label ();
+        void skip_statement ();
 };
 
 #endif
\ No newline at end of file
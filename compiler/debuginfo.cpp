@@ -0,0 +1,104 @@
+#include "bytecode.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+/**
+ * Note that the code written from here on was compiled from line
+ */
+void Bytecode::mark_line (int32_t line)
+{
+        int32_t address = this->count;
+
+        if (!this->lines.empty () && this->lines.back ().line == line)
+                return;
+
+        /* a statement that produced no code gives its address to the next one */
+        if (!this->lines.empty () && this->lines.back ().address == address)
+                this->lines.pop_back ();
+
+        if (!this->lines.empty () && this->lines.back ().line == line)
+                return;
+
+        this->lines.push_back ({ address, line });
+}
+
+void Bytecode::add_symbol (int32_t address, std::string name)
+{
+        this->symbols.push_back ({ address, name });
+}
+
+/**
+ * Append the lines of other, whose code was imported at offset
+ */
+void Bytecode::import_debug_info (Bytecode *other, int32_t offset)
+{
+        for (struct line_entry &entry : other->lines)
+                this->lines.push_back ({ entry.address + offset, entry.line });
+}
+
+/**
+ * Move the debug information along with code that was rewritten, new_address
+ * holds the new address of every instruction that starts at an old one and -1
+ * for every other address
+ */
+void Bytecode::relocate_debug_info (std::vector<int32_t> &new_address)
+{
+        std::vector<struct line_entry> lines;
+
+        for (struct line_entry &entry : this->lines) {
+                if (entry.address < 0 || (size_t)entry.address >= new_address.size () || new_address[entry.address] == -1)
+                        continue;
+
+                int32_t address = new_address[entry.address];
+
+                /* the code of the line before was merged away */
+                if (!lines.empty () && lines.back ().address == address)
+                        lines.pop_back ();
+
+                if (lines.empty () || lines.back ().line != entry.line)
+                        lines.push_back ({ address, entry.line });
+        }
+
+        this->lines = lines;
+
+        for (struct function_symbol &symbol : this->symbols) {
+                if (symbol.address >= 0 && (size_t)symbol.address < new_address.size () &&
+                    new_address[symbol.address] != -1)
+                        symbol.address = new_address[symbol.address];
+        }
+}
+
+/**
+ * Write the symbols and lines followed by the debug trailer, right after the
+ * code. Returns false when writing fails.
+ */
+bool Bytecode::write_debug_info (FILE *fp)
+{
+        struct debug_trailer trailer;
+
+        for (struct function_symbol &symbol : this->symbols) {
+                int32_t fields[2] = { symbol.address, (int32_t)symbol.name.size () };
+
+                if (fwrite (fields, sizeof (fields), 1, fp) != 1)
+                        return false;
+
+                if (!symbol.name.empty () && fwrite (symbol.name.data (), symbol.name.size (), 1, fp) != 1)
+                        return false;
+        }
+
+        for (struct line_entry &entry : this->lines) {
+                int32_t fields[2] = { entry.address, entry.line };
+
+                if (fwrite (fields, sizeof (fields), 1, fp) != 1)
+                        return false;
+        }
+
+        trailer.code_size = this->count;
+        trailer.symbol_count = this->symbols.size ();
+        trailer.line_count = this->lines.size ();
+        memcpy (trailer.magic, DEBUG_MAGIC, sizeof (trailer.magic));
+
+        return fwrite (&trailer, sizeof (trailer), 1, fp) == 1;
+}
@@ -0,0 +1,395 @@
+#include "emitc.h"
+#include "bytecode.h"
+#include "verifier.h"
+#include "vm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+CEmitter::CEmitter (Bytecode *bytecode, int32_t entry_address, uint32_t quantum)
+{
+        this->bytecode = bytecode;
+        this->entry_address = entry_address;
+        this->quantum = quantum;
+        this->out = NULL;
+        this->pending_ops = 0;
+}
+
+void CEmitter::fetch (int32_t address, enum OpCode *op, int32_t *args, int32_t *next)
+{
+        size_t position = address;
+
+        this->bytecode->instruction_at (&position, op, args);
+        *next = position;
+}
+
+/**
+ * Whether the C code of the instruction continues with the code of the next
+ * one, rather than jumping, returning or leaving the thread in memory
+ */
+static bool falls_through (enum OpCode op)
+{
+        switch (op) {
+        case OPJMP:
+        case OPJMPFALSE:
+        case OPRET:
+        case OPTAILCALL:
+        case OPHALT:
+        case OPEXIT:
+        case OPFORK:
+        case OPKILL:
+        case OPYIELD: return false;
+        case OPCALL: return true;
+        default: return Bytecode::jump_operand (op) == -1;
+        }
+}
+
+/**
+ * Collect the instructions reachable from entry without following calls, and
+ * queue the functions it calls. Every address the function can be resumed at
+ * gets a label: its entry, jump targets, and what follows a call or an
+ * instruction that gives up the time slice.
+ */
+void CEmitter::scan (int32_t entry)
+{
+        std::vector<int32_t> pending = { entry };
+
+        while (!pending.empty ()) {
+                int32_t function_entry = pending.back ();
+                pending.pop_back ();
+
+                if (this->functions.count (function_entry))
+                        continue;
+
+                struct c_function *function = &this->functions[function_entry];
+                std::vector<int32_t> worklist = { function_entry };
+
+                function->entry = function_entry;
+                function->labels.insert (function_entry);
+
+                while (!worklist.empty ()) {
+                        int32_t address = worklist.back ();
+                        worklist.pop_back ();
+
+                        if (!function->addresses.insert (address).second)
+                                continue;
+
+                        enum OpCode op;
+                        int32_t args[MAX_OPERANDS];
+                        int32_t next;
+
+                        this->fetch (address, &op, args, &next);
+
+                        int target = Bytecode::jump_operand (op);
+
+                        switch (op) {
+                        case OPRET:
+                        case OPHALT:
+                        case OPEXIT: break;
+                        case OPJMP:
+                        case OPINC_JMP:
+                                function->labels.insert (args[target]);
+                                worklist.push_back (args[target]);
+                                break;
+                        case OPCALL:
+                                pending.push_back (args[0]);
+                                function->labels.insert (next);
+                                worklist.push_back (next);
+                                break;
+                        case OPTAILCALL: pending.push_back (args[0]); break;
+                        case OPFORK:
+                        case OPKILL:
+                        case OPYIELD:
+                        case OPSEND:
+                        case OPRECV:
+                        case OPJOIN:
+                        case OPJOINANY:
+                        case OPREAD:
+                        case OPWRITE:
+                        case OPCLOSE:
+                                function->labels.insert (next);
+                                worklist.push_back (next);
+                                break;
+                        default:
+                                /* conditional jumps, superinstructions included */
+                                if (target != -1) {
+                                        function->labels.insert (args[target]);
+                                        function->labels.insert (next);
+                                        worklist.push_back (args[target]);
+                                }
+
+                                worklist.push_back (next);
+                                break;
+                        }
+                }
+
+                /* code that falls through into an instruction emitted elsewhere jumps there */
+                for (std::set<int32_t>::iterator it = function->addresses.begin (); it != function->addresses.end (); ++it) {
+                        enum OpCode op;
+                        int32_t args[MAX_OPERANDS];
+                        int32_t next;
+
+                        this->fetch (*it, &op, args, &next);
+
+                        std::set<int32_t>::iterator following = std::next (it);
+
+                        if (falls_through (op) && (following == function->addresses.end () || *following != next))
+                                function->labels.insert (next);
+                }
+        }
+}
+
+void CEmitter::flush_ops ()
+{
+        if (this->pending_ops == 0)
+                return;
+
+        fprintf (this->out, "        cb_ops += %d;\n", this->pending_ops);
+        this->pending_ops = 0;
+}
+
+/**
+ * The template of an instruction that neither jumps nor leaves the function,
+ * args are its operands
+ */
+void CEmitter::emit_operation (enum OpCode op, const int32_t *args)
+{
+        static const char *comparisons[] = { "==", ">", "<", ">=", "<=", "&&", "||" };
+        int32_t arg = Bytecode::has_operand (op) ? args[0] : 0;
+
+        switch (op) {
+        case OPADD: fprintf (this->out, "        sp[-2] = CB_ADD (sp[-2], sp[-1]);\n        sp--;\n"); break;
+        case OPSUB: fprintf (this->out, "        sp[-2] = CB_SUB (sp[-2], sp[-1]);\n        sp--;\n"); break;
+        case OPMULT: fprintf (this->out, "        sp[-2] = CB_MULT (sp[-2], sp[-1]);\n        sp--;\n"); break;
+        case OPDIV: fprintf (this->out, "        sp[-2] = sp[-2] / sp[-1];\n        sp--;\n"); break;
+        case OPMOD: fprintf (this->out, "        sp[-2] = sp[-2] %% sp[-1];\n        sp--;\n"); break;
+        case OPEQ:
+        case OPGT:
+        case OPLT:
+        case OPGTEQ:
+        case OPLTEQ:
+        case OPAND:
+        case OPOR:
+                fprintf (this->out, "        sp[-2] = sp[-2] %s sp[-1];\n        sp--;\n", comparisons[op - OPEQ]);
+                break;
+        case OPNEQ: fprintf (this->out, "        sp[-2] = sp[-2] != sp[-1];\n        sp--;\n"); break;
+        case OPNEG: fprintf (this->out, "        sp[-1] = CB_NEG (sp[-1]);\n"); break;
+        case OPNOT: fprintf (this->out, "        sp[-1] = CB_NOT (sp[-1]);\n"); break;
+        case OPSTORE: fprintf (this->out, "        CB_STORE (%d);\n", arg); break;
+        case OPLOAD: fprintf (this->out, "        *sp++ = bp[%d];\n", arg); break;
+        case OPDUP: fprintf (this->out, "        *sp = sp[-1];\n        sp++;\n"); break;
+        case OPINC:
+                if (args[1] == INT32_MIN)
+                        fprintf (this->out, "        bp[%d] = CB_ADD (bp[%d], -2147483647 - 1);\n", arg, arg);
+                else
+                        fprintf (this->out, "        bp[%d] = CB_ADD (bp[%d], %d);\n", arg, arg, args[1]);
+                break;
+        case OPADDTO: fprintf (this->out, "        sp--;\n        bp[%d] = CB_ADD (bp[%d], *sp);\n", arg, arg); break;
+        case OPSUBTO: fprintf (this->out, "        sp--;\n        bp[%d] = CB_SUB (bp[%d], *sp);\n", arg, arg); break;
+        case OPMULTTO: fprintf (this->out, "        sp--;\n        bp[%d] = CB_MULT (bp[%d], *sp);\n", arg, arg); break;
+        case OPPUSH:
+                /* the most negative literal has no spelling of its own in C */
+                if (arg == INT32_MIN)
+                        fprintf (this->out, "        *sp++ = -2147483647 - 1;\n");
+                else
+                        fprintf (this->out, "        *sp++ = %d;\n", arg);
+                break;
+        case OPPOP: fprintf (this->out, "        sp--;\n"); break;
+        case OPPRINT: fprintf (this->out, "        printf (\"%%d\\n\", *--sp);\n"); break;
+        case OPCHAN: fprintf (this->out, "        sp[-1] = cb_chan (sp[-1]);\n"); break;
+        case OPOPEN: fprintf (this->out, "        sp[-2] = cb_open (sp[-2], sp[-1]);\n        sp--;\n"); break;
+        case OPPIPE: fprintf (this->out, "        *sp++ = cb_pipe (0);\n"); break;
+        case OPSOCKETPAIR: fprintf (this->out, "        *sp++ = cb_pipe (1);\n"); break;
+        default: break;
+        }
+}
+
+/**
+ * Emit the instruction at address. A superinstruction runs the templates of
+ * its sequence and counts as one instruction, like in the interpreter.
+ */
+void CEmitter::emit_instruction (struct c_function *function, int32_t address)
+{
+        enum OpCode op;
+        int32_t args[MAX_OPERANDS];
+        int32_t next;
+
+        this->fetch (address, &op, args, &next);
+
+        if (function->labels.count (address)) {
+                this->flush_ops ();
+                fprintf (this->out, "a%d:\n", address);
+        }
+
+        enum OpCode sequence[MAX_SEQUENCE];
+        int length = Bytecode::superinstruction_sequence (op, sequence);
+        int operand = 0;
+
+        if (length == 0) {
+                sequence[0] = op;
+                length = 1;
+        }
+
+        for (int k = 0; k < length - 1; k++) {
+                this->emit_operation (sequence[k], &args[operand]);
+                operand += Bytecode::operand_count (sequence[k]);
+        }
+
+        enum OpCode last = sequence[length - 1];
+        int32_t arg = Bytecode::has_operand (last) ? args[operand] : 0;
+
+        this->pending_ops++;
+
+        switch (last) {
+        case OPJMP:
+                this->flush_ops ();
+                fprintf (this->out, "        CB_JUMP (%d);\n", arg);
+                break;
+        case OPJMPFALSE:
+                this->flush_ops ();
+                fprintf (this->out, "        if (!*--sp)\n                CB_JUMP (%d);\n        CB_JUMP (%d);\n", arg, next);
+                break;
+        case OPCALL:
+                this->flush_ops ();
+                fprintf (this->out, "        *sp++ = %d;\n", next);
+                fprintf (this->out, "        CB_CALL (cb_function_%d, %d, %d);\n", arg, arg, this->frame_sizes[arg]);
+                break;
+        case OPTAILCALL:
+                this->flush_ops ();
+                fprintf (this->out, "        CB_REPLACE_FRAME (%d);\n", args[operand + 1]);
+
+                /* a function that calls itself just starts over */
+                if (arg == function->entry)
+                        fprintf (this->out, "        CB_JUMP (%d);\n", arg);
+                else
+                        fprintf (this->out, "        CB_SAVE (%d);\n        return cb_enter (t, cb_function_%d, %d, %d);\n", arg,
+                                 arg, arg, this->frame_sizes[arg]);
+                break;
+        case OPRET:
+                this->flush_ops ();
+                fprintf (this->out, "        CB_RETURN ();\n");
+                break;
+        case OPHALT:
+                this->flush_ops ();
+                fprintf (this->out, "        t->state = CB_EXITED;\n        CB_SUSPEND_AT (%d);\n", next);
+                break;
+        case OPEXIT:
+                this->flush_ops ();
+                fprintf (this->out, "        t->exit_value = *--sp;\n        t->state = CB_EXITED;\n        CB_SUSPEND_AT (%d);\n",
+                         next);
+                break;
+        case OPFORK:
+        case OPKILL:
+                this->flush_ops ();
+                fprintf (this->out, "        CB_SAVE (%d);\n        %s (t);\n        return CB_SUSPEND;\n", next,
+                         last == OPFORK ? "cb_fork" : "cb_kill");
+                break;
+        case OPYIELD:
+                this->flush_ops ();
+                fprintf (this->out, "        CB_SUSPEND_AT (%d);\n", next);
+                break;
+        case OPSEND:
+        case OPRECV:
+        case OPJOIN:
+        case OPJOINANY:
+        case OPREAD:
+        case OPWRITE:
+        case OPCLOSE: {
+                /* a thread that blocked resumes at next with its result pushed */
+                const char *runtime = last == OPSEND        ? "cb_send"
+                                      : last == OPRECV      ? "cb_recv"
+                                      : last == OPJOIN      ? "cb_join"
+                                      : last == OPJOINANY   ? "cb_join_any"
+                                      : last == OPREAD      ? "cb_read"
+                                      : last == OPWRITE     ? "cb_write"
+                                                            : "cb_close";
+
+                this->flush_ops ();
+                fprintf (this->out, "        CB_SAVE (%d);\n        if (%s (t))\n                return CB_SUSPEND;\n        sp = t->sp;\n",
+                         next, runtime);
+                break;
+        }
+        default: this->emit_operation (last, &args[operand]); break;
+        }
+
+        if (!falls_through (op))
+                return;
+
+        std::set<int32_t>::iterator following = function->addresses.upper_bound (address);
+
+        if (following == function->addresses.end () || *following != next) {
+                this->flush_ops ();
+                fprintf (this->out, "        goto a%d;\n", next);
+        }
+}
+
+void CEmitter::emit_function (struct c_function *function)
+{
+        fprintf (this->out, "\nstatic int32_t cb_function_%d (struct cb_thread *t, int32_t at)\n{\n", function->entry);
+        fprintf (this->out, "        int32_t *sp = t->sp;\n        int32_t *bp = t->bp;\n\n");
+        fprintf (this->out, "        switch (at) {\n");
+
+        for (int32_t label : function->labels)
+                fprintf (this->out, "        case %d: goto a%d;\n", label, label);
+
+        fprintf (this->out, "        default: return cb_bad_address (at);\n        }\n\n");
+
+        this->pending_ops = 0;
+
+        for (int32_t address : function->addresses)
+                this->emit_instruction (function, address);
+
+        fprintf (this->out, "}\n");
+}
+
+/**
+ * Write the C translation of the image to out. Fails when the image does not
+ * verify, the translation relies on the frame sizes of the verifier.
+ */
+bool CEmitter::emit (FILE *out)
+{
+        Verifier verifier (this->bytecode->chunk, this->bytecode->count, MAX_FRAME_SLOTS);
+
+        if (!verifier.verify (this->entry_address))
+                return false;
+
+        this->frame_sizes = verifier.frame_sizes;
+        this->out = out;
+        this->scan (this->entry_address);
+
+        fprintf (out, "/* generated by cobrac --emit-c, build with: cc -O2 -I<cobra compiler directory> */\n");
+        fprintf (out, "#define CB_QUANTUM      %u\n", this->quantum);
+        fprintf (out, "#define CB_STACK_SIZE   %d\n", STACK_SIZE);
+        fprintf (out, "#define CB_FRAME_SIZE   %d\n", FRAME_SIZE);
+        fprintf (out, "#define CB_MAX_THREADS  %d\n", MAX_THREADS);
+        fprintf (out, "#define CB_THREAD_BLOCK %d\n", THREAD_BLOCK);
+        fprintf (out, "#define CB_MAX_CHANNELS %d\n", MAX_CHANNELS);
+        fprintf (out, "#define CB_IO_BUFFER    %d\n", IO_BUFFER);
+        fprintf (out, "#define CB_IO_POLL_INTERVAL %d\n", IO_POLL_INTERVAL);
+        fprintf (out, "#include \"cobra_runtime.h\"\n\n");
+
+        for (auto &function : this->functions)
+                fprintf (out, "static int32_t cb_function_%d (struct cb_thread *t, int32_t at);\n", function.first);
+
+        for (auto &function : this->functions)
+                this->emit_function (&function.second);
+
+        fprintf (out, "\nstatic int32_t cb_resume (struct cb_thread *t, int32_t at)\n{\n        switch (at) {\n");
+
+        std::set<int32_t> resumable;
+
+        for (auto &function : this->functions) {
+                for (int32_t label : function.second.labels) {
+                        /* code shared by two functions runs the same in either */
+                        if (resumable.insert (label).second)
+                                fprintf (out, "        case %d: return cb_function_%d (t, at);\n", label, function.first);
+                }
+        }
+
+        fprintf (out, "        default: return cb_bad_address (at);\n        }\n}\n");
+        fprintf (out, "\nint main (int argc, char **argv)\n{\n        return cb_run (cb_resume, %d, %d, argc - 1, argv + 1);\n}\n",
+                 this->entry_address,
+                 this->frame_sizes[this->entry_address]);
+
+        return true;
+}
@@ -0,0 +1,51 @@
+#ifndef emitc_h
+#define emitc_h
+
+#include "bytecode.h"
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+/* a cobra function as it is translated into a C function */
+struct c_function {
+        int32_t entry;
+        /* addresses of its reachable instructions, in the order they are emitted */
+        std::set<int32_t> addresses;
+        /* addresses it can be entered at or jumped to, each one gets a C label */
+        std::set<int32_t> labels;
+};
+
+/**
+ * Ahead-of-time translation of a linked stack image into a C translation unit
+ * for the runtime in cobra_runtime.h. Every function reachable from the script
+ * becomes a C function that runs the templates of its instructions, so the
+ * program no longer pays for dispatch. A function can be entered at any of
+ * its labels, which is how threads resume after they were switched out.
+ */
+class CEmitter {
+    public:
+        CEmitter (Bytecode *bytecode, int32_t entry_address, uint32_t quantum);
+        bool emit (FILE *out);
+
+    private:
+        Bytecode *bytecode;
+        int32_t entry_address;
+        uint32_t quantum;
+        FILE *out;
+        std::vector<int32_t> frame_sizes;
+        std::map<int32_t, struct c_function> functions;
+
+        /* instructions emitted since cb_ops was last brought up to date */
+        int32_t pending_ops;
+
+        void fetch (int32_t address, enum OpCode *op, int32_t *args, int32_t *next);
+        void scan (int32_t entry);
+        void emit_function (struct c_function *function);
+        void emit_instruction (struct c_function *function, int32_t address);
+        void emit_operation (enum OpCode op, const int32_t *args);
+        void flush_ops ();
+};
+
+#endif
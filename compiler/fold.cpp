@@ -0,0 +1,302 @@
+#include "compiler.h"
+#include "scanner.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+/* size of an instruction with one operand */
+#define OPERAND_SIZE (1 + sizeof (int32_t))
+
+/**
+ * Compute a op b as the VM would. Returns false for what has to fault at run
+ * time instead.
+ */
+static bool fold (enum OpCode op, int32_t a, int32_t b, int32_t *result)
+{
+        /* wrap around like the VM does */
+        uint32_t x = a, y = b;
+
+        switch (op) {
+        case OPADD: *result = (int32_t)(x + y); break;
+        case OPMULT: *result = (int32_t)(x * y); break;
+        case OPDIV: {
+                if (b == 0 || (a == INT32_MIN && b == -1))
+                        return false;
+
+                *result = a / b;
+                break;
+        }
+        case OPEQ: *result = a == b; break;
+        case OPGT: *result = a > b; break;
+        case OPLT: *result = a < b; break;
+        case OPGTEQ: *result = a >= b; break;
+        case OPLTEQ: *result = a <= b; break;
+        case OPAND: *result = a && b; break;
+        case OPOR: *result = a || b; break;
+        default: return false;
+        }
+
+        return true;
+}
+
+/**
+ * Find the operand recorded at address. Returns false when the instruction
+ * there is not one.
+ */
+bool Compiler::operand_at (size_t address, struct operand *operand)
+{
+        for (size_t i = this->operands.size (); i-- > 0 && this->operands[i].address >= address;) {
+                if (this->operands[i].address == address) {
+                        *operand = this->operands[i];
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+void Compiler::emit_constant (int32_t value)
+{
+        if (this->fold_constants)
+                this->operands.push_back ({ this->function->bytecode->address (), OPPUSH, value });
+
+        this->function->bytecode->emit_op (OPPUSH);
+        this->function->bytecode->write_int32 (value);
+}
+
+/**
+ * Push the local at offset, or the constant it is known to hold
+ */
+void Compiler::emit_load (int32_t offset)
+{
+        auto known = this->known_values.find (offset);
+
+        if (known != this->known_values.end ()) {
+                this->emit_constant (known->second);
+                return;
+        }
+
+        if (this->fold_constants)
+                this->operands.push_back ({ this->function->bytecode->address (), OPLOAD, offset });
+
+        this->function->bytecode->emit_op (OPLOAD);
+        this->function->bytecode->write_int32 (offset);
+}
+
+void Compiler::emit_store (int32_t offset)
+{
+        this->declare_known_value (offset);
+        this->function->bytecode->emit_op (OPSTORE);
+        this->function->bytecode->write_int32 (offset);
+}
+
+/**
+ * Note what the local at offset holds now that the value on top of the stack
+ * went into it
+ */
+void Compiler::declare_known_value (int32_t offset)
+{
+        struct operand value;
+
+        if (this->operand_at (this->function->bytecode->address () - OPERAND_SIZE, &value) && value.op == OPPUSH)
+                this->known_values[offset] = value.value;
+        else
+                this->known_values.erase (offset);
+}
+
+void Compiler::emit_unary (enum OpCode op)
+{
+        struct operand a;
+
+        if (this->operand_at (this->function->bytecode->address () - OPERAND_SIZE, &a) && a.op == OPPUSH) {
+                uint32_t x = a.value;
+
+                this->truncate (a.address);
+                this->emit_constant (op == OPNEG ? (int32_t)(0 - x) : (int32_t)(1 - x));
+                return;
+        }
+
+        this->function->bytecode->emit_op (op);
+}
+
+/**
+ * Emit a binary operation on the last two values, folding it when both are
+ * constants and dropping it when one of them leaves the other unchanged
+ */
+void Compiler::emit_binary (enum OpCode op)
+{
+        size_t end = this->function->bytecode->address ();
+        struct operand a, b;
+        bool has_b = this->operand_at (end - OPERAND_SIZE, &b);
+        bool has_a = has_b && this->operand_at (end - 2 * OPERAND_SIZE, &a);
+        int32_t result;
+
+        if (has_a && a.op == OPPUSH && b.op == OPPUSH && fold (op, a.value, b.value, &result)) {
+                this->truncate (a.address);
+                this->emit_constant (result);
+                return;
+        }
+
+        /* x + 0, x * 1 and x / 1 */
+        if (has_b && b.op == OPPUSH &&
+            ((op == OPADD && b.value == 0) || ((op == OPMULT || op == OPDIV) && b.value == 1))) {
+                this->truncate (b.address);
+                return;
+        }
+
+        /* 0 + x and 1 * x */
+        if (has_a && a.op == OPPUSH && b.op == OPLOAD &&
+            ((op == OPADD && a.value == 0) || (op == OPMULT && a.value == 1))) {
+                this->truncate (a.address);
+                this->emit_load (b.value);
+                return;
+        }
+
+        /* x * 0 and 0 * x, when x is a local that can be left unread */
+        if (has_a && op == OPMULT &&
+            ((a.op == OPLOAD && b.op == OPPUSH && b.value == 0) || (a.op == OPPUSH && a.value == 0 && b.op == OPLOAD))) {
+                this->truncate (a.address);
+                this->emit_constant (0);
+                return;
+        }
+
+        this->function->bytecode->emit_op (op);
+}
+
+/**
+ * Whether the code from start is a single constant, the condition of a
+ * branch that always goes the same way. Removes it if so.
+ */
+bool Compiler::constant_condition (size_t start, int32_t *value)
+{
+        struct operand a;
+
+        if (this->function->bytecode->address () != start + OPERAND_SIZE || !this->operand_at (start, &a) ||
+            a.op != OPPUSH)
+                return false;
+
+        this->truncate (start);
+        *value = a.value;
+
+        return true;
+}
+
+/**
+ * Whether the code emitted last pushes a constant, which is then the value of
+ * the expression that ends there. Removes it if so.
+ */
+bool Compiler::constant_result (int32_t *value)
+{
+        struct operand a;
+
+        if (!this->operand_at (this->function->bytecode->address () - OPERAND_SIZE, &a) || a.op != OPPUSH)
+                return false;
+
+        this->truncate (a.address);
+        *value = a.value;
+
+        return true;
+}
+
+/**
+ * Forget the locals assigned anywhere in the loop whose header starts at
+ * source, the parenthesis after while or for. Only their values are not
+ * the same on every iteration.
+ */
+void Compiler::forget_assigned_in_loop (char *source)
+{
+        if (this->known_values.empty ())
+                return;
+
+        Scanner scanner (source);
+        struct token previous = { 0 };
+        int depth = 0;
+
+        scanner.quiet = true;
+
+        for (;;) {
+                struct token token = scanner.scan_token ();
+
+                switch (token.type) {
+                case LPAREN:
+                case LBRACE: depth++; break;
+                case RPAREN:
+                case RBRACE: depth--; break;
+                case EQUAL:
+                case PLUS_EQUAL:
+                case MINUS_EQUAL:
+                case MULT_EQUAL:
+                case DIV_EQUAL: {
+                        if (previous.type == IDENTIFIER)
+                                this->known_values.erase (this->symbols->get_stack_offset (previous.name, previous.len));
+                        break;
+                }
+                case END: return;
+                default: break;
+                }
+
+                /* the body ends in a brace or a semicolon outside of any parentheses, unless an else follows */
+                if (depth <= 0 && (token.type == RBRACE || token.type == SEMICOLON)) {
+                        token = scanner.scan_token ();
+
+                        if (token.type != ELSE)
+                                return;
+                }
+
+                previous = token;
+        }
+}
+
+/**
+ * Keep the known values that hold on both paths into a jump target
+ */
+void Compiler::merge_known_values (std::unordered_map<int32_t, int32_t> &other)
+{
+        for (auto known = this->known_values.begin (); known != this->known_values.end ();) {
+                auto value = other.find (known->first);
+
+                if (value == other.end () || value->second != known->second)
+                        known = this->known_values.erase (known);
+                else
+                        known++;
+        }
+}
+
+void Compiler::truncate (size_t address)
+{
+        this->function->bytecode->truncate (address);
+
+        while (!this->operands.empty () && this->operands.back ().address >= address)
+                this->operands.pop_back ();
+}
+
+/**
+ * Code emitted from here on can be jumped to, the instructions before are
+ * not its operands
+ */
+void Compiler::mark_label ()
+{
+        this->operands.clear ();
+}
+
+/**
+ * Parse a statement that can never run and drop its code
+ */
+void Compiler::skip_statement ()
+{
+        Bytecode *bytecode = this->function->bytecode;
+        size_t start = bytecode->address ();
+        size_t line_count = bytecode->lines.size ();
+        struct line_entry line = line_count ? bytecode->lines.back () : (struct line_entry){ 0, 0 };
+        std::unordered_map<int32_t, int32_t> known = this->known_values;
+
+        this->parse_statement ();
+        this->truncate (start);
+
+        /* its first line may have replaced the one of the statement it belongs to */
+        bytecode->lines.resize (line_count);
+
+        if (line_count)
+                bytecode->lines.back () = line;
+
+        this->known_values = known;
+}
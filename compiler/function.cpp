@@ -8,6 +8,7 @@ Function::Function (char *name, size_t len, struct token f)
         this->f = f;
         this->name = name;
         this->len = len;
+        this->arity = -1;
 }
 
 void Function::set_entry_address (size_t address)
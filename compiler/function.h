@@ -15,6 +15,8 @@ class Function {
         struct token f;
         size_t len;
         size_t entry_address;
+        /* number of declared parameters, -1 for the script */
+        int arity;
         void set_entry_address(size_t address);
     
 };
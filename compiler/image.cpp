@@ -0,0 +1,141 @@
+#include "vm.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Map the image in fd read-only and return its size in bytes. A regular file
+ * is mapped in place, so loading it copies nothing and only the pages that
+ * run are read. Pipes and other streams are read into memory instead.
+ */
+size_t VM::map_image (int fd, const char *filename)
+{
+        struct stat st;
+
+        if (fstat (fd, &st) != 0) {
+                perror ("fstat");
+                exit (EXIT_FAILURE);
+        }
+
+        if (!S_ISREG (st.st_mode))
+                return this->read_image (fd, filename);
+
+        if (st.st_size == 0) {
+                fprintf (stderr, "error: %s: empty image\n", filename);
+                exit (EXIT_FAILURE);
+        }
+
+        void *image = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (image == MAP_FAILED) {
+                perror ("mmap");
+                exit (EXIT_FAILURE);
+        }
+
+        this->unmap_image ();
+        this->runtime->image = (int8_t *)image;
+        this->runtime->image_length = st.st_size;
+
+        return st.st_size;
+}
+
+/**
+ * Read the image in fd until end of file into an anonymous mapping that
+ * doubles as it fills, then make it read-only. Returns the size in bytes.
+ */
+size_t VM::read_image (int fd, const char *filename)
+{
+        size_t length = IMAGE_CHUNK;
+        size_t size = 0;
+        void *image = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (image == MAP_FAILED) {
+                perror ("mmap");
+                exit (EXIT_FAILURE);
+        }
+
+        for (;;) {
+                if (size == length) {
+                        image = mremap (image, length, length * 2, MREMAP_MAYMOVE);
+
+                        if (image == MAP_FAILED) {
+                                perror ("mremap");
+                                exit (EXIT_FAILURE);
+                        }
+
+                        length *= 2;
+                }
+
+                ssize_t n = read (fd, (int8_t *)image + size, length - size);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0) {
+                        perror ("read");
+                        exit (EXIT_FAILURE);
+                }
+
+                if (n == 0)
+                        break;
+
+                size += n;
+        }
+
+        if (size == 0) {
+                fprintf (stderr, "error: %s: empty image\n", filename);
+                exit (EXIT_FAILURE);
+        }
+
+        if (mprotect (image, length, PROT_READ) != 0) {
+                perror ("mprotect");
+                exit (EXIT_FAILURE);
+        }
+
+        this->unmap_image ();
+        this->runtime->image = (int8_t *)image;
+        this->runtime->image_length = length;
+
+        return size;
+}
+
+/**
+ * Copy code that was compiled in memory into a fresh read-only mapping, so it
+ * runs like an image loaded from a file.
+ */
+void VM::map_code (int8_t *code, size_t code_size)
+{
+        size_t length = code_size > 0 ? code_size : 1;
+        void *image = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (image == MAP_FAILED) {
+                perror ("mmap");
+                exit (EXIT_FAILURE);
+        }
+
+        memcpy (image, code, code_size);
+
+        if (mprotect (image, length, PROT_READ) != 0) {
+                perror ("mprotect");
+                exit (EXIT_FAILURE);
+        }
+
+        this->unmap_image ();
+        this->runtime->image = (int8_t *)image;
+        this->runtime->image_length = length;
+}
+
+void VM::unmap_image ()
+{
+        if (this->runtime->image)
+                munmap (this->runtime->image, this->runtime->image_length);
+
+        this->runtime->image = NULL;
+        this->runtime->image_length = 0;
+        this->runtime->code = NULL;
+}
@@ -0,0 +1,483 @@
+#include "vm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Take the next byte of handle into value, -1 at the end of the input or on an
+ * error. Returns false when there is none yet and the reader has to wait.
+ */
+static bool read_byte (struct io_handle *handle, int32_t *value)
+{
+        while (handle->in_start == handle->in_end && !handle->eof) {
+                /* a blocking descriptor is read once per time the event loop finds it readable */
+                if (handle->blocking && !handle->readable)
+                        return false;
+
+                handle->readable = false;
+
+                ssize_t n = read (handle->fd, handle->in, IO_BUFFER);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return false;
+
+                if (n <= 0) {
+                        handle->eof = true;
+                } else {
+                        handle->in_start = 0;
+                        handle->in_end = n;
+                }
+        }
+
+        *value = handle->in_start < handle->in_end ? handle->in[handle->in_start++] : -1;
+
+        return true;
+}
+
+/**
+ * Write out what handle buffers, a pipe or socket that is full keeps the rest.
+ * Returns false on an error, the buffer is dropped then.
+ */
+static bool flush_handle (struct io_handle *handle)
+{
+        int32_t written = 0;
+
+        while (written < handle->out_count) {
+                ssize_t n = write (handle->fd, handle->out + written, handle->out_count - written);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+
+                if (n < 0) {
+                        handle->out_count = 0;
+                        return false;
+                }
+
+                written += n;
+        }
+
+        memmove (handle->out, handle->out + written, handle->out_count - written);
+        handle->out_count -= written;
+
+        return true;
+}
+
+/**
+ * Buffer the byte value for handle. Returns 1 once it is, 0 when the buffer is
+ * full and the writer has to wait, -1 on an error.
+ */
+static int write_byte (struct io_handle *handle, int32_t value)
+{
+        if (handle->stream)
+                return fputc (value, handle->stream) == EOF ? -1 : 1;
+
+        if (handle->out_count == IO_BUFFER && !flush_handle (handle))
+                return -1;
+
+        if (handle->out_count == IO_BUFFER)
+                return 0;
+
+        handle->out[handle->out_count++] = value;
+
+        return 1;
+}
+
+/**
+ * The handle with the given id, NULL if there is none or it was closed. The
+ * caller holds the channel lock.
+ */
+struct io_handle *VM::handle_at (int32_t id)
+{
+        if (id < 0 || (size_t)id >= this->runtime->handles.size ())
+                return NULL;
+
+        return this->runtime->handles[id];
+}
+
+/**
+ * Make a handle of fd and return its id. Descriptors other than regular files
+ * are watched by the event loop, those it can not watch are made blocking. A
+ * stream marks one of the standard handles. Of those only standard input is
+ * watched, once for each time a reader waits for it. The caller holds the
+ * channel lock.
+ */
+int32_t VM::add_handle (int fd, FILE *stream)
+{
+        struct io_handle *handle = (struct io_handle *)calloc (1, sizeof (struct io_handle));
+        int32_t id = this->runtime->handles.size ();
+        struct stat info;
+
+        if (!handle) {
+                perror ("calloc");
+                exit (EXIT_FAILURE);
+        }
+
+        handle->fd = fd;
+        handle->stream = stream;
+
+        /* epoll refuses regular files, they are always ready */
+        if ((!stream || stream == stdin) && fstat (fd, &info) == 0 && !S_ISREG (info.st_mode)) {
+                if (this->runtime->epoll_fd == -1 && (this->runtime->epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) == -1) {
+                        perror ("epoll_create1");
+                        exit (EXIT_FAILURE);
+                }
+
+                struct epoll_event event;
+
+                event.events = stream ? EPOLLIN | EPOLLRDHUP | EPOLLONESHOT : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.u32 = id;
+                handle->pollable = epoll_ctl (this->runtime->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+                handle->blocking = stream && handle->pollable;
+
+                /* a reader that closed its end is reported by write, not by a signal */
+                if (!stream)
+                        signal (SIGPIPE, SIG_IGN);
+        }
+
+        if (!stream && !handle->pollable)
+                fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+
+        this->runtime->handles.push_back (handle);
+
+        return id;
+}
+
+/**
+ * Have the event loop report blocking handle id once more when it is readable.
+ * The caller holds the channel lock.
+ */
+void VM::watch_input (int32_t id)
+{
+        struct epoll_event event;
+
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.u32 = id;
+        epoll_ctl (this->runtime->epoll_fd, EPOLL_CTL_MOD, this->runtime->handles[id]->fd, &event);
+}
+
+/**
+ * Block the current thread in queue of handle until the event loop finds it
+ * ready. The caller holds the channel lock.
+ */
+void VM::wait_io (struct io_handle *handle, struct wait_queue *queue)
+{
+        this->block (NULL, queue);
+        this->thread->handle = handle;
+        this->runtime->io_waiting++;
+}
+
+/**
+ * Close handle id, threads still waiting on it get -1. The caller holds the
+ * channel lock.
+ */
+void VM::close_handle (int32_t id)
+{
+        struct io_handle *handle = this->runtime->handles[id];
+        struct context *waiting;
+
+        this->runtime->handles[id] = NULL;
+
+        while ((waiting = dequeue (&handle->readers)) || (waiting = dequeue (&handle->writers))) {
+                *waiting->sp++ = -1;
+                this->wake (waiting);
+        }
+
+        if (handle->stream)
+                fflush (handle->stream);
+        else
+                close (handle->fd);
+
+        free (handle);
+}
+
+/**
+ * Serve the threads waiting on handle id in the order they came, as far as it
+ * is ready. The caller holds the channel lock.
+ */
+void VM::serve_io (int32_t id)
+{
+        struct io_handle *handle = this->handle_at (id);
+        struct context *waiting;
+        int32_t value;
+
+        if (!handle)
+                return;
+
+        while ((waiting = handle->readers.head) && read_byte (handle, &value)) {
+                dequeue (&handle->readers);
+                *waiting->sp++ = value;
+                this->wake (waiting);
+        }
+
+        if (handle->blocking && handle->readers.head)
+                this->watch_input (id);
+
+        while ((waiting = handle->writers.head)) {
+                if (waiting->message == IO_CLOSE) {
+                        bool flushed = flush_handle (handle);
+
+                        if (handle->out_count > 0)
+                                break;
+
+                        dequeue (&handle->writers);
+                        *waiting->sp++ = flushed ? 0 : -1;
+                        this->wake (waiting);
+                        this->close_handle (id);
+                        return;
+                }
+
+                int result = write_byte (handle, waiting->message);
+
+                if (result == 0)
+                        break;
+
+                if (result == 1)
+                        this->runtime->io_dirty = true;
+
+                dequeue (&handle->writers);
+                *waiting->sp++ = result;
+                this->wake (waiting);
+        }
+}
+
+/**
+ * open(i, mode): open the i-th argument after the image, for reading with mode
+ * 0, for writing with 1 and for appending with 2, creating it for either.
+ * Pushes its handle, -1 when it can not be opened.
+ */
+void VM::open_op ()
+{
+        static const int flags[] = { O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND };
+        int32_t mode = this->pop ();
+        int32_t index = this->pop ();
+        int32_t id = -1;
+
+        if (index >= 0 && index < this->argument_count && mode >= 0 && mode <= 2) {
+                int fd = open (this->arguments[index], flags[mode] | O_NONBLOCK | O_CLOEXEC, 0666);
+
+                if (fd >= 0) {
+                        std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+                        id = this->add_handle (fd, NULL);
+                }
+        }
+
+        this->push (id);
+}
+
+/**
+ * read(h): push the next byte of handle h, -1 at its end or when h is not
+ * open. A thread waits for a pipe or socket that has nothing to read, the
+ * others keep running. Returns whether the thread blocked.
+ */
+bool VM::read_byte_op ()
+{
+        int32_t id = this->pop ();
+        std::unique_lock<std::mutex> guard (this->runtime->channel_lock);
+        struct io_handle *handle = this->handle_at (id);
+        int32_t value = -1;
+
+        if (handle && !read_byte (handle, &value)) {
+                this->wait_io (handle, &handle->readers);
+
+                if (handle->blocking)
+                        this->watch_input (id);
+
+                return true;
+        }
+
+        guard.unlock ();
+        this->push (value);
+
+        return false;
+}
+
+/**
+ * write(h, b): buffer the low byte of b for handle h. Pushes 1, -1 on an error
+ * or when h is not open. A thread waits while a pipe or socket is full.
+ * Returns whether the thread blocked.
+ */
+bool VM::write_byte_op ()
+{
+        int32_t value = this->pop () & 0xff;
+        int32_t id = this->pop ();
+        std::unique_lock<std::mutex> guard (this->runtime->channel_lock);
+        struct io_handle *handle = this->handle_at (id);
+        int result = -1;
+
+        if (handle) {
+                result = write_byte (handle, value);
+
+                if (result == 0) {
+                        this->thread->message = value;
+                        this->wait_io (handle, &handle->writers);
+                        return true;
+                }
+
+                if (result == 1 && !handle->stream)
+                        this->runtime->io_dirty = true;
+        }
+
+        guard.unlock ();
+        this->push (result);
+
+        return false;
+}
+
+/**
+ * close(h): write out what h buffers and close it. Pushes 0, -1 when the
+ * output could not be written or h is not open. A thread waits while a pipe
+ * or socket is too full to take the rest. Returns whether it blocked.
+ */
+bool VM::close_op ()
+{
+        int32_t id = this->pop ();
+        std::unique_lock<std::mutex> guard (this->runtime->channel_lock);
+        struct io_handle *handle = this->handle_at (id);
+        int32_t result = -1;
+
+        if (handle) {
+                bool flushed = handle->stream ? fflush (handle->stream) == 0 : flush_handle (handle);
+
+                if (handle->out_count > 0) {
+                        this->thread->message = IO_CLOSE;
+                        this->wait_io (handle, &handle->writers);
+                        return true;
+                }
+
+                this->close_handle (id);
+                result = flushed ? 0 : -1;
+        }
+
+        guard.unlock ();
+        this->push (result);
+
+        return false;
+}
+
+/**
+ * pipe() and socketpair(): create a pipe, or a pair of connected UNIX stream
+ * sockets. Pushes the handle of the read end, or of the first socket, the
+ * other end is the next handle. Pushes -1 when there are no descriptors left.
+ */
+void VM::pipe_op (bool socket)
+{
+        int fds[2];
+        int32_t id = -1;
+        int result = socket ? socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds)
+                            : pipe2 (fds, O_NONBLOCK | O_CLOEXEC);
+
+        if (result == 0) {
+                std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+
+                id = this->add_handle (fds[0], NULL);
+                this->add_handle (fds[1], NULL);
+        }
+
+        this->push (id);
+}
+
+/**
+ * Run the event loop once: wait up to timeout milliseconds for watched handles
+ * to become ready and serve the threads waiting on them. Woken threads join the
+ * ring of this worker.
+ */
+void VM::poll_io (int timeout)
+{
+        struct epoll_event events[IO_EVENTS];
+        int count = epoll_wait (this->runtime->epoll_fd, events, IO_EVENTS, timeout);
+
+        if (count <= 0)
+                return;
+
+        std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+
+        for (int i = 0; i < count; i++) {
+                struct io_handle *handle = this->handle_at (events[i].data.u32);
+
+                if (handle)
+                        handle->readable = true;
+
+                this->serve_io (events[i].data.u32);
+        }
+}
+
+/**
+ * Write out the output every handle buffers, which gives writers waiting on a
+ * full buffer room again
+ */
+void VM::flush_io ()
+{
+        std::lock_guard<std::mutex> guard (this->runtime->channel_lock);
+
+        this->runtime->io_dirty = false;
+
+        for (size_t id = 0; id < this->runtime->handles.size (); id++) {
+                struct io_handle *handle = this->runtime->handles[id];
+
+                if (!handle || handle->out_count == 0)
+                        continue;
+
+                flush_handle (handle);
+                this->serve_io (id);
+
+                /* the rest goes out when the reader caught up */
+                if (this->runtime->handles[id] && this->runtime->handles[id]->out_count > 0)
+                        this->runtime->io_dirty = true;
+        }
+}
+
+/**
+ * Open the standard handles for a run
+ */
+void VM::setup_io ()
+{
+        this->destroy_io ();
+        this->add_handle (STDIN_FILENO, stdin);
+        this->add_handle (STDOUT_FILENO, stdout);
+        this->add_handle (STDERR_FILENO, stderr);
+}
+
+/**
+ * Close every handle, output still buffered is written out blocking since no
+ * thread is left to wait for it
+ */
+void VM::destroy_io ()
+{
+        for (struct io_handle *handle : this->runtime->handles) {
+                if (!handle)
+                        continue;
+
+                if (handle->out_count > 0) {
+                        fcntl (handle->fd, F_SETFL, fcntl (handle->fd, F_GETFL) & ~O_NONBLOCK);
+                        flush_handle (handle);
+                }
+
+                if (!handle->stream)
+                        close (handle->fd);
+
+                free (handle);
+        }
+
+        this->runtime->handles.clear ();
+
+        if (this->runtime->epoll_fd != -1)
+                close (this->runtime->epoll_fd);
+
+        this->runtime->epoll_fd = -1;
+        this->runtime->io_waiting = 0;
+        this->runtime->io_dirty = false;
+}
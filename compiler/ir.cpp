@@ -0,0 +1,933 @@
+#include "ir.h"
+#include <algorithm>
+#include <stdint.h>
+#include <unordered_set>
+#include <vector>
+
+IR::IR (Bytecode *bytecode, int32_t arity, std::unordered_map<int32_t, int32_t> *call_arities, struct ir_stats *stats)
+{
+        this->bytecode = bytecode;
+        this->call_arities = call_arities;
+        this->stats = stats;
+
+        /* the script has no frame below it, a function has its parameters and the return address */
+        this->lowest_slot = arity < 0 ? 0 : -(1 + arity);
+        this->slot_count = 0;
+        this->undefined = this->add_value (IR_UNDEF, OPCODE_COUNT, -1, -1);
+        this->depth = 0;
+        this->line = -1;
+        this->failed = false;
+}
+
+static bool is_jump (enum OpCode op)
+{
+        return op == OPJMP || op == OPJMPFALSE;
+}
+
+/**
+ * Put value into slot k of holds, growing it as temporaries go past the
+ * deepest slot of the stack code
+ */
+static void hold (std::vector<int32_t> &holds, int32_t k, int32_t value)
+{
+        if ((size_t)k >= holds.size ())
+                holds.resize (k + 1, -1);
+
+        holds[k] = value;
+}
+
+int32_t IR::add_value (enum ir_kind kind, enum OpCode op, int32_t a, int32_t b)
+{
+        struct ir_value value;
+
+        value.kind = kind;
+        value.op = op;
+        value.constant = 0;
+        value.operands[0] = a;
+        value.operands[1] = b;
+        value.block = -1;
+        value.used = false;
+        this->values.push_back (value);
+
+        return this->values.size () - 1;
+}
+
+/**
+ * The value of the constant k, the same one for every use of it
+ */
+int32_t IR::constant (int32_t k)
+{
+        auto found = this->constants.find (k);
+
+        if (found != this->constants.end ())
+                return found->second;
+
+        int32_t value = this->add_value (IR_CONST, OPPUSH, -1, -1);
+
+        this->values[value].constant = k;
+        this->constants[k] = value;
+
+        return value;
+}
+
+/**
+ * The value a pass replaced value by, value itself if none did
+ */
+int32_t IR::resolve (int32_t value)
+{
+        if (value < 0 || (size_t)value >= this->replacements.size ())
+                return value;
+
+        int32_t root = value;
+
+        while (this->replacements[root] != root)
+                root = this->replacements[root];
+
+        while (this->replacements[value] != root) {
+                int32_t next = this->replacements[value];
+
+                this->replacements[value] = root;
+                value = next;
+        }
+
+        return root;
+}
+
+/**
+ * How an instruction that stays in the IR changes the stack: the slots it
+ * pops, the arguments below those a call can write over and the slots it
+ * pushes. Returns false for instructions the IR does not model.
+ */
+bool IR::effect (size_t index, int32_t *pops, int32_t *pushes, int32_t *clobbered)
+{
+        struct ir_source &instruction = this->code[index];
+
+        *pops = 0;
+        *pushes = 0;
+        *clobbered = 0;
+
+        switch (instruction.op) {
+        case OPDIV:
+        case OPMOD:
+        case OPSEND:
+        case OPOPEN:
+        case OPWRITE: *pops = 2, *pushes = 1; return true;
+        case OPKILL:
+        case OPCHAN:
+        case OPRECV:
+        case OPJOIN:
+        case OPREAD:
+        case OPCLOSE: *pops = 1, *pushes = 1; return true;
+        case OPFORK:
+        case OPJOINANY:
+        case OPPIPE:
+        case OPSOCKETPAIR: *pushes = 1; return true;
+        case OPPRINT:
+        case OPJMPFALSE:
+        case OPRET:
+        case OPEXIT: *pops = 1; return true;
+        case OPJMP:
+        case OPYIELD:
+        case OPHALT: return true;
+        case OPCALL: {
+                auto arity = this->call_arities->find (instruction.args[0]);
+
+                if (arity == this->call_arities->end ())
+                        return false;
+
+                /* the callee owns its arguments and can store into them */
+                *clobbered = arity->second;
+                *pushes = 1;
+                return true;
+        }
+        case OPTAILCALL: *pops = instruction.args[1]; return *pops >= 0;
+        default: return false;
+        }
+}
+
+/**
+ * The slots, as indices into a state, the instruction at index reads and
+ * writes
+ */
+void IR::access (size_t index, std::vector<int32_t> &reads, std::vector<int32_t> &writes)
+{
+        struct ir_source &instruction = this->code[index];
+        int32_t top = instruction.depth - this->lowest_slot;
+        int32_t arg = instruction.args[0] - this->lowest_slot;
+
+        reads.clear ();
+        writes.clear ();
+
+        switch (instruction.op) {
+        case OPPUSH: writes.push_back (top); return;
+        case OPLOAD:
+                reads.push_back (arg);
+                writes.push_back (top);
+                return;
+        case OPSTORE:
+                reads.push_back (top - 1);
+                writes.push_back (arg);
+                return;
+        case OPPOP: return;
+        case OPDUP:
+                reads.push_back (top - 1);
+                writes.push_back (top);
+                return;
+        case OPINC:
+                reads.push_back (arg);
+                writes.push_back (arg);
+                return;
+        case OPNEG:
+        case OPNOT:
+                reads.push_back (top - 1);
+                writes.push_back (top - 1);
+                return;
+        default: break;
+        }
+
+        int32_t pops = 2, pushes = 1, clobbered = 0;
+
+        if (!is_binary (instruction.op) || instruction.op == OPDIV || instruction.op == OPMOD)
+                this->effect (index, &pops, &pushes, &clobbered);
+
+        int32_t base = top - pops - clobbered;
+
+        for (int32_t k = base; k < top; k++)
+                reads.push_back (k);
+
+        for (int32_t k = base; k < base + clobbered + pushes; k++)
+                writes.push_back (k);
+}
+
+/**
+ * A point where the slots hold the values in state without an instruction
+ * to run, right before the stack instruction at index
+ */
+struct ir_instruction IR::checkpoint (size_t index, int32_t line, std::vector<int32_t> &state)
+{
+        struct ir_instruction instruction = {};
+
+        instruction.op = OPCODE_COUNT;
+        instruction.line = line;
+        instruction.index = index;
+        instruction.depth = state.size () + this->lowest_slot;
+        instruction.state = state;
+
+        return instruction;
+}
+
+/**
+ * Run the stack code of block over state, the values of its slots on entry.
+ * Pure instructions only change the values, everything else becomes an
+ * ir_instruction. Returns false if the code does something the IR does not
+ * model.
+ */
+bool IR::simulate (struct ir_block &block, std::vector<int32_t> &state)
+{
+        for (size_t i = block.first; i < block.end; i++) {
+                struct ir_source &source = this->code[i];
+                int32_t top = state.size ();
+                int32_t arg = source.args[0] - this->lowest_slot;
+                bool local = source.args[0] != -1 && arg >= 0;
+
+                source.depth = top + this->lowest_slot;
+
+                switch (source.op) {
+                case OPPUSH: state.push_back (this->constant (source.args[0])); break;
+                case OPLOAD:
+                        if (!local || arg >= top)
+                                return false;
+
+                        state.push_back (this->add_value (IR_COPY, OPLOAD, state[arg], -1));
+                        break;
+                case OPDUP:
+                        if (top < 1)
+                                return false;
+
+                        state.push_back (this->add_value (IR_COPY, OPDUP, state.back (), -1));
+                        break;
+                case OPSTORE: {
+                        if (!local || top < 1)
+                                return false;
+
+                        int32_t value = state.back ();
+
+                        state.pop_back ();
+
+                        /* a store past the top moves the stack up to the stored slot */
+                        if ((size_t)arg >= state.size ())
+                                state.resize (arg + 1, this->undefined);
+
+                        state[arg] = value;
+
+                        /* assignments stay in order, so later code loads what they stored instead of computing it again */
+                        block.instructions.push_back (this->checkpoint (i + 1, source.line, state));
+                        break;
+                }
+                case OPPOP:
+                        if (top < 1)
+                                return false;
+
+                        state.pop_back ();
+                        break;
+                case OPINC:
+                        if (!local || arg >= top)
+                                return false;
+
+                        state[arg] = this->add_value (IR_PURE, OPADD, state[arg], this->constant (source.args[1]));
+                        break;
+                case OPNEG:
+                case OPNOT:
+                        if (top < 1)
+                                return false;
+
+                        state.back () = this->add_value (IR_PURE, source.op, state.back (), -1);
+                        break;
+                default: {
+                        /* a division is pure where its divisor is a constant it can not fault on */
+                        if (is_binary (source.op) && top >= 2) {
+                                int32_t divisor = state.back ();
+
+                                while (this->values[divisor].kind == IR_COPY)
+                                        divisor = this->values[divisor].operands[0];
+
+                                if ((source.op != OPDIV && source.op != OPMOD) ||
+                                    (this->values[divisor].kind == IR_CONST && this->values[divisor].constant != 0 &&
+                                     this->values[divisor].constant != -1)) {
+                                        int32_t b = state.back ();
+
+                                        state.pop_back ();
+                                        state.back () = this->add_value (IR_PURE, source.op, state.back (), b);
+                                        break;
+                                }
+                        }
+
+                        struct ir_instruction instruction;
+                        int32_t pushes;
+
+                        if (!this->effect (i, &instruction.pops, &pushes, &instruction.clobbered) ||
+                            top < instruction.pops + instruction.clobbered)
+                                return false;
+
+                        instruction.op = source.op;
+                        std::copy (source.args, source.args + MAX_OPERANDS, instruction.args);
+                        instruction.line = source.line;
+                        instruction.index = i;
+                        instruction.depth = source.depth;
+                        instruction.state = state;
+
+                        state.resize (top - instruction.pops - instruction.clobbered);
+
+                        for (int32_t k = 0; k < instruction.clobbered + pushes; k++) {
+                                instruction.results.push_back (this->add_value (IR_RESULT, source.op, -1, -1));
+                                state.push_back (instruction.results.back ());
+                        }
+
+                        block.instructions.push_back (instruction);
+                        break;
+                }
+                }
+
+                if ((int32_t)state.size () + 1 > this->slot_count)
+                        this->slot_count = state.size () + 1;
+        }
+
+        enum OpCode last = this->code[block.end - 1].op;
+
+        if (!is_jump (last) && !Bytecode::ends_path (last))
+                block.instructions.push_back (this->checkpoint (block.end, this->code[block.end - 1].line, state));
+
+        return true;
+}
+
+/**
+ * Build the IR from the stack code the parser emitted for the function. Only
+ * JMP and JMPFALSE may hold addresses, and every path has to reach a block
+ * with the same stack depth. Returns false, leaving the code alone, where the
+ * code does something the IR can not model.
+ */
+bool IR::build ()
+{
+        Bytecode *bytecode = this->bytecode;
+        std::vector<int32_t> index (bytecode->count + 1, -1);
+        struct ir_source source = {};
+        size_t c = 0;
+        size_t address = c;
+        size_t line = 0;
+
+        while (bytecode->instruction_at (&c, &source.op, source.args)) {
+                while (line < bytecode->lines.size () && (size_t)bytecode->lines[line].address <= address)
+                        line++;
+
+                source.line = line > 0 ? bytecode->lines[line - 1].line : -1;
+                source.depth = -1;
+                index[address] = this->code.size ();
+                this->code.push_back (source);
+                address = c;
+        }
+
+        if (this->code.empty () || c != bytecode->count)
+                return false;
+
+        std::vector<int32_t> targets (this->code.size (), -1);
+        std::vector<bool> leaders (this->code.size () + 1, false);
+
+        leaders[0] = true;
+
+        for (size_t i = 0; i < this->code.size (); i++) {
+                if (is_jump (this->code[i].op)) {
+                        int32_t target = this->code[i].args[0];
+
+                        if (target < 0 || (size_t)target >= bytecode->count || index[target] == -1)
+                                return false;
+
+                        targets[i] = index[target];
+                        leaders[targets[i]] = true;
+                }
+
+                if (is_jump (this->code[i].op) || Bytecode::ends_path (this->code[i].op))
+                        leaders[i + 1] = true;
+        }
+
+        std::vector<int32_t> block_of (this->code.size ());
+
+        for (size_t i = 0; i < this->code.size (); i++) {
+                if (leaders[i]) {
+                        struct ir_block block;
+
+                        block.first = i;
+                        block.depth = -1;
+                        block.reachable = false;
+                        this->blocks.push_back (block);
+                }
+
+                this->blocks.back ().end = i + 1;
+                block_of[i] = this->blocks.size () - 1;
+        }
+
+        for (size_t b = 0; b < this->blocks.size (); b++) {
+                struct ir_block &block = this->blocks[b];
+                size_t last = block.end - 1;
+                enum OpCode op = this->code[last].op;
+
+                if (!Bytecode::ends_path (op)) {
+                        /* the code must not run off its end */
+                        if (b + 1 == this->blocks.size ())
+                                return false;
+
+                        block.successors.push_back (b + 1);
+                }
+
+                if (is_jump (op))
+                        block.successors.push_back (block_of[targets[last]]);
+        }
+
+        /* reverse postorder of the blocks a path from the entry reaches */
+        std::vector<std::pair<int32_t, size_t>> stack;
+        std::vector<int32_t> postorder;
+
+        stack.push_back ({ 0, 0 });
+        this->blocks[0].reachable = true;
+
+        while (!stack.empty ()) {
+                int32_t b = stack.back ().first;
+                size_t next = stack.back ().second++;
+
+                if (next == this->blocks[b].successors.size ()) {
+                        postorder.push_back (b);
+                        stack.pop_back ();
+                        continue;
+                }
+
+                int32_t successor = this->blocks[b].successors[next];
+
+                if (!this->blocks[successor].reachable) {
+                        this->blocks[successor].reachable = true;
+                        stack.push_back ({ successor, 0 });
+                }
+        }
+
+        this->order.assign (postorder.rbegin (), postorder.rend ());
+
+        for (int32_t b : this->order) {
+                for (int32_t successor : this->blocks[b].successors)
+                        this->blocks[successor].predecessors.push_back (b);
+        }
+
+        /* parameters hold what the caller passed, the slot of the return address holds nothing to read */
+        std::vector<int32_t> parameters;
+
+        for (int32_t slot = this->lowest_slot; slot < 0; slot++) {
+                if (slot == -1) {
+                        parameters.push_back (this->undefined);
+                        continue;
+                }
+
+                parameters.push_back (this->add_value (IR_ENTRY, OPCODE_COUNT, -1, -1));
+                this->values.back ().constant = slot;
+        }
+
+        /* pushed for slots nothing reads */
+        this->constant (0);
+
+        this->blocks[0].depth = 0;
+
+        for (int32_t b : this->order) {
+                struct ir_block &block = this->blocks[b];
+                size_t size = block.depth - this->lowest_slot;
+
+                if (b == 0 && block.predecessors.empty ()) {
+                        block.entry = parameters;
+                } else if (b != 0 && block.predecessors.size () == 1) {
+                        block.entry = this->blocks[block.predecessors[0]].exit;
+                } else {
+                        for (size_t k = 0; k < size; k++) {
+                                int32_t slot = k + this->lowest_slot;
+
+                                if (slot == -1) {
+                                        block.entry.push_back (this->undefined);
+                                        continue;
+                                }
+
+                                block.entry.push_back (this->add_value (IR_PHI, OPCODE_COUNT, -1, -1));
+                                this->values.back ().constant = slot;
+                                this->values.back ().block = b;
+                        }
+                }
+
+                std::vector<int32_t> state = block.entry;
+
+                if (!this->simulate (block, state))
+                        return false;
+
+                block.exit = state;
+
+                int32_t exit_depth = state.size () + this->lowest_slot;
+
+                for (int32_t successor : block.successors) {
+                        struct ir_block &next = this->blocks[successor];
+
+                        if (next.depth == -1)
+                                next.depth = exit_depth;
+                        else if (next.depth != exit_depth)
+                                return false;
+                }
+        }
+
+        for (struct ir_value &value : this->values) {
+                if (value.kind != IR_PHI)
+                        continue;
+
+                struct ir_block &block = this->blocks[value.block];
+                int32_t k = value.constant - this->lowest_slot;
+
+                if (value.block == 0)
+                        value.incoming.push_back (parameters[k]);
+
+                for (int32_t predecessor : block.predecessors)
+                        value.incoming.push_back (this->blocks[predecessor].exit[k]);
+        }
+
+        this->replacements.resize (this->values.size ());
+
+        for (size_t v = 0; v < this->values.size (); v++)
+                this->replacements[v] = v;
+
+        for (struct ir_block &block : this->blocks) {
+                block.live_in.assign (this->slot_count, true);
+
+                for (struct ir_instruction &instruction : block.instructions)
+                        instruction.live.assign (this->slot_count, true);
+        }
+
+        return true;
+}
+
+void IR::emit (enum OpCode op, int32_t arg)
+{
+        struct lowered instruction = {};
+
+        instruction.op = op;
+        instruction.args[0] = arg;
+        instruction.line = this->line;
+        instruction.target = -1;
+        this->out.push_back (instruction);
+}
+
+/**
+ * Push value: load it from a slot that holds it or compute it from its
+ * operands
+ */
+void IR::emit_value (int32_t value)
+{
+        int32_t top = this->depth - this->lowest_slot;
+
+        value = this->resolve (value);
+
+        /* values shared inside an expression are computed once per use, which must not blow up */
+        if (this->out.size () > 4 * this->code.size () + 64)
+                this->failed = true;
+
+        /* a slot nothing was written to holds whatever was there before, 0 is as good */
+        if (this->values[value].kind == IR_CONST || value == this->undefined) {
+                this->emit (OPPUSH, this->values[value].constant);
+                this->depth++;
+                hold (this->holds, top, value);
+                return;
+        }
+
+        for (int32_t k = top - 1; k >= 0; k--) {
+                if (this->holds[k] == value) {
+                        this->emit (OPLOAD, k + this->lowest_slot);
+                        this->depth++;
+                        hold (this->holds, top, value);
+                        return;
+                }
+        }
+
+        enum ir_kind kind = this->values[value].kind;
+        enum OpCode op = this->values[value].op;
+        int32_t a = this->resolve (this->values[value].operands[0]);
+        int32_t b = this->resolve (this->values[value].operands[1]);
+
+        if (kind == IR_COPY) {
+                this->emit_value (a);
+                hold (this->holds, top, value);
+                return;
+        }
+
+        if (kind != IR_PURE || this->failed) {
+                /* a phi, a parameter or a result no slot holds anymore */
+                this->failed = true;
+                this->emit (OPPUSH, 0);
+                this->depth++;
+                hold (this->holds, top, value);
+                return;
+        }
+
+        if (b == -1) {
+                this->emit_value (a);
+                this->emit (op);
+        } else if (op == OPADD && this->values[a].kind == IR_PURE && this->values[a].op == OPNEG) {
+                /* -x + y, the operands swapped around a subtraction */
+                this->emit_value (b);
+                this->emit_value (this->values[a].operands[0]);
+                this->emit (OPSUB);
+                this->depth--;
+        } else if (op == OPADD && this->values[b].kind == IR_PURE && this->values[b].op == OPNEG) {
+                this->emit_value (a);
+                this->emit_value (this->values[b].operands[0]);
+                this->emit (OPSUB);
+                this->depth--;
+        } else {
+                this->emit_value (a);
+                this->emit_value (b);
+                this->emit (op);
+                this->depth--;
+        }
+
+        hold (this->holds, top, value);
+        hold (this->holds, top + 1, -1);
+}
+
+/**
+ * Whether value can be pushed by a single instruction, so a slot nothing
+ * reads can as well be filled with it and the fused instructions still match
+ */
+bool IR::single_instruction (int32_t value)
+{
+        if (this->values[value].kind == IR_CONST)
+                return true;
+
+        for (int32_t k = 0; k < this->depth - this->lowest_slot; k++) {
+                if (this->holds[k] == value)
+                        return true;
+        }
+
+        return false;
+}
+
+/**
+ * Push the values instruction wants in the slots from the current depth up
+ * to its own
+ */
+void IR::push_slots (struct ir_instruction &instruction)
+{
+        for (int32_t k = this->depth - this->lowest_slot; k < (int32_t)instruction.state.size (); k++) {
+                int32_t value = this->resolve (instruction.state[k]);
+
+                if (value != this->undefined && (instruction.live[k] || this->single_instruction (value)))
+                        this->emit_value (value);
+                else
+                        this->emit_value (this->constant (0));
+        }
+}
+
+/**
+ * Whether computing value from the slots as they are now reads the one at
+ * index k, seen keeps shared operands from being walked twice
+ */
+bool IR::reads_slot (int32_t value, int32_t k, std::unordered_set<int32_t> &seen)
+{
+        value = this->resolve (value);
+
+        if (value < 0 || !seen.insert (value).second || this->values[value].kind == IR_CONST)
+                return false;
+
+        for (int32_t slot = 0; slot < this->depth - this->lowest_slot; slot++) {
+                if (slot != k && this->holds[slot] == value)
+                        return false;
+        }
+
+        if (this->holds[k] == value)
+                return true;
+
+        if (this->values[value].kind != IR_PURE && this->values[value].kind != IR_COPY)
+                return false;
+
+        return this->reads_slot (this->values[value].operands[0], k, seen) ||
+               this->reads_slot (this->values[value].operands[1], k, seen);
+}
+
+/**
+ * Whether value is computed from part
+ */
+bool IR::computed_from (int32_t value, int32_t part, std::unordered_set<int32_t> &seen)
+{
+        value = this->resolve (value);
+
+        if (value < 0 || !seen.insert (value).second)
+                return false;
+
+        if (value == part)
+                return true;
+
+        if (this->values[value].kind != IR_PURE && this->values[value].kind != IR_COPY)
+                return false;
+
+        return this->computed_from (this->values[value].operands[0], part, seen) ||
+               this->computed_from (this->values[value].operands[1], part, seen);
+}
+
+/**
+ * Put the values instruction wants into the live slots below both depths
+ * that hold something else. A slot is stored right away when no other new
+ * value still reads what it holds, preferring one whose new value the others
+ * are computed from, so they can load it. Slots that read each other are
+ * moved at once: their values are pushed first and stored last to first.
+ */
+void IR::store_slots (struct ir_instruction &instruction)
+{
+        int32_t wanted = instruction.state.size ();
+        std::vector<int32_t> changed;
+
+        for (int32_t k = 0; k < std::min ((int32_t)(this->depth - this->lowest_slot), wanted); k++) {
+                int32_t value = this->resolve (instruction.state[k]);
+
+                if (instruction.live[k] && value != this->undefined && this->holds[k] != value)
+                        changed.push_back (k);
+        }
+
+        while (!changed.empty ()) {
+                int32_t top = this->depth - this->lowest_slot;
+                int32_t pick = -1;
+
+                for (size_t i = 0; i < changed.size (); i++) {
+                        int32_t k = changed[i];
+                        int32_t value = this->resolve (instruction.state[k]);
+                        bool safe = true, provides = false;
+
+                        for (int32_t other : changed) {
+                                std::unordered_set<int32_t> reading, computing;
+
+                                if (other == k)
+                                        continue;
+
+                                safe = safe && !this->reads_slot (instruction.state[other], k, reading);
+                                provides = provides || this->computed_from (instruction.state[other], value, computing);
+                        }
+
+                        if (safe && (pick == -1 || provides)) {
+                                pick = i;
+
+                                if (provides)
+                                        break;
+                        }
+                }
+
+                if (pick == -1)
+                        break;
+
+                int32_t k = changed[pick];
+                int32_t value = this->resolve (instruction.state[k]);
+
+                /* the value is on top already and the slot goes away, as when a local is declared from an expression */
+                if (!(top > wanted && this->holds[top - 1] == value))
+                        this->emit_value (value);
+
+                this->emit (OPSTORE, k + this->lowest_slot);
+                this->depth--;
+                this->holds[k] = value;
+                changed.erase (changed.begin () + pick);
+        }
+
+        for (int32_t k : changed)
+                this->emit_value (instruction.state[k]);
+
+        for (auto k = changed.rbegin (); k != changed.rend (); k++) {
+                this->emit (OPSTORE, *k + this->lowest_slot);
+                this->depth--;
+                this->holds[*k] = this->resolve (instruction.state[*k]);
+        }
+}
+
+/**
+ * Bring the stack to what instruction expects, its depth and the value it
+ * wants in every live slot, in one of the two orders
+ */
+void IR::settle (struct ir_instruction &instruction, bool stores_first)
+{
+        if (stores_first) {
+                this->store_slots (instruction);
+                this->push_slots (instruction);
+        } else {
+                this->push_slots (instruction);
+                this->store_slots (instruction);
+        }
+
+        while (this->depth - this->lowest_slot > (int32_t)instruction.state.size ()) {
+                this->emit (OPPOP);
+                this->depth--;
+        }
+}
+
+/**
+ * Bring the stack to what instruction expects. A new slot can be computed
+ * from a value stored into a slot below it, or a store can reuse a value
+ * that was pushed, so both orders are tried and the shorter code is kept.
+ */
+void IR::sync (struct ir_instruction &instruction)
+{
+        size_t start = this->out.size ();
+        std::vector<int32_t> holds = this->holds;
+        int32_t depth = this->depth;
+        bool failed = this->failed;
+
+        this->line = instruction.line;
+        this->settle (instruction, true);
+
+        size_t stores_first = this->out.size () - start;
+        bool stores_first_failed = this->failed;
+
+        this->out.resize (start);
+        this->holds = holds;
+        this->depth = depth;
+        this->failed = failed;
+        this->settle (instruction, false);
+
+        if (this->failed || (!stores_first_failed && this->out.size () - start >= stores_first)) {
+                this->out.resize (start);
+                this->holds = holds;
+                this->depth = depth;
+                this->failed = failed;
+                this->settle (instruction, true);
+        }
+}
+
+/**
+ * Emit the stack code of the IR in place of the code it was built from.
+ * Blocks keep their order, and between two instructions that stay only the
+ * slots read later on are brought up to date. Returns false, leaving the
+ * code alone, if some value can not be brought back or the new code is not
+ * smaller.
+ */
+bool IR::lower ()
+{
+        std::vector<int32_t> block_start (this->blocks.size (), -1);
+
+        this->out.clear ();
+        this->failed = false;
+
+        for (size_t b = 0; b < this->blocks.size (); b++) {
+                struct ir_block &block = this->blocks[b];
+
+                if (!block.reachable)
+                        continue;
+
+                block_start[b] = this->out.size ();
+                this->depth = block.depth;
+                this->holds.assign (this->slot_count, -1);
+
+                for (size_t k = 0; k < block.entry.size (); k++) {
+                        if (block.live_in[k])
+                                this->holds[k] = this->resolve (block.entry[k]);
+                }
+
+                for (struct ir_instruction &instruction : block.instructions) {
+                        this->sync (instruction);
+
+                        if (instruction.op == OPCODE_COUNT)
+                                continue;
+
+                        this->emit (instruction.op);
+                        std::copy (instruction.args, instruction.args + MAX_OPERANDS, this->out.back ().args);
+
+                        if (instruction.op == OPJMP)
+                                this->out.back ().target = block.successors[0];
+                        else if (instruction.op == OPJMPFALSE)
+                                this->out.back ().target = block.successors[1];
+
+                        this->depth -= instruction.pops + instruction.clobbered;
+
+                        for (int32_t result : instruction.results) {
+                                hold (this->holds, this->depth - this->lowest_slot, result);
+                                this->depth++;
+                        }
+                }
+        }
+
+        this->stats->instructions_before += this->code.size ();
+
+        if (this->failed || this->out.size () > this->code.size ()) {
+                this->stats->instructions_after += this->code.size ();
+                return false;
+        }
+
+        this->stats->functions++;
+        this->stats->instructions_after += this->out.size ();
+
+        std::vector<int32_t> address_of (this->out.size ());
+        size_t size = 0;
+
+        for (size_t i = 0; i < this->out.size (); i++) {
+                address_of[i] = size;
+                size += 1 + Bytecode::operand_count (this->out[i].op) * sizeof (int32_t);
+        }
+
+        Bytecode *bytecode = this->bytecode;
+
+        bytecode->lines.clear ();
+
+        for (size_t i = 0; i < this->out.size (); i++) {
+                int32_t line = this->out[i].line;
+
+                if (line == -1 || (!bytecode->lines.empty () && bytecode->lines.back ().line == line))
+                        continue;
+
+                bytecode->lines.push_back ({ address_of[i], line });
+        }
+
+        bytecode->count = 0;
+
+        for (struct lowered &i : this->out) {
+                if (i.target != -1)
+                        i.args[0] = address_of[block_start[i.target]];
+
+                bytecode->write_int8 (i.op);
+
+                for (int j = 0; j < Bytecode::operand_count (i.op); j++)
+                        bytecode->write_int32 (i.args[j]);
+        }
+
+        return true;
+}
@@ -0,0 +1,179 @@
+#ifndef ir_h
+#define ir_h
+
+#include "bytecode.h"
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/* what an SSA value of the IR stands for */
+enum ir_kind {
+        IR_CONST,  /* a constant */
+        IR_ENTRY,  /* a parameter as the function was entered */
+        IR_UNDEF,  /* a slot nothing was written to */
+        IR_PHI,    /* a slot where paths meet, one incoming value per predecessor */
+        IR_COPY,   /* a load or a dup of another value */
+        IR_PURE,   /* arithmetic that can neither fault nor have side effects */
+        IR_RESULT, /* left by an instruction with side effects */
+};
+
+struct ir_value {
+        enum ir_kind kind;
+        enum OpCode op;
+
+        /* the constant of IR_CONST, the slot of IR_ENTRY and IR_PHI */
+        int32_t constant;
+
+        /* operands of IR_COPY and IR_PURE, -1 where there is none */
+        int32_t operands[2];
+
+        /* block of an IR_PHI and its incoming values, in the order of the predecessors */
+        int32_t block;
+        std::vector<int32_t> incoming;
+
+        bool used;
+};
+
+/**
+ * An instruction that has to stay where it was: it has side effects, can
+ * fault or ends a block. Before it runs, the slots it reads and every slot
+ * read later on hold the values in state. Everything between two of them is
+ * pure and only changes which values the slots hold.
+ */
+struct ir_instruction {
+        /* OPCODE_COUNT for an assignment and for the end of a block that goes on to the next one */
+        enum OpCode op;
+        int32_t args[MAX_OPERANDS];
+        int32_t line;
+
+        /* index of the stack instruction it stands for */
+        size_t index;
+
+        /* stack depth right before it and the value of every slot from the lowest parameter up */
+        int32_t depth;
+        std::vector<int32_t> state;
+
+        /* which of those slots are read before they are written again */
+        std::vector<bool> live;
+
+        /* slots it pops, arguments a call can write over and the values left in both */
+        int32_t pops;
+        int32_t clobbered;
+        std::vector<int32_t> results;
+};
+
+struct ir_block {
+        /* its instructions in the stack code */
+        size_t first;
+        size_t end;
+
+        std::vector<int32_t> predecessors;
+        std::vector<int32_t> successors;
+
+        /* stack depth on entry, -1 until a path to it was seen */
+        int32_t depth;
+
+        /* values of the slots on entry and where it ends, after a JMPFALSE popped its condition */
+        std::vector<int32_t> entry;
+        std::vector<int32_t> exit;
+        std::vector<bool> live_in;
+
+        std::vector<struct ir_instruction> instructions;
+        bool reachable;
+};
+
+/* instruction of the stack code the IR is built from */
+struct ir_source {
+        enum OpCode op;
+        int32_t args[MAX_OPERANDS];
+        int32_t line;
+        int32_t depth;
+};
+
+/* work done by the IR passes over all functions */
+struct ir_stats {
+        uint64_t functions;  /* lowered from the IR */
+        uint64_t kept;       /* left as emitted: not modelled or not smaller */
+        uint64_t copies;     /* copies and phis of a single value propagated */
+        uint64_t common;     /* expressions merged with an equal one */
+        uint64_t dead_values;
+        uint64_t dead_stores;
+        uint64_t instructions_before;
+        uint64_t instructions_after;
+};
+
+/**
+ * SSA form of a single function between the parser and the bytecode it
+ * runs as. Every stack slot, parameters and temporaries included, is a
+ * variable, so the locals tracked by Symbols get a value per assignment and
+ * a phi where paths meet.
+ */
+class IR {
+    public:
+        IR (Bytecode *bytecode, int32_t arity, std::unordered_map<int32_t, int32_t> *call_arities,
+            struct ir_stats *stats);
+
+        bool build ();
+        void propagate_copies ();
+        void eliminate_common_subexpressions ();
+        void eliminate_dead_stores ();
+        void eliminate_dead_code ();
+        bool lower ();
+
+        static void print_stats (FILE *fp, struct ir_stats *stats);
+
+    private:
+        Bytecode *bytecode;
+        std::unordered_map<int32_t, int32_t> *call_arities;
+        struct ir_stats *stats;
+
+        /* slot of index 0 in every state, the lowest parameter */
+        int32_t lowest_slot;
+        int32_t slot_count;
+
+        std::vector<struct ir_source> code;
+        std::vector<struct ir_block> blocks;
+        std::vector<int32_t> order;
+        std::vector<struct ir_value> values;
+        std::vector<int32_t> replacements;
+        std::unordered_map<int32_t, int32_t> constants;
+        int32_t undefined;
+
+        int32_t add_value (enum ir_kind kind, enum OpCode op, int32_t a, int32_t b);
+        int32_t constant (int32_t value);
+        int32_t resolve (int32_t value);
+        void replace_everywhere ();
+        bool effect (size_t index, int32_t *pops, int32_t *pushes, int32_t *clobbered);
+        void access (size_t index, std::vector<int32_t> &reads, std::vector<int32_t> &writes);
+        std::vector<bool> live_out (struct ir_block &block);
+        struct ir_instruction checkpoint (size_t index, int32_t line, std::vector<int32_t> &state);
+        bool simulate (struct ir_block &block, std::vector<int32_t> &state);
+        void mark (int32_t value);
+
+        /* lowering */
+        struct lowered {
+                enum OpCode op;
+                int32_t args[MAX_OPERANDS];
+                int32_t line;
+                int32_t target;
+        };
+
+        std::vector<struct lowered> out;
+        std::vector<int32_t> holds;
+        int32_t depth;
+        int32_t line;
+        bool failed;
+
+        void emit (enum OpCode op, int32_t arg = 0);
+        void emit_value (int32_t value);
+        bool reads_slot (int32_t value, int32_t k, std::unordered_set<int32_t> &seen);
+        bool computed_from (int32_t value, int32_t part, std::unordered_set<int32_t> &seen);
+        bool single_instruction (int32_t value);
+        void push_slots (struct ir_instruction &instruction);
+        void store_slots (struct ir_instruction &instruction);
+        void settle (struct ir_instruction &instruction, bool stores_first);
+        void sync (struct ir_instruction &instruction);
+};
+
+#endif
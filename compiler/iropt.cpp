@@ -0,0 +1,274 @@
+#include "ir.h"
+#include <inttypes.h>
+#include <map>
+#include <stdint.h>
+#include <tuple>
+#include <vector>
+
+static bool is_commutative (enum OpCode op)
+{
+        return op == OPADD || op == OPMULT || op == OPEQ || op == OPNEQ || op == OPAND || op == OPOR;
+}
+
+/**
+ * Put the value every replacement leads to in place of the replaced ones
+ */
+void IR::replace_everywhere ()
+{
+        for (struct ir_value &value : this->values) {
+                for (int32_t &operand : value.operands)
+                        operand = this->resolve (operand);
+
+                for (int32_t &incoming : value.incoming)
+                        incoming = this->resolve (incoming);
+        }
+
+        for (struct ir_block &block : this->blocks) {
+                for (int32_t &value : block.entry)
+                        value = this->resolve (value);
+
+                for (int32_t &value : block.exit)
+                        value = this->resolve (value);
+
+                for (struct ir_instruction &instruction : block.instructions) {
+                        for (int32_t &value : instruction.state)
+                                value = this->resolve (value);
+                }
+        }
+}
+
+/**
+ * Replace every copy by the value it copies, and every phi whose incoming
+ * values are itself or a single other value by that value. A slot nothing
+ * was written to on some path keeps its phi.
+ */
+void IR::propagate_copies ()
+{
+        for (size_t v = 0; v < this->values.size (); v++) {
+                if (this->values[v].kind == IR_COPY) {
+                        this->replacements[v] = this->values[v].operands[0];
+                        this->stats->copies++;
+                }
+        }
+
+        bool changed = true;
+
+        while (changed) {
+                changed = false;
+
+                for (size_t v = 0; v < this->values.size (); v++) {
+                        struct ir_value &value = this->values[v];
+
+                        if (value.kind != IR_PHI || this->replacements[v] != (int32_t)v)
+                                continue;
+
+                        int32_t single = -1;
+                        bool trivial = true;
+
+                        for (int32_t incoming : value.incoming) {
+                                incoming = this->resolve (incoming);
+
+                                if (incoming == (int32_t)v || incoming == single)
+                                        continue;
+
+                                if (single != -1) {
+                                        trivial = false;
+                                        break;
+                                }
+
+                                single = incoming;
+                        }
+
+                        if (trivial && single != -1) {
+                                this->replacements[v] = single;
+                                this->stats->copies++;
+                                changed = true;
+                        }
+                }
+        }
+
+        this->replace_everywhere ();
+}
+
+/**
+ * Merge pure expressions of the same operator over the same operands.
+ * Operands are made before the values built from them, so a single pass in
+ * the order values were made sees every operand merged already.
+ */
+void IR::eliminate_common_subexpressions ()
+{
+        std::map<std::tuple<int32_t, int32_t, int32_t>, int32_t> seen;
+
+        for (size_t v = 0; v < this->values.size (); v++) {
+                struct ir_value &value = this->values[v];
+
+                if (value.kind != IR_PURE || this->replacements[v] != (int32_t)v)
+                        continue;
+
+                int32_t a = value.operands[0] = this->resolve (value.operands[0]);
+                int32_t b = value.operands[1] = this->resolve (value.operands[1]);
+
+                /* only the key is put in order, the operands stay in the order the fused instructions expect */
+                if (b != -1 && b < a && is_commutative (value.op))
+                        std::swap (a, b);
+
+                auto key = std::make_tuple ((int32_t)value.op, a, b);
+                auto found = seen.find (key);
+
+                if (found != seen.end ()) {
+                        this->replacements[v] = found->second;
+                        this->stats->common++;
+                } else {
+                        seen[key] = v;
+                }
+        }
+
+        this->replace_everywhere ();
+}
+
+/**
+ * The slots read after block, by its successors or, when it leaves the
+ * function, by the caller: the parameters are in the caller's frame, which
+ * takes its result from them
+ */
+std::vector<bool> IR::live_out (struct ir_block &block)
+{
+        std::vector<bool> live (this->slot_count, false);
+
+        if (block.successors.empty ()) {
+                for (int32_t slot = this->lowest_slot; slot < -1 && slot - this->lowest_slot < this->slot_count; slot++)
+                        live[slot - this->lowest_slot] = true;
+        }
+
+        for (int32_t successor : block.successors) {
+                for (int32_t k = 0; k < this->slot_count; k++)
+                        live[k] = live[k] || this->blocks[successor].live_in[k];
+        }
+
+        return live;
+}
+
+/**
+ * Find the slots each instruction that stays reads before they are written
+ * again, over the stack code the IR was built from. Lowering then leaves
+ * every other slot as it is, which drops stores nothing reads.
+ */
+void IR::eliminate_dead_stores ()
+{
+        std::vector<int32_t> reads, writes;
+        bool changed = true;
+
+        for (struct ir_block &block : this->blocks)
+                block.live_in.assign (this->slot_count, false);
+
+        while (changed) {
+                changed = false;
+
+                for (auto b = this->order.rbegin (); b != this->order.rend (); b++) {
+                        struct ir_block &block = this->blocks[*b];
+                        std::vector<bool> live = this->live_out (block);
+
+                        for (size_t i = block.end; i-- > block.first;) {
+                                this->access (i, reads, writes);
+
+                                for (int32_t k : writes)
+                                        live[k] = false;
+
+                                for (int32_t k : reads)
+                                        live[k] = true;
+                        }
+
+                        if (live != block.live_in) {
+                                block.live_in = live;
+                                changed = true;
+                        }
+                }
+        }
+
+        for (int32_t b : this->order) {
+                struct ir_block &block = this->blocks[b];
+                std::vector<bool> live = this->live_out (block);
+                auto instruction = block.instructions.rbegin ();
+
+                while (instruction != block.instructions.rend () && instruction->index == block.end)
+                        (instruction++)->live = live;
+
+                for (size_t i = block.end; i-- > block.first;) {
+                        this->access (i, reads, writes);
+
+                        if ((this->code[i].op == OPSTORE || this->code[i].op == OPINC) && !live[writes[0]])
+                                this->stats->dead_stores++;
+
+                        for (int32_t k : writes)
+                                live[k] = false;
+
+                        for (int32_t k : reads)
+                                live[k] = true;
+
+                        while (instruction != block.instructions.rend () && instruction->index == i)
+                                (instruction++)->live = live;
+                }
+        }
+}
+
+/**
+ * Mark value and every value it is computed from as used
+ */
+void IR::mark (int32_t value)
+{
+        std::vector<int32_t> work (1, value);
+
+        while (!work.empty ()) {
+                int32_t v = this->resolve (work.back ());
+
+                work.pop_back ();
+
+                if (v < 0 || this->values[v].used)
+                        continue;
+
+                this->values[v].used = true;
+
+                for (int32_t operand : this->values[v].operands)
+                        work.push_back (operand);
+
+                for (int32_t incoming : this->values[v].incoming)
+                        work.push_back (incoming);
+        }
+}
+
+/**
+ * Find the values no instruction that stays needs. Lowering only computes
+ * values it brings into a live slot, so these are never emitted.
+ */
+void IR::eliminate_dead_code ()
+{
+        for (struct ir_value &value : this->values)
+                value.used = false;
+
+        for (int32_t b : this->order) {
+                for (struct ir_instruction &instruction : this->blocks[b].instructions) {
+                        for (size_t k = 0; k < instruction.state.size (); k++) {
+                                if (instruction.live[k])
+                                        this->mark (instruction.state[k]);
+                        }
+                }
+        }
+
+        for (size_t v = 0; v < this->values.size (); v++) {
+                struct ir_value &value = this->values[v];
+
+                if (!value.used && this->replacements[v] == (int32_t)v &&
+                    (value.kind == IR_PHI || value.kind == IR_PURE))
+                        this->stats->dead_values++;
+        }
+}
+
+void IR::print_stats (FILE *fp, struct ir_stats *stats)
+{
+        fprintf (fp,
+                 "IR: %" PRIu64 " functions lowered, %" PRIu64 " kept, %" PRIu64 " copies propagated, %" PRIu64
+                 " common subexpressions, %" PRIu64 " dead values, %" PRIu64 " dead stores\n",
+                 stats->functions, stats->kept, stats->copies, stats->common, stats->dead_values, stats->dead_stores);
+        fprintf (fp, "IR: %" PRIu64 " instructions before, %" PRIu64 " after\n", stats->instructions_before,
+                 stats->instructions_after);
+}
@@ -0,0 +1,743 @@
+#include "jit.h"
+#include "vm.h"
+#include <algorithm>
+#include <set>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* thread state the machine code keeps in callee-saved registers */
+static const int REG_SP = RBX;
+static const int REG_BP = R12;
+static const int REG_THREAD = R13;
+static const int REG_VM = R14;
+static const int REG_OPS = R15;
+
+#define CONTEXT(field) ((int32_t)offsetof (struct context, field))
+
+/*
+ * enter machine code at code on the stack ending at stack_top; returns the
+ * return address or -1. ops holds minus the time slice and comes back with
+ * the instructions run added.
+ */
+typedef int32_t (*jit_enter_function) (struct context *thread, VM *vm, void *code, uint64_t *ops, void *stack_top);
+
+static void jit_print (int32_t value)
+{
+        printf ("%d\n", value);
+}
+
+/**
+ * The slow path of a call that goes deeper than the frame high-water mark.
+ * Returns 0 when the thread was killed for exceeding the recursion limit.
+ */
+int32_t VM::jit_grow_frames (VM *vm, struct context *thread)
+{
+        if (thread->frame_no == thread->frame_capacity && !vm->grow_frames (thread)) {
+                fprintf (stderr, "call: maximum recursion depth exceeded\n");
+                thread->state = KILLED;
+                return 0;
+        }
+
+        thread->frame_high = thread->frame_no + 1;
+
+        return 1;
+}
+
+/**
+ * The slow path of a call whose callee frame lies past the stack high-water
+ * mark. The machine code reloads sp and bp, the stack may have moved.
+ */
+void VM::jit_grow_stack (VM *vm, struct context *thread, int32_t frame_size)
+{
+        thread->stack_high = thread->sp + frame_size + 1;
+        vm->grow_stack (thread, thread->stack_high - thread->stack);
+}
+
+/**
+ * Allocate the shared tables of the JIT for the loaded image
+ */
+void VM::setup_jit ()
+{
+        this->destroy_jit ();
+        free (this->call_counts);
+
+        this->runtime->jit_entries = (std::atomic<void *> *)calloc (this->code_size, sizeof (std::atomic<void *>));
+        this->runtime->jit_rejected = (bool *)calloc (this->code_size, sizeof (bool));
+        this->runtime->jit_enter = NULL;
+        this->runtime->jit_compiled = 0;
+        this->call_counts = (uint32_t *)calloc (this->code_size, sizeof (uint32_t));
+
+        if (!this->runtime->jit_entries || !this->runtime->jit_rejected || !this->call_counts) {
+                perror ("calloc");
+                exit (EXIT_FAILURE);
+        }
+}
+
+void VM::destroy_jit ()
+{
+        for (std::pair<void *, size_t> &segment : this->runtime->jit_segments)
+                munmap (segment.first, segment.second);
+
+        this->runtime->jit_segments.clear ();
+        free (this->runtime->jit_entries);
+        free (this->runtime->jit_rejected);
+        this->runtime->jit_entries = NULL;
+        this->runtime->jit_rejected = NULL;
+}
+
+/**
+ * Run the function at target, whose frame the caller has just set up, in
+ * machine code once it has been called JIT_THRESHOLD times. Returns false
+ * when the interpreter has to run it. Otherwise the function has returned, or
+ * stopped the thread, and thread->ip, sp and bp are where the interpreter
+ * continues.
+ */
+bool VM::jit_call (int32_t target)
+{
+        void *code = this->runtime->jit_entries[target].load (std::memory_order_acquire);
+
+        if (!code) {
+                if (++this->call_counts[target] != JIT_THRESHOLD)
+                        return false;
+
+                Jit jit (this);
+
+                if (!(code = jit.compile (target)))
+                        return false;
+        }
+
+        if (!this->jit_stack) {
+                void *stack = mmap (NULL, JIT_STACK_SIZE, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+
+                if (stack == MAP_FAILED) {
+                        perror ("mmap");
+                        exit (EXIT_FAILURE);
+                }
+
+                this->jit_stack = (int8_t *)stack;
+        }
+
+        jit_enter_function enter = (jit_enter_function)this->runtime->jit_enter;
+        uint64_t slice = std::min (this->time_slice (), (uint64_t)INT64_MAX);
+        uint64_t ops = -slice;
+        int32_t ret_addr = enter (this->thread, this, code, &ops, this->jit_stack + JIT_STACK_SIZE);
+
+        ops += slice;
+        this->thread->op_count += ops;
+        this->executed += ops;
+
+        if (ret_addr >= 0)
+                this->thread->ip = this->thread->instructions + ret_addr;
+
+        return true;
+}
+
+Jit::Jit (VM *vm)
+{
+        this->vm = vm;
+        this->code = vm->thread->instructions;
+        this->pending_ops = 0;
+}
+
+/**
+ * Translate the function at entry and the functions it can call. Returns its
+ * machine code, NULL if it has to stay interpreted.
+ */
+void *Jit::compile (int32_t entry)
+{
+        struct runtime *runtime = this->vm->runtime;
+        std::lock_guard<std::mutex> guard (runtime->jit_lock);
+
+        /* another worker may have got here first */
+        void *compiled = runtime->jit_entries[entry].load ();
+
+        if (compiled || runtime->jit_rejected[entry])
+                return compiled;
+
+        if (!this->scan (entry)) {
+                runtime->jit_rejected[entry] = true;
+                return NULL;
+        }
+
+        if (!runtime->jit_enter) {
+                this->emit_trampoline ();
+                runtime->jit_enter = this->install ();
+                this->as.code.clear ();
+        }
+
+        std::vector<std::pair<size_t, int32_t> > calls;
+
+        for (std::pair<const int32_t, struct jit_function> &function : this->batch)
+                this->emit_function (&function.second, calls);
+
+        for (std::pair<size_t, int32_t> &call : calls)
+                this->as.patch (call.first, this->batch[call.second].native_entry);
+
+        int8_t *base = (int8_t *)this->install ();
+
+        for (std::pair<const int32_t, struct jit_function> &function : this->batch) {
+                runtime->jit_entries[function.first].store (base + function.second.native_entry);
+                runtime->jit_compiled++;
+        }
+
+        return base + this->batch[entry].native_entry;
+}
+
+/**
+ * Decode the instruction at address
+ */
+void Jit::fetch (int32_t address, enum OpCode *op, int32_t *args, int32_t *next)
+{
+        *op = (enum OpCode)this->code[address];
+
+        int count = Bytecode::operand_count (*op);
+
+        for (int i = 0; i < count; i++)
+                memcpy (&args[i], this->code + address + 1 + i * sizeof (int32_t), sizeof (int32_t));
+
+        *next = address + 1 + count * sizeof (int32_t);
+}
+
+/**
+ * Collect the reachable instructions of the function at entry and, in turn,
+ * of every function it calls that is not compiled yet. Fails on instructions
+ * the machine code can not run and on calls into rejected functions.
+ */
+bool Jit::scan (int32_t entry)
+{
+        struct runtime *runtime = this->vm->runtime;
+        std::vector<int32_t> functions = { entry };
+
+        while (!functions.empty ()) {
+                int32_t function_entry = functions.back ();
+
+                functions.pop_back ();
+
+                if (this->batch.count (function_entry) || runtime->jit_entries[function_entry].load ())
+                        continue;
+
+                if (runtime->jit_rejected[function_entry])
+                        return false;
+
+                struct jit_function &function = this->batch[function_entry];
+                std::set<int32_t> seen;
+                std::vector<int32_t> work = { function_entry };
+
+                function.entry = function_entry;
+
+                while (!work.empty ()) {
+                        int32_t address = work.back ();
+                        int32_t args[MAX_OPERANDS], next, target = -1;
+                        enum OpCode op;
+                        bool falls_through = true;
+
+                        work.pop_back ();
+
+                        if (!seen.insert (address).second)
+                                continue;
+
+                        this->fetch (address, &op, args, &next);
+
+                        switch (op) {
+                        case OPHALT:
+                        case OPFORK:
+                        case OPKILL:
+                        case OPYIELD:
+                        case OPCHAN:
+                        case OPSEND:
+                        case OPRECV:
+                        case OPEXIT:
+                        case OPJOIN:
+                        case OPJOINANY:
+                        case OPOPEN:
+                        case OPREAD:
+                        case OPWRITE:
+                        case OPCLOSE:
+                        case OPPIPE:
+                        case OPSOCKETPAIR: return false;
+                        case OPJMP: target = args[0], falls_through = false; break;
+                        case OPINC_JMP: target = args[2], falls_through = false; break;
+                        case OPJMPFALSE:
+                        case OPLT_JMPFALSE: target = args[0]; break;
+                        case OPLOAD_PUSH_LT_JMPFALSE: target = args[2]; break;
+                        case OPRET: falls_through = false; break;
+                        case OPCALL:
+                                functions.push_back (args[0]);
+                                break;
+                        case OPTAILCALL:
+                                functions.push_back (args[0]);
+                                falls_through = false;
+                                break;
+                        default:
+                                if (op >= OPCODE_COUNT)
+                                        return false;
+                                break;
+                        }
+
+                        if (target >= 0) {
+                                function.labels[target] = 0;
+
+                                if (target <= address)
+                                        function.loop_headers[target] = true;
+
+                                work.push_back (target);
+                        }
+
+                        if (falls_through)
+                                work.push_back (next);
+                }
+
+                function.addresses.assign (seen.begin (), seen.end ());
+        }
+
+        return true;
+}
+
+/**
+ * The entry from C++: saves the callee-saved registers, switches to the stack
+ * of the worker for machine code, loads the thread state into the registers
+ * the machine code keeps it in and calls the function. The callee-saved rbp
+ * keeps the C++ stack pointer.
+ */
+void Jit::emit_trampoline ()
+{
+        Assembler &as = this->as;
+
+        as.push (RBX);
+        as.push (RBP);
+        as.push (R12);
+        as.push (R13);
+        as.push (R14);
+        as.push (R15);
+        as.mov64 (RBP, RSP);
+        as.mov64 (RSP, R8);
+        as.push (RCX);
+        as.sub64 (RSP, 8);
+        as.mov64 (REG_THREAD, RDI);
+        as.mov64 (REG_VM, RSI);
+        as.load64 (REG_SP, REG_THREAD, CONTEXT (sp));
+        as.load64 (REG_BP, REG_THREAD, CONTEXT (bp));
+        as.load64 (REG_OPS, RCX, 0);
+        as.call (RDX);
+        as.store64 (REG_THREAD, CONTEXT (sp), REG_SP);
+        as.store64 (REG_THREAD, CONTEXT (bp), REG_BP);
+        as.load64 (RCX, RSP, 8);
+        as.store64 (RCX, 0, REG_OPS);
+        as.mov64 (RSP, RBP);
+        as.pop (R15);
+        as.pop (R14);
+        as.pop (R13);
+        as.pop (R12);
+        as.pop (RBP);
+        as.pop (RBX);
+        as.ret ();
+}
+
+/**
+ * Translate one function. A function returns the return address it pops, or
+ * -1 through its exit stub when the thread stopped or its time slice ran out
+ * while it ran. The entry and loop headers check both, so a thread killed from
+ * another worker stops and a looping thread gives the worker back to the
+ * scheduler.
+ */
+void Jit::emit_function (struct jit_function *function, std::vector<std::pair<size_t, int32_t> > &calls)
+{
+        Assembler &as = this->as;
+        size_t exit = as.position ();
+
+        as.add64 (RSP, 8);
+        as.mov_imm (RAX, -1);
+        as.ret ();
+
+        function->native_entry = as.position ();
+        as.sub64 (RSP, 8);
+        as.cmp_mem_imm (REG_THREAD, CONTEXT (state), RUNNING);
+        as.jump_if_to (CC_NE, exit);
+        this->emit_preempt (function->entry, exit);
+
+        this->fixups.clear ();
+
+        for (int32_t address : function->addresses) {
+                if (function->labels.count (address)) {
+                        this->flush_ops ();
+                        function->labels[address] = as.position ();
+
+                        if (function->loop_headers.count (address)) {
+                                as.cmp_mem_imm (REG_THREAD, CONTEXT (state), RUNNING);
+                                as.jump_if_to (CC_NE, exit);
+                                this->emit_preempt (address, exit);
+                        }
+                }
+
+                this->emit_instruction (function, address, exit, calls);
+        }
+
+        for (std::pair<size_t, int32_t> &fixup : this->fixups)
+                as.patch (fixup.first, function->labels[fixup.second]);
+}
+
+/**
+ * Leave through exit with the thread at address once the instructions counted
+ * so far, which start at minus the time slice, reach 0. The interpreter goes
+ * on from there and the frames of the compiled callers are all in memory.
+ */
+void Jit::emit_preempt (int32_t address, size_t exit)
+{
+        Assembler &as = this->as;
+
+        as.regs (true, 0x85, REG_OPS, REG_OPS);
+        size_t in_slice = as.jump_if (CC_S);
+        as.load64 (RAX, REG_THREAD, CONTEXT (instructions));
+        as.add64 (RAX, address);
+        as.store64 (REG_THREAD, CONTEXT (ip), RAX);
+        as.jump_to (exit);
+        as.patch (in_slice, as.position ());
+}
+
+/**
+ * Jump to the instruction at target, bound now or once the function is done
+ */
+void Jit::emit_jump (enum cond cc, bool conditional, int32_t target)
+{
+        size_t at = conditional ? this->as.jump_if (cc) : this->as.jump ();
+
+        this->fixups.push_back (std::make_pair (at, target));
+}
+
+void Jit::emit_instruction (struct jit_function *function, int32_t address, size_t exit,
+                            std::vector<std::pair<size_t, int32_t> > &calls)
+{
+        Assembler &as = this->as;
+        int32_t args[MAX_OPERANDS], next;
+        enum OpCode op;
+
+        this->fetch (address, &op, args, &next);
+        this->pending_ops++;
+
+        if (is_binary (op)) {
+                this->emit_binary (op);
+                return;
+        }
+
+        switch (op) {
+        case OPNEG: as.mem (false, 0xf7, 3, REG_SP, -4); break;
+        case OPNOT:
+                as.mov_imm (RAX, 1);
+                as.mem (false, 0x2b, RAX, REG_SP, -4);
+                as.store (REG_SP, -4, RAX);
+                break;
+        case OPJMP:
+                this->flush_ops ();
+                this->emit_jump (CC_E, false, args[0]);
+                break;
+        case OPJMPFALSE:
+                this->flush_ops ();
+                as.load (RAX, REG_SP, -4);
+                as.lea (REG_SP, REG_SP, -4);
+                as.regs (false, 0x85, RAX, RAX);
+                this->emit_jump (CC_E, true, args[0]);
+                break;
+        case OPSTORE: this->emit_store (args[0]); break;
+        case OPLOAD:
+                as.load (RAX, REG_BP, args[0] * 4);
+                as.store (REG_SP, 0, RAX);
+                as.add64 (REG_SP, 4);
+                break;
+        case OPDUP:
+                as.load (RAX, REG_SP, -4);
+                as.store (REG_SP, 0, RAX);
+                as.add64 (REG_SP, 4);
+                break;
+        case OPINC:
+                as.mem (false, 0x81, 0, REG_BP, args[0] * 4);
+                as.emit32 (args[1]);
+                break;
+        case OPADDTO:
+        case OPSUBTO:
+                as.load (RAX, REG_SP, -4);
+                as.sub64 (REG_SP, 4);
+                as.mem (false, op == OPADDTO ? 0x01 : 0x29, RAX, REG_BP, args[0] * 4);
+                break;
+        case OPMULTTO:
+                as.load (RAX, REG_SP, -4);
+                as.sub64 (REG_SP, 4);
+                as.mem (false, 0x0faf, RAX, REG_BP, args[0] * 4);
+                as.store (REG_BP, args[0] * 4, RAX);
+                break;
+        case OPPUSH:
+                as.store_imm (REG_SP, 0, args[0]);
+                as.add64 (REG_SP, 4);
+                break;
+        case OPPOP: as.sub64 (REG_SP, 4); break;
+        case OPPRINT:
+                as.load (RDI, REG_SP, -4);
+                as.sub64 (REG_SP, 4);
+                this->emit_call_helper ((void *)jit_print);
+                break;
+        case OPCALL: {
+                int32_t callee = args[0];
+                int32_t frame_size = this->vm->frame_sizes[callee];
+
+                as.store_imm (REG_SP, 0, next);
+                as.add64 (REG_SP, 4);
+
+                /* the frame array only has to grow when the call goes deeper than any before */
+                as.load (RAX, REG_THREAD, CONTEXT (frame_no));
+                as.mem (false, 0x3b, RAX, REG_THREAD, CONTEXT (frame_high));
+                size_t frames_ok = as.jump_if (CC_L);
+                as.mov64 (RDI, REG_VM);
+                as.mov64 (RSI, REG_THREAD);
+                this->emit_call_helper ((void *)VM::jit_grow_frames);
+                as.regs (false, 0x85, RAX, RAX);
+                as.jump_if_to (CC_E, exit);
+                as.patch (frames_ok, as.position ());
+
+                /* so does the stack when the callee frame reaches past the high-water mark */
+                as.lea (RAX, REG_SP, frame_size * 4);
+                as.mem (true, 0x3b, RAX, REG_THREAD, CONTEXT (stack_high));
+                size_t stack_ok = as.jump_if (CC_B);
+                as.store64 (REG_THREAD, CONTEXT (sp), REG_SP);
+                as.store64 (REG_THREAD, CONTEXT (bp), REG_BP);
+                as.mov64 (RDI, REG_VM);
+                as.mov64 (RSI, REG_THREAD);
+                as.mov_imm (RDX, frame_size);
+                this->emit_call_helper ((void *)VM::jit_grow_stack);
+                as.load64 (REG_SP, REG_THREAD, CONTEXT (sp));
+                as.load64 (REG_BP, REG_THREAD, CONTEXT (bp));
+                as.patch (stack_ok, as.position ());
+
+                as.movsxd (RAX, REG_THREAD, CONTEXT (frame_no));
+                as.load64 (RCX, REG_THREAD, CONTEXT (stack_frames));
+                as.mem_index (true, 0x89, REG_BP, RCX, RAX);
+                as.mem (false, 0xff, 0, REG_THREAD, CONTEXT (frame_no));
+                as.mov64 (REG_BP, REG_SP);
+                this->flush_ops ();
+
+                void *compiled = this->vm->runtime->jit_entries[callee].load ();
+
+                if (compiled) {
+                        this->emit_call_helper (compiled);
+                } else {
+                        calls.push_back (std::make_pair (as.call_rel (), callee));
+                }
+
+                as.regs (false, 0x85, RAX, RAX);
+                as.jump_if_to (CC_S, exit);
+                break;
+        }
+        case OPTAILCALL: {
+                int32_t callee = args[0];
+                int32_t count = args[1];
+                int32_t frame_size = this->vm->frame_sizes[callee];
+
+                /* the arguments replace the parameters, the frame and return address stay */
+                for (int32_t i = 0; i < count; i++) {
+                        as.load (RAX, REG_SP, (i - count) * 4);
+                        as.store (REG_BP, (i - count - 1) * 4, RAX);
+                }
+
+                as.mov64 (REG_SP, REG_BP);
+
+                as.lea (RAX, REG_SP, frame_size * 4);
+                as.mem (true, 0x3b, RAX, REG_THREAD, CONTEXT (stack_high));
+                size_t stack_ok = as.jump_if (CC_B);
+                as.store64 (REG_THREAD, CONTEXT (sp), REG_SP);
+                as.store64 (REG_THREAD, CONTEXT (bp), REG_BP);
+                as.mov64 (RDI, REG_VM);
+                as.mov64 (RSI, REG_THREAD);
+                as.mov_imm (RDX, frame_size);
+                this->emit_call_helper ((void *)VM::jit_grow_stack);
+                as.load64 (REG_SP, REG_THREAD, CONTEXT (sp));
+                as.load64 (REG_BP, REG_THREAD, CONTEXT (bp));
+                as.patch (stack_ok, as.position ());
+                this->flush_ops ();
+
+                /* the callee returns straight to our caller */
+                as.add64 (RSP, 8);
+
+                void *compiled = this->vm->runtime->jit_entries[callee].load ();
+
+                if (compiled) {
+                        as.mov_imm64 (RAX, (uint64_t)compiled);
+                        as.jump (RAX);
+                } else {
+                        calls.push_back (std::make_pair (as.jump (), callee));
+                }
+                break;
+        }
+        case OPRET:
+                this->flush_ops ();
+                as.load (RCX, REG_SP, -4);
+                as.load (RAX, REG_SP, -8);
+                as.store (REG_SP, -8, RCX);
+                as.sub64 (REG_SP, 4);
+                as.mem (false, 0xff, 1, REG_THREAD, CONTEXT (frame_no));
+                as.movsxd (RDX, REG_THREAD, CONTEXT (frame_no));
+                as.load64 (RCX, REG_THREAD, CONTEXT (stack_frames));
+                as.mem_index (true, 0x8b, REG_BP, RCX, RDX);
+                as.add64 (RSP, 8);
+                as.ret ();
+                break;
+
+        /* superinstructions, like the sequences they stand for */
+        case OPLOAD_PUSH_LT_JMPFALSE:
+                this->flush_ops ();
+                as.cmp_mem_imm (REG_BP, args[0] * 4, args[1]);
+                this->emit_jump (CC_GE, true, args[2]);
+                break;
+        case OPLOAD_PUSH_ADD:
+                as.load (RAX, REG_BP, args[0] * 4);
+                as.regs (false, 0x81, 0, RAX);
+                as.emit32 (args[1]);
+                as.store (REG_SP, 0, RAX);
+                as.add64 (REG_SP, 4);
+                break;
+        case OPLOAD_ADD_STORE:
+                as.load (RAX, REG_SP, -4);
+                as.mem (false, 0x03, RAX, REG_BP, args[0] * 4);
+                as.store (REG_SP, -4, RAX);
+                this->emit_store (args[1]);
+                break;
+        case OPLOAD_LOAD:
+                /* the second load may read the slot the first one pushes to */
+                as.load (RAX, REG_BP, args[0] * 4);
+                as.store (REG_SP, 0, RAX);
+                as.load (RCX, REG_BP, args[1] * 4);
+                as.store (REG_SP, 4, RCX);
+                as.add64 (REG_SP, 8);
+                break;
+        case OPSTORE_POP:
+                this->emit_store (args[0]);
+                as.sub64 (REG_SP, 4);
+                break;
+        case OPLT_JMPFALSE:
+                this->flush_ops ();
+                as.load (RAX, REG_SP, -8);
+                as.mem (false, 0x3b, RAX, REG_SP, -4);
+                as.lea (REG_SP, REG_SP, -8);
+                this->emit_jump (CC_GE, true, args[0]);
+                break;
+        case OPINC_JMP:
+                this->flush_ops ();
+                as.mem (false, 0x81, 0, REG_BP, args[0] * 4);
+                as.emit32 (args[1]);
+                this->emit_jump (CC_E, false, args[2]);
+                break;
+        default: break;
+        }
+}
+
+/**
+ * Replace the two topmost slots by a op b
+ */
+void Jit::emit_binary (enum OpCode op)
+{
+        Assembler &as = this->as;
+        int result = RAX;
+
+        as.load (RAX, REG_SP, -8);
+
+        switch (op) {
+        case OPADD: as.mem (false, 0x03, RAX, REG_SP, -4); break;
+        case OPSUB: as.mem (false, 0x2b, RAX, REG_SP, -4); break;
+        case OPMULT: as.mem (false, 0x0faf, RAX, REG_SP, -4); break;
+        case OPDIV:
+        case OPMOD:
+                as.emit8 (0x99);
+                as.mem (false, 0xf7, 7, REG_SP, -4);
+                result = op == OPMOD ? RDX : RAX;
+                break;
+        case OPAND:
+        case OPOR:
+                as.regs (false, 0x85, RAX, RAX);
+                as.setcc (CC_NE, RAX);
+                as.load (RCX, REG_SP, -4);
+                as.regs (false, 0x85, RCX, RCX);
+                as.setcc (CC_NE, RCX);
+                as.regs (false, op == OPAND ? 0x20 : 0x08, RCX, RAX);
+                as.movzx8 (RAX, RAX);
+                break;
+        default: {
+                enum cond cc = op == OPEQ ? CC_E : op == OPNEQ ? CC_NE : op == OPGT ? CC_G : op == OPLT ? CC_L
+                             : op == OPGTEQ ? CC_GE
+                                            : CC_LE;
+
+                as.mem (false, 0x3b, RAX, REG_SP, -4);
+                as.setcc (cc, RAX);
+                as.movzx8 (RAX, RAX);
+                break;
+        }
+        }
+
+        as.store (REG_SP, -8, result);
+        as.sub64 (REG_SP, 4);
+}
+
+/**
+ * Pop into slot, moving sp past it when the slot lies above the stack top
+ */
+void Jit::emit_store (int32_t slot)
+{
+        Assembler &as = this->as;
+
+        as.load (RAX, REG_SP, -4);
+        as.sub64 (REG_SP, 4);
+        as.store (REG_BP, slot * 4, RAX);
+        as.lea (RCX, REG_BP, slot * 4 + 4);
+        as.regs (true, 0x3b, RCX, REG_SP);
+        as.cmov64 (CC_A, REG_SP, RCX);
+}
+
+/**
+ * Call a C++ function or compiled code at an absolute address. The stack is
+ * 16 byte aligned inside every function, as the ABI wants it at calls.
+ */
+void Jit::emit_call_helper (void *helper)
+{
+        this->as.mov_imm64 (RAX, (uint64_t)helper);
+        this->as.call (RAX);
+}
+
+/**
+ * Add the instructions translated since the last control transfer to the
+ * count of executed ones
+ */
+void Jit::flush_ops ()
+{
+        if (this->pending_ops == 0)
+                return;
+
+        this->as.add64 (REG_OPS, this->pending_ops);
+        this->pending_ops = 0;
+}
+
+/**
+ * Copy the generated code into a mapping of its own and make it executable.
+ * Mappings are never written again and live until the program is unloaded.
+ */
+void *Jit::install ()
+{
+        size_t length = this->as.code.size ();
+        void *segment = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (segment == MAP_FAILED) {
+                perror ("mmap");
+                exit (EXIT_FAILURE);
+        }
+
+        memcpy (segment, this->as.code.data (), length);
+
+        if (mprotect (segment, length, PROT_READ | PROT_EXEC) != 0) {
+                perror ("mprotect");
+                exit (EXIT_FAILURE);
+        }
+
+        this->vm->runtime->jit_segments.push_back (std::make_pair (segment, length));
+
+        return segment;
+}
@@ -0,0 +1,67 @@
+#ifndef jit_h
+#define jit_h
+
+#include "assembler.h"
+#include "bytecode.h"
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+class VM;
+
+/* what a function needs to be translated, collected by scanning it from its entry */
+struct jit_function {
+        int32_t entry;
+        /* addresses of its reachable instructions in ascending order */
+        std::vector<int32_t> addresses;
+        /* jump targets, and those of them a backward jump reaches */
+        std::map<int32_t, size_t> labels;
+        std::map<int32_t, bool> loop_headers;
+        /* offset of its machine code in the batch */
+        size_t native_entry;
+};
+
+/**
+ * Baseline template JIT for the stack instruction set. A hot function is
+ * translated together with every function it can call that is not compiled
+ * yet; a batch with an instruction that needs the scheduler (fork, kill,
+ * yield, halt, channels) is rejected and stays interpreted.
+ *
+ * The machine code works on the interpreter's own thread state: rbx holds sp,
+ * r12 bp, r13 the context and r14 the VM. Calls push the return address and
+ * frame like OPCALL does, so a function can return into the interpreter or
+ * into machine code alike.
+ */
+class Jit {
+    public:
+        Jit (VM *vm);
+        void *compile (int32_t entry);
+
+    private:
+        VM *vm;
+        int8_t *code;
+        Assembler as;
+        std::map<int32_t, struct jit_function> batch;
+
+        bool scan (int32_t entry);
+        void fetch (int32_t address, enum OpCode *op, int32_t *args, int32_t *next);
+        void emit_trampoline ();
+        void emit_function (struct jit_function *function, std::vector<std::pair<size_t, int32_t> > &calls);
+        void emit_instruction (struct jit_function *function, int32_t address, size_t exit,
+                               std::vector<std::pair<size_t, int32_t> > &calls);
+        void emit_jump (enum cond cc, bool conditional, int32_t target);
+        void emit_preempt (int32_t address, size_t exit);
+        void emit_binary (enum OpCode op);
+        void emit_store (int32_t slot);
+        void emit_call_helper (void *helper);
+        void flush_ops ();
+        void *install ();
+
+        /* instructions translated since the count in r15 was last brought up to date */
+        int32_t pending_ops;
+
+        /* jumps of the current function to patch once its labels are bound */
+        std::vector<std::pair<size_t, int32_t> > fixups;
+};
+
+#endif
@@ -0,0 +1,478 @@
+#include "bytecode.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <vector>
+
+struct flow_instruction {
+        enum OpCode op;
+        int32_t args[MAX_OPERANDS];
+
+        /* address in the function before the pass and the line it was compiled from */
+        int32_t address;
+        int32_t line;
+
+        /* where a jump leads: a block while laying out, an instruction after */
+        int32_t target;
+        bool removed;
+};
+
+struct basic_block {
+        size_t first;
+        size_t end;
+
+        /* block the jump that ends this one leads to, -1 if it does not end in one */
+        int32_t target;
+        bool falls_through;
+        bool reachable;
+        bool placed;
+};
+
+static bool is_jump (enum OpCode op)
+{
+        return op == OPJMP || op == OPJMPFALSE;
+}
+
+/**
+ * The comparison that yields 1 exactly where op yields 0, OPCODE_COUNT if op
+ * is not a comparison
+ */
+static enum OpCode inverse_comparison (enum OpCode op)
+{
+        switch (op) {
+        case OPEQ: return OPNEQ;
+        case OPNEQ: return OPEQ;
+        case OPLT: return OPGTEQ;
+        case OPGTEQ: return OPLT;
+        case OPGT: return OPLTEQ;
+        case OPLTEQ: return OPGT;
+        default: return OPCODE_COUNT;
+        }
+}
+
+/**
+ * The first instruction at or after i that is still there, code.size () if
+ * there is none
+ */
+static size_t live (std::vector<struct flow_instruction> &code, size_t i)
+{
+        while (i < code.size () && code[i].removed)
+                i++;
+
+        return i;
+}
+
+/**
+ * The last instruction before i that is still there, code.size () if there is
+ * none
+ */
+static size_t live_before (std::vector<struct flow_instruction> &code, size_t i)
+{
+        while (i > 0) {
+                if (!code[--i].removed)
+                        return i;
+        }
+
+        return code.size ();
+}
+
+/**
+ * Whether the block ends in an unconditional jump
+ */
+static bool jumps_away (struct basic_block &block)
+{
+        return block.target != -1 && !block.falls_through;
+}
+
+/**
+ * Whether nothing but a single instruction op is left in the block
+ */
+static bool holds_only (std::vector<struct flow_instruction> &code, struct basic_block &block, enum OpCode op)
+{
+        for (size_t i = block.first; i + 1 < block.end; i++) {
+                if (!code[i].removed)
+                        return false;
+        }
+
+        return !code[block.end - 1].removed && code[block.end - 1].op == op;
+}
+
+/**
+ * The constant pushed right before the last instruction of the block, if
+ * there is one in it. Returns its index or -1.
+ */
+static int32_t constant_before_last (std::vector<struct flow_instruction> &code, struct basic_block &block)
+{
+        if (block.end - block.first < 2 || code[block.end - 2].removed || code[block.end - 2].op != OPPUSH)
+                return -1;
+
+        return block.end - 2;
+}
+
+/**
+ * Send the paths that push a constant only for a branch to test straight to
+ * where the branch leads. These are the 1 and 0 that && and || leave on the
+ * stack when their value is the condition of an if or a loop:
+ *
+ *     PUSH 1; JMP a; ... a: JMPFALSE b; c:    becomes    JMP c
+ *     PUSH 0; a: JMPFALSE b                   becomes    JMP b; a: JMPFALSE b
+ *     PUSH 0; JMPFALSE b                      becomes    JMP b
+ */
+static void decide_constant_branches (std::vector<struct flow_instruction> &code,
+                                      std::vector<struct basic_block> &blocks, struct jump_stats *stats)
+{
+        for (size_t b = 0; b < blocks.size (); b++) {
+                struct basic_block &block = blocks[b];
+                struct flow_instruction &last = code[block.end - 1];
+                int32_t constant = constant_before_last (code, block);
+
+                /* PUSH k; JMPFALSE */
+                if (last.op == OPJMPFALSE && constant != -1) {
+                        code[constant].removed = true;
+
+                        if (code[constant].args[0] == 0) {
+                                last.op = OPJMP;
+                                block.falls_through = false;
+                        } else {
+                                last.removed = true;
+                                block.target = -1;
+                        }
+
+                        stats->decided++;
+                        continue;
+                }
+
+                /* PUSH k going on to a block that does nothing but test it */
+                size_t test;
+
+                if (!last.removed && last.op == OPPUSH && block.falls_through) {
+                        test = b + 1;
+                        constant = block.end - 1;
+                } else if (jumps_away (block) && constant != -1) {
+                        test = block.target;
+                } else {
+                        continue;
+                }
+
+                if (test + 1 >= blocks.size () || !holds_only (code, blocks[test], OPJMPFALSE))
+                        continue;
+
+                int32_t target = code[constant].args[0] ? test + 1 : blocks[test].target;
+
+                if (constant == (int32_t)block.end - 1) {
+                        last.op = OPJMP;
+                        block.falls_through = false;
+                } else {
+                        code[constant].removed = true;
+                }
+
+                block.target = target;
+                stats->decided++;
+        }
+}
+
+/**
+ * Place the chain of blocks that starts at b, each of which falls through
+ * into the next. Returns the last one.
+ */
+static size_t place_chain (std::vector<struct basic_block> &blocks, std::vector<bool> &chain_start, size_t b,
+                           std::vector<size_t> &order)
+{
+        while (true) {
+                blocks[b].placed = true;
+                order.push_back (b);
+
+                if (b + 1 == blocks.size () || chain_start[b + 1])
+                        return b;
+
+                b++;
+        }
+}
+
+/**
+ * Remove the jumps a block layout leaves to the next instruction and merge a
+ * branch over a jump into a single branch by inverting the comparison that
+ * feeds it:
+ *
+ *     LT; JMPFALSE a; JMP b; a:    becomes    GTEQ; JMPFALSE b; a:
+ */
+static void clean_jumps (std::vector<struct flow_instruction> &code, struct jump_stats *stats)
+{
+        std::vector<bool> labels (code.size () + 1, false);
+        bool changed = true;
+
+        for (struct flow_instruction &i : code) {
+                if (is_jump (i.op))
+                        labels[i.target] = true;
+        }
+
+        while (changed) {
+                changed = false;
+
+                for (size_t i = live (code, 0); i < code.size (); i = live (code, i + 1)) {
+                        struct flow_instruction *jump = &code[i];
+
+                        if (!is_jump (jump->op))
+                                continue;
+
+                        size_t next = live (code, i + 1);
+
+                        jump->target = live (code, jump->target);
+
+                        if (jump->target == (int32_t)next) {
+                                /* both ways lead to the next instruction, the condition is only dropped */
+                                if (jump->op == OPJMPFALSE)
+                                        jump->op = OPPOP;
+                                else
+                                        jump->removed = true;
+
+                                labels[next] = labels[next] || labels[i];
+                                stats->removed++;
+                                changed = true;
+                                continue;
+                        }
+
+                        if (jump->op != OPJMPFALSE || labels[i] || next == code.size ())
+                                continue;
+
+                        struct flow_instruction *over = &code[next];
+                        size_t comparison = live_before (code, i);
+
+                        if (over->op != OPJMP || labels[next] || jump->target != (int32_t)live (code, next + 1) ||
+                            comparison == code.size () || inverse_comparison (code[comparison].op) == OPCODE_COUNT)
+                                continue;
+
+                        code[comparison].op = inverse_comparison (code[comparison].op);
+                        jump->target = live (code, over->target);
+                        over->removed = true;
+                        stats->inverted++;
+                        changed = true;
+                }
+        }
+}
+
+/**
+ * Build the control flow graph of a single function before it is linked and
+ * lay its blocks out again: jumps to a jump go straight to where that one
+ * leads, branches on a constant are decided, a block reached by an unconditional jump is placed right after it
+ * when nothing else falls into it, and code no path reaches is dropped. A for
+ * loop then runs its condition, body and update in a row and takes a single
+ * jump back per iteration. Only JMP and JMPFALSE hold addresses at this point,
+ * so relocating them keeps the code correct through set_address_offset and
+ * link. The code is left alone if a jump leads outside of it.
+ */
+void Bytecode::thread_jumps (struct jump_stats *stats)
+{
+        std::vector<struct flow_instruction> code;
+        std::vector<int32_t> index (this->count + 1, -1);
+        struct flow_instruction instruction = {};
+        size_t c = 0;
+        size_t address = c;
+        size_t line = 0;
+
+        while (this->instruction_at (&c, &instruction.op, instruction.args)) {
+                while (line < this->lines.size () && (size_t)this->lines[line].address <= address)
+                        line++;
+
+                instruction.address = address;
+                instruction.line = line > 0 ? this->lines[line - 1].line : -1;
+                index[address] = code.size ();
+                code.push_back (instruction);
+                address = c;
+        }
+
+        if (code.empty ())
+                return;
+
+        std::vector<bool> leaders (code.size () + 1, false);
+
+        leaders[0] = true;
+
+        for (size_t i = 0; i < code.size (); i++) {
+                if (is_jump (code[i].op)) {
+                        int32_t target = code[i].args[0];
+
+                        if (target < 0 || (size_t)target >= this->count || index[target] == -1)
+                                return;
+
+                        code[i].target = index[target];
+                        leaders[index[target]] = true;
+                }
+
+                if (Bytecode::ends_path (code[i].op) || is_jump (code[i].op))
+                        leaders[i + 1] = true;
+        }
+
+        std::vector<struct basic_block> blocks;
+        std::vector<int32_t> block_of (code.size ());
+
+        for (size_t i = 0; i < code.size (); i++) {
+                if (leaders[i])
+                        blocks.push_back ({ i, i, -1, false, false, false });
+
+                blocks.back ().end = i + 1;
+                block_of[i] = blocks.size () - 1;
+        }
+
+        for (struct basic_block &block : blocks) {
+                struct flow_instruction &last = code[block.end - 1];
+
+                if (is_jump (last.op))
+                        block.target = block_of[last.target];
+
+                block.falls_through = !Bytecode::ends_path (last.op);
+        }
+
+        decide_constant_branches (code, blocks, stats);
+
+        /* thread jumps through blocks that hold nothing but a jump, loops of them are left alone */
+        for (struct basic_block &block : blocks) {
+                if (block.target == -1)
+                        continue;
+
+                int32_t target = block.target;
+                size_t steps = 0;
+
+                while (steps < blocks.size () && holds_only (code, blocks[target], OPJMP)) {
+                        target = blocks[target].target;
+                        steps++;
+                }
+
+                if (steps > 0 && steps < blocks.size ()) {
+                        block.target = target;
+                        stats->threaded++;
+                }
+        }
+
+        std::vector<size_t> pending (1, 0);
+
+        while (!pending.empty ()) {
+                size_t b = pending.back ();
+
+                pending.pop_back ();
+
+                if (blocks[b].reachable)
+                        continue;
+
+                blocks[b].reachable = true;
+
+                if (blocks[b].target != -1)
+                        pending.push_back (blocks[b].target);
+
+                if (blocks[b].falls_through && b + 1 < blocks.size ())
+                        pending.push_back (b + 1);
+        }
+
+        /* chains of blocks that fall through into each other have to stay together */
+        std::vector<bool> chain_start (blocks.size (), false);
+        std::vector<bool> chain_reachable (blocks.size (), false);
+
+        for (size_t b = 0, start = 0; b < blocks.size (); b++) {
+                if (b == 0 || !blocks[b - 1].falls_through || !blocks[b - 1].reachable)
+                        start = b;
+
+                chain_start[b] = start == b;
+                chain_reachable[start] = chain_reachable[start] || blocks[b].reachable;
+        }
+
+        std::vector<size_t> order;
+        size_t next = 0;
+        size_t b = 0;
+
+        while (true) {
+                size_t last = place_chain (blocks, chain_start, b, order);
+                int32_t target = jumps_away (blocks[last]) ? blocks[last].target : -1;
+
+                if (target != -1 && chain_start[target] && !blocks[target].placed && blocks[target].reachable) {
+                        if ((size_t)target != last + 1)
+                                stats->moved++;
+
+                        b = target;
+                        continue;
+                }
+
+                while (next < blocks.size () && (blocks[next].placed || !chain_start[next] || !chain_reachable[next]))
+                        next++;
+
+                if (next == blocks.size ())
+                        break;
+
+                b = next;
+        }
+
+        std::vector<struct flow_instruction> laid_out;
+        std::vector<int32_t> block_start (blocks.size (), -1);
+
+        for (size_t b : order) {
+                block_start[b] = laid_out.size ();
+                laid_out.insert (laid_out.end (), code.begin () + blocks[b].first, code.begin () + blocks[b].end);
+        }
+
+        stats->unreachable += code.size () - laid_out.size ();
+
+        for (size_t b : order) {
+                if (blocks[b].target != -1)
+                        laid_out[block_start[b] + blocks[b].end - blocks[b].first - 1].target =
+                                block_start[blocks[b].target];
+        }
+
+        clean_jumps (laid_out, stats);
+
+        /* an instruction that was removed leads to the one after it */
+        std::vector<int32_t> new_address (this->count + 1, -1);
+        std::vector<int32_t> address_of (laid_out.size () + 1);
+        size_t size = 0;
+
+        for (size_t i = 0; i < laid_out.size (); i++) {
+                address_of[i] = size;
+
+                if (!laid_out[i].removed)
+                        size += 1 + Bytecode::operand_count (laid_out[i].op) * sizeof (int32_t);
+        }
+
+        address_of[laid_out.size ()] = size;
+
+        for (size_t i = 0; i < laid_out.size (); i++)
+                new_address[laid_out[i].address] = address_of[i];
+
+        for (struct function_symbol &symbol : this->symbols) {
+                if (symbol.address >= 0 && (size_t)symbol.address < new_address.size () &&
+                    new_address[symbol.address] != -1)
+                        symbol.address = new_address[symbol.address];
+        }
+
+        /* blocks moved, so the lines are built again from the instructions in their new order */
+        this->lines.clear ();
+
+        for (size_t i = 0; i < laid_out.size (); i++) {
+                int32_t line = laid_out[i].line;
+
+                if (laid_out[i].removed || line == -1 || (!this->lines.empty () && this->lines.back ().line == line))
+                        continue;
+
+                this->lines.push_back ({ address_of[i], line });
+        }
+
+        /* the laid out code is never larger, so it is written over the old one */
+        this->count = 0;
+
+        for (struct flow_instruction &i : laid_out) {
+                if (i.removed)
+                        continue;
+
+                if (is_jump (i.op))
+                        i.args[0] = address_of[i.target];
+
+                this->write_int8 (i.op);
+
+                for (int j = 0; j < Bytecode::operand_count (i.op); j++)
+                        this->write_int32 (i.args[j]);
+        }
+}
+
+void Bytecode::print_jump_stats (FILE *fp, struct jump_stats *stats)
+{
+        fprintf (fp,
+                 "Jumps: %" PRIu64 " threaded, %" PRIu64 " removed, %" PRIu64 " branches inverted, %" PRIu64
+                 " branches decided, %" PRIu64 " blocks moved, %" PRIu64 " unreachable instructions\n",
+                 stats->threaded, stats->removed, stats->inverted, stats->decided, stats->moved, stats->unreachable);
+}
@@ -0,0 +1,173 @@
+#include "compiler.h"
+#include <inttypes.h>
+#include <map>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/**
+ * The functions f calls, one per call site in the order of its code
+ */
+std::vector<Function *> Compiler::callees (Function *f)
+{
+        std::vector<Function *> out;
+        int32_t args[MAX_OPERANDS];
+        enum OpCode op;
+        size_t c = 0;
+
+        while (f->bytecode->instruction_at (&c, &op, args)) {
+                if (op != OPCALL && op != OPTAILCALL)
+                        continue;
+
+                auto name = this->call_placeholders.find (args[0]);
+
+                if (name == this->call_placeholders.end ())
+                        continue;
+
+                auto callee = this->symbol_to_function.find (name->second);
+
+                if (callee != this->symbol_to_function.end ())
+                        out.push_back (callee->second);
+        }
+
+        return out;
+}
+
+/**
+ * The code of f with the placeholders of its calls cleared, so two functions
+ * calling the same functions compare equal
+ */
+static std::string masked_code (Function *f)
+{
+        std::string code ((char *)f->bytecode->chunk, f->bytecode->count);
+        int32_t args[MAX_OPERANDS];
+        enum OpCode op;
+        size_t c = 0;
+
+        while (f->bytecode->instruction_at (&c, &op, args)) {
+                if (op == OPCALL || op == OPTAILCALL) {
+                        size_t operand = c - Bytecode::operand_count (op) * sizeof (int32_t);
+
+                        memset (&code[operand], 0, sizeof (int32_t));
+                }
+        }
+
+        return code;
+}
+
+/**
+ * Pick the functions to import into the image. Only functions a chain of
+ * calls from the script reaches are kept, in the order the calls first reach
+ * them, so callers sit close to their callees. Functions with the same code
+ * and arity that call equal functions at every call site are folded into the
+ * first of them: folded maps each of those to the one that is imported.
+ */
+std::vector<Function *> Compiler::select_functions (std::unordered_map<Function *, Function *> &folded)
+{
+        std::unordered_map<Function *, std::vector<Function *>> calls;
+        std::vector<Function *> reached;
+        std::vector<Function *> stack (1, this->function);
+        std::unordered_map<Function *, bool> seen;
+
+        seen[this->function] = true;
+
+        while (!stack.empty ()) {
+                Function *f = stack.back ();
+
+                stack.pop_back ();
+                calls[f] = this->callees (f);
+
+                if (f != this->function)
+                        reached.push_back (f);
+
+                for (auto callee = calls[f].rbegin (); callee != calls[f].rend (); callee++) {
+                        if (!seen[*callee]) {
+                                seen[*callee] = true;
+                                stack.push_back (*callee);
+                        }
+                }
+        }
+
+        for (Function *f : this->functions) {
+                this->link_stats.bytes_before += f->bytecode->count;
+
+                if (!seen[f])
+                        this->link_stats.stripped.push_back (std::string (f->name, f->len));
+        }
+
+        std::unordered_map<Function *, int32_t> class_of;
+        std::map<std::pair<int, std::string>, int32_t> by_code;
+
+        for (Function *f : reached) {
+                auto key = std::make_pair (f->arity, masked_code (f));
+                auto found = by_code.find (key);
+
+                if (found == by_code.end ())
+                        found = by_code.insert ({ key, by_code.size () }).first;
+
+                class_of[f] = found->second;
+        }
+
+        /* a class only ever splits, so it is stable once the number of classes stays the same */
+        size_t classes = by_code.size ();
+
+        while (true) {
+                std::map<std::vector<int32_t>, int32_t> by_calls;
+                std::unordered_map<Function *, int32_t> refined;
+
+                for (Function *f : reached) {
+                        std::vector<int32_t> key (1, class_of[f]);
+
+                        for (Function *callee : calls[f])
+                                key.push_back (class_of[callee]);
+
+                        auto found = by_calls.find (key);
+
+                        if (found == by_calls.end ())
+                                found = by_calls.insert ({ key, by_calls.size () }).first;
+
+                        refined[f] = found->second;
+                }
+
+                class_of.swap (refined);
+
+                if (by_calls.size () == classes)
+                        break;
+
+                classes = by_calls.size ();
+        }
+
+        std::unordered_map<int32_t, Function *> first_of;
+        std::vector<Function *> imported;
+
+        for (Function *f : reached) {
+                auto first = first_of.find (class_of[f]);
+
+                if (first != first_of.end ()) {
+                        folded[f] = first->second;
+                        this->link_stats.folded.push_back ({ std::string (f->name, f->len),
+                                                             std::string (first->second->name, first->second->len) });
+                        continue;
+                }
+
+                first_of[class_of[f]] = f;
+                imported.push_back (f);
+                this->link_stats.bytes_after += f->bytecode->count;
+        }
+
+        return imported;
+}
+
+void Compiler::print_link_stats (FILE *fp, struct link_stats *stats)
+{
+        fprintf (fp,
+                 "Link: %zu functions stripped, %zu folded, %" PRIu64 " bytes of function code before, %" PRIu64
+                 " after\n",
+                 stats->stripped.size (), stats->folded.size (), stats->bytes_before, stats->bytes_after);
+
+        for (std::string &name : stats->stripped)
+                fprintf (fp, "  stripped %s\n", name.c_str ());
+
+        for (auto &folded : stats->folded)
+                fprintf (fp, "  folded %s into %s\n", folded.first.c_str (), folded.second.c_str ());
+}
@@ -0,0 +1,225 @@
+#include "vm.h"
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+/* rows of each table printed at exit, the JSON file has all of them */
+#define OPSTATS_TOP 20
+
+/**
+ * Count the instruction at ip for the current thread, then execute it. Only
+ * the switch engine calls this, in place of execute_instruction.
+ */
+bool VM::count_instruction ()
+{
+        struct context *thread = this->thread;
+        int8_t *ip = thread->ip;
+
+        if (ip >= thread->instructions && ip < thread->instructions + this->code_size &&
+            (uint8_t)*ip < OPCODE_COUNT) {
+                struct op_stats *stats = thread->stats;
+                int32_t op = (uint8_t)*ip;
+
+                if (!stats) {
+                        stats = thread->stats = new struct op_stats ();
+                        stats->last[0] = -1;
+                        stats->last[1] = -1;
+                }
+
+                stats->ops[op]++;
+
+                if (stats->last[0] != -1)
+                        stats->pairs[stats->last[0] * OPCODE_COUNT + op]++;
+
+                if (this->opstats_triples && stats->last[1] != -1)
+                        stats->triples[(stats->last[1] * OPCODE_COUNT + stats->last[0]) * OPCODE_COUNT + op]++;
+
+                stats->last[1] = stats->last[0];
+                stats->last[0] = op;
+        }
+
+        return this->execute_instruction ();
+}
+
+/**
+ * The entries of a pair or triple table, most frequent first
+ */
+static std::vector<std::pair<uint32_t, uint64_t> > by_count (std::unordered_map<uint32_t, uint64_t> &table)
+{
+        std::vector<std::pair<uint32_t, uint64_t> > entries (table.begin (), table.end ());
+
+        std::sort (entries.begin (), entries.end (),
+                   [] (const std::pair<uint32_t, uint64_t> &a, const std::pair<uint32_t, uint64_t> &b) {
+                           return a.second != b.second ? a.second > b.second : a.first < b.first;
+                   });
+
+        return entries;
+}
+
+/**
+ * Decode a pair or triple key of length opcodes into ops
+ */
+static void decode_key (uint32_t key, int length, enum OpCode *ops)
+{
+        for (int i = length - 1; i >= 0; i--) {
+                ops[i] = (enum OpCode)(key % OPCODE_COUNT);
+                key /= OPCODE_COUNT;
+        }
+}
+
+static void print_table (std::unordered_map<uint32_t, uint64_t> &table, int length, uint64_t total)
+{
+        std::vector<std::pair<uint32_t, uint64_t> > entries = by_count (table);
+
+        for (size_t i = 0; i < entries.size () && i < OPSTATS_TOP; i++) {
+                enum OpCode ops[3];
+                char name[128] = "";
+
+                decode_key (entries[i].first, length, ops);
+
+                for (int k = 0; k < length; k++)
+                        snprintf (name + strlen (name), sizeof (name) - strlen (name), "%s%s", k ? " " : "",
+                                  Bytecode::get_op_name (ops[k]));
+
+                fprintf (stderr, "  %-44s %14lu %6.2f%%\n", name, entries[i].second,
+                         total ? 100.0 * entries[i].second / total : 0.0);
+        }
+}
+
+static void write_ops_json (FILE *fp, uint64_t *ops)
+{
+        bool first = true;
+
+        fprintf (fp, "{");
+
+        for (int op = 0; op < OPCODE_COUNT; op++) {
+                if (!ops[op])
+                        continue;
+
+                fprintf (fp, "%s\"%s\": %lu", first ? "" : ", ", Bytecode::get_op_name ((enum OpCode)op), ops[op]);
+                first = false;
+        }
+
+        fprintf (fp, "}");
+}
+
+static void write_table_json (FILE *fp, std::unordered_map<uint32_t, uint64_t> &table, int length)
+{
+        std::vector<std::pair<uint32_t, uint64_t> > entries = by_count (table);
+
+        fprintf (fp, "[");
+
+        for (size_t i = 0; i < entries.size (); i++) {
+                enum OpCode ops[3];
+
+                decode_key (entries[i].first, length, ops);
+                fprintf (fp, "%s{\"ops\": [", i ? ", " : "");
+
+                for (int k = 0; k < length; k++)
+                        fprintf (fp, "%s\"%s\"", k ? ", " : "", Bytecode::get_op_name (ops[k]));
+
+                fprintf (fp, "], \"count\": %lu}", entries[i].second);
+        }
+
+        fprintf (fp, "]");
+}
+
+/**
+ * Write the statistics of every released thread and their sum to the opstats
+ * file as JSON and print the most frequent opcodes, pairs and triples
+ */
+void VM::write_op_stats ()
+{
+        std::vector<std::pair<int32_t, struct op_stats *> > &threads = this->runtime->op_stats;
+        struct op_stats *all = new struct op_stats ();
+        uint64_t total = 0;
+
+        std::stable_sort (threads.begin (), threads.end (),
+                          [] (const std::pair<int32_t, struct op_stats *> &a,
+                              const std::pair<int32_t, struct op_stats *> &b) { return a.first < b.first; });
+
+        for (auto &thread : threads) {
+                for (int op = 0; op < OPCODE_COUNT; op++) {
+                        all->ops[op] += thread.second->ops[op];
+                        total += thread.second->ops[op];
+                }
+
+                for (auto &pair : thread.second->pairs)
+                        all->pairs[pair.first] += pair.second;
+
+                for (auto &triple : thread.second->triples)
+                        all->triples[triple.first] += triple.second;
+        }
+
+        fprintf (stderr, "Opcode statistics: %lu instructions in %zu threads\n", total, threads.size ());
+
+        std::vector<int> order;
+
+        for (int op = 0; op < OPCODE_COUNT; op++) {
+                if (all->ops[op])
+                        order.push_back (op);
+        }
+
+        std::sort (order.begin (), order.end (), [all] (int a, int b) { return all->ops[a] > all->ops[b]; });
+
+        for (int op : order)
+                fprintf (stderr, "  %-44s %14lu %6.2f%%\n", Bytecode::get_op_name ((enum OpCode)op), all->ops[op],
+                         100.0 * all->ops[op] / total);
+
+        fprintf (stderr, "Opcode pairs:\n");
+        print_table (all->pairs, 2, total);
+
+        if (this->opstats_triples) {
+                fprintf (stderr, "Opcode triples:\n");
+                print_table (all->triples, 3, total);
+        }
+
+        FILE *fp = fopen (this->opstats, "w");
+
+        if (!fp) {
+                perror ("fopen");
+                exit (EXIT_FAILURE);
+        }
+
+        fprintf (fp, "{\n  \"total\": %lu,\n  \"opcodes\": ", total);
+        write_ops_json (fp, all->ops);
+        fprintf (fp, ",\n  \"pairs\": ");
+        write_table_json (fp, all->pairs, 2);
+
+        if (this->opstats_triples) {
+                fprintf (fp, ",\n  \"triples\": ");
+                write_table_json (fp, all->triples, 3);
+        }
+
+        fprintf (fp, ",\n  \"threads\": [");
+
+        for (size_t i = 0; i < threads.size (); i++) {
+                struct op_stats *stats = threads[i].second;
+                uint64_t count = 0;
+
+                for (int op = 0; op < OPCODE_COUNT; op++)
+                        count += stats->ops[op];
+
+                fprintf (fp, "%s\n    {\"id\": %d, \"total\": %lu, \"opcodes\": ", i ? "," : "", threads[i].first, count);
+                write_ops_json (fp, stats->ops);
+                fprintf (fp, ", \"pairs\": ");
+                write_table_json (fp, stats->pairs, 2);
+
+                if (this->opstats_triples) {
+                        fprintf (fp, ", \"triples\": ");
+                        write_table_json (fp, stats->triples, 3);
+                }
+
+                fprintf (fp, "}");
+                delete stats;
+        }
+
+        fprintf (fp, "\n  ]\n}\n");
+        fclose (fp);
+
+        threads.clear ();
+        delete all;
+}
@@ -0,0 +1,343 @@
+#include "bytecode.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <vector>
+
+struct peephole_instruction {
+        enum OpCode op;
+        int32_t args[MAX_OPERANDS];
+        bool label;
+
+        /* addresses in the function before the pass that now lead here */
+        std::vector<int32_t> origins;
+};
+
+static const char *rule_names[PEEPHOLE_RULE_COUNT] = {
+        "PUSH POP",
+        "LOAD x STORE x",
+        "NEG ADD",
+        "LOAD NEG LOAD ADD",
+        "EQ NOT",
+        "LOAD x PUSH ADD STORE x",
+        "LOAD x OP STORE x",
+        "NEG LOAD x ADD STORE x",
+        "STORE x LOAD x",
+};
+
+/**
+ * Whether length instructions start at i and nothing jumps into them past the
+ * first one
+ */
+static bool window (std::vector<struct peephole_instruction> &code, size_t i, size_t length)
+{
+        if (i + length > code.size ())
+                return false;
+
+        for (size_t k = 1; k < length; k++) {
+                if (code[i + k].label)
+                        return false;
+        }
+
+        return true;
+}
+
+/**
+ * Whether op is a call or a built-in with a result. A local declared from it
+ * is stored into the slot the result already occupies.
+ */
+static bool leaves_result (enum OpCode op)
+{
+        switch (op) {
+        case OPCALL:
+        case OPFORK:
+        case OPKILL:
+        case OPCHAN:
+        case OPSEND:
+        case OPRECV:
+        case OPJOIN:
+        case OPJOINANY:
+        case OPOPEN:
+        case OPREAD:
+        case OPWRITE:
+        case OPCLOSE:
+        case OPPIPE:
+        case OPSOCKETPAIR: return true;
+        default: return false;
+        }
+}
+
+/**
+ * The instruction that applies the binary op to a local in place,
+ * OPCODE_COUNT if there is none
+ */
+static enum OpCode update (enum OpCode op)
+{
+        switch (op) {
+        case OPADD: return OPADDTO;
+        case OPSUB: return OPSUBTO;
+        case OPMULT: return OPMULTTO;
+        default: return OPCODE_COUNT;
+        }
+}
+
+/**
+ * Replace the length instructions at i by the count ones in replacement. Code
+ * that led to the old instructions leads to the first new one, or to the
+ * instruction after them if there are none.
+ */
+static void replace (std::vector<struct peephole_instruction> &code, size_t i, size_t length,
+                     struct peephole_instruction *replacement, size_t count, std::vector<int32_t> &end_origins)
+{
+        bool label = code[i].label;
+        std::vector<int32_t> origins;
+
+        for (size_t k = 0; k < length; k++)
+                origins.insert (origins.end (), code[i + k].origins.begin (), code[i + k].origins.end ());
+
+        code.erase (code.begin () + i, code.begin () + i + length);
+        code.insert (code.begin () + i, replacement, replacement + count);
+
+        if (i == code.size ()) {
+                end_origins.insert (end_origins.end (), origins.begin (), origins.end ());
+                return;
+        }
+
+        for (size_t k = 0; k < count; k++)
+                code[i + k].label = false;
+
+        code[i].label = code[i].label || label;
+        code[i].origins.insert (code[i].origins.end (), origins.begin (), origins.end ());
+}
+
+/**
+ * An instruction like the one at i, to be put in place of it
+ */
+static struct peephole_instruction copy (std::vector<struct peephole_instruction> &code, size_t i, enum OpCode op)
+{
+        struct peephole_instruction out = code[i];
+
+        out.op = op;
+        out.origins.clear ();
+
+        return out;
+}
+
+/**
+ * Try every rule at instruction i. Returns the rule that rewrote the code
+ * there, or PEEPHOLE_RULE_COUNT if none did.
+ */
+static enum peephole_rule rewrite (std::vector<struct peephole_instruction> &code, size_t i,
+                                   std::vector<int32_t> &end_origins)
+{
+        struct peephole_instruction out[3];
+
+        /* x = x + k, x += k and x -= k */
+        if (window (code, i, 4) && code[i + 3].op == OPSTORE && (code[i + 2].op == OPADD || code[i + 2].op == OPSUB)) {
+                int32_t x = code[i + 3].args[0];
+                bool load_first = code[i].op == OPLOAD && code[i].args[0] == x && code[i + 1].op == OPPUSH;
+                bool push_first = code[i].op == OPPUSH && code[i + 1].op == OPLOAD && code[i + 1].args[0] == x &&
+                                  code[i + 2].op == OPADD;
+
+                if (load_first || push_first) {
+                        int32_t k = load_first ? code[i + 1].args[0] : code[i].args[0];
+
+                        out[0] = copy (code, i, OPINC);
+                        out[0].args[0] = x;
+                        out[0].args[1] = code[i + 2].op == OPSUB ? (int32_t)(0 - (uint32_t)k) : k;
+                        replace (code, i, 4, out, 1, end_origins);
+                        return PEEPHOLE_INC;
+                }
+        }
+
+        /* x = x op y, y is loaded first since loading a local has no side effects */
+        if (window (code, i, 4) && code[i].op == OPLOAD && code[i + 1].op == OPLOAD &&
+            update (code[i + 2].op) != OPCODE_COUNT && code[i + 3].op == OPSTORE &&
+            code[i].args[0] == code[i + 3].args[0]) {
+                out[0] = copy (code, i + 1, OPLOAD);
+                out[1] = copy (code, i + 3, update (code[i + 2].op));
+                replace (code, i, 4, out, 2, end_origins);
+                return PEEPHOLE_UPDATE;
+        }
+
+        /* x -= e */
+        if (window (code, i, 4) && code[i].op == OPNEG && code[i + 1].op == OPLOAD && code[i + 2].op == OPADD &&
+            code[i + 3].op == OPSTORE && code[i + 1].args[0] == code[i + 3].args[0]) {
+                out[0] = copy (code, i + 3, OPSUBTO);
+                replace (code, i, 4, out, 1, end_origins);
+                return PEEPHOLE_SUB_TO;
+        }
+
+        /* x += e and x *= e */
+        if (window (code, i, 3) && code[i].op == OPLOAD && (code[i + 1].op == OPADD || code[i + 1].op == OPMULT) &&
+            code[i + 2].op == OPSTORE && code[i].args[0] == code[i + 2].args[0]) {
+                out[0] = copy (code, i + 2, update (code[i + 1].op));
+                replace (code, i, 3, out, 1, end_origins);
+                return PEEPHOLE_UPDATE;
+        }
+
+        /* x + -y, the operands swapped around a subtraction since loading a local has no side effects */
+        if (window (code, i, 4) && code[i].op == OPLOAD && code[i + 1].op == OPNEG && code[i + 2].op == OPLOAD &&
+            code[i + 3].op == OPADD) {
+                out[0] = copy (code, i + 2, OPLOAD);
+                out[1] = copy (code, i, OPLOAD);
+                out[2] = copy (code, i + 3, OPSUB);
+                replace (code, i, 4, out, 3, end_origins);
+                return PEEPHOLE_SWAP_SUB;
+        }
+
+        if (!window (code, i, 2))
+                return PEEPHOLE_RULE_COUNT;
+
+        struct peephole_instruction *a = &code[i], *b = &code[i + 1];
+
+        if ((a->op == OPPUSH || a->op == OPLOAD) && b->op == OPPOP) {
+                replace (code, i, 2, out, 0, end_origins);
+                return PEEPHOLE_DEAD_VALUE;
+        }
+
+        if (a->op == OPLOAD && b->op == OPSTORE && a->args[0] == b->args[0]) {
+                replace (code, i, 2, out, 0, end_origins);
+                return PEEPHOLE_SELF_STORE;
+        }
+
+        if (a->op == OPNEG && b->op == OPADD) {
+                out[0] = copy (code, i, OPSUB);
+                replace (code, i, 2, out, 1, end_origins);
+                return PEEPHOLE_SUB;
+        }
+
+        if (a->op == OPEQ && b->op == OPNOT) {
+                out[0] = copy (code, i, OPNEQ);
+                replace (code, i, 2, out, 1, end_origins);
+                return PEEPHOLE_NEQ;
+        }
+
+        return PEEPHOLE_RULE_COUNT;
+}
+
+/**
+ * Keep the value a store at i puts into a local on the stack when it is
+ * loaded right after: STORE x; LOAD x becomes DUP; STORE x. This saves no
+ * dispatch, so it is left to the end and skipped where the load or the store
+ * is part of a sequence the superinstruction pass fuses. Returns whether it
+ * rewrote the code.
+ */
+static bool keep_stored_value (std::vector<struct peephole_instruction> &code, size_t i,
+                               std::vector<int32_t> &end_origins)
+{
+        struct peephole_instruction out[2];
+
+        if (!window (code, i, 2) || i == 0 || code[i].label || code[i].op != OPSTORE || code[i + 1].op != OPLOAD ||
+            code[i].args[0] != code[i + 1].args[0])
+                return false;
+
+        /* a store right after a call or a built-in can move the stack up to the stored value */
+        if (leaves_result (code[i - 1].op))
+                return false;
+
+        /* LOAD ADD STORE, LOAD LOAD and LOAD PUSH */
+        if ((i > 1 && code[i - 2].op == OPLOAD && code[i - 1].op == OPADD) ||
+            (i + 2 < code.size () && (code[i + 2].op == OPLOAD || code[i + 2].op == OPPUSH)))
+                return false;
+
+        out[0] = copy (code, i, OPDUP);
+        out[1] = copy (code, i, OPSTORE);
+        replace (code, i, 2, out, 2, end_origins);
+
+        return true;
+}
+
+/**
+ * Rewrite the stack code of a single function into fewer and cheaper
+ * instructions before it is linked. Only JMP and JMPFALSE hold addresses at
+ * this point, and no rule rewrites across their targets. The rules run until
+ * none applies anymore.
+ */
+void Bytecode::peephole (struct peephole_stats *stats)
+{
+        std::vector<struct peephole_instruction> code;
+        std::vector<bool> labels (this->count + 1, false);
+        struct peephole_instruction instruction;
+        size_t c = 0;
+        size_t address = c;
+
+        while (this->instruction_at (&c, &instruction.op, instruction.args)) {
+                if ((instruction.op == OPJMP || instruction.op == OPJMPFALSE) && instruction.args[0] >= 0 &&
+                    (size_t)instruction.args[0] <= this->count)
+                        labels[instruction.args[0]] = true;
+
+                instruction.origins.assign (1, address);
+                code.push_back (instruction);
+                address = c;
+        }
+
+        labels[0] = true;
+
+        for (struct peephole_instruction &i : code)
+                i.label = labels[i.origins[0]];
+
+        stats->instructions_before += code.size ();
+
+        std::vector<int32_t> end_origins (1, this->count);
+        bool changed = true;
+
+        while (changed) {
+                changed = false;
+
+                for (size_t i = 0; i < code.size (); i++) {
+                        enum peephole_rule rule = rewrite (code, i, end_origins);
+
+                        if (rule != PEEPHOLE_RULE_COUNT) {
+                                stats->rewrites[rule]++;
+                                changed = true;
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < code.size (); i++) {
+                if (keep_stored_value (code, i, end_origins))
+                        stats->rewrites[PEEPHOLE_DUP]++;
+        }
+
+        stats->instructions_after += code.size ();
+
+        std::vector<int32_t> new_address (this->count + 1, -1);
+        size_t size = 0;
+
+        for (struct peephole_instruction &i : code) {
+                for (int32_t origin : i.origins)
+                        new_address[origin] = size;
+
+                size += 1 + Bytecode::operand_count (i.op) * sizeof (int32_t);
+        }
+
+        for (int32_t origin : end_origins)
+                new_address[origin] = size;
+
+        this->relocate_debug_info (new_address);
+
+        /* the rewritten code is never larger, so it is written over the old one */
+        this->count = 0;
+
+        for (struct peephole_instruction &i : code) {
+                if ((i.op == OPJMP || i.op == OPJMPFALSE) && i.args[0] >= 0 && (size_t)i.args[0] < new_address.size () &&
+                    new_address[i.args[0]] != -1)
+                        i.args[0] = new_address[i.args[0]];
+
+                this->write_int8 (i.op);
+
+                for (int j = 0; j < Bytecode::operand_count (i.op); j++)
+                        this->write_int32 (i.args[j]);
+        }
+}
+
+void Bytecode::print_peephole_stats (FILE *fp, struct peephole_stats *stats)
+{
+        fprintf (fp, "Peephole: %" PRIu64 " instructions before, %" PRIu64 " after\n", stats->instructions_before,
+                 stats->instructions_after);
+
+        for (int rule = 0; rule < PEEPHOLE_RULE_COUNT; rule++) {
+                if (stats->rewrites[rule])
+                        fprintf (fp, "  %-28s %8" PRIu64 "\n", rule_names[rule], stats->rewrites[rule]);
+        }
+}
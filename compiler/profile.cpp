@@ -0,0 +1,176 @@
+#include "vm.h"
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Read the debug information at the end of the size bytes at code into the
+ * runtime. Returns the size of the code in front of it, all of size when
+ * there is none.
+ */
+size_t VM::load_debug_info (int8_t *code, size_t size, const char *filename)
+{
+        struct debug_trailer trailer;
+
+        this->runtime->symbols.clear ();
+        this->runtime->lines.clear ();
+
+        if (size < sizeof (trailer) || memcmp (code + size - sizeof (trailer.magic), DEBUG_MAGIC, sizeof (trailer.magic)) != 0)
+                return size;
+
+        memcpy (&trailer, code + size - sizeof (trailer), sizeof (trailer));
+
+        size_t end = size - sizeof (trailer);
+        size_t c = trailer.code_size;
+
+        if (trailer.code_size < 0 || trailer.symbol_count < 0 || trailer.line_count < 0 || c > end) {
+                fprintf (stderr, "warning: %s: ignoring malformed debug information\n", filename);
+                return size;
+        }
+
+        for (int32_t i = 0; i < trailer.symbol_count; i++) {
+                int32_t fields[2];
+
+                if (end - c < sizeof (fields))
+                        break;
+
+                memcpy (fields, code + c, sizeof (fields));
+                c += sizeof (fields);
+
+                if (fields[1] < 0 || end - c < (size_t)fields[1])
+                        break;
+
+                this->runtime->symbols.push_back ({ fields[0], std::string ((char *)code + c, fields[1]) });
+                c += fields[1];
+        }
+
+        for (int32_t i = 0; i < trailer.line_count && end - c >= 2 * sizeof (int32_t); i++) {
+                int32_t fields[2];
+
+                memcpy (fields, code + c, sizeof (fields));
+                c += sizeof (fields);
+                this->runtime->lines.push_back ({ fields[0], fields[1] });
+        }
+
+        if (c != end || this->runtime->symbols.size () != (size_t)trailer.symbol_count ||
+            this->runtime->lines.size () != (size_t)trailer.line_count) {
+                fprintf (stderr, "warning: %s: ignoring malformed debug information\n", filename);
+                this->runtime->symbols.clear ();
+                this->runtime->lines.clear ();
+        }
+
+        return trailer.code_size;
+}
+
+/**
+ * Count the call stack of the current thread: where it is and the return
+ * address of every frame below, up to PROFILE_MAX_DEPTH frames
+ */
+void VM::take_sample ()
+{
+        static thread_local std::vector<int32_t> stack;
+        struct context *thread = this->thread;
+        int32_t *bp = thread->bp;
+
+        stack.clear ();
+        stack.push_back (thread->ip - thread->instructions);
+
+        for (int32_t frame = thread->frame_no - 1; frame >= 0; frame--) {
+                /* a cut off stack ends in -1 */
+                if (stack.size () == PROFILE_MAX_DEPTH) {
+                        stack.push_back (-1);
+                        break;
+                }
+
+                stack.push_back (bp[-1]);
+                bp = thread->stack_frames[frame];
+        }
+
+        auto sample = this->samples.find (stack);
+
+        if (sample != this->samples.end ())
+                sample->second++;
+        else
+                this->samples.emplace (stack, 1);
+}
+
+/**
+ * Name of the function and line address lies in, as function:line
+ */
+static std::string frame_name (struct runtime *runtime, int32_t address)
+{
+        auto symbol = std::upper_bound (runtime->symbols.begin (), runtime->symbols.end (), address,
+                                        [] (int32_t a, const struct function_symbol &s) { return a < s.address; });
+        auto line = std::upper_bound (runtime->lines.begin (), runtime->lines.end (), address,
+                                      [] (int32_t a, const struct line_entry &l) { return a < l.address; });
+        char buffer[32];
+        std::string name;
+
+        if (symbol == runtime->symbols.begin ()) {
+                snprintf (buffer, sizeof (buffer), "0x%x", address);
+                return buffer;
+        }
+
+        name = (symbol - 1)->name;
+
+        if (line != runtime->lines.begin ()) {
+                snprintf (buffer, sizeof (buffer), ":%d", (line - 1)->line);
+                name += buffer;
+        }
+
+        return name;
+}
+
+/**
+ * Write the samples to the profile file in collapsed stack format, one line
+ * per stack from the outermost frame in, followed by its count
+ */
+void VM::write_profile ()
+{
+        std::map<std::string, uint64_t> stacks;
+        std::unordered_map<int32_t, std::string> names;
+        uint64_t total = 0;
+
+        for (auto &sample : this->samples) {
+                const std::vector<int32_t> &addresses = sample.first;
+                std::string stack;
+
+                for (size_t i = addresses.size (); i-- > 0;) {
+                        if (!stack.empty ())
+                                stack += ';';
+
+                        /* return addresses follow the call, the call itself is the line that waits */
+                        int32_t address = i > 0 ? addresses[i] - 1 : addresses[i];
+                        auto name = names.find (address);
+
+                        if (addresses[i] == -1)
+                                stack += "[truncated]";
+                        else if (name != names.end ())
+                                stack += name->second;
+                        else
+                                stack += names[address] = frame_name (this->runtime, address);
+                }
+
+                stacks[stack] += sample.second;
+                total += sample.second;
+        }
+
+        FILE *fp = fopen (this->profile, "w");
+
+        if (!fp) {
+                perror ("fopen");
+                exit (EXIT_FAILURE);
+        }
+
+        for (auto &stack : stacks)
+                fprintf (fp, "%s %lu\n", stack.first.c_str (), stack.second);
+
+        fclose (fp);
+
+        if (this->verbose)
+                printf ("Profile samples: %lu\n", total);
+}
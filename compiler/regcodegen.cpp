@@ -0,0 +1,621 @@
+#include "bytecode.h"
+#include "compiler.h"
+#include "verifier.h"
+#include "vm.h"
+#include <stdio.h>
+#include <vector>
+
+/**
+ * A register instruction while it is being generated and optimized. Jump and
+ * call targets hold the index of the target instruction.
+ */
+struct reg_instruction {
+        enum RegOpCode op;
+        int32_t args[MAX_REG_OPERANDS];
+        /* stack depth after the stack instruction this was translated from, slots at or above it are dead */
+        int32_t depth;
+        bool label;
+        bool deleted;
+};
+
+/**
+ * Index of the operand holding a code address, -1 if the instruction has none
+ */
+static int target_operand (enum RegOpCode op)
+{
+        if (ROP_JEQ <= op && op <= ROP_JGTEQK)
+                return 2;
+
+        switch (op) {
+        case ROP_JMP:
+        case ROP_CALL: return 0;
+        case ROP_JMPFALSE: return 1;
+        default: return -1;
+        }
+}
+
+/**
+ * Index of the operand written by the instruction, -1 if it writes no slot it
+ * can be redirected to
+ */
+static int destination_operand (enum RegOpCode op)
+{
+        if (ROP_ADD <= op && op <= ROP_SUB)
+                return 0;
+
+        switch (op) {
+        case ROP_ADDK:
+        case ROP_NEG:
+        case ROP_NOT:
+        case ROP_MOV:
+        case ROP_LOADK:
+        case ROP_KILL: return 0;
+        default: return -1;
+        }
+}
+
+/**
+ * Marks which operands are slots read by the instruction
+ */
+static int source_operands (enum RegOpCode op, bool *sources)
+{
+        sources[0] = sources[1] = sources[2] = false;
+
+        if (ROP_ADD <= op && op <= ROP_SUB)
+                return sources[1] = sources[2] = true;
+
+        if (ROP_JEQ <= op && op <= ROP_JGTEQ)
+                return sources[0] = sources[1] = true;
+
+        switch (op) {
+        case ROP_ADDK:
+        case ROP_NEG:
+        case ROP_NOT:
+        case ROP_MOV:
+        case ROP_KILL: return sources[1] = true;
+        case ROP_JMPFALSE:
+        case ROP_RET:
+        case ROP_PRINT: return sources[0] = true;
+        default: {
+                if (ROP_JEQK <= op && op <= ROP_JGTEQK)
+                        return sources[0] = true;
+                return false;
+        }
+        }
+}
+
+/**
+ * Branch taken when the comparison op is false
+ */
+static enum RegOpCode negated_branch (enum RegOpCode op)
+{
+        switch (op) {
+        case ROP_EQ: return ROP_JNE;
+        case ROP_NEQ: return ROP_JEQ;
+        case ROP_GT: return ROP_JLTEQ;
+        case ROP_LT: return ROP_JGTEQ;
+        case ROP_GTEQ: return ROP_JLT;
+        case ROP_LTEQ: return ROP_JGT;
+        default: return ROP_HALT;
+        }
+}
+
+/**
+ * Compare and branch with the operands swapped: a < b is b > a
+ */
+static enum RegOpCode swapped_branch (enum RegOpCode op)
+{
+        switch (op) {
+        case ROP_JLT: return ROP_JGT;
+        case ROP_JLTEQ: return ROP_JGTEQ;
+        case ROP_JGT: return ROP_JLT;
+        case ROP_JGTEQ: return ROP_JLTEQ;
+        default: return op;
+        }
+}
+
+static size_t next_live (std::vector<struct reg_instruction> &code, size_t i)
+{
+        while (i < code.size () && code[i].deleted)
+                i++;
+
+        return i;
+}
+
+static void delete_instruction (std::vector<struct reg_instruction> &code, size_t i)
+{
+        code[i].deleted = true;
+
+        /* jumps to a deleted instruction continue at the next live one */
+        if (code[i].label) {
+                size_t next = next_live (code, i + 1);
+
+                if (next < code.size ())
+                        code[next].label = true;
+        }
+}
+
+/**
+ * Rewrite the instruction pair starting at i. The stack code moves every value
+ * through a temporary slot above the locals, most of these copies can be folded
+ * into the instruction producing or consuming the value. Returns whether
+ * anything changed.
+ */
+static bool combine (std::vector<struct reg_instruction> &code, size_t i)
+{
+        struct reg_instruction *a = &code[i];
+        size_t j = next_live (code, i + 1);
+
+        if (a->op == ROP_MOV && a->args[0] == a->args[1]) {
+                delete_instruction (code, i);
+                return true;
+        }
+
+        if (j >= code.size () || code[j].label)
+                return false;
+
+        struct reg_instruction *b = &code[j];
+        bool sources[MAX_REG_OPERANDS];
+        source_operands (b->op, sources);
+
+        /* the value a computes into t is only needed by b: t is popped or overwritten by b */
+        int dst = destination_operand (a->op);
+        int32_t t = dst == -1 ? -1 : a->args[dst];
+        int b_dst = destination_operand (b->op);
+        bool dead_after_b = t >= b->depth || (b_dst != -1 && b->args[b_dst] == t);
+
+        /* OP t, ...; MOV x, t -> OP x, ... */
+        if (dst != -1 && dead_after_b && b->op == ROP_MOV && b->args[1] == t) {
+                a->args[dst] = b->args[0];
+                a->depth = b->depth;
+                delete_instruction (code, j);
+                return true;
+        }
+
+        /* CMP t, x, y; JMPFALSE t, L -> JNCMP x, y, L */
+        if (((ROP_EQ <= a->op && a->op <= ROP_LTEQ) || a->op == ROP_NEQ) && dead_after_b && b->op == ROP_JMPFALSE && b->args[0] == t) {
+                b->op = negated_branch (a->op);
+                b->args[2] = b->args[1];
+                b->args[0] = a->args[1];
+                b->args[1] = a->args[2];
+                delete_instruction (code, i);
+                return true;
+        }
+
+        /* EQ t, x, y; NOT t, t; JMPFALSE t, L -> JEQ x, y, L */
+        size_t k = next_live (code, j + 1);
+
+        if (a->op == ROP_EQ && b->op == ROP_NOT && b->args[0] == t && b->args[1] == t && k < code.size () &&
+            !code[k].label && code[k].op == ROP_JMPFALSE && code[k].args[0] == t && t >= code[k].depth) {
+                struct reg_instruction *c = &code[k];
+                c->op = ROP_JEQ;
+                c->args[2] = c->args[1];
+                c->args[0] = a->args[1];
+                c->args[1] = a->args[2];
+                delete_instruction (code, j);
+                delete_instruction (code, i);
+                return true;
+        }
+
+        /* LOADK t, k; NEG x, t -> LOADK x, -k */
+        if (a->op == ROP_LOADK && dead_after_b && b->op == ROP_NEG && b->args[1] == t) {
+                b->op = ROP_LOADK;
+                b->args[1] = -a->args[1];
+                delete_instruction (code, i);
+                return true;
+        }
+
+        if (a->op == ROP_LOADK && dead_after_b) {
+                int32_t constant = a->args[1];
+
+                /* LOADK t, k; ADD x, y, t -> ADDK x, y, k */
+                if (b->op == ROP_ADD && (b->args[1] == t) != (b->args[2] == t)) {
+                        b->args[1] = b->args[1] == t ? b->args[2] : b->args[1];
+                        b->args[2] = constant;
+                        b->op = ROP_ADDK;
+                        delete_instruction (code, i);
+                        return true;
+                }
+
+                /* LOADK t, k; SUB x, y, t -> ADDK x, y, -k */
+                if (b->op == ROP_SUB && b->args[2] == t && b->args[1] != t) {
+                        b->args[2] = (int32_t)(0 - (uint32_t)constant);
+                        b->op = ROP_ADDK;
+                        delete_instruction (code, i);
+                        return true;
+                }
+
+                /* LOADK t, k; JCC x, t, L -> JCCK x, k, L */
+                if (ROP_JEQ <= b->op && b->op <= ROP_JGTEQ && (b->args[0] == t) != (b->args[1] == t)) {
+                        if (b->args[0] == t) {
+                                b->op = swapped_branch (b->op);
+                                b->args[0] = b->args[1];
+                        }
+                        b->args[1] = constant;
+                        b->op = (enum RegOpCode)(b->op - ROP_JEQ + ROP_JEQK);
+                        delete_instruction (code, i);
+                        return true;
+                }
+        }
+
+        /* MOV t, x; OP ..., t, ... -> OP ..., x, ... */
+        if (a->op == ROP_MOV && dead_after_b) {
+                bool changed = false;
+
+                for (int operand = 0; operand < MAX_REG_OPERANDS; operand++) {
+                        if (sources[operand] && b->args[operand] == t) {
+                                b->args[operand] = a->args[1];
+                                changed = true;
+                        }
+                }
+
+                if (changed) {
+                        delete_instruction (code, i);
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * Number of slots a stack instruction pops and pushes. Stores that grow the
+ * stack are counted as plain pops.
+ */
+static void stack_effect (enum OpCode op, int32_t *pops, int32_t *pushes)
+{
+        *pops = 0;
+        *pushes = 0;
+
+        if (is_binary (op)) {
+                *pops = 2;
+                *pushes = 1;
+                return;
+        }
+
+        switch (op) {
+        case OPNEG:
+        case OPNOT:
+        case OPKILL: *pops = *pushes = 1; break;
+        case OPPUSH:
+        case OPLOAD:
+        case OPFORK:
+        case OPCALL: *pushes = 1; break;
+        case OPDUP: *pops = 1, *pushes = 2; break;
+        case OPSTORE:
+        case OPADDTO:
+        case OPSUBTO:
+        case OPMULTTO:
+        case OPPOP:
+        case OPJMPFALSE:
+        case OPRET:
+        case OPPRINT: *pops = 1; break;
+        default: break;
+        }
+}
+
+/**
+ * For every address, the number of slots already on the stack that the code
+ * from there on can pop before pushing its own. Where paths that left
+ * different numbers of slots behind meet, nothing on the stack may be
+ * consumed, otherwise the values would be in different slots on each path.
+ */
+static std::vector<int32_t> consumed_slots (Bytecode *stack_code)
+{
+        std::vector<int32_t> consumed (stack_code->count + 1, 0);
+        bool changed = true;
+
+        while (changed) {
+                changed = false;
+
+                size_t c = 0;
+                size_t address = 0;
+                enum OpCode op;
+                int32_t operands[MAX_OPERANDS];
+
+                while (stack_code->instruction_at (&c, &op, operands)) {
+                        int32_t arg = operands[0];
+                        int32_t pops, pushes;
+                        stack_effect (op, &pops, &pushes);
+
+                        int32_t after = 0;
+
+                        if (op != OPJMP && op != OPRET && op != OPHALT)
+                                after = consumed[c];
+
+                        if ((op == OPJMP || op == OPJMPFALSE) && 0 <= arg && (size_t)arg < stack_code->count &&
+                            consumed[arg] > after)
+                                after = consumed[arg];
+
+                        int32_t needed = pops - pushes + after > pops ? pops - pushes + after : pops;
+
+                        /* the verifier bounds the stack, this only guards against looping forever */
+                        if (needed > consumed[address] && needed <= MAX_FRAME_SLOTS) {
+                                consumed[address] = needed;
+                                changed = true;
+                        }
+
+                        address = c;
+                }
+        }
+
+        return consumed;
+}
+
+/**
+ * Translate the linked stack image into the register instruction set. Every
+ * stack slot is a frame slot at a depth known statically from the verifier, so
+ * each stack instruction becomes a three address instruction on those slots.
+ * The copies through temporary slots are then folded away, which removes most
+ * loads, stores, pushes and pops. Returns false and leaves the stack image in
+ * place when the image has instructions without a single known stack depth.
+ */
+bool Compiler::emit_register_code ()
+{
+        Bytecode *stack_code = this->function->bytecode;
+        Verifier verifier (stack_code->chunk, stack_code->count, MAX_FRAME_SLOTS);
+
+        if (!verifier.verify (0))
+                return false;
+
+        std::vector<int32_t> consumed = consumed_slots (stack_code);
+        std::vector<bool> jump_targets (stack_code->count, false);
+        bool previous_exact = true;
+        std::vector<struct reg_instruction> code;
+        std::vector<size_t> first_at (stack_code->count + 1, 0);
+        std::vector<bool> entries (stack_code->count, false);
+
+        size_t c = 0;
+        size_t address = 0;
+        enum OpCode op;
+        int32_t operands[MAX_OPERANDS];
+
+        entries[0] = true;
+
+        while (stack_code->instruction_at (&c, &op, operands)) {
+                int32_t arg = operands[0];
+
+                if ((op == OPJMP || op == OPJMPFALSE) && 0 <= arg && (size_t)arg < stack_code->count)
+                        jump_targets[arg] = true;
+        }
+
+        c = 0;
+
+        while (stack_code->instruction_at (&c, &op, operands)) {
+                int32_t arg = operands[0];
+                struct depth_range depth = verifier.depths[address];
+
+                first_at[address] = code.size ();
+
+                if (depth.lo == -1) {
+                        address = c;
+                        continue;
+                }
+
+                /*
+                 * paths that left different numbers of slots behind continue
+                 * above the highest of them, the slots in between are stale
+                 */
+                if (depth.lo != depth.hi && (jump_targets[address] || previous_exact) && consumed[address] != 0)
+                        return false;
+
+                previous_exact = depth.lo == depth.hi;
+
+                int32_t d = depth.hi;
+                struct reg_instruction instruction = { ROP_HALT, { 0, 0, 0 }, d, false, false };
+
+                if (is_binary (op)) {
+                        instruction.op = binary_rop (op);
+                        instruction.args[0] = d - 2;
+                        instruction.args[1] = d - 2;
+                        instruction.args[2] = d - 1;
+                        instruction.depth = d - 1;
+                } else {
+                        switch (op) {
+                        case OPNEG:
+                        case OPNOT: {
+                                instruction.op = op == OPNEG ? ROP_NEG : ROP_NOT;
+                                instruction.args[0] = d - 1;
+                                instruction.args[1] = d - 1;
+                                break;
+                        }
+                        case OPPUSH: {
+                                instruction.op = ROP_LOADK;
+                                instruction.args[0] = d;
+                                instruction.args[1] = arg;
+                                instruction.depth = d + 1;
+                                break;
+                        }
+                        case OPLOAD: {
+                                /* reading above the top of the stack depends on stale slots */
+                                if (arg >= depth.lo)
+                                        return false;
+
+                                instruction.op = ROP_MOV;
+                                instruction.args[0] = d;
+                                instruction.args[1] = arg;
+                                instruction.depth = d + 1;
+                                break;
+                        }
+                        case OPSTORE: {
+                                if (arg > d - 1)
+                                        return false;
+
+                                instruction.op = ROP_MOV;
+                                instruction.args[0] = arg;
+                                instruction.args[1] = d - 1;
+                                instruction.depth = d - 1 > arg ? d - 1 : arg + 1;
+                                break;
+                        }
+                        case OPDUP: {
+                                instruction.op = ROP_MOV;
+                                instruction.args[0] = d;
+                                instruction.args[1] = d - 1;
+                                instruction.depth = d + 1;
+                                break;
+                        }
+                        case OPINC: {
+                                if (arg >= depth.lo)
+                                        return false;
+
+                                instruction.op = ROP_ADDK;
+                                instruction.args[0] = arg;
+                                instruction.args[1] = arg;
+                                instruction.args[2] = operands[1];
+                                break;
+                        }
+                        case OPADDTO:
+                        case OPSUBTO:
+                        case OPMULTTO: {
+                                /* the local is below the value added to it */
+                                if (arg >= depth.lo - 1)
+                                        return false;
+
+                                instruction.op = op == OPADDTO ? ROP_ADD : op == OPSUBTO ? ROP_SUB : ROP_MULT;
+                                instruction.args[0] = arg;
+                                instruction.args[1] = arg;
+                                instruction.args[2] = d - 1;
+                                instruction.depth = d - 1;
+                                break;
+                        }
+                        case OPPOP: {
+                                address = c;
+                                continue;
+                        }
+                        case OPJMP: {
+                                instruction.op = ROP_JMP;
+                                instruction.args[0] = arg;
+                                break;
+                        }
+                        case OPJMPFALSE: {
+                                instruction.op = ROP_JMPFALSE;
+                                instruction.args[0] = d - 1;
+                                instruction.args[1] = arg;
+                                instruction.depth = d - 1;
+                                break;
+                        }
+                        case OPCALL: {
+                                instruction.op = ROP_CALL;
+                                instruction.args[0] = arg;
+                                instruction.args[1] = d;
+                                instruction.depth = d + 1;
+                                entries[arg] = true;
+                                break;
+                        }
+                        case OPRET: {
+                                instruction.op = ROP_RET;
+                                instruction.args[0] = d - 1;
+                                break;
+                        }
+                        case OPPRINT: {
+                                instruction.op = ROP_PRINT;
+                                instruction.args[0] = d - 1;
+                                instruction.depth = d - 1;
+                                break;
+                        }
+                        case OPFORK: {
+                                instruction.op = ROP_FORK;
+                                instruction.args[0] = d;
+                                instruction.depth = d + 1;
+                                break;
+                        }
+                        case OPKILL: {
+                                instruction.op = ROP_KILL;
+                                instruction.args[0] = d - 1;
+                                instruction.args[1] = d - 1;
+                                break;
+                        }
+                        case OPYIELD: instruction.op = ROP_YIELD; break;
+                        case OPHALT: instruction.op = ROP_HALT; break;
+                        default: return false;
+                        }
+                }
+
+                code.push_back (instruction);
+                address = c;
+        }
+
+        first_at[stack_code->count] = code.size ();
+
+        /* resolve stack addresses to instruction indices and mark every jump target */
+        for (struct reg_instruction &instruction : code) {
+                int target = target_operand (instruction.op);
+
+                if (target != -1)
+                        instruction.args[target] = first_at[instruction.args[target]];
+        }
+
+        for (struct reg_instruction &instruction : code) {
+                int target = target_operand (instruction.op);
+
+                if (target != -1 && (size_t)instruction.args[target] < code.size ())
+                        code[instruction.args[target]].label = true;
+        }
+
+        for (size_t i = 0; i < stack_code->count; i++) {
+                if (entries[i] && first_at[i] < code.size ())
+                        code[first_at[i]].label = true;
+        }
+
+        bool changed = true;
+
+        while (changed) {
+                changed = false;
+
+                for (size_t i = next_live (code, 0); i < code.size (); i = next_live (code, i + 1))
+                        changed |= combine (code, i);
+        }
+
+        /* lay out the surviving instructions and patch the targets */
+        Bytecode *register_code = new Bytecode ();
+        std::vector<size_t> addresses (code.size () + 1, 0);
+
+        register_code->isa = ISA_REGISTER;
+
+        size_t size = 0;
+
+        for (size_t i = 0; i < code.size (); i++) {
+                addresses[i] = size;
+
+                if (!code[i].deleted)
+                        size += 1 + Bytecode::register_operand_count (code[i].op) * sizeof (int32_t);
+        }
+
+        addresses[code.size ()] = size;
+
+        for (size_t i = 0; i < code.size (); i++) {
+                struct reg_instruction &instruction = code[i];
+
+                if (instruction.deleted)
+                        continue;
+
+                int target = target_operand (instruction.op);
+
+                if (target != -1)
+                        instruction.args[target] = addresses[next_live (code, instruction.args[target])];
+
+                register_code->write_int8 (instruction.op);
+
+                for (int operand = 0; operand < Bytecode::register_operand_count (instruction.op); operand++)
+                        register_code->write_int32 (instruction.args[operand]);
+        }
+
+        std::vector<int32_t> new_address (stack_code->count + 1, -1);
+
+        c = 0;
+        address = 0;
+
+        while (stack_code->instruction_at (&c, &op, operands)) {
+                new_address[address] = addresses[next_live (code, first_at[address])];
+                address = c;
+        }
+
+        register_code->symbols = stack_code->symbols;
+        register_code->lines = stack_code->lines;
+        register_code->relocate_debug_info (new_address);
+
+        delete stack_code;
+        this->function->bytecode = register_code;
+
+        return true;
+}
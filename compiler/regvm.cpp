@@ -0,0 +1,329 @@
+#include "bytecode.h"
+#include "vm.h"
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__GNUC__) && !defined(COBRA_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
+/**
+ * Interpreter loop for register instruction images. Operands name frame slots
+ * relative to bp, so there is no stack pointer to maintain: the thread's sp is
+ * only materialized for the operations shared with the stack engines. Register
+ * images always pass the verifier before they run, so only calls check the
+ * stack.
+ */
+void VM::run_registers ()
+{
+#if COMPUTED_GOTO
+        /* must be kept in the same order as enum RegOpCode */
+        static const void *handlers[] = {
+                &&rop_add,    &&rop_mult,   &&rop_div,     &&rop_mod,    &&rop_eq,     &&rop_gt,
+                &&rop_lt,     &&rop_gteq,   &&rop_lteq,    &&rop_and,    &&rop_or,     &&rop_neq,
+                &&rop_sub,    &&rop_addk,   &&rop_neg,     &&rop_not,    &&rop_mov,    &&rop_loadk,
+                &&rop_jmp,    &&rop_jmpfalse,              &&rop_jeq,    &&rop_jne,    &&rop_jlt,
+                &&rop_jlteq,  &&rop_jgt,    &&rop_jgteq,   &&rop_jeqk,   &&rop_jnek,   &&rop_jltk,
+                &&rop_jlteqk, &&rop_jgtk,   &&rop_jgteqk,  &&rop_call,   &&rop_ret,    &&rop_print,
+                &&rop_fork,   &&rop_kill,   &&rop_yield,   &&rop_halt
+        };
+#define TARGET(label, op) label:
+#define DISPATCH()        goto *handlers[*ip]
+#else
+#define TARGET(label, op) case op:
+#define DISPATCH()        goto dispatch
+#endif
+
+#define OPERAND(n)  AS_INT32 (&ip[1 + (n) * sizeof (int32_t)])
+#define SLOT(n)     bp[OPERAND (n)]
+#define ADVANCE(n)  (ip += 1 + (n) * sizeof (int32_t))
+#define JUMP(n)     (ip = code + OPERAND (n))
+
+#define SAVE_STATE()                                                                                                   \
+        do {                                                                                                           \
+                thread->ip = thread->instructions + (ip - code);                                                       \
+                thread->bp = bp;                                                                                       \
+                thread->op_count += ops - counted;                                                                     \
+                this->executed += ops - counted;                                                                       \
+                counted = ops;                                                                                         \
+        } while (0)
+
+#define LOAD_STATE()                                                                                                   \
+        do {                                                                                                           \
+                thread = this->thread;                                                                                 \
+                code = thread->instructions;                                                                           \
+                ip = thread->ip;                                                                                       \
+                bp = thread->bp;                                                                                       \
+                slice_end = ops + std::min (this->time_slice (), UINT64_MAX - ops);                                    \
+        } while (0)
+
+#define NEXT()                                                                                                         \
+        do {                                                                                                           \
+                ops++;                                                                                                 \
+                DISPATCH ();                                                                                           \
+        } while (0)
+
+/* the time slice is only checked on control transfers, every loop and call passes one */
+#define NEXT_BRANCH()                                                                                                  \
+        do {                                                                                                           \
+                if (++ops >= slice_end)                                                                                \
+                        goto switch_thread;                                                                            \
+                DISPATCH ();                                                                                           \
+        } while (0)
+
+#define BINARY_OP(expr)                                                                                                \
+        do {                                                                                                           \
+                int32_t a = SLOT (1);                                                                                  \
+                int32_t b = SLOT (2);                                                                                  \
+                SLOT (0) = (expr);                                                                                     \
+                ADVANCE (3);                                                                                           \
+                NEXT ();                                                                                               \
+        } while (0)
+
+#define BRANCH(expr)                                                                                                   \
+        do {                                                                                                           \
+                int32_t a = SLOT (0);                                                                                  \
+                int32_t b = SLOT (1);                                                                                  \
+                if (expr)                                                                                              \
+                        JUMP (2);                                                                                      \
+                else                                                                                                   \
+                        ADVANCE (3);                                                                                   \
+                NEXT_BRANCH ();                                                                                        \
+        } while (0)
+
+#define BRANCH_K(expr)                                                                                                 \
+        do {                                                                                                           \
+                int32_t a = SLOT (0);                                                                                  \
+                int32_t b = OPERAND (1);                                                                               \
+                if (expr)                                                                                              \
+                        JUMP (2);                                                                                      \
+                else                                                                                                   \
+                        ADVANCE (3);                                                                                   \
+                NEXT_BRANCH ();                                                                                        \
+        } while (0)
+
+/*
+ * the stack engine operations that yield run with sp just above the given slot
+ * and give up the rest of the time slice
+ */
+#define YIELD_OP(top, operands, call)                                                                                  \
+        do {                                                                                                           \
+                thread->sp = bp + (top);                                                                               \
+                ADVANCE (operands);                                                                                    \
+                ops++;                                                                                                 \
+                SAVE_STATE ();                                                                                         \
+                call;                                                                                                  \
+                goto reschedule;                                                                                       \
+        } while (0)
+
+        struct context *thread;
+        int8_t *code;
+        int8_t *ip;
+        int32_t *bp;
+        uint64_t ops = 0;
+        uint64_t counted = 0;
+        uint64_t slice_end;
+
+        LOAD_STATE ();
+
+        if (thread->state != RUNNING)
+                return;
+
+#if COMPUTED_GOTO
+        DISPATCH ();
+#else
+dispatch:
+        switch ((enum RegOpCode)*ip) {
+#endif
+
+        TARGET (rop_add, ROP_ADD) BINARY_OP (a + b);
+        TARGET (rop_mult, ROP_MULT) BINARY_OP (a * b);
+        TARGET (rop_div, ROP_DIV) BINARY_OP (a / b);
+        TARGET (rop_mod, ROP_MOD) BINARY_OP (a % b);
+        TARGET (rop_eq, ROP_EQ) BINARY_OP (a == b);
+        TARGET (rop_gt, ROP_GT) BINARY_OP (a > b);
+        TARGET (rop_lt, ROP_LT) BINARY_OP (a < b);
+        TARGET (rop_gteq, ROP_GTEQ) BINARY_OP (a >= b);
+        TARGET (rop_lteq, ROP_LTEQ) BINARY_OP (a <= b);
+        TARGET (rop_and, ROP_AND) BINARY_OP (a && b);
+        TARGET (rop_or, ROP_OR) BINARY_OP (a || b);
+        TARGET (rop_neq, ROP_NEQ) BINARY_OP (a != b);
+        TARGET (rop_sub, ROP_SUB) BINARY_OP (a - b);
+
+        TARGET (rop_addk, ROP_ADDK)
+        {
+                SLOT (0) = SLOT (1) + OPERAND (2);
+                ADVANCE (3);
+                NEXT ();
+        }
+
+        TARGET (rop_neg, ROP_NEG)
+        {
+                SLOT (0) = -SLOT (1);
+                ADVANCE (2);
+                NEXT ();
+        }
+
+        TARGET (rop_not, ROP_NOT)
+        {
+                SLOT (0) = 1 - SLOT (1);
+                ADVANCE (2);
+                NEXT ();
+        }
+
+        TARGET (rop_mov, ROP_MOV)
+        {
+                SLOT (0) = SLOT (1);
+                ADVANCE (2);
+                NEXT ();
+        }
+
+        TARGET (rop_loadk, ROP_LOADK)
+        {
+                SLOT (0) = OPERAND (1);
+                ADVANCE (2);
+                NEXT ();
+        }
+
+        TARGET (rop_jmp, ROP_JMP)
+        {
+                JUMP (0);
+                NEXT_BRANCH ();
+        }
+
+        TARGET (rop_jmpfalse, ROP_JMPFALSE)
+        {
+                if (!SLOT (0))
+                        JUMP (1);
+                else
+                        ADVANCE (2);
+                NEXT_BRANCH ();
+        }
+
+        TARGET (rop_jeq, ROP_JEQ) BRANCH (a == b);
+        TARGET (rop_jne, ROP_JNE) BRANCH (a != b);
+        TARGET (rop_jlt, ROP_JLT) BRANCH (a < b);
+        TARGET (rop_jlteq, ROP_JLTEQ) BRANCH (a <= b);
+        TARGET (rop_jgt, ROP_JGT) BRANCH (a > b);
+        TARGET (rop_jgteq, ROP_JGTEQ) BRANCH (a >= b);
+
+        TARGET (rop_jeqk, ROP_JEQK) BRANCH_K (a == b);
+        TARGET (rop_jnek, ROP_JNEK) BRANCH_K (a != b);
+        TARGET (rop_jltk, ROP_JLTK) BRANCH_K (a < b);
+        TARGET (rop_jlteqk, ROP_JLTEQK) BRANCH_K (a <= b);
+        TARGET (rop_jgtk, ROP_JGTK) BRANCH_K (a > b);
+        TARGET (rop_jgteqk, ROP_JGTEQK) BRANCH_K (a >= b);
+
+        TARGET (rop_call, ROP_CALL)
+        {
+                int32_t target = OPERAND (0);
+                int32_t *base = &SLOT (1);
+
+                ADVANCE (2);
+                *base = ip - code;
+
+                if (thread->frame_no >= thread->frame_high) {
+                        if (thread->frame_no == thread->frame_capacity && !this->grow_frames (thread)) {
+                                fprintf (stderr, "call: maximum recursion depth exceeded\n");
+                                thread->state = KILLED;
+                                ops++;
+                                goto switch_thread;
+                        }
+
+                        thread->frame_high = thread->frame_no + 1;
+                }
+
+                /* the stack moves when it grows, bp and base are rebased onto it */
+                if (base + 1 + this->frame_sizes[target] >= thread->stack_high) {
+                        ptrdiff_t offset = base - thread->stack;
+
+                        thread->stack_high = base + 1 + this->frame_sizes[target] + 1;
+                        thread->bp = bp;
+                        this->grow_stack (thread, thread->stack_high - thread->stack);
+                        bp = thread->bp;
+                        base = thread->stack + offset;
+                }
+
+                thread->stack_frames[thread->frame_no++] = bp;
+                bp = base + 1;
+                ip = code + target;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (rop_ret, ROP_RET)
+        {
+                int32_t ret_value = SLOT (0);
+                int32_t ret_addr = bp[-1];
+
+                /* the result replaces the return address in the caller's frame */
+                bp[-1] = ret_value;
+                bp = thread->stack_frames[--thread->frame_no];
+                ip = code + ret_addr;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (rop_print, ROP_PRINT)
+        {
+                printf ("%d\n", SLOT (0));
+                ADVANCE (1);
+                NEXT ();
+        }
+
+        TARGET (rop_fork, ROP_FORK) YIELD_OP (OPERAND (0), 1, this->fork_op ());
+
+        TARGET (rop_kill, ROP_KILL)
+        {
+                int32_t *result = &SLOT (0);
+                int32_t *victim = &SLOT (1);
+                int32_t id = *victim;
+
+                /* kill_op leaves its result where it popped the id, the register keeps the id */
+                YIELD_OP (OPERAND (1) + 1, 2, {
+                        this->kill_op ();
+                        int32_t value = *victim;
+                        *victim = id;
+                        *result = value;
+                });
+        }
+
+        TARGET (rop_yield, ROP_YIELD) YIELD_OP (0, 0, (void)0);
+        TARGET (rop_halt, ROP_HALT) YIELD_OP (0, 1, this->halt_op ());
+
+#if !COMPUTED_GOTO
+        default: {
+                fprintf (stderr, "illegal instruction: 0x%x\n", *ip);
+                thread->state = KILLED;
+                ops++;
+                goto switch_thread;
+        }
+        }
+#endif
+
+switch_thread:
+        SAVE_STATE ();
+reschedule:
+        if (!this->schedule ())
+                return;
+
+        LOAD_STATE ();
+        DISPATCH ();
+
+#undef YIELD_OP
+#undef BRANCH_K
+#undef BRANCH
+#undef BINARY_OP
+#undef NEXT_BRANCH
+#undef NEXT
+#undef LOAD_STATE
+#undef SAVE_STATE
+#undef JUMP
+#undef ADVANCE
+#undef SLOT
+#undef OPERAND
+#undef DISPATCH
+#undef TARGET
+}
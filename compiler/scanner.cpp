@@ -10,6 +10,7 @@ Scanner::Scanner (char *src_code)
         this->col_no = 0;
         this->curr_line = this->curr;
         this->has_errors = false;
+        this->quiet = false;
 }
 
 void Scanner::advance ()
@@ -274,6 +275,9 @@ struct token Scanner::scan_token ()
                                 return this->match_identifier ();
                         } else if (this->is_numeric (c)) {
                                 return this->match_number ();
+                        } else if (this->quiet) {
+                                /* the scanner reading the source for real reports it */
+                                return (struct token){ .type = END };
                         } else {
                                 this->scan_error ("unexpected symbol '%c'\n", c);
                                 this->highlight_line (this->col_no - 1, this->col_no);
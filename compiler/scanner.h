@@ -76,6 +76,9 @@ class Scanner {
         char *curr_line;
         bool has_errors;
 
+        /* end at unexpected symbols instead of reporting them, for scanning ahead */
+        bool quiet;
+
     private:
         char *source;
         char *curr;
@@ -0,0 +1,422 @@
+#include "vm.h"
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+/**
+ * Add a block of THREAD_BLOCK slots to the thread table and put them on the
+ * free list, lowest id on top. A slot gets its stack when it is first used.
+ * The caller holds the lock of the runtime.
+ */
+void VM::grow_threads ()
+{
+        int32_t capacity = this->runtime->capacity;
+        int32_t block = capacity / THREAD_BLOCK;
+        struct context *threads = new struct context[THREAD_BLOCK];
+
+        this->runtime->blocks[block] = threads;
+
+        for (int32_t i = THREAD_BLOCK - 1; i >= 0; i--) {
+                struct context *thread = &threads[i];
+
+                thread->state = UNUSED;
+                thread->worker = -1;
+                thread->instructions = NULL;
+                thread->stack = NULL;
+                thread->stack_limit = NULL;
+                thread->stack_frames = NULL;
+                thread->frame_capacity = 0;
+                thread->exit_value = -1;
+                thread->finished = true;
+                thread->joiners.head = NULL;
+                thread->joiners.tail = NULL;
+                thread->generation = 0;
+                thread->exits = NULL;
+                thread->exits_tail = NULL;
+                thread->stats = NULL;
+                thread->id = capacity + i + 1;
+                thread->next_free = this->runtime->free_threads;
+                this->runtime->free_threads = thread;
+        }
+
+        /* published last, thread_at only looks into blocks below the capacity */
+        this->runtime->capacity = capacity + THREAD_BLOCK;
+}
+
+void VM::destroy_threads ()
+{
+        for (int32_t block = 0; block < this->runtime->capacity / THREAD_BLOCK; block++) {
+                for (int32_t i = 0; i < THREAD_BLOCK; i++) {
+                        free (this->runtime->blocks[block][i].stack);
+                        free (this->runtime->blocks[block][i].stack_frames);
+                        delete this->runtime->blocks[block][i].stats;
+                }
+
+                delete[] this->runtime->blocks[block];
+        }
+
+        this->runtime->capacity = 0;
+        this->runtime->free_threads = NULL;
+}
+
+/**
+ * The thread with the given id, NULL if no slot has that id
+ */
+struct context *VM::thread_at (int32_t id)
+{
+        if (id < 1 || id > this->runtime->capacity)
+                return NULL;
+
+        return &this->runtime->blocks[(id - 1) / THREAD_BLOCK][(id - 1) % THREAD_BLOCK];
+}
+
+/**
+ * Take a slot from the free list for a child of parent on this worker, growing
+ * the table when the list is empty. Returns NULL when the table is full.
+ */
+struct context *VM::allocate_thread (struct context *parent)
+{
+        /* joiners look at the slot under the channel lock, it may be an old id of the thread */
+        std::lock_guard<std::mutex> channels (this->runtime->channel_lock);
+        std::lock_guard<std::mutex> guard (this->runtime->lock);
+
+        if (!this->runtime->free_threads) {
+                if (this->runtime->capacity == MAX_THREADS)
+                        return NULL;
+
+                this->grow_threads ();
+        }
+
+        struct context *free_thread = this->runtime->free_threads;
+
+        this->runtime->free_threads = free_thread->next_free;
+        free_thread->op_count = 0;
+        free_thread->worker = this->id;
+        free_thread->queue = NULL;
+        free_thread->channel = NULL;
+        free_thread->handle = NULL;
+        free_thread->joining = NULL;
+        free_thread->parked = false;
+        free_thread->exit_value = 0;
+        free_thread->finished = false;
+        free_thread->parent = parent;
+        free_thread->parent_generation = parent ? parent->generation : 0;
+        free_thread->children = 0;
+
+        if (parent)
+                parent->children++;
+
+        if (++this->runtime->live > this->runtime->peak)
+                this->runtime->peak = this->runtime->live;
+
+        this->reset_stack (free_thread);
+
+        return free_thread;
+}
+
+/**
+ * Link thread into the ring after the current thread, or make it the ring when
+ * the worker has none. The caller holds the lock of this worker.
+ */
+void VM::add_thread (struct context *thread)
+{
+        if (!this->thread) {
+                thread->next = thread;
+                thread->previous = thread;
+                this->thread = thread;
+                return;
+        }
+
+        struct context *curr_next = this->thread->next;
+
+        this->thread->next = thread;
+        thread->previous = this->thread;
+
+        thread->next = curr_next;
+        curr_next->previous = thread;
+}
+
+/**
+ * Unlink thread from the ring it is in. The caller holds the lock of the
+ * worker that owns the ring.
+ */
+void VM::remove_thread (struct context *thread)
+{
+        if (thread->previous == thread || thread->next == thread)
+                return;
+
+        struct context *left = thread->previous;
+        struct context *right = thread->next;
+
+        left->next = right;
+        right->previous = left;
+
+        thread->next = thread;
+        thread->previous = thread;
+}
+
+/**
+ * Finish a stopped thread and put its slot back on the free list, unless the
+ * value is kept for its parent, which frees the slot once it takes the value.
+ * Wakes the idle workers when it was the last thread of the program. The
+ * caller holds no lock, finishing wakes the threads joining it.
+ */
+void VM::release_thread (struct context *thread)
+{
+        {
+                std::lock_guard<std::mutex> guard (this->runtime->lock);
+
+                /* the slot counts afresh for the next thread */
+                if (thread->stats) {
+                        this->runtime->op_stats.push_back ({ thread->id - 1, thread->stats });
+                        thread->stats = NULL;
+                }
+
+                thread->worker = -1;
+        }
+
+        /* a kept slot may be reused by the parent on another worker as soon as this returns */
+        bool kept = this->finish_thread (thread);
+
+        if (!kept)
+                this->reset_stack (thread);
+
+        std::lock_guard<std::mutex> guard (this->runtime->lock);
+
+        if (!kept) {
+                thread->next_free = this->runtime->free_threads;
+                this->runtime->free_threads = thread;
+        }
+
+        if (--this->runtime->live == 0)
+                this->runtime->work.notify_all ();
+}
+
+/**
+ * Put the slot of a finished thread whose value its parent took back on the
+ * free list, its id is not handed out before then
+ */
+void VM::free_thread (struct context *thread)
+{
+        std::lock_guard<std::mutex> guard (this->runtime->lock);
+
+        thread->next_free = this->runtime->free_threads;
+        this->runtime->free_threads = thread;
+}
+
+/**
+ * Switch to the next running thread in the ring of this worker. Stopped and
+ * killed threads are unlinked and released on the way, a thread that blocked
+ * on a channel or joining is unlinked and parked until it is woken. A worker whose ring
+ * runs empty steals a thread from another worker. Returns false once every
+ * thread of the program has stopped.
+ */
+bool VM::schedule ()
+{
+        struct context *old_thread = this->thread;
+
+        if (this->profile && old_thread && this->executed >= this->next_sample) {
+                this->take_sample ();
+                this->next_sample = this->executed + this->profile_interval;
+        }
+
+        if (this->runtime->io_waiting > 0 && this->executed - this->io_polled >= IO_POLL_INTERVAL) {
+                this->io_polled = this->executed;
+
+                if (this->runtime->io_dirty)
+                        this->flush_io ();
+
+                this->poll_io (0);
+        }
+
+        if (old_thread) {
+                /* stopped threads are released once the locks are dropped, linked by next_free */
+                struct context *stopped_threads = NULL;
+
+                /* parking happens under the channel lock, so a waker knows whether the thread left the ring */
+                std::unique_lock<std::mutex> channels (this->runtime->channel_lock, std::defer_lock);
+
+                if (old_thread->state == BLOCKED)
+                        channels.lock ();
+
+                std::unique_lock<std::mutex> guard (this->lock);
+                struct context *next = old_thread->next;
+
+                while (next != old_thread && next->state != RUNNING) {
+                        struct context *stopped = next;
+
+                        next = next->next;
+                        this->remove_thread (stopped);
+                        stopped->next_free = stopped_threads;
+                        stopped_threads = stopped;
+                }
+
+                if (old_thread->state == BLOCKED) {
+                        this->remove_thread (old_thread);
+                        old_thread->parked = true;
+
+                        if (next == old_thread)
+                                next = NULL;
+                } else if (old_thread->state != RUNNING) {
+                        this->remove_thread (old_thread);
+                        old_thread->next_free = stopped_threads;
+                        stopped_threads = old_thread;
+
+                        if (next == old_thread)
+                                next = NULL;
+                }
+
+                this->thread = next;
+
+                if (stopped_threads) {
+                        if (channels.owns_lock ())
+                                channels.unlock ();
+
+                        guard.unlock ();
+
+                        while (stopped_threads) {
+                                struct context *stopped = stopped_threads;
+
+                                stopped_threads = stopped->next_free;
+                                this->release_thread (stopped);
+                        }
+
+                        /* threads joining them joined the ring meanwhile */
+                        guard.lock ();
+                }
+
+                /* with other workers around the thread can be killed while it runs */
+                this->alone = this->thread && this->thread->next == this->thread && this->workers == 1;
+
+                if (this->thread)
+                        return true;
+        }
+
+        return this->steal ();
+}
+
+/**
+ * Take a waiting thread from the ring of another worker, never the one it is
+ * running. Waits for work while other workers still run threads, returns false
+ * when the program has finished. Stops it when all of its threads are blocked.
+ */
+bool VM::steal ()
+{
+        size_t count = this->runtime->workers.size ();
+
+        while (this->runtime->live > 0) {
+                for (size_t i = 1; i < count; i++) {
+                        VM *victim = this->runtime->workers[(this->id + i) % count];
+                        struct context *stolen = NULL;
+
+                        {
+                                std::lock_guard<std::mutex> guard (victim->lock);
+                                struct context *current = victim->thread;
+
+                                if (!current)
+                                        continue;
+
+                                for (struct context *t = current->next; t != current; t = t->next) {
+                                        if (t->state == RUNNING) {
+                                                stolen = t;
+                                                break;
+                                        }
+                                }
+
+                                if (!stolen)
+                                        continue;
+
+                                victim->remove_thread (stolen);
+                                stolen->worker = this->id;
+                        }
+
+                        std::lock_guard<std::mutex> guard (this->lock);
+                        this->thread = stolen;
+                        this->alone = false;
+
+                        return true;
+                }
+
+                this->check_deadlock ();
+
+                if (this->runtime->io_dirty)
+                        this->flush_io ();
+
+                /* an idle worker waits in the event loop while threads wait for I/O */
+                if (this->runtime->io_waiting > 0) {
+                        this->poll_io (1);
+
+                        if (this->thread) {
+                                this->alone = false;
+                                return true;
+                        }
+
+                        continue;
+                }
+
+                /* forks notify the idle workers, the timeout covers a notification sent before the wait */
+                std::unique_lock<std::mutex> guard (this->runtime->lock);
+
+                if (this->runtime->live > 0)
+                        this->runtime->work.wait_for (guard, std::chrono::milliseconds (1));
+        }
+
+        return false;
+}
+
+/**
+ * Instructions the current thread may run before the worker schedules again:
+ * a quantum, or until it yields when it runs alone, and no further than the
+ * next profile sample
+ */
+uint64_t VM::time_slice ()
+{
+        uint64_t slice = this->alone ? UINT64_MAX : this->quantum;
+
+        if (this->profile)
+                slice = std::min (slice, this->next_sample > this->executed ? this->next_sample - this->executed : 0);
+
+        return slice;
+}
+
+/**
+ * Run the program on a pool of workers, one OS thread each. The calling thread
+ * is worker 0 and starts with the main thread of the program, the others
+ * steal the threads it forks.
+ */
+void VM::run_workers ()
+{
+        std::vector<std::thread> os_threads;
+
+        for (uint32_t i = 1; i < this->workers; i++)
+                this->runtime->workers.push_back (new VM (this, i));
+
+        for (uint32_t i = 1; i < this->workers; i++) {
+                VM *worker = this->runtime->workers[i];
+
+                os_threads.push_back (std::thread ([worker] {
+                        while (worker->schedule ())
+                                worker->run_engine ();
+                }));
+        }
+
+        do {
+                this->run_engine ();
+        } while (this->schedule ());
+
+        for (std::thread &os_thread : os_threads)
+                os_thread.join ();
+
+        for (uint32_t i = 1; i < this->workers; i++) {
+                this->executed += this->runtime->workers[i]->executed;
+
+                for (auto &sample : this->runtime->workers[i]->samples)
+                        this->samples[sample.first] += sample.second;
+                delete this->runtime->workers[i];
+        }
+
+        this->runtime->workers.resize (1);
+}
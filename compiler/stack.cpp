@@ -0,0 +1,123 @@
+#include "vm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Give thread an empty stack and frame array of the initial size. A slot keeps
+ * its storage between threads, but what a deeper thread grew is freed again.
+ */
+void VM::reset_stack (struct context *thread)
+{
+        if (!thread->stack || thread->stack_limit - thread->stack > INITIAL_STACK_SIZE) {
+                free (thread->stack);
+                thread->stack = (int32_t *)calloc (INITIAL_STACK_SIZE, sizeof (int32_t));
+                thread->stack_limit = thread->stack + INITIAL_STACK_SIZE;
+        }
+
+        if (!thread->stack_frames || thread->frame_capacity > INITIAL_FRAME_SIZE) {
+                free (thread->stack_frames);
+                thread->stack_frames = (int32_t **)malloc (INITIAL_FRAME_SIZE * sizeof (int32_t *));
+                thread->frame_capacity = INITIAL_FRAME_SIZE;
+        }
+
+        if (!thread->stack || !thread->stack_frames) {
+                perror ("malloc");
+                exit (EXIT_FAILURE);
+        }
+
+        thread->sp = thread->stack;
+        thread->bp = thread->stack;
+        thread->stack_high = thread->stack;
+        thread->frame_no = 0;
+        thread->frame_high = 0;
+}
+
+/**
+ * Free the stack and frame array of a finished thread whose slot waits for its
+ * parent, the next thread in the slot gets new ones
+ */
+void VM::free_stack (struct context *thread)
+{
+        free (thread->stack);
+        free (thread->stack_frames);
+        thread->stack = NULL;
+        thread->stack_limit = NULL;
+        thread->stack_frames = NULL;
+        thread->frame_capacity = 0;
+}
+
+/**
+ * Make room for at least needed stack slots, doubling the stack until it fits.
+ * The stack moves, so the pointers into it are rebased onto the new one.
+ */
+void VM::grow_stack (struct context *thread, size_t needed)
+{
+        size_t capacity = thread->stack_limit - thread->stack;
+
+        if (needed <= capacity)
+                return;
+
+        if (needed > STACK_SIZE) {
+                fprintf (stderr, "error: stack overflow: thread #%d needs %lu stack slots, at most %d fit\n",
+                         thread->id - 1, needed, STACK_SIZE);
+                exit (EXIT_FAILURE);
+        }
+
+        size_t grown = capacity;
+
+        while (grown < needed)
+                grown *= 2;
+
+        if (grown > STACK_SIZE)
+                grown = STACK_SIZE;
+
+        int32_t *stack = (int32_t *)malloc (grown * sizeof (int32_t));
+
+        if (!stack) {
+                perror ("malloc");
+                exit (EXIT_FAILURE);
+        }
+
+        memcpy (stack, thread->stack, capacity * sizeof (int32_t));
+        memset (stack + capacity, 0, (grown - capacity) * sizeof (int32_t));
+
+        for (int32_t i = 0; i < thread->frame_no; i++)
+                thread->stack_frames[i] = stack + (thread->stack_frames[i] - thread->stack);
+
+        thread->sp = stack + (thread->sp - thread->stack);
+        thread->bp = stack + (thread->bp - thread->stack);
+        thread->stack_high = stack + (thread->stack_high - thread->stack);
+
+        free (thread->stack);
+        thread->stack = stack;
+        thread->stack_limit = stack + grown;
+}
+
+/**
+ * Double the frame array of thread. Returns false when it already holds
+ * FRAME_SIZE frames.
+ */
+bool VM::grow_frames (struct context *thread)
+{
+        if (thread->frame_capacity == FRAME_SIZE)
+                return false;
+
+        int32_t grown = thread->frame_capacity * 2;
+
+        if (grown > FRAME_SIZE)
+                grown = FRAME_SIZE;
+
+        int32_t **frames = (int32_t **)realloc (thread->stack_frames, grown * sizeof (int32_t *));
+
+        if (!frames) {
+                perror ("realloc");
+                exit (EXIT_FAILURE);
+        }
+
+        thread->stack_frames = frames;
+        thread->frame_capacity = grown;
+
+        return true;
+}
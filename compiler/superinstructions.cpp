@@ -0,0 +1,170 @@
+#include "bytecode.h"
+#include <stdint.h>
+#include <vector>
+
+struct superinstruction {
+        enum OpCode op;
+        int length;
+        enum OpCode sequence[MAX_SEQUENCE];
+};
+
+/**
+ * The fused sequences are the most frequently executed instruction sequences
+ * that can be fused statically (no jump target or return address inside them),
+ * measured on bench/fib.cb, bench/loop.cb and call and fork heavy scripts as
+ * the share of executed instructions that start the sequence:
+ *
+ *   LOAD PUSH LT JMPFALSE   loop and if conditions     fib 7.1%, loop 4.5%
+ *   LOAD PUSH ADD           n - k, n + k               fib 7.1%
+ *   LOAD ADD STORE          compound assignment        loop 13.6%, fib 3.6%
+ *   LOAD LOAD               operators on two locals    loop 4.5%, others up to 8.3%
+ *   STORE POP               assignment statements      fib 3.6%, others up to 5.7%
+ *   LT JMPFALSE             non constant bounds        others up to 2.0%
+ *   INC JMP                 counter at the loop end    once per iteration of a loop
+ *
+ * RET STORE and CALL LOAD are as frequent but cross a call or return and can
+ * not be fused. Longer sequences come first, the pass picks the first one
+ * that matches.
+ */
+static const struct superinstruction superinstructions[] = {
+        {OPLOAD_PUSH_LT_JMPFALSE, 4,  { OPLOAD, OPPUSH, OPLT, OPJMPFALSE }},
+        {        OPLOAD_PUSH_ADD, 3,            { OPLOAD, OPPUSH, OPADD }},
+        {       OPLOAD_ADD_STORE, 3,           { OPLOAD, OPADD, OPSTORE }},
+        {            OPLOAD_LOAD, 2,                   { OPLOAD, OPLOAD }},
+        {            OPSTORE_POP, 2,                   { OPSTORE, OPPOP }},
+        {          OPLT_JMPFALSE, 2,                 { OPLT, OPJMPFALSE }},
+        {              OPINC_JMP, 2,                   { OPINC, OPJMP }},
+};
+
+/**
+ * Copy the instruction sequence op stands for into sequence. Returns its
+ * length, or 0 if op is not a superinstruction.
+ */
+int Bytecode::superinstruction_sequence (enum OpCode op, enum OpCode *sequence)
+{
+        if (op < OPLOAD_PUSH_LT_JMPFALSE || op >= OPCODE_COUNT)
+                return 0;
+
+        const struct superinstruction *s = &superinstructions[op - OPLOAD_PUSH_LT_JMPFALSE];
+
+        for (int i = 0; i < s->length; i++)
+                sequence[i] = s->sequence[i];
+
+        return s->length;
+}
+
+struct decoded_instruction {
+        size_t address;
+        enum OpCode op;
+        int32_t args[MAX_OPERANDS];
+};
+
+/**
+ * Whether the sequence of s starts at instruction i and nothing jumps or
+ * returns into the middle of it
+ */
+static bool matches (std::vector<struct decoded_instruction> &code, size_t i, const struct superinstruction &s,
+                     std::vector<bool> &barriers)
+{
+        if (i + s.length > code.size ())
+                return false;
+
+        for (int k = 0; k < s.length; k++) {
+                if (code[i + k].op != s.sequence[k])
+                        return false;
+
+                if (k > 0 && barriers[code[i + k].address])
+                        return false;
+        }
+
+        return true;
+}
+
+/**
+ * Rewrite a linked stack image to use superinstructions. Every jump target,
+ * call target and return address stays an instruction boundary, so the
+ * instructions at those addresses are only ever fused with the ones after
+ * them. Jump and call operands are relocated to the new addresses.
+ */
+void Bytecode::fuse_superinstructions ()
+{
+        if (this->isa != ISA_STACK)
+                return;
+
+        std::vector<struct decoded_instruction> code;
+        std::vector<bool> barriers (this->count + 1, false);
+        size_t c = 0;
+        struct decoded_instruction instruction;
+
+        instruction.address = c;
+
+        while (this->instruction_at (&c, &instruction.op, instruction.args)) {
+                int target = Bytecode::jump_operand (instruction.op);
+
+                if (target != -1 && instruction.args[target] >= 0 && (size_t)instruction.args[target] <= this->count)
+                        barriers[instruction.args[target]] = true;
+
+                /* the callee returns to the instruction after the call */
+                if (instruction.op == OPCALL && c <= this->count)
+                        barriers[c] = true;
+
+                code.push_back (instruction);
+                instruction.address = c;
+        }
+
+        barriers[0] = true;
+
+        std::vector<struct decoded_instruction> fused;
+        std::vector<int32_t> new_address (this->count + 1, -1);
+        size_t size = 0;
+        size_t i = 0;
+
+        while (i < code.size ()) {
+                struct decoded_instruction out = code[i];
+                int length = 1;
+
+                for (const struct superinstruction &s : superinstructions) {
+                        if (!matches (code, i, s, barriers))
+                                continue;
+
+                        int operand = 0;
+
+                        for (int k = 0; k < s.length; k++) {
+                                for (int j = 0; j < Bytecode::operand_count (s.sequence[k]); j++)
+                                        out.args[operand++] = code[i + k].args[j];
+                        }
+
+                        out.op = s.op;
+                        length = s.length;
+                        break;
+                }
+
+                /* the instructions a superinstruction swallows start where it does */
+                for (int k = 0; k < length; k++)
+                        new_address[code[i + k].address] = size;
+
+                size += 1 + Bytecode::operand_count (out.op) * sizeof (int32_t);
+
+                fused.push_back (out);
+                i += length;
+        }
+
+        new_address[this->count] = size;
+        this->relocate_debug_info (new_address);
+
+        /* the fused image is never larger, so it is written over the old one */
+        this->count = 0;
+
+        for (struct decoded_instruction &out : fused) {
+                int target = Bytecode::jump_operand (out.op);
+
+                if (target != -1 && out.args[target] >= 0 && (size_t)out.args[target] < new_address.size () &&
+                    new_address[out.args[target]] != -1)
+                        out.args[target] = new_address[out.args[target]];
+
+                this->write_int8 (out.op);
+
+                for (int j = 0; j < Bytecode::operand_count (out.op); j++)
+                        this->write_int32 (out.args[j]);
+        }
+}
@@ -0,0 +1,114 @@
+#!/bin/sh
+#
+# Run every program in tests/ on each engine, worker count, instruction set,
+# optimization level and with each pass turned off, and compiled to C, and
+# compare what it prints and exits with to the .out file next to it, which
+# holds the output checked by hand and "exit <status>" as its last line.
+# Threads print in any order, so the lines are compared sorted. A program with
+# a "// skip: <label>" line is not run in the configurations of that label.
+# usage: tests/run.sh [program.cb ...]   (run from the compiler directory)
+
+COBRAC=${COBRAC:-./cobrac}
+CC=${CC:-cc}
+TIMEOUT=${TIMEOUT:-120}
+DIR=$(mktemp -d)
+
+trap 'rm -rf "$DIR"' EXIT
+
+[ $# -eq 0 ] && set -- tests/*.cb
+
+# the arguments open() takes: a file to read, also piped to standard input, and one to write
+INPUT=tests/arith.cb
+OUTPUT=$DIR/output
+
+programs=0
+runs=0
+failed=0
+
+# print what the command prints and exits with, sorted; standard input is a pipe
+output ()
+{
+        cat "$INPUT" | timeout "$TIMEOUT" "$@" "$INPUT" "$OUTPUT" > "$DIR/raw" 2>&1
+        echo "exit $?" >> "$DIR/raw"
+        sort "$DIR/raw"
+}
+
+# compare the output of a command to the expected one
+check ()
+{
+        name=$1
+        shift
+        runs=$((runs + 1))
+
+        output "$@" > "$DIR/actual"
+
+        if ! cmp -s "$DIR/expected" "$DIR/actual"; then
+                failed=$((failed + 1))
+                echo "FAIL $program $name"
+                diff "$DIR/expected" "$DIR/actual" | head -10
+        fi
+}
+
+# compile with options, run the image with each set of --exec options
+variant ()
+{
+        label=$1
+        options=$2
+        shift 2
+
+        grep -q "^// skip: $label\$" "$program" && return
+
+        if ! "$COBRAC" $options -o "$DIR/image" "$program" > "$DIR/compile" 2>&1; then
+                runs=$((runs + 1))
+                failed=$((failed + 1))
+                echo "FAIL $program $label: does not compile"
+                head -5 "$DIR/compile"
+                return
+        fi
+
+        for exec_options in "$@"; do
+                check "$label $exec_options" "$COBRAC" --exec $exec_options "$DIR/image"
+        done
+}
+
+for program in "$@"; do
+        programs=$((programs + 1))
+
+        if [ ! -f "${program%.cb}.out" ]; then
+                failed=$((failed + 1))
+                echo "FAIL $program: no ${program%.cb}.out"
+                continue
+        fi
+
+        sort "${program%.cb}.out" > "$DIR/expected"
+
+        variant default "" ""
+        variant stack "" "-E switch" "-E threaded" "-n" "-n -E threaded" "--jit" "--jit -E threaded" \
+                "--workers 4" "--workers 3 -E threaded" "--quantum 1"
+        variant register "-i register" "-E switch" "-E threaded" "-n" "--workers 4 -E threaded"
+
+        for level in 0 1 2; do
+                variant "O$level" "-O $level" "-E switch" "-E threaded"
+        done
+
+        variant no-superinstructions "-s" "-E threaded"
+        variant no-fold "-f" "-E switch"
+        variant no-peephole "-k" "-E switch"
+        variant no-jump-threading "-t" "-E switch"
+        variant no-strip "-x" "-E switch"
+
+        if ! grep -q "^// skip: c\$" "$program"; then
+                if "$COBRAC" --emit-c -o "$DIR/program.c" "$program" &&
+                   "$CC" -O2 -I. "$DIR/program.c" -o "$DIR/program"; then
+                        check c "$DIR/program"
+                else
+                        runs=$((runs + 1))
+                        failed=$((failed + 1))
+                        echo "FAIL $program c: does not build"
+                fi
+        fi
+done
+
+echo "$programs programs, $runs runs, $failed failed"
+
+[ $failed -eq 0 ]
@@ -0,0 +1,683 @@
+#include "bytecode.h"
+#include "vm.h"
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * The threaded engine stores handler addresses in the decoded stream, which
+ * needs the labels-as-values extension. Other compilers dispatch through a
+ * switch over the decoded opcode instead.
+ */
+#if defined(__GNUC__) && !defined(COBRA_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
+/* pseudo opcodes for decoded instructions that can not be executed */
+#define OP_ILLEGAL     (OPCODE_COUNT)
+#define OP_BAD_TARGET  (OPCODE_COUNT + 1)
+#define OP_END_OF_CODE (OPCODE_COUNT + 2)
+#define HANDLER_COUNT  (OPCODE_COUNT + 3)
+
+/**
+ * Decodes the instruction image of the current thread into a stream of
+ * decoded_op. decoded_at maps every byte address to the instruction that
+ * starts there, or NULL if the address is not an instruction boundary.
+ */
+void VM::decode_program (const void *const *handlers)
+{
+        int8_t *code = this->thread->instructions;
+        size_t count = 0;
+        size_t c = 0;
+
+        free (this->program);
+        free (this->decoded_at);
+
+        /* one slot per byte is an upper bound, plus the end of code and bad target sentinels */
+        this->program = (struct decoded_op *)calloc (this->code_size + 2, sizeof (struct decoded_op));
+        this->decoded_at = (struct decoded_op **)calloc (this->code_size + 1, sizeof (struct decoded_op *));
+
+        if (!this->program || !this->decoded_at) {
+                perror ("calloc");
+                exit (EXIT_FAILURE);
+        }
+
+        while (c < this->code_size) {
+                struct decoded_op *op = &this->program[count++];
+                int32_t op_byte = code[c];
+                int32_t args[MAX_OPERANDS] = { 0 };
+
+                this->decoded_at[c] = op;
+                op->address = c++;
+                op->op = (enum OpCode)op_byte;
+                op->target = NULL;
+
+                if (op_byte < OPADD || op_byte >= OPCODE_COUNT) {
+                        op_byte = OP_ILLEGAL;
+                } else if (c + Bytecode::operand_count (op->op) * sizeof (int32_t) > this->code_size) {
+                        op_byte = OP_ILLEGAL;
+                        c = this->code_size;
+                } else {
+                        for (int i = 0; i < Bytecode::operand_count (op->op); i++) {
+                                args[i] = AS_INT32 (&code[c]);
+                                c += sizeof (int32_t);
+                        }
+                }
+
+                /* superinstructions keep their first two operands, a jump operand is resolved below */
+                op->arg = args[0];
+                op->arg2 = args[1];
+
+                op->handler = COMPUTED_GOTO ? handlers[op_byte] : (const void *)(intptr_t)op_byte;
+        }
+
+        struct decoded_op *end = &this->program[count];
+        end->address = this->code_size;
+        end->handler = COMPUTED_GOTO ? handlers[OP_END_OF_CODE] : (const void *)(intptr_t)OP_END_OF_CODE;
+        this->decoded_at[this->code_size] = end;
+
+        struct decoded_op *bad_target = &this->program[count + 1];
+        bad_target->handler = COMPUTED_GOTO ? handlers[OP_BAD_TARGET] : (const void *)(intptr_t)OP_BAD_TARGET;
+
+        for (size_t i = 0; i < count; i++) {
+                struct decoded_op *op = &this->program[i];
+                int target = Bytecode::jump_operand (op->op);
+
+                /* truncated instructions decode as illegal and have no target */
+                if (target == -1 || op->address + 1 + (target + 1) * sizeof (int32_t) > this->code_size)
+                        continue;
+
+                int32_t address = AS_INT32 (&code[op->address + 1 + target * sizeof (int32_t)]);
+
+                op->target = this->resolve_address (address);
+
+                if (!op->target)
+                        op->target = bad_target;
+                else if ((op->op == OPCALL || op->op == OPTAILCALL) && this->verified)
+                        op->frame_size = this->frame_sizes[address];
+        }
+}
+
+/**
+ * Map a byte address onto its decoded instruction. Returns NULL when the address
+ * is outside the image or not an instruction boundary.
+ */
+struct decoded_op *VM::resolve_address (int32_t address)
+{
+        if (address < 0 || (size_t)address > this->code_size)
+                return NULL;
+
+        return this->decoded_at[address];
+}
+
+/**
+ * Execute the program using the pre-decoded instruction stream. Verified images
+ * run without per instruction bounds checks.
+ */
+void VM::run_threaded ()
+{
+        if (this->verified)
+                this->run_threaded_loop<false> ();
+        else
+                this->run_threaded_loop<true> ();
+}
+
+/**
+ * The interpreter state lives in local variables and is only written back to the
+ * thread context on thread switches and around the slow operations that share
+ * their implementation with the switch engine. When checked is false the stack
+ * is only checked once per call against the frame size computed by the verifier.
+ */
+template <bool checked> void VM::run_threaded_loop ()
+{
+#if COMPUTED_GOTO
+        /* must be kept in the same order as enum OpCode */
+        static const void *handlers[HANDLER_COUNT] = {
+                &&op_add,       &&op_mult,  &&op_div,   &&op_mod,   &&op_eq,   &&op_gt,
+                &&op_lt,        &&op_gteq,  &&op_lteq,  &&op_and,   &&op_or,   &&op_neg,
+                &&op_not,       &&op_jmp,   &&op_jmpfalse,          &&op_store, &&op_load,
+                &&op_push,      &&op_pop,   &&op_call,  &&op_halt,  &&op_print, &&op_fork,
+                &&op_kill,      &&op_ret,   &&op_yield, &&op_tailcall,          &&op_chan,
+                &&op_send,      &&op_recv,  &&op_exit,  &&op_join,  &&op_join_any, &&op_open,
+                &&op_read,      &&op_write, &&op_close, &&op_pipe,  &&op_socketpair,
+                &&op_neq,       &&op_sub,   &&op_dup,   &&op_inc,   &&op_add_to, &&op_sub_to, &&op_mult_to,
+                &&op_load_push_lt_jmpfalse, &&op_load_push_add,     &&op_load_add_store,
+                &&op_load_load, &&op_store_pop,         &&op_lt_jmpfalse,       &&op_inc_jmp,
+                &&op_illegal,   &&op_bad_target,        &&op_end_of_code
+        };
+#define TARGET(label, op) label:
+#define DISPATCH()        goto *(ip++)->handler
+#else
+        static const void *const *handlers = NULL;
+#define TARGET(label, op) case op:
+#define DISPATCH()        goto dispatch
+#endif
+
+#define ARG        (ip[-1].arg)
+#define ARG2       (ip[-1].arg2)
+#define JUMP_TARGET (ip[-1].target)
+
+#define SAVE_STATE()                                                                                                   \
+        do {                                                                                                           \
+                thread->ip = thread->instructions + ip->address;                                                       \
+                thread->sp = sp;                                                                                       \
+                thread->bp = bp;                                                                                       \
+                thread->op_count += ops - counted;                                                                     \
+                this->executed += ops - counted;                                                                       \
+                counted = ops;                                                                                         \
+        } while (0)
+
+#define LOAD_STATE()                                                                                                   \
+        do {                                                                                                           \
+                thread = this->thread;                                                                                 \
+                ip = this->resolve_address (thread->ip - thread->instructions);                                        \
+                sp = thread->sp;                                                                                       \
+                bp = thread->bp;                                                                                       \
+                slice_end = ops + std::min (this->time_slice (), UINT64_MAX - ops);                                    \
+        } while (0)
+
+#define NEXT()                                                                                                         \
+        do {                                                                                                           \
+                ops++;                                                                                                 \
+                DISPATCH ();                                                                                           \
+        } while (0)
+
+/* the time slice is only checked on control transfers, every loop and call passes one */
+#define NEXT_BRANCH()                                                                                                  \
+        do {                                                                                                           \
+                if (++ops >= slice_end)                                                                                \
+                        goto switch_thread;                                                                            \
+                DISPATCH ();                                                                                           \
+        } while (0)
+
+#define STACK_ERROR(kind, prefix)                                                                                      \
+        do {                                                                                                           \
+                fprintf (stderr, "error: stack " kind ": %s\n", prefix);                                               \
+                fprintf (stderr, "ip: %d", ip[-1].address);                                                            \
+                exit (EXIT_FAILURE);                                                                                   \
+        } while (0)
+
+/* the stack moves when it grows, sp and bp are reloaded and pointers into it go stale */
+#define GROW_STACK(needed)                                                                                             \
+        do {                                                                                                           \
+                thread->sp = sp;                                                                                       \
+                thread->bp = bp;                                                                                       \
+                this->grow_stack (thread, (needed));                                                                   \
+                sp = thread->sp;                                                                                       \
+                bp = thread->bp;                                                                                       \
+        } while (0)
+
+#define CHECK_LOCATION(ptr, prefix)                                                                                    \
+        do {                                                                                                           \
+                if (checked && (ptr) < thread->stack)                                                                  \
+                        STACK_ERROR ("underflow", prefix);                                                             \
+                if (checked && (ptr) >= thread->stack_high) {                                                          \
+                        ptrdiff_t offset = (ptr) - thread->stack;                                                      \
+                        thread->stack_high = (ptr) + 1;                                                                \
+                        GROW_STACK (offset + 1);                                                                       \
+                        (ptr) = thread->stack + offset;                                                                \
+                }                                                                                                      \
+        } while (0)
+
+#define PUSH(v)                                                                                                        \
+        do {                                                                                                           \
+                *sp++ = (v);                                                                                           \
+                if (checked && sp >= thread->stack_high) {                                                             \
+                        thread->stack_high = sp + 1;                                                                   \
+                        GROW_STACK (sp - thread->stack + 1);                                                           \
+                }                                                                                                      \
+        } while (0)
+
+#define POP_INTO(v)                                                                                                    \
+        do {                                                                                                           \
+                sp--;                                                                                                  \
+                if (checked && sp < thread->stack)                                                                     \
+                        STACK_ERROR ("underflow", "pop: attempted to pop stack with invalid VM configuration");       \
+                (v) = *sp;                                                                                             \
+        } while (0)
+
+#define BINARY_OP(expr)                                                                                                \
+        do {                                                                                                           \
+                int32_t b, a;                                                                                          \
+                POP_INTO (b);                                                                                          \
+                POP_INTO (a);                                                                                          \
+                *sp++ = (expr);                                                                                        \
+                NEXT ();                                                                                               \
+        } while (0)
+
+/* slow operations run the switch engine implementation on the saved thread context */
+#define SLOW_OP(call)                                                                                                  \
+        do {                                                                                                           \
+                SAVE_STATE ();                                                                                         \
+                call;                                                                                                  \
+                sp = thread->sp;                                                                                       \
+                NEXT ();                                                                                               \
+        } while (0)
+
+/* yielding operations give up the rest of the time slice */
+#define YIELD_OP(call)                                                                                                 \
+        do {                                                                                                           \
+                ops++;                                                                                                 \
+                SAVE_STATE ();                                                                                         \
+                call;                                                                                                  \
+                goto reschedule;                                                                                       \
+        } while (0)
+
+/* operations that can block give up the time slice when they block or wake a thread */
+#define BLOCKING_OP(call)                                                                                              \
+        do {                                                                                                           \
+                ops++;                                                                                                 \
+                SAVE_STATE ();                                                                                         \
+                if (call)                                                                                              \
+                        goto reschedule;                                                                               \
+                sp = thread->sp;                                                                                       \
+                DISPATCH ();                                                                                           \
+        } while (0)
+
+        if (!this->program)
+                this->decode_program (handlers);
+
+        struct context *thread;
+        struct decoded_op *ip;
+        int32_t *sp;
+        int32_t *bp;
+        uint64_t ops = 0;
+        uint64_t counted = 0;
+        uint64_t slice_end;
+
+        LOAD_STATE ();
+
+        if (thread->state != RUNNING)
+                return;
+
+#if COMPUTED_GOTO
+        DISPATCH ();
+#else
+dispatch:
+        switch ((intptr_t)(ip++)->handler) {
+#endif
+
+        TARGET (op_add, OPADD) BINARY_OP (a + b);
+        TARGET (op_mult, OPMULT) BINARY_OP (a * b);
+        TARGET (op_div, OPDIV) BINARY_OP (a / b);
+        TARGET (op_mod, OPMOD) BINARY_OP (a % b);
+        TARGET (op_eq, OPEQ) BINARY_OP (a == b);
+        TARGET (op_gt, OPGT) BINARY_OP (a > b);
+        TARGET (op_lt, OPLT) BINARY_OP (a < b);
+        TARGET (op_gteq, OPGTEQ) BINARY_OP (a >= b);
+        TARGET (op_lteq, OPLTEQ) BINARY_OP (a <= b);
+        TARGET (op_and, OPAND) BINARY_OP (a && b);
+        TARGET (op_or, OPOR) BINARY_OP (a || b);
+        TARGET (op_neq, OPNEQ) BINARY_OP (a != b);
+        TARGET (op_sub, OPSUB) BINARY_OP (a - b);
+
+        TARGET (op_neg, OPNEG)
+        {
+                int32_t a;
+                POP_INTO (a);
+                *sp++ = -a;
+                NEXT ();
+        }
+
+        TARGET (op_not, OPNOT)
+        {
+                int32_t a;
+                POP_INTO (a);
+                *sp++ = 1 - a;
+                NEXT ();
+        }
+
+        TARGET (op_jmp, OPJMP)
+        {
+                ip = JUMP_TARGET;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_jmpfalse, OPJMPFALSE)
+        {
+                int32_t condition;
+                POP_INTO (condition);
+
+                if (!condition)
+                        ip = JUMP_TARGET;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_store, OPSTORE)
+        {
+                int32_t value;
+                POP_INTO (value);
+
+                int32_t *store_location = bp + ARG;
+                CHECK_LOCATION (store_location, "store: attempted to store with invalid VM configuration");
+
+                *store_location = value;
+
+                if (store_location >= sp)
+                        sp = store_location + 1;
+                NEXT ();
+        }
+
+        TARGET (op_load, OPLOAD)
+        {
+                int32_t *load_location = bp + ARG;
+                CHECK_LOCATION (load_location, "load: attempted to load with invalid VM configuration");
+                PUSH (*load_location);
+                NEXT ();
+        }
+
+        TARGET (op_dup, OPDUP)
+        {
+                int32_t value;
+                POP_INTO (value);
+                PUSH (value);
+                PUSH (value);
+                NEXT ();
+        }
+
+        TARGET (op_inc, OPINC)
+        {
+                int32_t *location = bp + ARG;
+                CHECK_LOCATION (location, "inc: attempted to increment with invalid VM configuration");
+                *location += ARG2;
+                NEXT ();
+        }
+
+        TARGET (op_add_to, OPADDTO)
+        {
+                int32_t value;
+                POP_INTO (value);
+
+                int32_t *location = bp + ARG;
+                CHECK_LOCATION (location, "update: attempted to update with invalid VM configuration");
+                *location += value;
+                NEXT ();
+        }
+
+        TARGET (op_sub_to, OPSUBTO)
+        {
+                int32_t value;
+                POP_INTO (value);
+
+                int32_t *location = bp + ARG;
+                CHECK_LOCATION (location, "update: attempted to update with invalid VM configuration");
+                *location -= value;
+                NEXT ();
+        }
+
+        TARGET (op_mult_to, OPMULTTO)
+        {
+                int32_t value;
+                POP_INTO (value);
+
+                int32_t *location = bp + ARG;
+                CHECK_LOCATION (location, "update: attempted to update with invalid VM configuration");
+                *location *= value;
+                NEXT ();
+        }
+
+        TARGET (op_push, OPPUSH)
+        {
+                PUSH (ARG);
+                NEXT ();
+        }
+
+        TARGET (op_pop, OPPOP)
+        {
+                int32_t discarded;
+                POP_INTO (discarded);
+                (void)discarded;
+                NEXT ();
+        }
+
+        TARGET (op_call, OPCALL)
+        {
+                PUSH (ip->address);
+
+                if (thread->frame_no >= thread->frame_high) {
+                        if (thread->frame_no == thread->frame_capacity && !this->grow_frames (thread)) {
+                                fprintf (stderr, "call: maximum recursion depth exceeded\n");
+                                thread->state = KILLED;
+                                ops++;
+                                goto switch_thread;
+                        }
+
+                        thread->frame_high = thread->frame_no + 1;
+                }
+
+                /* verified code is covered up to the deepest frame it reached so far */
+                if (!checked && sp + ip[-1].frame_size >= thread->stack_high) {
+                        thread->stack_high = sp + ip[-1].frame_size + 1;
+                        GROW_STACK (thread->stack_high - thread->stack);
+                }
+
+                thread->stack_frames[thread->frame_no++] = bp;
+                bp = sp;
+
+                /* a hot callee runs in machine code and returns here when it is done */
+                if (!checked && this->jit) {
+                        thread->sp = sp;
+                        thread->bp = bp;
+
+                        if (this->jit_call (JUMP_TARGET->address)) {
+                                sp = thread->sp;
+                                bp = thread->bp;
+
+                                if (thread->state != RUNNING) {
+                                        ops++;
+                                        goto switch_thread;
+                                }
+
+                                ip = this->resolve_address (thread->ip - thread->instructions);
+                                NEXT_BRANCH ();
+                        }
+                }
+
+                ip = JUMP_TARGET;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_ret, OPRET)
+        {
+                int32_t ret_value, ret_addr;
+                POP_INTO (ret_value);
+                POP_INTO (ret_addr);
+
+                if (thread->frame_no == 0) {
+                        fprintf (stderr, "error: ret: no stack frame to return to\n");
+                        exit (EXIT_FAILURE);
+                }
+
+                bp = thread->stack_frames[--thread->frame_no];
+                ip = this->resolve_address (ret_addr);
+
+                if (!ip) {
+                        fprintf (stderr, "error: ret: invalid return address: %d\n", ret_addr);
+                        exit (EXIT_FAILURE);
+                }
+
+                *sp++ = ret_value;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_tailcall, OPTAILCALL)
+        {
+                int32_t *params = bp - 1 - ARG2;
+                CHECK_LOCATION (params, "tailcall: attempted to reuse a frame with invalid VM configuration");
+
+                /* the arguments take the place of the parameters below the return address */
+                for (int32_t i = ARG2 - 1; i >= 0; i--)
+                        POP_INTO (params[i]);
+
+                sp = bp;
+
+                if (!checked && sp + ip[-1].frame_size >= thread->stack_high) {
+                        thread->stack_high = sp + ip[-1].frame_size + 1;
+                        GROW_STACK (thread->stack_high - thread->stack);
+                }
+
+                ip = JUMP_TARGET;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_load_push_lt_jmpfalse, OPLOAD_PUSH_LT_JMPFALSE)
+        {
+                int32_t *load_location = bp + ARG;
+                CHECK_LOCATION (load_location, "load: attempted to load with invalid VM configuration");
+
+                if (!(*load_location < ARG2))
+                        ip = JUMP_TARGET;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_load_push_add, OPLOAD_PUSH_ADD)
+        {
+                int32_t *load_location = bp + ARG;
+                CHECK_LOCATION (load_location, "load: attempted to load with invalid VM configuration");
+                PUSH (*load_location + ARG2);
+                NEXT ();
+        }
+
+        TARGET (op_load_add_store, OPLOAD_ADD_STORE)
+        {
+                int32_t *load_location = bp + ARG;
+                int32_t *store_location = bp + ARG2;
+                int32_t a;
+
+                CHECK_LOCATION (load_location, "load: attempted to load with invalid VM configuration");
+                CHECK_LOCATION (store_location, "store: attempted to store with invalid VM configuration");
+                load_location = bp + ARG;
+                POP_INTO (a);
+
+                *store_location = a + *load_location;
+
+                if (store_location >= sp)
+                        sp = store_location + 1;
+                NEXT ();
+        }
+
+        TARGET (op_load_load, OPLOAD_LOAD)
+        {
+                int32_t *first = bp + ARG;
+                int32_t *second = bp + ARG2;
+
+                CHECK_LOCATION (first, "load: attempted to load with invalid VM configuration");
+                CHECK_LOCATION (second, "load: attempted to load with invalid VM configuration");
+
+                /* the second load may read the slot the first one pushes to */
+                PUSH (bp[ARG]);
+                PUSH (bp[ARG2]);
+                NEXT ();
+        }
+
+        TARGET (op_store_pop, OPSTORE_POP)
+        {
+                int32_t value;
+                POP_INTO (value);
+
+                int32_t *store_location = bp + ARG;
+                CHECK_LOCATION (store_location, "store: attempted to store with invalid VM configuration");
+
+                *store_location = value;
+
+                if (store_location >= sp)
+                        sp = store_location + 1;
+
+                POP_INTO (value);
+                NEXT ();
+        }
+
+        TARGET (op_lt_jmpfalse, OPLT_JMPFALSE)
+        {
+                int32_t b, a;
+                POP_INTO (b);
+                POP_INTO (a);
+
+                if (!(a < b))
+                        ip = JUMP_TARGET;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_inc_jmp, OPINC_JMP)
+        {
+                int32_t *location = bp + ARG;
+                CHECK_LOCATION (location, "inc: attempted to increment with invalid VM configuration");
+                *location += ARG2;
+                ip = JUMP_TARGET;
+                NEXT_BRANCH ();
+        }
+
+        TARGET (op_print, OPPRINT) SLOW_OP (this->print_op ());
+        TARGET (op_halt, OPHALT) YIELD_OP (this->halt_op ());
+        TARGET (op_fork, OPFORK) YIELD_OP (this->fork_op ());
+        TARGET (op_kill, OPKILL) YIELD_OP (this->kill_op ());
+        TARGET (op_yield, OPYIELD) YIELD_OP ((void)0);
+        TARGET (op_chan, OPCHAN) SLOW_OP (this->chan_op ());
+        TARGET (op_send, OPSEND) BLOCKING_OP (this->send_op ());
+        TARGET (op_recv, OPRECV) BLOCKING_OP (this->recv_op ());
+        TARGET (op_exit, OPEXIT) YIELD_OP (this->exit_op ());
+        TARGET (op_join, OPJOIN) BLOCKING_OP (this->join_op ());
+        TARGET (op_join_any, OPJOINANY) BLOCKING_OP (this->join_any_op ());
+        TARGET (op_open, OPOPEN) SLOW_OP (this->open_op ());
+        TARGET (op_read, OPREAD) BLOCKING_OP (this->read_byte_op ());
+        TARGET (op_write, OPWRITE) BLOCKING_OP (this->write_byte_op ());
+        TARGET (op_close, OPCLOSE) BLOCKING_OP (this->close_op ());
+        TARGET (op_pipe, OPPIPE) SLOW_OP (this->pipe_op (false));
+        TARGET (op_socketpair, OPSOCKETPAIR) SLOW_OP (this->pipe_op (true));
+
+        TARGET (op_illegal, OP_ILLEGAL)
+        {
+                fprintf (stderr, "illegal instruction: 0x%x\n", this->thread->instructions[ip[-1].address]);
+                thread->state = KILLED;
+                ops++;
+                goto switch_thread;
+        }
+
+        TARGET (op_bad_target, OP_BAD_TARGET)
+        {
+                fprintf (stderr, "error: invalid jump target\n");
+                exit (EXIT_FAILURE);
+        }
+
+        TARGET (op_end_of_code, OP_END_OF_CODE)
+        {
+                fprintf (stderr, "error: overflow: invalid instruction pointer location: address: %d", ip[-1].address);
+                exit (EXIT_FAILURE);
+        }
+
+#if !COMPUTED_GOTO
+        default: break;
+        }
+#endif
+
+switch_thread:
+        SAVE_STATE ();
+reschedule:
+        if (!this->schedule ())
+                return;
+
+        LOAD_STATE ();
+        DISPATCH ();
+
+#undef BLOCKING_OP
+#undef YIELD_OP
+#undef SLOW_OP
+#undef BINARY_OP
+#undef POP_INTO
+#undef PUSH
+#undef CHECK_LOCATION
+#undef GROW_STACK
+#undef STACK_ERROR
+#undef NEXT_BRANCH
+#undef NEXT
+#undef LOAD_STATE
+#undef SAVE_STATE
+#undef JUMP_TARGET
+#undef ARG2
+#undef ARG
+#undef DISPATCH
+#undef TARGET
+}
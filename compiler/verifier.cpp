@@ -0,0 +1,590 @@
+#include "verifier.h"
+#include "bytecode.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+Verifier::Verifier (int8_t *code, size_t code_size, int32_t stack_size)
+{
+        this->code = code;
+        this->code_size = code_size;
+        this->stack_size = stack_size;
+        this->registers = false;
+}
+
+/**
+ * Report a verification failure at address in the same format as dump_bytecode
+ */
+bool Verifier::fail (size_t address, const char *message)
+{
+        enum OpCode op = OPHALT;
+        int32_t args[MAX_OPERANDS] = { 0 };
+
+        if (this->registers) {
+                enum RegOpCode rop = ROP_HALT;
+
+                if (address < this->code_size) {
+                        rop = (enum RegOpCode)this->code[address];
+
+                        for (int i = 0; i < Bytecode::register_operand_count (rop); i++) {
+                                if (address + 1 + (i + 1) * sizeof (int32_t) <= this->code_size)
+                                        args[i] = AS_INT32 (&this->code[address + 1 + i * sizeof (int32_t)]);
+                        }
+                }
+
+                fprintf (stderr, "error: bytecode verification failed at ");
+                Bytecode::print_register_instruction (stderr, address, rop, args);
+                fprintf (stderr, ": %s\n", message);
+
+                return false;
+        }
+
+        if (address < this->code_size) {
+                op = (enum OpCode)this->code[address];
+
+                for (int i = 0; i < Bytecode::operand_count (op); i++) {
+                        if (address + 1 + (i + 1) * sizeof (int32_t) <= this->code_size)
+                                args[i] = AS_INT32 (&this->code[address + 1 + i * sizeof (int32_t)]);
+                }
+        }
+
+        fprintf (stderr, "error: bytecode verification failed at ");
+        Bytecode::print_instruction (stderr, address, op, args);
+        fprintf (stderr, ": %s\n", message);
+
+        return false;
+}
+
+/**
+ * Read the instruction at address. Only valid after decode () succeeded.
+ */
+void Verifier::fetch (size_t address, enum OpCode *op, int32_t *args, size_t *next)
+{
+        *op = (enum OpCode)this->code[address];
+        *next = address + 1;
+
+        for (int i = 0; i < Bytecode::operand_count (*op); i++) {
+                args[i] = AS_INT32 (&this->code[*next]);
+                *next += sizeof (int32_t);
+        }
+}
+
+/**
+ * Walk the image linearly, checking every opcode and operand and recording
+ * the instruction boundaries.
+ */
+bool Verifier::decode ()
+{
+        this->boundaries.assign (this->code_size, false);
+
+        size_t c = 0;
+
+        while (c < this->code_size) {
+                int8_t op = this->code[c];
+
+                if (op < OPADD || op >= OPCODE_COUNT)
+                        return this->fail (c, "invalid opcode");
+
+                size_t size = 1 + Bytecode::operand_count ((enum OpCode)op) * sizeof (int32_t);
+
+                if (c + size > this->code_size)
+                        return this->fail (c, "truncated operand");
+
+                this->boundaries[c] = true;
+                c += size;
+        }
+
+        return true;
+}
+
+/**
+ * Every jump and call must land on an instruction boundary
+ */
+bool Verifier::check_targets ()
+{
+        size_t c = 0;
+
+        while (c < this->code_size) {
+                enum OpCode op;
+                int32_t args[MAX_OPERANDS];
+                size_t next;
+
+                this->fetch (c, &op, args, &next);
+
+                int target = Bytecode::jump_operand (op);
+
+                if (target != -1) {
+                        int32_t address = args[target];
+
+                        if (address < 0 || (size_t)address >= this->code_size || !this->boundaries[address])
+                                return this->fail (c, "target is not an instruction boundary");
+                }
+
+                c = next;
+        }
+
+        return true;
+}
+
+/**
+ * Abstract interpretation of a single function over stack depth ranges. Computes
+ * the frame size and how deep below bp the function reads its parameters, and
+ * rejects any path that could underflow the frame, return with anything but the
+ * return value on the frame, or grow the stack without bound.
+ */
+bool Verifier::analyze_function (int32_t entry_address, bool is_script)
+{
+        std::unordered_map<size_t, struct depth_range> states;
+        std::vector<size_t> worklist;
+        int32_t frame_size = 0;
+        int32_t param_depth = 0;
+
+        states[entry_address] = (struct depth_range){ 0, 0 };
+        worklist.push_back (entry_address);
+
+        while (!worklist.empty ()) {
+                size_t address = worklist.back ();
+                worklist.pop_back ();
+
+                struct depth_range depth = states[address];
+                enum OpCode op;
+                int32_t args[MAX_OPERANDS];
+                size_t next;
+
+                this->fetch (address, &op, args, &next);
+
+                size_t successors[2];
+                int successor_count = 1;
+                successors[0] = next;
+
+                /* a superinstruction is checked as the sequence it stands for, which only jumps at its end */
+                enum OpCode sequence[MAX_SEQUENCE];
+                int length = Bytecode::superinstruction_sequence (op, sequence);
+                int operand = 0;
+
+                if (length == 0) {
+                        sequence[0] = op;
+                        length = 1;
+                }
+
+                for (int k = 0; k < length; k++) {
+                        int32_t arg = Bytecode::has_operand (sequence[k]) ? args[operand] : 0;
+                        int32_t pops = 0, pushes = 0;
+
+                        operand += Bytecode::operand_count (sequence[k]);
+
+                        switch (sequence[k]) {
+                        case OPADD:
+                        case OPMULT:
+                        case OPDIV:
+                        case OPMOD:
+                        case OPEQ:
+                        case OPGT:
+                        case OPLT:
+                        case OPGTEQ:
+                        case OPLTEQ:
+                        case OPAND:
+                        case OPOR:
+                        case OPNEQ:
+                        case OPSUB: pops = 2, pushes = 1; break;
+                        case OPNEG:
+                        case OPNOT:
+                        case OPKILL:
+                        case OPCHAN:
+                        case OPRECV:
+                        case OPJOIN:
+                        case OPREAD:
+                        case OPCLOSE: pops = 1, pushes = 1; break;
+                        case OPSEND:
+                        case OPOPEN:
+                        case OPWRITE: pops = 2, pushes = 1; break;
+                        case OPPUSH:
+                        case OPFORK:
+                        case OPJOINANY:
+                        case OPPIPE:
+                        case OPSOCKETPAIR: pushes = 1; break;
+                        case OPPOP:
+                        case OPPRINT: pops = 1; break;
+                        case OPDUP: pops = 1, pushes = 2; break;
+                        case OPLOAD:
+                        case OPSTORE:
+                        case OPINC:
+                        case OPADDTO:
+                        case OPSUBTO:
+                        case OPMULTTO: {
+                                if (arg < 0 && is_script)
+                                        return this->fail (address, "frame offset below the script frame");
+
+                                if (sequence[k] != OPLOAD && arg == -1)
+                                        return this->fail (address, "store overwrites the return address");
+
+                                param_depth = MAX (param_depth, -arg);
+                                frame_size = MAX (frame_size, arg + 1);
+
+                                if (sequence[k] == OPLOAD)
+                                        pushes = 1;
+                                else if (sequence[k] != OPINC)
+                                        pops = 1;
+                                break;
+                        }
+                        case OPJMP: successors[0] = arg; break;
+                        case OPJMPFALSE: {
+                                pops = 1;
+                                successors[1] = arg;
+                                successor_count = 2;
+                                break;
+                        }
+                        case OPCALL: {
+                                this->call_sites.push_back ((struct call_site){ address, arg, depth.lo });
+
+                                if (this->frame_sizes[arg] == -1 &&
+                                    this->param_depths.find (arg) == this->param_depths.end ()) {
+                                        this->param_depths[arg] = 0;
+                                        this->pending_functions.push_back (arg);
+                                }
+
+                                /* the return address slot is replaced by the return value */
+                                pushes = 1;
+                                break;
+                        }
+                        case OPTAILCALL: {
+                                if (is_script)
+                                        return this->fail (address, "tail call outside of a function");
+
+                                if (args[1] < 0)
+                                        return this->fail (address, "negative argument count");
+
+                                /* the arguments overwrite the parameters of this function */
+                                param_depth = MAX (param_depth, args[1] + 1);
+                                this->tail_sites.push_back ((struct tail_site){ address, arg, entry_address });
+
+                                if (this->frame_sizes[arg] == -1 &&
+                                    this->param_depths.find (arg) == this->param_depths.end ()) {
+                                        this->param_depths[arg] = 0;
+                                        this->pending_functions.push_back (arg);
+                                }
+
+                                pops = args[1];
+                                successor_count = 0;
+                                break;
+                        }
+                        case OPRET: {
+                                if (is_script)
+                                        return this->fail (address, "return outside of a function");
+
+                                if (depth.lo != 1 || depth.hi != 1)
+                                        return this->fail (address,
+                                                           "return with values other than the result on the frame");
+
+                                successor_count = 0;
+                                break;
+                        }
+                        case OPHALT: successor_count = 0; break;
+                        case OPEXIT: pops = 1, successor_count = 0; break;
+                        case OPYIELD: break;
+                        default: return this->fail (address, "invalid opcode");
+                        }
+
+                        if (depth.lo < pops)
+                                return this->fail (address, "stack underflow");
+
+                        struct depth_range after = { depth.lo - pops + pushes, depth.hi - pops + pushes };
+
+                        /* a store past the top of the stack grows the stack up to the stored slot */
+                        if (sequence[k] == OPSTORE)
+                                after = (struct depth_range){ MAX (after.lo, arg + 1), MAX (after.hi, arg + 1) };
+
+                        frame_size = MAX (frame_size, after.hi);
+
+                        if (frame_size >= this->stack_size)
+                                return this->fail (address, "stack depth exceeds the stack size");
+
+                        depth = after;
+                }
+
+                struct depth_range after = depth;
+
+                for (int i = 0; i < successor_count; i++) {
+                        size_t successor = successors[i];
+
+                        if (successor >= this->code_size)
+                                return this->fail (address, "execution falls off the end of the code");
+
+                        auto state = states.find (successor);
+
+                        if (state == states.end ()) {
+                                states[successor] = after;
+                                worklist.push_back (successor);
+                                continue;
+                        }
+
+                        struct depth_range merged = { MIN (state->second.lo, after.lo),
+                                                      MAX (state->second.hi, after.hi) };
+
+                        if (merged.lo != state->second.lo || merged.hi != state->second.hi) {
+                                state->second = merged;
+                                worklist.push_back (successor);
+                        }
+                }
+        }
+
+        for (auto &state : states) {
+                struct depth_range &known = this->depths[state.first];
+
+                if (known.lo == -1)
+                        known = state.second;
+                else
+                        known = (struct depth_range){ MIN (known.lo, state.second.lo), MAX (known.hi, state.second.hi) };
+        }
+
+        this->frame_sizes[entry_address] = frame_size;
+        this->param_depths[entry_address] = param_depth;
+
+        return true;
+}
+
+/**
+ * A callee may only read parameters the caller has pushed onto its own frame
+ */
+bool Verifier::check_call_sites ()
+{
+        for (struct call_site &site : this->call_sites) {
+                if (this->param_depths[site.callee] > site.depth + 1)
+                        return this->fail (site.address, "callee reads more parameters than are on the stack");
+        }
+
+        /* a tail callee finds the parameters of the function it replaces */
+        for (struct tail_site &site : this->tail_sites) {
+                if (this->param_depths[site.callee] > this->param_depths[site.caller])
+                        return this->fail (site.address, "tail callee reads more parameters than its caller has");
+        }
+
+        return true;
+}
+
+/**
+ * Verify the whole image, starting with the script at entry_address and every
+ * function reachable from it through OPCALL or OPTAILCALL.
+ */
+bool Verifier::verify (int32_t entry_address)
+{
+        this->registers = false;
+        this->frame_sizes.assign (this->code_size, -1);
+        this->depths.assign (this->code_size, (struct depth_range){ -1, -1 });
+        this->param_depths.clear ();
+        this->call_sites.clear ();
+        this->tail_sites.clear ();
+        this->pending_functions.clear ();
+
+        if (!this->decode () || !this->check_targets ())
+                return false;
+
+        if (entry_address < 0 || (size_t)entry_address >= this->code_size || !this->boundaries[entry_address])
+                return this->fail (entry_address, "entry point is not an instruction boundary");
+
+        this->param_depths[entry_address] = 0;
+
+        if (!this->analyze_function (entry_address, true))
+                return false;
+
+        while (!this->pending_functions.empty ()) {
+                int32_t function = this->pending_functions.back ();
+                this->pending_functions.pop_back ();
+
+                if (!this->analyze_function (function, false))
+                        return false;
+        }
+
+        return this->check_call_sites ();
+}
+
+/**
+ * Walk a register image linearly, checking every opcode and operand and
+ * recording the instruction boundaries.
+ */
+bool Verifier::decode_registers ()
+{
+        this->boundaries.assign (this->code_size, false);
+
+        size_t c = 0;
+
+        while (c < this->code_size) {
+                int8_t op = this->code[c];
+
+                if (op < ROP_ADD || op > ROP_HALT)
+                        return this->fail (c, "invalid opcode");
+
+                size_t size = 1 + Bytecode::register_operand_count ((enum RegOpCode)op) * sizeof (int32_t);
+
+                if (c + size > this->code_size)
+                        return this->fail (c, "truncated operand");
+
+                this->boundaries[c] = true;
+                c += size;
+        }
+
+        return true;
+}
+
+/**
+ * Register functions have no stack to track, only the frame slots they name.
+ * Computes the frame size and parameter depth of the function and checks that
+ * every path stays within the code and never overwrites the return address.
+ */
+bool Verifier::analyze_register_function (int32_t entry_address, bool is_script)
+{
+        std::vector<bool> visited (this->code_size, false);
+        std::vector<size_t> worklist;
+        int32_t frame_size = 0;
+        int32_t param_depth = 0;
+
+        visited[entry_address] = true;
+        worklist.push_back (entry_address);
+
+        while (!worklist.empty ()) {
+                size_t address = worklist.back ();
+                worklist.pop_back ();
+
+                enum RegOpCode op = (enum RegOpCode)this->code[address];
+                int operand_count = Bytecode::register_operand_count (op);
+                int32_t args[MAX_REG_OPERANDS];
+                size_t next = address + 1 + operand_count * sizeof (int32_t);
+
+                for (int i = 0; i < operand_count; i++)
+                        args[i] = AS_INT32 (&this->code[address + 1 + i * sizeof (int32_t)]);
+
+                /* which operands name slots, which one is written and which one is a code address */
+                int slots = 0, dst = -1, target = -1;
+                bool falls_through = true;
+
+                if (ROP_ADD <= op && op <= ROP_SUB) {
+                        slots = 3, dst = 0;
+                } else if (ROP_JEQ <= op && op <= ROP_JGTEQ) {
+                        slots = 2, target = 2;
+                } else if (ROP_JEQK <= op && op <= ROP_JGTEQK) {
+                        slots = 1, target = 2;
+                } else {
+                        switch (op) {
+                        case ROP_ADDK:
+                        case ROP_NEG:
+                        case ROP_NOT:
+                        case ROP_MOV:
+                        case ROP_KILL: slots = 2, dst = 0; break;
+                        case ROP_LOADK:
+                        case ROP_FORK: slots = 1, dst = 0; break;
+                        case ROP_JMP: target = 0, falls_through = false; break;
+                        case ROP_JMPFALSE: slots = 1, target = 1; break;
+                        case ROP_PRINT: slots = 1; break;
+                        case ROP_CALL: {
+                                /* the base slot receives the return address and the result */
+                                args[0] = args[1];
+                                slots = 1, dst = 0;
+
+                                int32_t callee = AS_INT32 (&this->code[address + 1]);
+
+                                if (callee < 0 || (size_t)callee >= this->code_size || !this->boundaries[callee])
+                                        return this->fail (address, "target is not an instruction boundary");
+
+                                this->call_sites.push_back ((struct call_site){ address, callee, args[1] });
+
+                                if (this->frame_sizes[callee] == -1 &&
+                                    this->param_depths.find (callee) == this->param_depths.end ()) {
+                                        this->param_depths[callee] = 0;
+                                        this->pending_functions.push_back (callee);
+                                }
+                                break;
+                        }
+                        case ROP_RET: {
+                                if (is_script)
+                                        return this->fail (address, "return outside of a function");
+
+                                slots = 1, falls_through = false;
+                                break;
+                        }
+                        case ROP_HALT: falls_through = false; break;
+                        case ROP_YIELD: break;
+                        default: return this->fail (address, "invalid opcode");
+                        }
+                }
+
+                for (int i = 0; i < slots; i++) {
+                        if (args[i] < 0 && is_script)
+                                return this->fail (address, "frame offset below the script frame");
+
+                        if (i == dst && args[i] == -1)
+                                return this->fail (address, "store overwrites the return address");
+
+                        param_depth = MAX (param_depth, -args[i]);
+                        frame_size = MAX (frame_size, args[i] + 1);
+                }
+
+                if (frame_size >= this->stack_size)
+                        return this->fail (address, "frame exceeds the stack size");
+
+                size_t successors[2];
+                int successor_count = 0;
+
+                if (falls_through)
+                        successors[successor_count++] = next;
+
+                if (target != -1) {
+                        int32_t jump = AS_INT32 (&this->code[address + 1 + target * sizeof (int32_t)]);
+
+                        if (jump < 0 || (size_t)jump >= this->code_size || !this->boundaries[jump])
+                                return this->fail (address, "target is not an instruction boundary");
+
+                        successors[successor_count++] = jump;
+                }
+
+                for (int i = 0; i < successor_count; i++) {
+                        if (successors[i] >= this->code_size)
+                                return this->fail (address, "execution falls off the end of the code");
+
+                        if (!visited[successors[i]]) {
+                                visited[successors[i]] = true;
+                                worklist.push_back (successors[i]);
+                        }
+                }
+        }
+
+        this->frame_sizes[entry_address] = frame_size;
+        this->param_depths[entry_address] = param_depth;
+
+        return true;
+}
+
+/**
+ * Verify a register instruction image. Unlike stack images these are only ever
+ * run on the unchecked path, so failing images must be rejected.
+ */
+bool Verifier::verify_registers (int32_t entry_address)
+{
+        this->registers = true;
+        this->frame_sizes.assign (this->code_size, -1);
+        this->param_depths.clear ();
+        this->call_sites.clear ();
+        this->pending_functions.clear ();
+
+        if (!this->decode_registers ())
+                return false;
+
+        if (entry_address < 0 || (size_t)entry_address >= this->code_size || !this->boundaries[entry_address])
+                return this->fail (entry_address, "entry point is not an instruction boundary");
+
+        this->param_depths[entry_address] = 0;
+
+        if (!this->analyze_register_function (entry_address, true))
+                return false;
+
+        while (!this->pending_functions.empty ()) {
+                int32_t function = this->pending_functions.back ();
+                this->pending_functions.pop_back ();
+
+                if (!this->analyze_register_function (function, false))
+                        return false;
+        }
+
+        return this->check_call_sites ();
+}
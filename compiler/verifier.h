@@ -0,0 +1,71 @@
+#ifndef verifier_h
+#define verifier_h
+
+#include "bytecode.h"
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Range of stack depths, relative to the frame base pointer, that an
+ * instruction can observe on entry.
+ */
+struct depth_range {
+        int32_t lo;
+        int32_t hi;
+};
+
+class Verifier {
+    public:
+        Verifier (int8_t *code, size_t code_size, int32_t stack_size);
+        bool verify (int32_t entry_address);
+        bool verify_registers (int32_t entry_address);
+
+        /*
+         * frame size (maximum stack depth, relative to bp) of every function,
+         * indexed by entry address. -1 for addresses that are not entry points.
+         */
+        std::vector<int32_t> frame_sizes;
+
+        /* stack depth on entry to every instruction of a stack image, lo == -1 if unreachable */
+        std::vector<struct depth_range> depths;
+
+    private:
+        int8_t *code;
+        size_t code_size;
+        int32_t stack_size;
+        bool registers;
+
+        std::vector<bool> boundaries;
+
+        /* number of slots below bp each function reads, indexed by entry address */
+        std::unordered_map<int32_t, int32_t> param_depths;
+
+        struct call_site {
+                size_t address;
+                int32_t callee;
+                int32_t depth;
+        };
+
+        std::vector<struct call_site> call_sites;
+
+        struct tail_site {
+                size_t address;
+                int32_t callee;
+                int32_t caller;
+        };
+
+        std::vector<struct tail_site> tail_sites;
+        std::vector<int32_t> pending_functions;
+
+        bool decode ();
+        bool check_targets ();
+        bool analyze_function (int32_t entry_address, bool is_script);
+        bool check_call_sites ();
+        bool decode_registers ();
+        bool analyze_register_function (int32_t entry_address, bool is_script);
+        void fetch (size_t address, enum OpCode *op, int32_t *args, size_t *next);
+        bool fail (size_t address, const char *message);
+};
+
+#endif
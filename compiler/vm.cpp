@@ -1,27 +1,133 @@
 #include "vm.h"
 #include "bytecode.h"
 #include "function.h"
+#include "verifier.h"
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
 VM::VM ()
 {
-        for (int i = 0; i < MAX_THREADS; i++) {
-                this->threads[i].state = UNUSED;
-        }
-        this->thread = this->allocate_thread ();
+        this->runtime = new struct runtime;
+        this->runtime->live = 0;
+        this->runtime->image = NULL;
+        this->runtime->image_length = 0;
+        this->runtime->code = NULL;
+        this->runtime->capacity = 0;
+        this->runtime->free_threads = NULL;
+        this->runtime->peak = 0;
+        this->runtime->jit_entries = NULL;
+        this->runtime->jit_rejected = NULL;
+        this->runtime->jit_enter = NULL;
+        this->runtime->jit_compiled = 0;
+        this->runtime->blocked = 0;
+        this->runtime->epoll_fd = -1;
+        this->runtime->io_waiting = 0;
+        this->runtime->io_dirty = false;
+        this->runtime->workers.push_back (this);
+        this->id = 0;
+        this->thread = this->allocate_thread (NULL);
         this->thread->ip = NULL;
         this->thread->bp = NULL;
         this->thread->frame_no = 0;
         this->thread->op_count = 0;
         this->verbose = false;
+        this->verify = true;
+        this->verified = false;
+        this->engine = ENGINE_SWITCH;
+        this->quantum = DEFAULT_QUANTUM;
+        this->workers = 1;
+        this->alone = true;
+        this->code_size = 0;
+        this->isa = ISA_STACK;
+        this->executed = 0;
+        this->io_polled = 0;
+        this->program = NULL;
+        this->decoded_at = NULL;
+        this->jit = false;
+        this->arguments = NULL;
+        this->argument_count = 0;
+        this->profile = NULL;
+        this->profile_interval = PROFILE_INTERVAL;
+        this->opstats = NULL;
+        this->opstats_triples = false;
+        this->next_sample = 0;
+        this->call_counts = NULL;
+        this->jit_stack = NULL;
         this->thread->next = this->thread;
         this->thread->previous = this->thread;
 }
 
+/**
+ * Create worker id of the program loaded into main. Workers start without a
+ * thread and steal their first one.
+ */
+VM::VM (VM *main, int32_t id)
+{
+        this->runtime = main->runtime;
+        this->id = id;
+        this->thread = NULL;
+        this->alone = false;
+        this->verbose = main->verbose;
+        this->verify = main->verify;
+        this->verified = main->verified;
+        this->frame_sizes = main->frame_sizes;
+        this->engine = main->engine;
+        this->quantum = main->quantum;
+        this->workers = main->workers;
+        this->code_size = main->code_size;
+        this->isa = main->isa;
+        this->executed = 0;
+        this->io_polled = 0;
+        this->program = NULL;
+        this->decoded_at = NULL;
+        this->jit = main->jit;
+        this->arguments = main->arguments;
+        this->argument_count = main->argument_count;
+        this->profile = main->profile;
+        this->profile_interval = main->profile_interval;
+        this->opstats = main->opstats;
+        this->opstats_triples = main->opstats_triples;
+        this->next_sample = main->profile_interval;
+        this->call_counts = NULL;
+        this->jit_stack = NULL;
+
+        if (this->jit) {
+                this->call_counts = (uint32_t *)calloc (this->code_size, sizeof (uint32_t));
+
+                if (!this->call_counts) {
+                        perror ("calloc");
+                        exit (EXIT_FAILURE);
+                }
+        }
+}
+
+VM::~VM ()
+{
+        free (this->program);
+        free (this->decoded_at);
+        free (this->call_counts);
+
+        if (this->jit_stack)
+                munmap (this->jit_stack, JIT_STACK_SIZE);
+
+        if (this->id == 0) {
+                this->unmap_image ();
+                this->destroy_jit ();
+                this->destroy_channels ();
+                this->destroy_io ();
+                this->destroy_threads ();
+                delete this->runtime;
+        }
+}
+
 void VM::assert_valid_ip (int8_t *ip)
 {
         if (ip < this->thread->instructions) {
@@ -31,7 +137,7 @@ void VM::assert_valid_ip (int8_t *ip)
                 exit (EXIT_FAILURE);
         }
 
-        if (ip >= this->thread->instructions + CODE_SIZE) {
+        if (ip >= this->thread->instructions + this->code_size) {
                 fprintf (stderr,
                          "error: overflow: invalid instruction pointer location: address: %ld",
                          this->thread->ip - this->thread->instructions);
@@ -39,23 +145,33 @@ void VM::assert_valid_ip (int8_t *ip)
         }
 }
 
-void VM::assert_valid_stack_location (const char *prefix, void *ptr)
+/**
+ * Check a stack slot of unverified code, growing the stack when the slot lies
+ * past the high-water mark. Returns the slot, which moved if the stack grew.
+ */
+int32_t *VM::checked_stack_location (const char *prefix, int32_t *ptr)
 {
-        if (ptr >= this->thread->stack + STACK_SIZE) {
-                fprintf (stderr, "error: stack overflow: %s\n", prefix);
-                fprintf (stderr, "ip: %ld", this->thread->ip - this->thread->instructions);
-
-                exit (EXIT_FAILURE);
-        } else if (ptr < this->thread->stack) {
+        if (ptr < this->thread->stack) {
                 fprintf (stderr, "error: stack underflow: %s\n", prefix);
                 fprintf (stderr, "ip: %ld", this->thread->ip - this->thread->instructions);
                 exit (EXIT_FAILURE);
         }
+
+        if (ptr >= this->thread->stack_high) {
+                size_t offset = ptr - this->thread->stack;
+
+                this->thread->stack_high = ptr + 1;
+                this->grow_stack (this->thread, offset + 1);
+                ptr = this->thread->stack + offset;
+        }
+
+        return ptr;
 }
 
 int32_t VM::read_int32 ()
 {
-        this->assert_valid_ip (this->thread->ip);
+        if (!this->verified)
+                this->assert_valid_ip (this->thread->ip + sizeof (int32_t) - 1);
 
         int32_t value = *(int32_t *)this->thread->ip;
         this->thread->ip += sizeof (int32_t);
@@ -64,7 +180,8 @@ int32_t VM::read_int32 ()
 
 enum OpCode VM::read_op ()
 {
-        this->assert_valid_ip (this->thread->ip);
+        if (!this->verified)
+                this->assert_valid_ip (this->thread->ip);
 
         int8_t op = *this->thread->ip;
         this->thread->ip += sizeof (int8_t);
@@ -76,8 +193,9 @@ int32_t VM::pop ()
 {
         this->thread->sp -= 1;
 
-        this->assert_valid_stack_location ("pop: attempted to pop stack with invalid VM configuration",
-                                           this->thread->sp);
+        if (!this->verified)
+                this->checked_stack_location ("pop: attempted to pop stack with invalid VM configuration",
+                                              this->thread->sp);
 
         return *this->thread->sp;
 }
@@ -86,8 +204,10 @@ void VM::push (int32_t v)
 {
         *this->thread->sp = v;
         this->thread->sp += 1;
-        this->assert_valid_stack_location ("push: attempted to push stack with invalid VM configuration",
-                                           this->thread->sp);
+
+        if (!this->verified)
+                this->thread->sp = this->checked_stack_location (
+                        "push: attempted to push stack with invalid VM configuration", this->thread->sp);
 }
 
 void VM::bin_op (enum OpCode op)
@@ -107,6 +227,8 @@ void VM::bin_op (enum OpCode op)
         case OPLTEQ: c = (a <= b); break;
         case OPAND: c = (a && b); break;
         case OPOR: c = (a || b); break;
+        case OPNEQ: c = (a != b); break;
+        case OPSUB: c = a - b; break;
         default: exit (EXIT_FAILURE); break;
         }
         this->push (c);
@@ -143,7 +265,9 @@ void VM::store_op ()
 
         int32_t *store_location = this->thread->bp + offset;
 
-        assert_valid_stack_location ("store: attempted to store with invalid VM configuration", store_location);
+        if (!this->verified)
+                store_location = checked_stack_location ("store: attempted to store with invalid VM configuration",
+                                                         store_location);
 
         *store_location = value;
 
@@ -152,12 +276,48 @@ void VM::store_op ()
         }
 }
 
+void VM::dup_op ()
+{
+        int32_t value = pop ();
+
+        push (value);
+        push (value);
+}
+
+void VM::inc_op ()
+{
+        int32_t offset = read_int32 ();
+        int32_t value = read_int32 ();
+
+        int32_t *location = this->thread->bp + offset;
+        if (!this->verified)
+                location = checked_stack_location ("inc: attempted to increment with invalid VM configuration", location);
+        *location += value;
+}
+
+void VM::update_op (enum OpCode op)
+{
+        int32_t offset = read_int32 ();
+        int32_t value = pop ();
+
+        int32_t *location = this->thread->bp + offset;
+        if (!this->verified)
+                location = checked_stack_location ("update: attempted to update with invalid VM configuration", location);
+        switch (op) {
+        case OPADDTO: *location += value; break;
+        case OPSUBTO: *location -= value; break;
+        default: *location *= value; break;
+        }
+}
+
 void VM::load_op ()
 {
         int32_t offset = read_int32 ();
 
         int32_t *load_location = this->thread->bp + offset;
-        assert_valid_stack_location ("load: attempted to load with invalid VM configuration", load_location);
+        if (!this->verified)
+                load_location = checked_stack_location ("load: attempted to load with invalid VM configuration",
+                                                        load_location);
         push (*load_location);
 }
 
@@ -166,15 +326,57 @@ void VM::call_op ()
         int32_t addr = read_int32 ();
         push (this->thread->ip - this->thread->instructions);
 
-        if (this->thread->frame_no == FRAME_SIZE) {
-                fprintf (stderr, "call: maximum recursion depth exceeded\n");
-                this->thread->state = KILLED;
-                return;
+        /* the frame array only has to grow when the call goes deeper than any before */
+        if (this->thread->frame_no >= this->thread->frame_high) {
+                if (this->thread->frame_no == this->thread->frame_capacity && !this->grow_frames (this->thread)) {
+                        fprintf (stderr, "call: maximum recursion depth exceeded\n");
+                        this->thread->state = KILLED;
+                        return;
+                }
+
+                this->thread->frame_high = this->thread->frame_no + 1;
+        }
+
+        /* verified code checks the whole callee frame once instead of every push */
+        if (this->verified && this->thread->sp + this->frame_sizes[addr] >= this->thread->stack_high) {
+                this->thread->stack_high = this->thread->sp + this->frame_sizes[addr] + 1;
+                this->grow_stack (this->thread, this->thread->stack_high - this->thread->stack);
         }
 
         this->thread->stack_frames[this->thread->frame_no++] = this->thread->bp;
         this->thread->bp = this->thread->sp;
         this->thread->ip = this->thread->instructions + addr;
+
+        if (this->jit)
+                this->jit_call (addr);
+}
+
+/**
+ * Call the function at addr in the frame of the current one: the arguments
+ * replace the parameters and the callee returns to where the caller would
+ * have, so tail recursion runs in constant stack.
+ */
+void VM::tailcall_op ()
+{
+        int32_t addr = read_int32 ();
+        int32_t count = read_int32 ();
+        int32_t *params = this->thread->bp - 1 - count;
+
+        if (!this->verified)
+                params = checked_stack_location ("tailcall: attempted to reuse a frame with invalid VM configuration",
+                                                 params);
+
+        for (int32_t i = count - 1; i >= 0; i--)
+                params[i] = pop ();
+
+        this->thread->sp = this->thread->bp;
+
+        if (this->verified && this->thread->sp + this->frame_sizes[addr] >= this->thread->stack_high) {
+                this->thread->stack_high = this->thread->sp + this->frame_sizes[addr] + 1;
+                this->grow_stack (this->thread, this->thread->stack_high - this->thread->stack);
+        }
+
+        this->thread->ip = this->thread->instructions + addr;
 }
 
 void VM::swap_op ()
@@ -182,12 +384,12 @@ void VM::swap_op ()
         int32_t a = read_int32 ();
         int32_t b = read_int32 ();
 
+        checked_stack_location ("swap: invalid swap location pair", this->thread->bp + a);
+        checked_stack_location ("swap: invalid swap location pair", this->thread->bp + b);
+
         int32_t *location_a = this->thread->bp + a;
         int32_t *location_b = this->thread->bp + b;
 
-        assert_valid_stack_location ("swap: invalid swap location pair", location_a);
-        assert_valid_stack_location ("swap: invalid swap location pair", location_b);
-
         int32_t temp = *location_a;
         *location_a = *location_b;
         *location_b = temp;
@@ -209,9 +411,18 @@ void VM::halt_op ()
         this->display_thread_info (this->thread);
 }
 
+/**
+ * exit(v): stop the thread, joining it returns v
+ */
+void VM::exit_op ()
+{
+        this->thread->exit_value = this->pop ();
+        this->halt_op ();
+}
+
 void VM::fork_op ()
 {
-        struct context *new_thread = this->allocate_thread ();
+        struct context *new_thread = this->allocate_thread (this->thread);
 
         if (!new_thread) {
                 this->push (-1);
@@ -220,13 +431,17 @@ void VM::fork_op ()
 
         this->copy_thread_stats (this->thread, new_thread);
 
-        this->push (new_thread - this->threads + 1);
-        struct context *old_thread = this->thread;
-        this->thread = new_thread;
-        this->push (0);
-        this->thread = old_thread;
+        this->push (new_thread->id);
 
-        this->add_thread (new_thread);
+        /* the child has the same stack depth, so it has room wherever the parent had */
+        *new_thread->sp++ = 0;
+
+        {
+                std::lock_guard<std::mutex> guard (this->lock);
+                this->add_thread (new_thread);
+        }
+
+        this->runtime->work.notify_one ();
 
         if (this->verbose)
                 printf ("New thread was created...\n");
@@ -236,19 +451,38 @@ void VM::fork_op ()
 
 void VM::kill_op ()
 {
-        int32_t thread_id = this->pop () - 1;
+        int32_t thread_id = this->pop ();
+
+        struct context *victim_thread = this->thread_at (thread_id);
+        enum thread_state running = RUNNING;
+
+        if (!victim_thread) {
+                this->push (0);
+                return;
+        }
+
+        bool release = false;
+
+        if (victim_thread->state.compare_exchange_strong (running, KILLED)) {
+                /* a thread running on or queued by another worker is released by that worker */
+                std::lock_guard<std::mutex> guard (this->lock);
 
-        struct context *victim_thread = &this->threads[thread_id];
+                if (victim_thread->worker == this->id && victim_thread != this->thread) {
+                        this->remove_thread (victim_thread);
+                        release = true;
+                }
 
-        if (victim_thread->state == RUNNING) {
-                victim_thread->state = KILLED;
-                this->remove_thread (victim_thread);
+                this->push (1);
+        } else if (this->kill_blocked (victim_thread, &release)) {
                 this->push (1);
         } else {
                 this->push (0);
         }
 
         this->display_thread_info (victim_thread);
+
+        if (release)
+                this->release_thread (victim_thread);
 }
 
 void VM::print_op ()
@@ -261,7 +495,7 @@ void VM::display_thread_info (struct context *thread)
         if (!this->verbose)
                 return;
 
-        int thread_id = thread - this->threads;
+        int thread_id = thread->id - 1;
 
         switch (thread->state) {
         case EXITED: printf ("Thread #%d exited normally\n", thread_id); break;
@@ -271,81 +505,48 @@ void VM::display_thread_info (struct context *thread)
         }
 
         printf ("Opcodes executed: %lu\n", thread->op_count);
+        printf ("Stack high-water mark: %ld slots, %d frames\n", thread->stack_high - thread->stack, thread->frame_high);
 }
 
+/**
+ * Set up dest as a fork of src. The code segment is shared, only the used part
+ * of the stack and the frame pointers into it are copied. dest grows to the
+ * high-water marks of src, which verified code relies on.
+ */
 void VM::copy_thread_stats (struct context *src, struct context *dest)
 {
-        dest->ip = dest->instructions + (src->ip - src->instructions);
+        this->grow_stack (dest, src->stack_high - src->stack);
+
+        while (dest->frame_capacity < src->frame_high)
+                this->grow_frames (dest);
+
+        dest->instructions = src->instructions;
+        dest->ip = src->ip;
         dest->sp = dest->stack + (src->sp - src->stack);
         dest->bp = dest->stack + (src->bp - src->stack);
+        dest->stack_high = dest->stack + (src->stack_high - src->stack);
         dest->frame_no = src->frame_no;
+        dest->frame_high = src->frame_high;
         dest->op_count = src->op_count;
-        dest->state = src->state;
+        dest->state = src->state.load ();
 
         size_t used_stack_size = (src->sp - src->stack) * sizeof (int32_t);
         memcpy (dest->stack, src->stack, used_stack_size);
-        memcpy (dest->instructions, src->instructions, CODE_SIZE * sizeof (int8_t));
 
         for (int i = 0; i < src->frame_no; i++)
                 dest->stack_frames[i] = dest->stack + (src->stack_frames[i] - src->stack);
 }
 
-struct context *VM::allocate_thread ()
-{
-        for (int curr = 0; curr < MAX_THREADS; curr++) {
-                struct context *free_thread = &this->threads[curr];
-
-                switch (free_thread->state) {
-                case UNUSED:
-                case KILLED:
-                case EXITED: {
-                        free_thread->op_count = 0;
-                        return free_thread;
-                }
-                default: continue;
-                }
-        }
-
-        return NULL;
-}
-
-void VM::add_thread (struct context *thread)
-{
-        struct context *curr_next = this->thread->next;
-
-        this->thread->next = thread;
-        thread->previous = this->thread;
-
-        thread->next = curr_next;
-        curr_next->previous = thread;
-}
-
-void VM::remove_thread (struct context *thread)
-{
-        if (thread->previous == thread || thread->next == thread)
-                return;
-
-        struct context *left = thread->previous;
-        struct context *right = thread->next;
-
-        left->next = right;
-        right->previous = left;
-}
-
-void VM::schedule ()
-{
-        struct context *old_thread = this->thread;
-
-        this->thread = this->thread->next;
-
-        if (old_thread->state != RUNNING)
-                this->remove_thread (old_thread);
-}
-void VM::execute_instruction ()
+/**
+ * Execute the instruction at ip. Returns whether the thread gives up the rest
+ * of its time slice, because it yielded, forked, killed a thread or stopped.
+ */
+bool VM::execute_instruction ()
 {
         enum OpCode op = read_op ();
+        bool yields = false;
 
-        if (OPADD <= op && op <= OPOR) {
+        if (is_binary (op)) {
                 bin_op (op);
         } else {
                 switch (op) {
@@ -359,10 +560,70 @@ void VM::execute_instruction ()
                 case OPPOP: pop (); break;
                 case OPHALT: halt_op (); break;
                 case OPCALL: call_op (); break;
-                case OPFORK: fork_op (); break;
+                case OPFORK: fork_op (), yields = true; break;
                 case OPPRINT: print_op (); break;
-                case OPKILL: kill_op (); break;
+                case OPKILL: kill_op (), yields = true; break;
                 case OPRET: ret_op (); break;
+                case OPYIELD: yields = true; break;
+                case OPTAILCALL: tailcall_op (); break;
+                case OPCHAN: chan_op (); break;
+                case OPSEND: yields = send_op (); break;
+                case OPRECV: yields = recv_op (); break;
+                case OPEXIT: exit_op (); break;
+                case OPJOIN: yields = join_op (); break;
+                case OPJOINANY: yields = join_any_op (); break;
+                case OPOPEN: open_op (); break;
+                case OPREAD: yields = read_byte_op (); break;
+                case OPWRITE: yields = write_byte_op (); break;
+                case OPCLOSE: yields = close_op (); break;
+                case OPPIPE: pipe_op (false); break;
+                case OPSOCKETPAIR: pipe_op (true); break;
+                case OPDUP: dup_op (); break;
+                case OPINC: inc_op (); break;
+                case OPADDTO:
+                case OPSUBTO:
+                case OPMULTTO: update_op (op); break;
+
+                /* superinstructions run the instructions they stand for */
+                case OPLOAD_PUSH_LT_JMPFALSE: {
+                        load_op ();
+                        push (read_int32 ());
+                        bin_op (OPLT);
+                        jmpfalse_op ();
+                        break;
+                }
+                case OPLOAD_PUSH_ADD: {
+                        load_op ();
+                        push (read_int32 ());
+                        bin_op (OPADD);
+                        break;
+                }
+                case OPLOAD_ADD_STORE: {
+                        load_op ();
+                        bin_op (OPADD);
+                        store_op ();
+                        break;
+                }
+                case OPLOAD_LOAD: {
+                        load_op ();
+                        load_op ();
+                        break;
+                }
+                case OPSTORE_POP: {
+                        store_op ();
+                        pop ();
+                        break;
+                }
+                case OPLT_JMPFALSE: {
+                        bin_op (OPLT);
+                        jmpfalse_op ();
+                        break;
+                }
+                case OPINC_JMP: {
+                        inc_op ();
+                        jmp_op ();
+                        break;
+                }
                 default:
                         fprintf (stderr, "illegal instruction: 0x%x\n", op);
                         this->thread->state = KILLED;
@@ -371,62 +632,226 @@ void VM::execute_instruction ()
         }
 
         this->thread->op_count++;
+        this->executed++;
 
-        return;
+        return yields || this->thread->state != RUNNING;
 }
 
-void VM::run ()
+/**
+ * Run every thread for a time slice of quantum instructions. On a single
+ * worker only yielding instructions change the set of threads, so a thread
+ * that runs alone keeps the processor until it yields.
+ */
+void VM::run_switch ()
 {
         while (this->thread->state == RUNNING) {
-                this->execute_instruction ();
-                this->schedule ();
+                uint64_t slice = this->time_slice ();
+
+                if (this->opstats) {
+                        while (slice-- > 0 && !this->count_instruction ())
+                                ;
+                } else {
+                        while (slice-- > 0 && !this->execute_instruction ())
+                                ;
+                }
+
+                if (!this->schedule ())
+                        return;
+        }
+}
+
+void VM::run ()
+{
+        struct timespec start, end;
+
+        clock_gettime (CLOCK_MONOTONIC, &start);
+
+        if (this->workers > 1)
+                this->run_workers ();
+        else
+                this->run_engine ();
+
+        clock_gettime (CLOCK_MONOTONIC, &end);
+
+        if (this->profile)
+                this->write_profile ();
+
+        if (this->opstats)
+                this->write_op_stats ();
+
+        if (!this->verbose)
+                return;
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        if (this->isa == ISA_REGISTER)
+                printf ("Engine: register\n");
+        else
+                printf ("Engine: %s\n", this->engine == ENGINE_THREADED ? "threaded" : "switch");
+        if (this->workers > 1)
+                printf ("Workers: %u\n", this->workers);
+        printf ("Total opcodes executed: %lu in %.6f s (%.2f Mops/s)\n",
+                this->executed,
+                seconds,
+                seconds > 0 ? this->executed / seconds / 1e6 : 0.0);
+
+        struct rusage usage;
+
+        if (getrusage (RUSAGE_SELF, &usage) == 0)
+                printf ("Peak resident set: %ld KiB\n", usage.ru_maxrss);
+
+        printf ("Peak threads: %d\n", this->runtime->peak);
+
+        if (this->jit)
+                printf ("JIT-compiled functions: %d\n", this->runtime->jit_compiled);
+}
+
+void VM::run_engine ()
+{
+        if (this->isa == ISA_REGISTER) {
+                this->run_registers ();
+        } else {
+                switch (this->engine) {
+                case ENGINE_THREADED: this->run_threaded (); break;
+                default: this->run_switch (); break;
+                }
         }
 }
 
+/**
+ * Run the code_size bytes at code, which lie in the read-only image mapping
+ */
 int VM::initialize_and_run (int8_t *code, size_t code_size, int32_t entry_address)
 {
-        if (code_size > CODE_SIZE)
-                return -1;
+        this->runtime->code = code;
+        this->thread->instructions = code;
+        this->code_size = code_size;
+        this->executed = 0;
+        this->io_polled = 0;
+        this->next_sample = this->profile_interval;
+        this->samples.clear ();
+        this->verified = false;
+
+        if (this->isa == ISA_REGISTER) {
+                /* there is no checked path for register images */
+                Verifier verifier (this->thread->instructions, code_size, MAX_FRAME_SLOTS);
+
+                if (!verifier.verify_registers (entry_address))
+                        return -1;
+
+                this->verified = true;
+                this->frame_sizes = verifier.frame_sizes;
+        } else if (this->verify) {
+                Verifier verifier (this->thread->instructions, code_size, MAX_FRAME_SLOTS);
+
+                this->verified = verifier.verify (entry_address);
+
+                if (this->verified)
+                        this->frame_sizes = verifier.frame_sizes;
+                else
+                        fprintf (stderr, "warning: running unverified bytecode with runtime checks\n");
+        }
 
-        for (size_t i = 0; i < code_size; i++)
-                this->thread->instructions[i] = code[i];
+        /* machine code is only generated for verified stack images */
+        if (this->isa != ISA_STACK || !this->verified)
+                this->jit = false;
+
+        /* only the switch engine counts instructions, one at a time */
+        if (this->opstats) {
+                if (this->isa != ISA_STACK) {
+                        fprintf (stderr, "error: --opstats counts stack instructions, recompile without --isa register\n");
+                        return -1;
+                }
+
+                this->engine = ENGINE_SWITCH;
+                this->jit = false;
+        }
+
+        if (this->jit)
+                this->setup_jit ();
+
+        this->destroy_channels ();
+        this->setup_io ();
+        free (this->program);
+        free (this->decoded_at);
+        this->program = NULL;
+        this->decoded_at = NULL;
+
+        this->reset_stack (this->thread);
+
+        /* the script frame is covered up front, calls cover the frames of their callees */
+        if (this->verified) {
+                this->thread->stack_high = this->thread->stack + this->frame_sizes[entry_address] + 1;
+                this->grow_stack (this->thread, this->frame_sizes[entry_address] + 1);
+        }
 
-        this->thread->sp = this->thread->stack;
-        this->thread->bp = this->thread->stack;
         this->thread->ip = this->thread->instructions + entry_address;
-        this->thread->frame_no = 0;
         this->thread->state = RUNNING;
         this->thread->op_count = 0;
+        this->alone = this->workers == 1;
         run ();
 
         return 1;
 }
 
+/**
+ * Run the image in filename, or the one on standard input for "-". The image is
+ * executed in place from its mapping.
+ */
 int VM::load_file_and_run (char *filename)
 {
-        FILE *fp = fopen (filename, "rb");
+        bool from_stdin = strcmp (filename, "-") == 0;
+        int fd = from_stdin ? STDIN_FILENO : open (filename, O_RDONLY);
 
-        if (!fp) {
-                perror ("fopen");
+        if (fd < 0) {
+                perror ("open");
                 exit (EXIT_FAILURE);
         }
 
-        fseek (fp, 0, SEEK_END);
+        size_t fsize = this->map_image (fd, filename);
+        int8_t *code = this->runtime->image;
 
-        size_t fsize = ftell (fp);
+        if (!from_stdin)
+                close (fd);
 
-        int8_t code[fsize];
+        struct image_header header;
 
-        rewind (fp);
+        if (fsize >= sizeof (header.magic) && memcmp (code, IMAGE_MAGIC, sizeof (header.magic)) == 0) {
+                if (fsize < sizeof (header)) {
+                        fprintf (stderr, "error: %s: truncated image header\n", filename);
+                        return -1;
+                }
+
+                memcpy (&header, code, sizeof (header));
+
+                if (header.version != IMAGE_VERSION) {
+                        fprintf (stderr, "error: %s: image has format version %d, expected %d; recompile it\n",
+                                 filename, header.version, IMAGE_VERSION);
+                        return -1;
+                }
+
+                if (header.isa != ISA_STACK && header.isa != ISA_REGISTER) {
+                        fprintf (stderr, "error: %s: unknown instruction set %d\n", filename, header.isa);
+                        return -1;
+                }
+
+                this->isa = (enum isa)header.isa;
 
-        fread (code, sizeof (int8_t), fsize, fp);
+                size_t code_size = this->load_debug_info (code + sizeof (header), fsize - sizeof (header), filename);
 
-        fclose (fp);
+                return initialize_and_run (code + sizeof (header), code_size, header.entry_address);
+        }
+
+        this->isa = ISA_STACK;
 
         return initialize_and_run (code, fsize, 0);
 }
 
 int VM::load_function_and_run (Function *f)
 {
-        return this->initialize_and_run (f->bytecode->chunk, f->bytecode->count, f->entry_address);
+        this->map_code (f->bytecode->chunk, f->bytecode->count);
+        this->runtime->symbols = f->bytecode->symbols;
+        this->runtime->lines = f->bytecode->lines;
+
+        return this->initialize_and_run (this->runtime->image, f->bytecode->count, f->entry_address);
 }
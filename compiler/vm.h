@@ -2,42 +2,389 @@
 #define vm_h
 #include "bytecode.h"
 #include "function.h"
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #include <stdint.h>
+#include <unordered_map>
+#include <vector>
 
-#define STACK_SIZE  (1024 * 3)
-#define FRAME_SIZE  (1024 * 3)
-#define CODE_SIZE   (1024 * 3)
-#define MAX_THREADS 10
+/* stacks and frame arrays start small and grow on demand up to these limits */
+#define INITIAL_STACK_SIZE 256
+#define INITIAL_FRAME_SIZE 32
+#define STACK_SIZE         (1024 * 1024 * 16)
+#define FRAME_SIZE         (1024 * 1024)
 
+/* the most stack slots the verifier lets a single frame use */
+#define MAX_FRAME_SLOTS    (1024 * 3)
+#define MAX_THREADS  (1024 * 1024)
+#define THREAD_BLOCK 1024
+#define MAX_WORKERS  64
+#define MAX_CHANNELS (1024 * 1024)
+
+/*
+ * bytes an I/O handle buffers in each direction, the events the event loop
+ * takes at once and the instructions a worker runs between two turns of it
+ */
+#define IO_BUFFER        4096
+#define IO_EVENTS        64
+#define IO_POLL_INTERVAL 1000
+
+/* calls after which a function is compiled to machine code, when the JIT is on */
+#define JIT_THRESHOLD 1000
+
+/* machine code frames take 16 bytes, plus room for the C++ functions it calls */
+#define JIT_STACK_SIZE (FRAME_SIZE * 16 + 1024 * 1024)
+
+/* images that cannot be mapped in place are read in chunks of this size, doubling */
+#define IMAGE_CHUNK (64 * 1024)
+
+/* instructions a thread runs before the scheduler switches to the next one */
+#define DEFAULT_QUANTUM 1000
+
+/*
+ * instructions a worker runs between two profile samples, prime so it does
+ * not fall into step with loops, and the innermost frames a sample keeps
+ */
+#define PROFILE_INTERVAL  100003
+#define PROFILE_MAX_DEPTH 256
+
+/* BLOCKED threads wait on a channel, for I/O or for other threads to finish and are on no ring */
 enum thread_state { RUNNING, BLOCKED, KILLED, EXITED, UNUSED };
 
+enum engine { ENGINE_SWITCH, ENGINE_THREADED };
+
+/**
+ * A pre-decoded instruction for the threaded engine. The operands are already
+ * widened and jump/call targets are resolved to the decoded instruction they
+ * land on.
+ */
+struct decoded_op {
+        const void *handler;
+        enum OpCode op;
+        int32_t arg;
+        int32_t arg2;
+        int32_t address;
+        int32_t frame_size;
+        struct decoded_op *target;
+};
+
+/**
+ * Executed opcodes of a thread, and the pairs and triples of opcodes it ran
+ * one after the other, keyed by their opcodes in base OPCODE_COUNT. last holds
+ * the opcodes it ran before, -1 at its start.
+ */
+struct op_stats {
+        uint64_t ops[OPCODE_COUNT];
+        std::unordered_map<uint32_t, uint64_t> pairs;
+        std::unordered_map<uint32_t, uint64_t> triples;
+        int32_t last[2];
+};
+
+/* threads blocked on one end of a channel or joining a thread, in the order they blocked */
+struct wait_queue {
+        struct context *head;
+        struct context *tail;
+};
+
+/**
+ * The scheduling state of a thread. Contexts are kept apart from their
+ * stacks, so the contexts of a block share cache lines and walking a ring
+ * does not touch the stacks.
+ */
 struct context {
         int8_t *ip;
-        int8_t instructions[CODE_SIZE];
         int32_t *sp;
         int32_t *bp;
-        int32_t stack[STACK_SIZE];
         int32_t frame_no;
-        int32_t *stack_frames[FRAME_SIZE];
-        uint64_t op_count;
-        enum thread_state state;
+
+        /* written by other workers when they kill the thread */
+        std::atomic<enum thread_state> state;
+
+        /* the worker whose ring holds the thread, -1 while the slot is free */
+        std::atomic<int32_t> worker;
         struct context *next;
         struct context *previous;
+
+        /* the code segment, shared by every thread of the program */
+        int8_t *instructions;
+
+        /*
+         * the stack and the frame array are reallocated when they grow, which
+         * moves the stack: sp, bp, stack_high and the saved frame pointers are
+         * rebased, engines reload their copies of sp and bp after growing it
+         */
+        int32_t *stack;
+        int32_t *stack_limit;
+        int32_t **stack_frames;
+        int32_t frame_capacity;
+
+        /* high-water marks: one past the highest stack slot in use and the deepest frame */
+        int32_t *stack_high;
+        int32_t frame_high;
+        uint64_t op_count;
+
+        /* what fork returns and kill takes, stable for the life of the slot */
+        int32_t id;
+        struct context *next_free;
+
+        /*
+         * a blocked thread waits in queue, on channel, on an I/O handle or
+         * joining a thread, a sender or writer with the value it offers. a
+         * thread waiting for any of its children is in no queue. parked is set
+         * once its worker took it off the ring
+         */
+        struct wait_queue *queue;
+        struct channel *channel;
+        struct io_handle *handle;
+        struct context *joining;
+        struct context *next_waiting;
+        int32_t message;
+        bool parked;
+
+        /*
+         * what join returns for the thread, final once it is finished, that
+         * is released, and the threads joining it until then
+         */
+        int32_t exit_value;
+        bool finished;
+        struct wait_queue joiners;
+
+        /*
+         * the thread that forked it, which is gone once the generation of its
+         * slot moved on, the children it has running and the values of those
+         * that finished before it joined them
+         */
+        struct context *parent;
+        uint32_t parent_generation;
+        uint32_t generation;
+        int32_t children;
+        struct exit_record *exits;
+        struct exit_record *exits_tail;
+
+        /* what the thread ran so far with --opstats, NULL until it runs */
+        struct op_stats *stats;
+};
+
+/* wait queues are shared by channels, joins and I/O */
+static inline void enqueue (struct wait_queue *queue, struct context *thread)
+{
+        thread->next_waiting = NULL;
+
+        if (queue->tail)
+                queue->tail->next_waiting = thread;
+        else
+                queue->head = thread;
+
+        queue->tail = thread;
+}
+
+static inline struct context *dequeue (struct wait_queue *queue)
+{
+        struct context *thread = queue->head;
+
+        if (!thread)
+                return NULL;
+
+        queue->head = thread->next_waiting;
+
+        if (!queue->head)
+                queue->tail = NULL;
+
+        return thread;
+}
+
+/* the value a child finished with, kept for its parent */
+struct exit_record {
+        int32_t id;
+        int32_t value;
+        struct exit_record *next;
+};
+
+/**
+ * A bounded channel: a ring buffer of capacity values and the threads blocked
+ * sending to it or receiving from it. A channel of capacity 0 hands each
+ * value from a sender straight to a receiver.
+ */
+struct channel {
+        int32_t id;
+        int32_t capacity;
+        int32_t head;
+        int32_t count;
+        int32_t *buffer;
+        struct wait_queue senders;
+        struct wait_queue receivers;
+};
+
+/**
+ * An open file, pipe end or socket, with a buffer for each direction. Pipes
+ * and sockets are non-blocking and watched by the event loop: a thread that
+ * would block waits in readers or writers until the descriptor is ready, a
+ * waiting writer offers its byte, or IO_CLOSE when it closes the handle.
+ * Regular files are always ready, standard output and error are written
+ * through stdio so they stay in order with print. Standard input stays
+ * blocking, other processes may share it: when it is not a regular file it is
+ * only read after the event loop found it readable.
+ */
+struct io_handle {
+        int fd;
+        FILE *stream;
+        bool pollable;
+        bool blocking;
+        bool readable;
+        bool eof;
+        int32_t in_start;
+        int32_t in_end;
+        int32_t out_count;
+        uint8_t in[IO_BUFFER];
+        uint8_t out[IO_BUFFER];
+        struct wait_queue readers;
+        struct wait_queue writers;
+};
+
+#define IO_CLOSE (-1)
+
+class VM;
+
+/**
+ * State shared by the workers that run one program. Every worker is a VM of
+ * its own with a ring of threads it runs round robin; a worker whose ring is
+ * empty steals a waiting thread from another worker.
+ */
+struct runtime {
+        /*
+         * the thread table grows a block of THREAD_BLOCK slots at a time, blocks
+         * never move so thread ids and pointers to contexts stay valid
+         */
+        struct context *blocks[MAX_THREADS / THREAD_BLOCK];
+        std::atomic<int32_t> capacity;
+
+        /* free slots, the most recently released first */
+        struct context *free_threads;
+        int32_t peak;
+
+        /*
+         * the mapping of the image, read-only while the program runs so forked
+         * threads share it, and the code inside it past the image header
+         */
+        int8_t *image;
+        size_t image_length;
+        int8_t *code;
+
+        /* debug information of the image, empty when it has none */
+        std::vector<struct function_symbol> symbols;
+        std::vector<struct line_entry> lines;
+
+        /* guards the table, the free list and idle workers waiting for work */
+        std::mutex lock;
+        std::condition_variable work;
+
+        /*
+         * JIT-compiled functions by entry address, functions that can not be
+         * compiled, the entry from C++ and the mappings of machine code
+         */
+        std::atomic<void *> *jit_entries;
+        bool *jit_rejected;
+        void *jit_enter;
+        std::vector<std::pair<void *, size_t> > jit_segments;
+        int32_t jit_compiled;
+        std::mutex jit_lock;
+
+        /*
+         * channels by id - 1 and the number of blocked threads. the lock also
+         * guards joining and I/O handles, it is taken before the lock of a
+         * worker or of the runtime
+         */
+        std::vector<struct channel *> channels;
+        int32_t blocked;
+        std::mutex channel_lock;
+
+        /*
+         * I/O handles by id, 0 to 2 are the standard streams. while threads
+         * wait for I/O, workers flush buffered output and poll the event loop
+         * as they switch threads, otherwise output goes out when a buffer is
+         * full or closed
+         */
+        std::vector<struct io_handle *> handles;
+        int epoll_fd;
+        std::atomic<int32_t> io_waiting;
+        std::atomic<bool> io_dirty;
+
+        /* the opcode statistics of released threads by id, guarded by lock */
+        std::vector<std::pair<int32_t, struct op_stats *> > op_stats;
+
+        /* threads that were forked and not yet released by their worker */
+        std::atomic<int32_t> live;
+        std::vector<VM *> workers;
 };
 
 class VM {
     public:
         VM ();
+        ~VM ();
         int load_file_and_run (char *filename);
         int load_function_and_run (Function *f);
         bool verbose;
+        bool verify;
+        enum engine engine;
+        uint32_t quantum;
+        uint32_t workers;
+        bool jit;
+
+        /* the files open() takes by index, the arguments after the image */
+        char **arguments;
+        int argument_count;
+
+        /* file the collapsed stacks of the profile go to, NULL when not profiling */
+        const char *profile;
+        uint64_t profile_interval;
+
+        /* file the opcode statistics go to as JSON, NULL when not counting, and whether to count triples */
+        const char *opstats;
+        bool opstats_triples;
 
     private:
+        friend class Jit;
+
+        VM (VM *main, int32_t id);
+
         struct context *thread;
+        struct runtime *runtime;
+        int32_t id;
+
+        /* guards the ring of this worker against thieves */
+        std::mutex lock;
+
+        /* set when the current thread has the processor to itself until it yields */
+        bool alone;
+
+        size_t code_size;
+        enum isa isa;
+        uint64_t executed;
+
+        /* what executed was when this worker last ran the event loop */
+        uint64_t io_polled;
+
+        /*
+         * what executed has to reach for the next profile sample, and the
+         * samples of this worker by call stack, innermost address first
+         */
+        uint64_t next_sample;
+        std::map<std::vector<int32_t>, uint64_t> samples;
+
+        /* set when the loaded image passed the verifier, enables the unchecked fast path */
+        bool verified;
+        std::vector<int32_t> frame_sizes;
+
+        struct decoded_op *program;
+        struct decoded_op **decoded_at;
 
-        struct context threads[MAX_THREADS];
+        /* calls per function entry on this worker, and the stack its machine code runs on */
+        uint32_t *call_counts;
+        int8_t *jit_stack;
 
-        void assert_valid_stack_location (const char *prefix, void *ptr);
+        int32_t *checked_stack_location (const char *prefix, int32_t *ptr);
         void assert_valid_ip (int8_t *ip);
         int32_t read_int32 ();
         enum OpCode read_op ();
@@ -51,24 +398,89 @@ class VM {
         void jmp_op ();
         void jmpfalse_op ();
         void store_op ();
+        void dup_op ();
+        void inc_op ();
+        void update_op (enum OpCode op);
         void load_op ();
         void call_op ();
+        void tailcall_op ();
         void ret_op ();
         void halt_op ();
+        void exit_op ();
         void fork_op ();
         void kill_op ();
         void print_op ();
+        void chan_op ();
+        bool send_op ();
+        bool recv_op ();
+        bool join_op ();
+        bool join_any_op ();
+        void open_op ();
+        bool read_byte_op ();
+        bool write_byte_op ();
+        bool close_op ();
+        void pipe_op (bool socket);
         void swap_op ();
 
-        struct context *allocate_thread ();
-        void schedule ();
+        struct context *allocate_thread (struct context *parent);
+        struct context *thread_at (int32_t id);
+        void grow_threads ();
+        void destroy_threads ();
+        void reset_stack (struct context *thread);
+        void free_stack (struct context *thread);
+        void grow_stack (struct context *thread, size_t needed);
+        bool grow_frames (struct context *thread);
+        bool schedule ();
+        uint64_t time_slice ();
+        bool steal ();
         void add_thread(struct context *thread);
         void remove_thread(struct context *thread);
-        void execute_instruction ();
+        void release_thread (struct context *thread);
+        void free_thread (struct context *thread);
+        struct channel *channel_at (int32_t id);
+        void block (struct channel *channel, struct wait_queue *queue);
+        void wake (struct context *thread);
+        bool kill_blocked (struct context *thread, bool *release);
+        bool finish_thread (struct context *thread);
+        void check_deadlock ();
+        void destroy_channels ();
+        struct io_handle *handle_at (int32_t id);
+        int32_t add_handle (int fd, FILE *stream);
+        void wait_io (struct io_handle *handle, struct wait_queue *queue);
+        void close_handle (int32_t id);
+        void serve_io (int32_t id);
+        void watch_input (int32_t id);
+        void poll_io (int timeout);
+        void flush_io ();
+        void setup_io ();
+        void destroy_io ();
+        bool execute_instruction ();
+        bool count_instruction ();
+        void write_op_stats ();
         void run ();
+        void run_engine ();
+        void run_workers ();
+        void run_switch ();
+        void run_threaded ();
+        template <bool checked> void run_threaded_loop ();
+        void run_registers ();
+        void decode_program (const void *const *handlers);
+        struct decoded_op *resolve_address (int32_t address);
         int initialize_and_run (int8_t *code, size_t code_size, int32_t entry_address);
         void display_thread_info (struct context *thread);
         void copy_thread_stats (struct context *src, struct context *dest);
+        size_t map_image (int fd, const char *filename);
+        size_t read_image (int fd, const char *filename);
+        void map_code (int8_t *code, size_t code_size);
+        void setup_jit ();
+        void destroy_jit ();
+        bool jit_call (int32_t target);
+        static int32_t jit_grow_frames (VM *vm, struct context *thread);
+        static void jit_grow_stack (VM *vm, struct context *thread, int32_t frame_size);
+        void unmap_image ();
+        size_t load_debug_info (int8_t *code, size_t size, const char *filename);
+        void take_sample ();
+        void write_profile ();
 };
 
 #endif
\ No newline at end of file